@@ -15,7 +15,10 @@ Adafruit_NeoPixel ring = Adafruit_NeoPixel(16, RING_PIN, NEO_GRB + NEO_KHZ800);
 
 Lighting::Lighting()
 {
-  
+  _dirty = true;
+  _num_channels = 0;
+  _channel = -1;
+  _frames_left = 0;
 }
 
 void Lighting::begin()
@@ -27,7 +30,17 @@ void Lighting::begin()
 
 void Lighting::loop()
 {
-  ring.show();
+  //show() blocks interrupts while it clocks out the pixels, so only send
+  //the ring when it has changed
+  if(_dirty){
+    ring.show();
+    _dirty = false;
+  }
+}
+
+boolean Lighting::isDirty()
+{
+  return _dirty;
 }
 
 void Lighting::setRingColour(uint32_t rgb)
@@ -35,16 +48,68 @@ void Lighting::setRingColour(uint32_t rgb)
   for(uint16_t i=0;i<16;i++) {
     ring.setPixelColor(i, rgb);
   }
+  _dirty = true;
 }
     
 void Lighting::setRingBrightness(uint8_t b)
 {
   ring.setBrightness(b);
+  _dirty = true;
 }
 
 void Lighting::setStageLEDBrightness(uint8_t b)
 {
-  //analogWrite(DAC0, b);
+  //PWM on the LED pin, 0 for off and 255 for fully on
+  analogWrite(STAGE_LED, b);
+}
+
+void Lighting::clearChannels()
+{
+  _num_channels = 0;
+  _channel = -1;
+}
+
+boolean Lighting::addChannel(uint32_t rgb, uint8_t ring_b, uint8_t stage_b, uint8_t frames)
+{
+  if(_num_channels >= MAX_CHANNELS) return false;
+
+  _channels[_num_channels].colour = rgb;
+  _channels[_num_channels].ring_brightness = ring_b;
+  _channels[_num_channels].stage_brightness = stage_b;
+  _channels[_num_channels].frames = (frames > 0) ? frames : 1;
+  _num_channels++;
+  return true;
+}
+
+int Lighting::getChannelCount()
+{
+  return _num_channels;
+}
+
+void Lighting::startChannels()
+{
+  if(_num_channels > 0) _applyChannel(0);
+}
+
+void Lighting::frameTaken()
+{
+  //Move on once the channel has had its frames, back to the first after the
+  //last so the sequence can be run again straight away
+  if(_channel < 0) return;
+  _frames_left--;
+  if(_frames_left <= 0) _applyChannel((_channel + 1) % _num_channels);
+}
+
+void Lighting::_applyChannel(int c)
+{
+  //Only set what changes, so a channel that keeps the ring as it is doesn't
+  //resend it
+  Channel &next = _channels[c];
+  if(_channel < 0 || next.colour != _channels[_channel].colour) setRingColour(next.colour);
+  if(_channel < 0 || next.ring_brightness != _channels[_channel].ring_brightness) setRingBrightness(next.ring_brightness);
+  if(_channel < 0 || next.stage_brightness != _channels[_channel].stage_brightness) setStageLEDBrightness(next.stage_brightness);
+  _channel = c;
+  _frames_left = next.frames;
 }
 
 
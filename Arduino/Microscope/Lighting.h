@@ -10,6 +10,19 @@
 #ifndef Lighting_h
 #define Lighting_h
 
+//Number of channel slots for multi-channel acquisition
+#define MAX_CHANNELS 8
+
+//An illumination: ring colour and brightness, stage LED brightness, and how
+//many frames the host takes under it before the next channel
+struct Channel
+{
+  uint32_t colour;
+  uint8_t ring_brightness;
+  uint8_t stage_brightness;
+  uint8_t frames;
+};
+
 class Lighting
 {
   public:
@@ -19,6 +32,24 @@ class Lighting
     void setRingColour(uint32_t rgb);
     void setRingBrightness(uint8_t b);
     void setStageLEDBrightness(uint8_t b);
+    boolean isDirty();
+
+    //Multi-channel acquisition: the channels are loaded once, then every
+    //frame the host reports moves the sequence on without a command
+    void clearChannels();
+    boolean addChannel(uint32_t rgb, uint8_t ring_b, uint8_t stage_b, uint8_t frames);
+    int getChannelCount();
+    void startChannels();
+    void frameTaken();
+
+  private:
+    boolean _dirty;     //Ring needs sending to the pixels
+    Channel _channels[MAX_CHANNELS];
+    int _num_channels;
+    int _channel;       //Channel on, -1 before startChannels()
+    int _frames_left;   //Frames still to be taken under it
+
+    void _applyChannel(int c);
 };
 
 
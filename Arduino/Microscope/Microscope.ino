@@ -11,14 +11,21 @@
 #include "LiquidCrystal.h"
 #include "SerialControl.h"
 #include "Stage.h"
+#include "StepperDriver.h"
 #include "Lighting.h"
+#include "Scheduler.h"
+#include "Profiler.h"
 #include "TouchScreen.h"
 
+//Task periods in us
+#define TOUCHSCREEN_PERIOD 20000  //50 Hz
+
 //Create objects for Microscope functions
 SerialControl scontrol = SerialControl();
 Stage stage = Stage();
 Lighting lights = Lighting();
 LiquidCrystal lcd(0);
+Scheduler scheduler = Scheduler();
 
 //Calls associated functions and passes arguments for each command
 void handle_command(char* cmd, char* arg)
@@ -105,6 +112,43 @@ void handle_command(char* cmd, char* arg)
   {
     Serial.println(stage.getDistanceToGo(axis));    
   }
+  else if(cmdString.endsWith("_set_step_mode"))
+  {
+    //Coarse for fast travel, fine for microstepping the whole move
+    if(strcmp("coarse", arg)==0)
+    {
+      stage.setStepMode(axis, STEP_MODE_COARSE);
+      Serial.println("OK");
+    }
+    else if(strcmp("fine", arg)==0)
+    {
+      stage.setStepMode(axis, STEP_MODE_FINE);
+      Serial.println("OK");
+    }
+    else
+    {
+      Serial.println("ERR: UNKNOWN STEP MODE");
+    }
+  }
+  else if(strcmp("save_state", cmd)==0)
+  {
+    //Save the position so the next session can start without calibrating
+    stage.saveState();
+    Serial.println("OK");
+  }
+  else if(strcmp("get_timing", cmd)==0)
+  {
+    //Print loop timing, step lateness and task budgets since the last reset
+    profiler.report();
+    scheduler.report();
+    Serial.println("OK");
+  }
+  else if(strcmp("reset_timing", cmd)==0)
+  {
+    profiler.reset();
+    scheduler.resetBudgets();
+    Serial.println("OK");
+  }
   else if(strcmp("is_calibrated", cmd)==0)
   {
     //Test if calibrated
@@ -129,6 +173,42 @@ void handle_command(char* cmd, char* arg)
     lights.setStageLEDBrightness(brightness);
     Serial.println("OK");
   }
+  else if(strcmp("channels_clear", cmd)==0)
+  {
+    lights.clearChannels();
+    Serial.println("OK");
+  }
+  else if(strcmp("channel_add", cmd)==0)
+  {
+    //Argument is colour,ring brightness,stage LED brightness,frames as
+    //in FF0000,255,0,1
+    char* next;
+    uint32_t colour = strtoul(arg, &next, 16);
+    uint8_t ring_b = (*next == ',') ? strtoul(next+1, &next, 10) : 255;
+    uint8_t stage_b = (*next == ',') ? strtoul(next+1, &next, 10) : 0;
+    uint8_t frames = (*next == ',') ? strtoul(next+1, &next, 10) : 1;
+    if(lights.addChannel(colour, ring_b, stage_b, frames))
+    {
+      Serial.println("OK");
+    }
+    else
+    {
+      Serial.println("ERR: TOO MANY CHANNELS");
+    }
+  }
+  else if(strcmp("channels_start", cmd)==0)
+  {
+    //Switch to the first channel; sync markers move on from there
+    if(lights.getChannelCount() > 0)
+    {
+      lights.startChannels();
+      Serial.println("OK");
+    }
+    else
+    {
+      Serial.println("ERR: NO CHANNELS");
+    }
+  }
   else
   {
     //Print error message if command unknown.
@@ -136,26 +216,89 @@ void handle_command(char* cmd, char* arg)
   }
 }
 
+//Task wrappers for the scheduler
+boolean command_ready()
+{
+  return scontrol.string_complete;
+}
+
+void command_task()
+{
+  uint32_t started = profiler.start();
+  handle_command(scontrol.command, scontrol.arg);
+  // Reset input str
+  scontrol.string_complete = false;
+  profiler.stop(PROFILE_COMMAND, started);
+}
+
+void stage_task()
+{
+  uint32_t started = profiler.start();
+  stage.loop();
+  profiler.stop(PROFILE_STAGE, started);
+}
+
+void touchscreen_task()
+{
+  uint32_t started = profiler.start();
+  stage.manualControl();
+  profiler.stop(PROFILE_MANUAL, started);
+}
+
+boolean sync_ready()
+{
+  return scontrol.sync_count > 0;
+}
+
+void sync_task()
+{
+  //Runs just before lights_task, so the next channel is sent to the ring on
+  //the same pass the marker is handled
+  while(scontrol.sync_count > 0)
+  {
+    scontrol.sync_count--;
+    lights.frameTaken();
+  }
+}
+
+boolean lights_ready()
+{
+  return lights.isDirty();
+}
+
+void lights_task()
+{
+  //Only runs when the ring is dirty, so this times ring.show()
+  uint32_t started = profiler.start();
+  lights.loop();
+  profiler.stop(PROFILE_RING, started);
+}
+
 void setup() {
   //Initialize
   scontrol.begin();
   stage.begin();
   lights.begin();
   lcd.begin(16,2);
+  profiler.begin();
+
+  //Serial commands run as soon as a line arrives, stepping runs on every
+  //pass, the touchscreen at its sample rate, sync markers as they come and
+  //the ring only when changed
+  scheduler.addTask("command", command_task, 0, command_ready);
+  scheduler.addTask("stage", stage_task, 0);
+  scheduler.addTask("touchscreen", touchscreen_task, TOUCHSCREEN_PERIOD);
+  scheduler.addTask("sync", sync_task, 0, sync_ready);
+  scheduler.addTask("lights", lights_task, 0, lights_ready);
+
+  //Tell the host we are ready for commands
+  Serial.println("READY");
 }
 
 void loop() {
-  if (scontrol.string_complete) {
-    handle_command(scontrol.command, scontrol.arg);
-    // Reset input str
-    scontrol.string_complete = false;
-  }
-  stage.loop();
-  lights.loop();
-  
-  
-  
-  
+  uint32_t started = profiler.start();
+  scheduler.loop();
+  profiler.stop(PROFILE_LOOP, started);
 }
 
 void serialEvent() {
@@ -0,0 +1,121 @@
+/*
+  Profiler.cpp - Library for measuring firmware timing on the OpenLabTools microscope
+  Written by James Ritchie for OpenLabTools
+  github.com/OpenLabTools/Microscope
+
+  On the Due the timings come from the Cortex-M3 cycle counter, elsewhere
+  they fall back to micros().
+*/
+#include "Arduino.h"
+#include "Profiler.h"
+
+const char *profile_names[NUM_PROFILES] = {"loop", "handle_command", "manualControl", "ring.show", "stage"};
+
+Profiler profiler = Profiler();
+
+Profiler::Profiler()
+{
+  reset();
+}
+
+void Profiler::begin()
+{
+#if defined(__SAM3X8E__)
+  //Start the DWT cycle counter
+  CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+  DWT->CYCCNT = 0;
+  DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+#endif
+}
+
+uint32_t Profiler::start()
+{
+#if defined(__SAM3X8E__)
+  return DWT->CYCCNT;
+#else
+  return micros();
+#endif
+}
+
+void Profiler::stop(uint8_t id, uint32_t started)
+{
+  uint32_t elapsed = start()-started;
+  ProfileStats &stats = _stats[id];
+
+  stats.count++;
+  stats.sum += elapsed;
+  if(elapsed<stats.min){
+    stats.min = elapsed;
+  }
+  if(elapsed>stats.max){
+    stats.max = elapsed;
+  }
+}
+
+void Profiler::stepLateness(unsigned long lateness)
+{
+  uint8_t bin = 0;
+  unsigned long limit = LATENESS_FIRST_BIN;
+  while(bin<LATENESS_BINS-1 && lateness>=limit){
+    bin++;
+    limit <<= 1;
+  }
+  _lateness[bin]++;
+}
+
+void Profiler::report()
+{
+  //One line per subsystem with times in us, then the lateness histogram
+  for(uint8_t i=0; i<NUM_PROFILES; i++){
+    ProfileStats &stats = _stats[i];
+    Serial.print(profile_names[i]);
+    Serial.print(": n=");
+    Serial.print(stats.count);
+    if(stats.count>0){
+      Serial.print(" min=");
+      Serial.print(_toMicros(stats.min));
+      Serial.print(" mean=");
+      Serial.print(_toMicros((uint32_t)(stats.sum/stats.count)));
+      Serial.print(" max=");
+      Serial.print(_toMicros(stats.max));
+    }
+    Serial.println();
+  }
+
+  unsigned long limit = LATENESS_FIRST_BIN;
+  for(uint8_t bin=0; bin<LATENESS_BINS; bin++){
+    if(bin<LATENESS_BINS-1){
+      Serial.print("step_late<");
+      Serial.print(limit);
+    }
+    else{
+      Serial.print("step_late>=");
+      Serial.print(limit>>1);
+    }
+    Serial.print(": ");
+    Serial.println(_lateness[bin]);
+    limit <<= 1;
+  }
+}
+
+void Profiler::reset()
+{
+  for(uint8_t i=0; i<NUM_PROFILES; i++){
+    _stats[i].count = 0;
+    _stats[i].min = 0xFFFFFFFF;
+    _stats[i].max = 0;
+    _stats[i].sum = 0;
+  }
+  for(uint8_t bin=0; bin<LATENESS_BINS; bin++){
+    _lateness[bin] = 0;
+  }
+}
+
+uint32_t Profiler::_toMicros(uint32_t ticks)
+{
+#if defined(__SAM3X8E__)
+  return ticks/(F_CPU/1000000);
+#else
+  return ticks;
+#endif
+}
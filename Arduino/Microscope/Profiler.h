@@ -0,0 +1,56 @@
+/*
+  Profiler.h - Library for measuring firmware timing on the OpenLabTools microscope
+  Written by James Ritchie for OpenLabTools
+  github.com/OpenLabTools/Microscope
+*/
+#include "Arduino.h"
+
+#ifndef Profiler_h
+#define Profiler_h
+
+//Define timed subsystems
+#define PROFILE_LOOP 0
+#define PROFILE_COMMAND 1
+#define PROFILE_MANUAL 2
+#define PROFILE_RING 3
+#define PROFILE_STAGE 4
+#define NUM_PROFILES 5
+
+//Step lateness histogram, bin n counts steps less than 128<<n us late
+//and the last bin counts everything later
+#define LATENESS_BINS 8
+#define LATENESS_FIRST_BIN 128
+
+struct ProfileStats
+{
+  uint32_t count;
+  uint32_t min;
+  uint32_t max;
+  uint64_t sum;
+};
+
+class Profiler
+{
+  public:
+    Profiler();
+    void begin();
+
+    //Timestamp to pass to stop(), in counter ticks
+    uint32_t start();
+    void stop(uint8_t id, uint32_t started);
+
+    void stepLateness(unsigned long lateness);
+
+    void report();
+    void reset();
+
+  private:
+    ProfileStats _stats[NUM_PROFILES];
+    uint32_t _lateness[LATENESS_BINS];
+
+    uint32_t _toMicros(uint32_t ticks);
+};
+
+extern Profiler profiler;
+
+#endif
@@ -0,0 +1,84 @@
+/*
+  Scheduler.cpp - Library for cooperatively scheduling the firmware tasks on the
+  OpenLabTools microscope
+  Written by James Ritchie for OpenLabTools
+  github.com/OpenLabTools/Microscope
+*/
+#include "Arduino.h"
+#include "Scheduler.h"
+
+Scheduler::Scheduler()
+{
+  _num_tasks = 0;
+}
+
+int Scheduler::addTask(const char *name, TaskFunction run, unsigned long period, TaskReady ready)
+{
+  //Returns the slot of the task, or -1 if all slots are taken
+  if(_num_tasks>=MAX_TASKS){
+    return -1;
+  }
+
+  Task &task = _tasks[_num_tasks];
+  task.name = name;
+  task.run = run;
+  task.ready = ready;
+  task.period = period;
+  task.last_run = micros();
+  task.budget = 0;
+
+  return _num_tasks++;
+}
+
+void Scheduler::loop()
+{
+  //Run every task that is due and ready, in the order they were added,
+  //measuring how long each one takes
+  for(int i=0; i<_num_tasks; i++){
+    Task &task = _tasks[i];
+    unsigned long now = micros();
+
+    if((now-task.last_run)<task.period){
+      continue;
+    }
+    if(task.ready!=NULL && !task.ready()){
+      continue;
+    }
+
+    task.last_run = now;
+    task.run();
+
+    unsigned long elapsed = micros()-now;
+    if(elapsed>task.budget){
+      task.budget = elapsed;
+    }
+  }
+}
+
+int Scheduler::getTaskCount()
+{
+  return _num_tasks;
+}
+
+unsigned long Scheduler::getBudget(int task)
+{
+  return _tasks[task].budget;
+}
+
+void Scheduler::report()
+{
+  //One line per task with its longest run in us, in the order they were added
+  for(int i=0; i<_num_tasks; i++){
+    Serial.print("task ");
+    Serial.print(_tasks[i].name);
+    Serial.print(": budget=");
+    Serial.println(_tasks[i].budget);
+  }
+}
+
+void Scheduler::resetBudgets()
+{
+  for(int i=0; i<_num_tasks; i++){
+    _tasks[i].budget = 0;
+  }
+}
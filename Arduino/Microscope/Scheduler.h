@@ -0,0 +1,48 @@
+/*
+  Scheduler.h - Library for cooperatively scheduling the firmware tasks on the
+  OpenLabTools microscope
+  Written by James Ritchie for OpenLabTools
+  github.com/OpenLabTools/Microscope
+*/
+#include "Arduino.h"
+
+#ifndef Scheduler_h
+#define Scheduler_h
+
+//Number of task slots
+#define MAX_TASKS 8
+
+typedef void (*TaskFunction)();
+typedef boolean (*TaskReady)();
+
+struct Task
+{
+  const char *name;         //Name reported by get_timing
+  TaskFunction run;
+  TaskReady ready;          //Task only runs when this returns true (NULL for always)
+  unsigned long period;     //Minimum time between runs in us (0 for every pass)
+  unsigned long last_run;   //Time of the last run in us
+  unsigned long budget;     //Longest run measured so far in us
+};
+
+class Scheduler
+{
+  public:
+    Scheduler();
+
+    int addTask(const char *name, TaskFunction run, unsigned long period, TaskReady ready = NULL);
+    void loop();
+
+    int getTaskCount();
+    unsigned long getBudget(int task);
+
+    //Print the budget of every task; resetBudgets() clears them
+    void report();
+    void resetBudgets();
+
+  private:
+    Task _tasks[MAX_TASKS];
+    int _num_tasks;
+};
+
+#endif
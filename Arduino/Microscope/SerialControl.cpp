@@ -13,6 +13,7 @@ SerialControl::SerialControl()
   
   //Initialize variables
   string_complete = false;
+  sync_count = 0;
   input_string = (char *)malloc(MAX_LENGTH);
   str_pos = 0;
 }
@@ -28,6 +29,13 @@ void SerialControl::serialEvent()
   while (Serial.available()) {
     // get the new byte:
     char in_char = (char)Serial.read(); 
+    // sync markers only come between commands, and are counted rather
+    // than parsed so they never wait behind a line
+    if ((in_char == SYNC_MARKER) && (str_pos == 0))
+    {
+      sync_count++;
+      continue;
+    }
     // add it to the inputString:
     if ((str_pos<MAX_LENGTH) && (in_char!='\n'))
     {
@@ -8,10 +8,15 @@
 #ifndef SerialControl_h
 #define SerialControl_h
 
+//Single byte the host sends, outside any command, each time it has taken a
+//frame during multi-channel acquisition. It gets no reply.
+#define SYNC_MARKER '~'
+
 class SerialControl
 {
   public:  
     boolean string_complete;             //Flag to indicate command received
+    int sync_count;                      //Sync markers not yet handled
   
     char *input_string; //Raw string from serial
     char *command;
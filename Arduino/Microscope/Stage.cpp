@@ -7,17 +7,18 @@
 #include <Wire.h>
 #include <Adafruit_MotorShield.h>
 #include "Stage.h"
+#include "StepperDriver.h"
+#include "Profiler.h"
 #include "TouchScreen.h"
 
 // Create the motor shield objects
 Adafruit_MotorShield lower_afms = Adafruit_MotorShield(0x60);
 Adafruit_MotorShield upper_afms = Adafruit_MotorShield(0x61);
 
-// Create stepper motors for each axis (200 steps per rev)
-Adafruit_StepperMotor *xy_a_motor = lower_afms.getStepper(200,1);
-Adafruit_StepperMotor *xy_b_motor = lower_afms.getStepper(200,2);
-Adafruit_StepperMotor *z_1_motor = upper_afms.getStepper(200, 1);
-Adafruit_StepperMotor *z_2_motor = upper_afms.getStepper(200, 2);
+// Create drivers that step both motors of a shield in one go
+// (xy a and z 1 on stepper port 1, xy b and z 2 on stepper port 2)
+StepperDriver xy_driver = StepperDriver(0x60);
+StepperDriver z_driver = StepperDriver(0x61);
 
 //Create the touchscreen object
 TouchScreen ts = TouchScreen(XP, YP, XM, YM, 300);
@@ -33,6 +34,8 @@ void Stage::begin()
   //Initiliaze the motor shield
   lower_afms.begin();
   upper_afms.begin();
+  xy_driver.begin();
+  z_driver.begin();
 
   //Setup pins for input
   pinMode(Z_ULIMIT_SWITCH, INPUT_PULLUP);
@@ -43,16 +46,34 @@ void Stage::begin()
   _y_pos = 0;
   _z_pos = 0;
 
-  _xy_interval = 15;
-  _z_interval = 15;
+  _xy_interval = 15000;
+  _z_interval = 15000;
+
+  _z_stepping = false;
+  _xy_stepping = false;
+
+  _xy_mode = STEP_MODE_COARSE;
+  _z_mode = STEP_MODE_COARSE;
+
+  _z_phase = 0;
+  _xy_a_phase = 0;
+  _xy_b_phase = 0;
+
+  _restoreState();
 
 }
 
 void Stage::loop()
 {
 
-  //Check for manual commands
-  manualControl();
+  //Manual control is run separately by the scheduler, as reading the
+  //touchscreen is slow and only needs doing at the touch sample rate
+
+  //The saved position stops being valid as soon as the stage moves
+  if(_state_clean && (getDistanceToGo(X_STEPPER)!=0 || getDistanceToGo(Y_STEPPER)!=0 || getDistanceToGo(Z_STEPPER)!=0)){
+    _store.markDirty();
+    _state_clean = false;
+  }
 
   //Test limit switches to prevent driving stage past limits
   if(!digitalRead(Z_ULIMIT_SWITCH) && (getDistanceToGo(Z_STEPPER) > 0)){
@@ -63,78 +84,78 @@ void Stage::loop()
   }
 
   //Called on every loop to enable non-blocking control of steppers
-  if((millis()-_z_last_step)>_z_interval){
-    if((_z_target-_z_pos)>0){
-      z_1_motor->onestep(FORWARD, DOUBLE);
-      z_2_motor->onestep(FORWARD, DOUBLE);
-      _z_last_step = millis();
-      _z_pos++;
+  unsigned long z_elapsed = micros()-_z_last_step;
+  if(z_elapsed>_z_interval){
+    long z_to_go = _z_target-_z_pos;
+    if(z_to_go!=0){
+      if(_z_stepping){
+        profiler.stepLateness(z_elapsed-_z_interval);
+      }
+      _z_stepping = true;
+      uint8_t dir = (z_to_go>0) ? FORWARD : BACKWARD;
+      uint8_t style = _stepStyle(_z_mode, labs(z_to_go), DOUBLE, _onGrid(_z_phase));
+      //Both z motors are written in the same burst so they stay in lockstep
+      z_driver.step(dir, dir, style);
+      _z_pos += (z_to_go>0 ? 1 : -1)*_stepDelta(_z_phase, z_driver.getPhase(0), dir);
+      _z_last_step = micros();
     }
-    else if((_z_target-_z_pos)<0){
-       z_1_motor->onestep(BACKWARD, DOUBLE);
-       z_2_motor->onestep(BACKWARD, DOUBLE);
-       _z_last_step = millis();
-       _z_pos--;
+    else{
+      _z_stepping = false;
     }
   }
 
-  if((millis()-_xy_last_step)>_xy_interval){
+  unsigned long xy_elapsed = micros()-_xy_last_step;
+  if(xy_elapsed>_xy_interval){
+
+    long x_to_go = _x_target-_x_pos;
+    long y_to_go = _y_target-_y_pos;
 
-    if((_x_target-_x_pos)>0 && (_y_target-_y_pos)>0){
+    //Diagonal moves drive both axes, so stop at the nearer of the two targets
+    long xy_to_go;
+    if(x_to_go!=0 && y_to_go!=0){
+      xy_to_go = min(labs(x_to_go), labs(y_to_go));
+    }
+    else{
+      xy_to_go = max(labs(x_to_go), labs(y_to_go));
+    }
+    if(xy_to_go==0){
+      _xy_stepping = false;
+    }
+    else if(_xy_stepping){
+      profiler.stepLateness(xy_elapsed-_xy_interval);
+    }
+
+    if(x_to_go>0 && y_to_go>0){
       //Move up and right
-      xy_a_motor->onestep(FORWARD, INTERLEAVE);
-      _xy_last_step = millis();
-      _x_pos++;
-      _y_pos++;
+      _xyStep(FORWARD, HOLD, 1, 1, xy_to_go);
     }
-    else if((_x_target-_x_pos)>0 && (_y_target-_y_pos)<0){
+    else if(x_to_go>0 && y_to_go<0){
       //Move down and right
-      xy_b_motor->onestep(FORWARD, INTERLEAVE);
-      _xy_last_step = millis();
-      _x_pos++;
-      _y_pos--;
+      _xyStep(HOLD, FORWARD, 1, -1, xy_to_go);
     }
-     else if((_x_target-_x_pos)<0 && (_y_target-_y_pos)>0){
+    else if(x_to_go<0 && y_to_go>0){
       //Move up and left
-      xy_b_motor->onestep(BACKWARD, INTERLEAVE);
-      _xy_last_step = millis();
-      _x_pos--;
-      _y_pos++;
+      _xyStep(HOLD, BACKWARD, -1, 1, xy_to_go);
     }
-     else if((_x_target-_x_pos)<0 && (_y_target-_y_pos)<0){
+    else if(x_to_go<0 && y_to_go<0){
       //Move down and left
-      xy_a_motor->onestep(BACKWARD, INTERLEAVE);
-      _xy_last_step = millis();
-      _x_pos--;
-      _y_pos--;
+      _xyStep(BACKWARD, HOLD, -1, -1, xy_to_go);
     }
-     else if((_x_target-_x_pos)==0 && (_y_target-_y_pos)>0){
+    else if(x_to_go==0 && y_to_go>0){
       //Move up
-      xy_a_motor->onestep(FORWARD, INTERLEAVE);
-      xy_b_motor->onestep(BACKWARD, INTERLEAVE);
-      _xy_last_step = millis();
-      _y_pos++;
+      _xyStep(FORWARD, BACKWARD, 0, 1, xy_to_go);
     }
-    else if((_x_target-_x_pos)==0 && (_y_target-_y_pos)<0){
+    else if(x_to_go==0 && y_to_go<0){
       //Move down
-      xy_a_motor->onestep(BACKWARD, INTERLEAVE);
-      xy_b_motor->onestep(FORWARD, INTERLEAVE);
-      _xy_last_step = millis();
-      _y_pos--;
+      _xyStep(BACKWARD, FORWARD, 0, -1, xy_to_go);
     }
-    else if((_x_target-_x_pos)>0 && (_y_target-_y_pos)==0){
+    else if(x_to_go>0 && y_to_go==0){
       //Move right
-      xy_a_motor->onestep(FORWARD, INTERLEAVE);
-      xy_b_motor->onestep(FORWARD, INTERLEAVE);
-      _xy_last_step = millis();
-      _x_pos++;
+      _xyStep(FORWARD, FORWARD, 1, 0, xy_to_go);
     }
-    else if((_x_target-_x_pos)<0 && (_y_target-_y_pos)==0){
+    else if(x_to_go<0 && y_to_go==0){
       //Move left
-      xy_a_motor->onestep(BACKWARD, INTERLEAVE);
-      xy_b_motor->onestep(BACKWARD, INTERLEAVE);
-      _xy_last_step = millis();
-      _x_pos--;
+      _xyStep(BACKWARD, BACKWARD, -1, 0, xy_to_go);
     }
 
   }
@@ -142,6 +163,61 @@ void Stage::loop()
 
 }
 
+void Stage::_xyStep(uint8_t a_dir, uint8_t b_dir, int x_sign, int y_sign, long to_go)
+{
+  //Step the xy motors (HOLD leaves a motor where it is) and update the
+  //positions by the distance actually travelled, in microsteps. Only the
+  //motors that move need to be on the grid for a coarse step.
+  boolean on_grid = (a_dir==HOLD || _onGrid(_xy_a_phase)) && (b_dir==HOLD || _onGrid(_xy_b_phase));
+  uint8_t style = _stepStyle(_xy_mode, to_go, INTERLEAVE, on_grid);
+  xy_driver.step(a_dir, b_dir, style);
+  long delta = 0;
+  if(a_dir!=HOLD){
+    delta = _stepDelta(_xy_a_phase, xy_driver.getPhase(0), a_dir);
+  }
+  if(b_dir!=HOLD){
+    delta = _stepDelta(_xy_b_phase, xy_driver.getPhase(1), b_dir);
+  }
+  _x_pos += x_sign*delta;
+  _y_pos += y_sign*delta;
+  _xy_last_step = micros();
+  _xy_stepping = true;
+}
+
+uint8_t Stage::_stepStyle(uint8_t mode, long to_go, uint8_t coarse_style, boolean on_grid)
+{
+  //A coarse step can travel up to a full step, so only use it while at least
+  //that much is left; the remainder is made up in microsteps.
+  //Coarse steps energise the coils at half-step phases whatever the phase
+  //was, so after a fine move has left the motor between them, microstep to
+  //the next one first, otherwise the motor and the count would disagree.
+  if(mode==STEP_MODE_COARSE && to_go>=MICROSTEPS && on_grid){
+    return coarse_style;
+  }
+  return MICROSTEP;
+}
+
+boolean Stage::_onGrid(uint8_t phase)
+{
+  //Half-step phases, the only ones DOUBLE and INTERLEAVE steps stop at
+  return (phase % (MICROSTEPS/2))==0;
+}
+
+long Stage::_stepDelta(uint8_t &phase, uint8_t new_phase, uint8_t dir)
+{
+  //The drivers report the coil phase in microsteps, wrapping every four full
+  //steps. The change in phase is the distance moved by this step.
+  uint8_t delta;
+  if(dir==FORWARD){
+    delta = (new_phase-phase) & (MICROSTEPS*4-1);
+  }
+  else{
+    delta = (phase-new_phase) & (MICROSTEPS*4-1);
+  }
+  phase = new_phase;
+  return delta;
+}
+
 void Stage::manualControl()
 {
   //Get pressure point from TS.
@@ -151,32 +227,32 @@ void Stage::manualControl()
     //If pressed, move stage depending on sector
     if(p.y<400 && p.x>600){
       //Move forwards
-      _y_target = _y_pos - 1;
+      _y_target = _y_pos - MICROSTEPS/2;
     }
 
     if(p.y>700 && p.x>600){
       //Move backwards
-      _y_target = _y_pos + 1;
+      _y_target = _y_pos + MICROSTEPS/2;
     }
 
     if(p.x<700 &&p.x>380&&p.y>450&&p.y<650){
       //Move right
-      _x_target = _x_pos + 1;
+      _x_target = _x_pos + MICROSTEPS/2;
     }
 
     if(p.x>750&&p.y>450&&p.y<650){
       //Move left
-      _x_target = _x_pos - 1;
+      _x_target = _x_pos - MICROSTEPS/2;
     }
 
     if(p.x<310 && p.y<500){
       //Move up
-      _z_target = _z_pos + 1;
+      _z_target = _z_pos + MICROSTEPS;
     }
 
     if(p.x<310 && p.y>500){
       //Move down
-      _z_target = _z_pos - 1;
+      _z_target = _z_pos - MICROSTEPS;
     }
   }
 
@@ -185,7 +261,41 @@ void Stage::manualControl()
 
 void Stage::calibrate()
 {
+  //Run z down to the lower limit switch and up to the upper one to measure
+  //its travel. Blocks until done, so the host waits for the OK.
+  calibrated = false;
+  if(!_runToLimit(Z_LLIMIT_SWITCH, -CALIBRATE_TRAVEL)){
+    return;
+  }
+  _z_pos = _z_target = 0;
+  if(!_runToLimit(Z_ULIMIT_SWITCH, CALIBRATE_TRAVEL)){
+    return;
+  }
+  _z_length = _z_pos;
+
+  //Finish in the middle of the travel, clear of both switches
+  _z_target = _z_length/2;
+  while(getDistanceToGo(Z_STEPPER)!=0){
+    loop();
+  }
 
+  //x and y have no limit switches, so they count from where they are now
+  _x_pos = _x_target = 0;
+  _y_pos = _y_target = 0;
+  _x_length = 0;
+  _y_length = 0;
+  calibrated = true;
+}
+
+boolean Stage::_runToLimit(int pin, long steps)
+{
+  //Step z through loop(), which stops it when the switch is pressed.
+  //Returns false if the switch was never reached.
+  Move(Z_STEPPER, steps);
+  while(getDistanceToGo(Z_STEPPER)!=0){
+    loop();
+  }
+  return !digitalRead(pin);
 }
 
 long Stage::getPosition(int stepper)
@@ -268,3 +378,113 @@ void Stage::MoveTo(int stepper, long position)
     }
   }
 }
+
+void Stage::setStepMode(int stepper, uint8_t mode)
+{
+  //x and y share their motors, so they share a step mode
+  switch(stepper) {
+    case X_STEPPER:
+    case Y_STEPPER:
+      _xy_mode = mode;
+      break;
+    case Z_STEPPER:
+      _z_mode = mode;
+      break;
+  }
+}
+
+uint8_t Stage::getStepMode(int stepper)
+{
+  switch(stepper) {
+    case X_STEPPER:
+    case Y_STEPPER:
+      return _xy_mode;
+      break;
+    case Z_STEPPER:
+      return _z_mode;
+      break;
+  }
+}
+
+void Stage::saveState()
+{
+  //Save the lengths and position with the clean marker set. Only valid with
+  //the stage at rest, so the host should wait for moves to finish first.
+  StageState state;
+  state.clean = 1;
+  state.calibrated = calibrated;
+  state.x_length = _x_length;
+  state.y_length = _y_length;
+  state.z_length = _z_length;
+  state.x_pos = _x_pos;
+  state.y_pos = _y_pos;
+  state.z_pos = _z_pos;
+  state.z_phase = _z_phase;
+  state.xy_a_phase = _xy_a_phase;
+  state.xy_b_phase = _xy_b_phase;
+  _store.save(state);
+  _state_clean = true;
+}
+
+void Stage::_restoreState()
+{
+  _state_clean = false;
+
+  StageState state;
+  if(!_store.load(state)){
+    return;
+  }
+
+  //Axis lengths don't change, so keep them whatever state we were left in
+  _x_length = state.x_length;
+  _y_length = state.y_length;
+  _z_length = state.z_length;
+
+  if(!state.clean){
+    return;
+  }
+  //A rejected state is marked dirty, so it can't be restored after a later
+  //reset either, once the stage may have been moved by hand
+  if(!state.calibrated){
+    _store.markDirty();
+    return;
+  }
+
+  //Quick check against the z limit switches: a pressed switch must agree
+  //with the saved position, and a free axis must be between the two.
+  //With neither switch pressed this only catches a position outside the
+  //travel; a stage moved by hand between the switches is not detected, so
+  //send calibrate if it may have been.
+  boolean at_lower = !digitalRead(Z_LLIMIT_SWITCH);
+  boolean at_upper = !digitalRead(Z_ULIMIT_SWITCH);
+  boolean consistent;
+  if(at_lower){
+    consistent = (state.z_pos<=RESTORE_TOLERANCE);
+  }
+  else if(at_upper){
+    consistent = (state.z_pos>=state.z_length-RESTORE_TOLERANCE);
+  }
+  else{
+    consistent = (state.z_pos>=0 && state.z_pos<=state.z_length);
+  }
+  if(!consistent){
+    _store.markDirty();
+    return;
+  }
+
+  //The next step counts on from the phases the coils were left at, so it
+  //moves by one step from the restored position rather than jumping
+  _z_phase = state.z_phase;
+  _xy_a_phase = state.xy_a_phase;
+  _xy_b_phase = state.xy_b_phase;
+  z_driver.setPhase(0, _z_phase);
+  z_driver.setPhase(1, _z_phase);
+  xy_driver.setPhase(0, _xy_a_phase);
+  xy_driver.setPhase(1, _xy_b_phase);
+
+  _x_pos = _x_target = state.x_pos;
+  _y_pos = _y_target = state.y_pos;
+  _z_pos = _z_target = state.z_pos;
+  calibrated = true;
+  _state_clean = true;
+}
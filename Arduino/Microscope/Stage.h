@@ -8,6 +8,7 @@
 #include <Adafruit_MotorShield.h>
 #include <AccelStepper.h>
 #include "TouchScreen.h"
+#include "StateStore.h"
 
 #ifndef Stage_h
 #define Stage_h
@@ -16,11 +17,25 @@
 #define Z_ULIMIT_SWITCH 5
 #define Z_LLIMIT_SWITCH 4
 
+//How far a restored z position may be from a pressed limit switch
+#define RESTORE_TOLERANCE (4*MICROSTEPS)
+
+//Furthest calibrate runs z looking for a limit switch before giving up
+#define CALIBRATE_TRAVEL (10000L*MICROSTEPS)
+
 //Define motor selections
 #define X_STEPPER 0
 #define Y_STEPPER 1
 #define Z_STEPPER 2
 
+//Define step modes
+//Coarse runs full/half steps (DOUBLE for z, INTERLEAVE for xy) and finishes
+//the last part of a move in microsteps, fine microsteps the whole way.
+//A coarse move starting off the half-step grid microsteps onto it first.
+//Positions are always counted in microsteps (MICROSTEPS per full step).
+#define STEP_MODE_COARSE 0
+#define STEP_MODE_FINE 1
+
 //Define Touchscreen pins
 #define YP A2  // must be an analog pin, use "An" notation!
 #define XM A3  // must be an analog pin, use "An" notation!
@@ -48,6 +63,10 @@ class Stage
     void Move(int stepper, long steps);
     void MoveTo(int stepper,long position);
 
+    void setStepMode(int stepper, uint8_t mode);
+    uint8_t getStepMode(int stepper);
+
+    void saveState();
 
 
   private:
@@ -64,11 +83,35 @@ class Stage
     long _z_target;
     long _y_target;
 
-    long _z_last_step;
-    long _xy_last_step;
+    unsigned long _z_last_step;
+    unsigned long _xy_last_step;
+
+    //Time between steps in us
+    unsigned long _z_interval;
+    unsigned long _xy_interval;
+
+    //Set while an axis is stepping continuously, so lateness can be measured
+    boolean _z_stepping;
+    boolean _xy_stepping;
+
+    uint8_t _z_mode;
+    uint8_t _xy_mode;
+
+    //Coil phase of each motor after its last step
+    uint8_t _z_phase;
+    uint8_t _xy_a_phase;
+    uint8_t _xy_b_phase;
+
+    StateStore _store;
+    boolean _state_clean;   //Saved state matches the stage, until it next moves
+
+    void _restoreState();
+    boolean _runToLimit(int pin, long steps);
 
-    long _z_interval;
-    long _xy_interval;
+    uint8_t _stepStyle(uint8_t mode, long to_go, uint8_t coarse_style, boolean on_grid);
+    boolean _onGrid(uint8_t phase);
+    long _stepDelta(uint8_t &phase, uint8_t new_phase, uint8_t dir);
+    void _xyStep(uint8_t a_dir, uint8_t b_dir, int x_sign, int y_sign, long to_go);
 
     Point p;
 
@@ -0,0 +1,94 @@
+/*
+  StateStore.cpp - Library for keeping the stage state in non-volatile memory on
+  the OpenLabTools microscope
+  Written by James Ritchie for OpenLabTools
+  github.com/OpenLabTools/Microscope
+
+  The Due has no EEPROM, so there the state lives in a page of flash through
+  the DueFlashStorage library. Flash wears out after ~10000 writes, so the
+  state is only written on a save_state command and when the first move after
+  a save clears the clean marker, never on every move.
+*/
+#include "Arduino.h"
+#include <stddef.h>
+#include "StateStore.h"
+
+#if defined(__SAM3X8E__)
+#include <DueFlashStorage.h>
+DueFlashStorage flash_storage;
+#else
+#include <EEPROM.h>
+#endif
+
+#define STATE_ADDRESS 0
+
+StateStore::StateStore()
+{
+
+}
+
+boolean StateStore::load(StageState &state)
+{
+  //Returns false if nothing valid has been saved
+  _read((uint8_t *)&state, sizeof(state));
+  if(state.magic!=STATE_MAGIC || state.version!=STATE_VERSION){
+    return false;
+  }
+  return state.checksum==_checksum(state);
+}
+
+void StateStore::save(StageState &state)
+{
+  state.magic = STATE_MAGIC;
+  state.version = STATE_VERSION;
+  state.checksum = _checksum(state);
+  _write(0, (uint8_t *)&state, sizeof(state));
+}
+
+void StateStore::markDirty()
+{
+  //Clear only the clean byte and fix up the checksum to match
+  StageState state;
+  if(!load(state) || !state.clean){
+    return;
+  }
+  state.clean = 0;
+  state.checksum = _checksum(state);
+  _write(offsetof(StageState, clean), &state.clean, 1);
+  _write(offsetof(StageState, checksum), (uint8_t *)&state.checksum, sizeof(state.checksum));
+}
+
+uint16_t StateStore::_checksum(StageState &state)
+{
+  //Fletcher-16 over everything but the checksum itself
+  uint8_t *data = (uint8_t *)&state;
+  uint16_t sum_1 = 0;
+  uint16_t sum_2 = 0;
+  for(size_t i=0; i<offsetof(StageState, checksum); i++){
+    sum_1 = (sum_1 + data[i]) % 255;
+    sum_2 = (sum_2 + sum_1) % 255;
+  }
+  return (sum_2 << 8) | sum_1;
+}
+
+void StateStore::_read(uint8_t *data, int length)
+{
+  for(int i=0; i<length; i++){
+#if defined(__SAM3X8E__)
+    data[i] = flash_storage.read(STATE_ADDRESS+i);
+#else
+    data[i] = EEPROM.read(STATE_ADDRESS+i);
+#endif
+  }
+}
+
+void StateStore::_write(int offset, uint8_t *data, int length)
+{
+#if defined(__SAM3X8E__)
+  flash_storage.write(STATE_ADDRESS+offset, data, length);
+#else
+  for(int i=0; i<length; i++){
+    EEPROM.write(STATE_ADDRESS+offset+i, data[i]);
+  }
+#endif
+}
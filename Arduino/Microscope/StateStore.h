@@ -0,0 +1,48 @@
+/*
+  StateStore.h - Library for keeping the stage state in non-volatile memory on
+  the OpenLabTools microscope
+  Written by James Ritchie for OpenLabTools
+  github.com/OpenLabTools/Microscope
+*/
+#include "Arduino.h"
+
+#ifndef StateStore_h
+#define StateStore_h
+
+#define STATE_MAGIC 0x4F4C
+#define STATE_VERSION 2
+
+struct StageState
+{
+  uint16_t magic;
+  uint8_t version;
+  uint8_t clean;        //Set by a save with the stage at rest, cleared on the next move
+  uint8_t calibrated;
+  long x_length;
+  long y_length;
+  long z_length;
+  long x_pos;
+  long y_pos;
+  long z_pos;
+  uint8_t z_phase;      //Coil phases, so the first step after a restore starts where the motors are
+  uint8_t xy_a_phase;
+  uint8_t xy_b_phase;
+  uint16_t checksum;
+};
+
+class StateStore
+{
+  public:
+    StateStore();
+
+    boolean load(StageState &state);
+    void save(StageState &state);
+    void markDirty();
+
+  private:
+    uint16_t _checksum(StageState &state);
+    void _read(uint8_t *data, int length);
+    void _write(int offset, uint8_t *data, int length);
+};
+
+#endif
@@ -0,0 +1,187 @@
+/*
+  StepperDriver.cpp - Library for driving both steppers of a motor shield in
+  single I2C bursts on the OpenLabTools microscope
+  Written by James Ritchie for OpenLabTools
+  github.com/OpenLabTools/Microscope
+
+  The Adafruit library writes every coil of every motor as a separate I2C
+  transaction, so a step of the dual z motors costs twelve of them. This works
+  out the same coil pattern as Adafruit_StepperMotor::onestep() and writes all
+  the PWM registers of both motors with the PCA9685's auto-increment.
+*/
+#include "Arduino.h"
+#include <Wire.h>
+#include <Adafruit_MotorShield.h>
+#include "StepperDriver.h"
+
+//PCA9685 registers
+#define PCA9685_MODE1 0x00
+#define PCA9685_LED0_ON_L 0x06
+#define PCA9685_MODE1_AI 0x20
+
+//First channel used by the stepper ports
+#define FIRST_CHANNEL 2
+#define NUM_CHANNELS 12
+
+//Channels that fit in one transmission alongside the register address
+#define CHANNELS_PER_BURST ((BUFFER_LENGTH-1)/4)
+
+//Sine table for microstepping, as in the Adafruit library
+#if (MICROSTEPS == 8)
+const uint8_t microstep_curve[] = {0, 50, 98, 142, 180, 212, 236, 250, 255};
+#elif (MICROSTEPS == 16)
+const uint8_t microstep_curve[] = {0, 25, 50, 74, 98, 120, 141, 162, 180, 197, 212, 225, 236, 244, 250, 253, 255};
+#endif
+
+StepperDriver::StepperDriver(uint8_t addr)
+{
+  _addr = addr;
+  setPhase(0, 0);
+  setPhase(1, 0);
+}
+
+void StepperDriver::begin()
+{
+  //Call after the Adafruit_MotorShield has been started, as it sets up the
+  //PWM frequency. Run the bus at fast-mode and make sure auto-increment is on.
+  Wire.setClock(I2C_CLOCK);
+
+  Wire.beginTransmission(_addr);
+  Wire.write(PCA9685_MODE1);
+  Wire.endTransmission();
+  Wire.requestFrom(_addr, (uint8_t)1);
+  uint8_t mode = Wire.read();
+
+  Wire.beginTransmission(_addr);
+  Wire.write(PCA9685_MODE1);
+  Wire.write(mode | PCA9685_MODE1_AI);
+  Wire.endTransmission();
+}
+
+void StepperDriver::step(uint8_t dir_1, uint8_t dir_2, uint8_t style)
+{
+  if(dir_1!=HOLD){
+    _advance(0, dir_1, style);
+    _setCoils(0, style);
+  }
+  if(dir_2!=HOLD){
+    _advance(1, dir_2, style);
+    _setCoils(1, style);
+  }
+  _write();
+}
+
+uint8_t StepperDriver::getPhase(uint8_t motor)
+{
+  return _phase[motor];
+}
+
+void StepperDriver::setPhase(uint8_t motor, uint8_t phase)
+{
+  //Nothing is written yet, but the registers are seeded with the coils for
+  //this phase: every burst writes both motors, so one that holds during the
+  //next step is energised where it is rather than released
+  _phase[motor] = phase % (MICROSTEPS*4);
+  _setCoils(motor, MICROSTEP);
+}
+
+void StepperDriver::_advance(uint8_t motor, uint8_t dir, uint8_t style)
+{
+  //Full steps snap to the nearest phase of their kind, as in onestep()
+  uint8_t odd = (_phase[motor]/(MICROSTEPS/2)) % 2;
+  uint8_t steps;
+  switch(style) {
+    case SINGLE:
+      steps = odd ? MICROSTEPS/2 : MICROSTEPS;
+      break;
+    case DOUBLE:
+      steps = odd ? MICROSTEPS : MICROSTEPS/2;
+      break;
+    case INTERLEAVE:
+      steps = MICROSTEPS/2;
+      break;
+    default:
+      steps = 1;
+      break;
+  }
+
+  if(dir==FORWARD){
+    _phase[motor] = (_phase[motor] + steps) % (MICROSTEPS*4);
+  }
+  else{
+    _phase[motor] = (_phase[motor] + MICROSTEPS*4 - steps) % (MICROSTEPS*4);
+  }
+}
+
+void StepperDriver::_setCoils(uint8_t motor, uint8_t style)
+{
+  //Stepper 1 is on channels 8-13 and stepper 2 on channels 2-7
+  uint8_t base = (motor==0) ? 8 : 2;
+  uint8_t phase = _phase[motor];
+  uint8_t quadrant = phase/MICROSTEPS;
+
+  uint8_t ocra = 255;
+  uint8_t ocrb = 255;
+  uint8_t latch_state = 0;
+
+  if(style==MICROSTEP){
+    switch(quadrant) {
+      case 0:
+        ocra = microstep_curve[MICROSTEPS - phase];
+        ocrb = microstep_curve[phase];
+        latch_state = 0x03;
+        break;
+      case 1:
+        ocra = microstep_curve[phase - MICROSTEPS];
+        ocrb = microstep_curve[MICROSTEPS*2 - phase];
+        latch_state = 0x06;
+        break;
+      case 2:
+        ocra = microstep_curve[MICROSTEPS*3 - phase];
+        ocrb = microstep_curve[phase - MICROSTEPS*2];
+        latch_state = 0x0C;
+        break;
+      case 3:
+        ocra = microstep_curve[phase - MICROSTEPS*3];
+        ocrb = microstep_curve[MICROSTEPS*4 - phase];
+        latch_state = 0x09;
+        break;
+    }
+  }
+  else{
+    const uint8_t half_steps[] = {0x1, 0x3, 0x2, 0x6, 0x4, 0xC, 0x8, 0x9};
+    latch_state = half_steps[phase/(MICROSTEPS/2)];
+  }
+
+  //PWMA, AIN2, AIN1, BIN1, BIN2, PWMB; full on is (4096, 0)
+  _setChannel(base, 0, ocra*16);
+  _setChannel(base+1, (latch_state & 0x1) ? 4096 : 0, 0);
+  _setChannel(base+2, (latch_state & 0x4) ? 4096 : 0, 0);
+  _setChannel(base+3, (latch_state & 0x2) ? 4096 : 0, 0);
+  _setChannel(base+4, (latch_state & 0x8) ? 4096 : 0, 0);
+  _setChannel(base+5, 0, ocrb*16);
+}
+
+void StepperDriver::_setChannel(uint8_t channel, uint16_t on, uint16_t off)
+{
+  uint8_t *reg = _regs + (channel-FIRST_CHANNEL)*4;
+  reg[0] = on & 0xFF;
+  reg[1] = on >> 8;
+  reg[2] = off & 0xFF;
+  reg[3] = off >> 8;
+}
+
+void StepperDriver::_write()
+{
+  //Write the registers of both motors with auto-increment, in as few
+  //transmissions as the Wire buffer allows (one if it holds all 48 bytes)
+  for(uint8_t first=0; first<NUM_CHANNELS; first+=CHANNELS_PER_BURST){
+    uint8_t count = min(NUM_CHANNELS-first, CHANNELS_PER_BURST);
+    Wire.beginTransmission(_addr);
+    Wire.write(PCA9685_LED0_ON_L + 4*(FIRST_CHANNEL+first));
+    for(uint8_t i=0; i<count*4; i++){
+      Wire.write(_regs[first*4+i]);
+    }
+    Wire.endTransmission();
+  }
+}
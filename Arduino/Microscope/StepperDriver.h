@@ -0,0 +1,48 @@
+/*
+  StepperDriver.h - Library for driving both steppers of a motor shield in
+  single I2C bursts on the OpenLabTools microscope
+  Written by James Ritchie for OpenLabTools
+  github.com/OpenLabTools/Microscope
+*/
+#include "Arduino.h"
+#include <Wire.h>
+#include <Adafruit_MotorShield.h>
+
+#ifndef StepperDriver_h
+#define StepperDriver_h
+
+//Fast-mode I2C clock for the PWM chips on the shields
+#define I2C_CLOCK 400000
+
+//Leave a motor where it is during a step
+#define HOLD 0
+
+class StepperDriver
+{
+  public:
+    StepperDriver(uint8_t addr);
+    void begin();
+
+    //Step both motors of the shield at once, each FORWARD, BACKWARD or HOLD
+    void step(uint8_t dir_1, uint8_t dir_2, uint8_t style);
+
+    //Coil phase of a motor (0 or 1) in microsteps, wrapping every four full steps
+    uint8_t getPhase(uint8_t motor);
+    //Set the phase the next step counts from, as restored from a saved state,
+    //and the coils a motor holding during that step is left on
+    void setPhase(uint8_t motor, uint8_t phase);
+
+  private:
+    uint8_t _addr;
+    uint8_t _phase[2];
+
+    //PWM on/off counts for channels 2-13, which hold both stepper ports
+    uint8_t _regs[12*4];
+
+    void _advance(uint8_t motor, uint8_t dir, uint8_t style);
+    void _setCoils(uint8_t motor, uint8_t style);
+    void _setChannel(uint8_t channel, uint16_t on, uint16_t off);
+    void _write();
+};
+
+#endif
@@ -0,0 +1,133 @@
+// Acquisition File Program
+
+/* Lists the frames of an acquisition file, or extracts one of them as a PGM picture, found by number, time or position.
+ * Usage:
+ * 		./acquisition.x [options] <file.acq>
+ * Options:
+ * 		-f <frame>		choose a frame by number
+ * 		-t <ms>			choose the frame taken closest to a time, in milliseconds since 1970 as recorded
+ * 		-z <z>			choose the frame taken closest to a height, with -x and -y for the XY position (default 0)
+ * 		-c <channel>	only consider frames of a channel when choosing by position
+ * 		-o <file.pgm>	save the chosen frame as a PGM picture
+ * Without a frame chosen, the index of the whole file is listed.
+ * For more information, see description of acquisition_class.h
+ */
+
+
+
+#include <cstdlib>
+#include <cstdio>
+#include <sstream>
+#include <iomanip>
+
+#include "acquisition_class.h"
+#include "pgm_io.h"
+
+
+int main (int argc, char ** argv) {
+	
+	int frame = -1;
+	double time_ms = -1;
+	bool by_position = false;
+	int x = 0;
+	int y = 0;
+	int z = 0;
+	int channel = -1;
+	string output;
+	vector<string> files;
+	
+	for (int i=1; i<argc; i++)
+	{
+		string option = argv[i];
+		bool has_value = (i+1 < argc);
+		
+		if (option == "-f" && has_value)
+			frame = atoi(argv[++i]);
+		else if (option == "-t" && has_value)
+			time_ms = atof(argv[++i]);
+		else if (option == "-z" && has_value)
+		{
+			by_position = true;
+			z = atoi(argv[++i]);
+		}
+		else if (option == "-x" && has_value)
+			x = atoi(argv[++i]);
+		else if (option == "-y" && has_value)
+			y = atoi(argv[++i]);
+		else if (option == "-c" && has_value)
+			channel = atoi(argv[++i]);
+		else if (option == "-o" && has_value)
+			output = argv[++i];
+		else if (option[0] == '-')
+		{
+			cout << "\nUnknown option " << option << endl;
+			return 1;
+		}
+		else
+			files.push_back(option);
+	}
+	
+	if (files.size() != 1)
+	{
+		cout << "\nUsage: " << argv[0] << " [-f frame | -t ms | -z z [-x x] [-y y] [-c channel]] [-o output.pgm] <file.acq>" << endl;
+		return 1;
+	}
+	
+	Acqreader reading;
+	if (!reading.open(files[0]))
+		return 1;
+	
+	if (time_ms >= 0)
+		frame = reading.nearest_time(time_ms);
+	else if (by_position)
+		frame = reading.nearest_position(x, y, z, channel);
+	
+	
+	// Whole index
+	if (frame < 0 && time_ms < 0 && !by_position)
+	{
+		cout << "\n" << reading.frames() << " frames" << endl;
+		cout << "frame\ttime_ms\tx\ty\tz\tchannel\tsize\tstored\tmetrics" << endl;
+		for (int i=0; i<reading.frames(); i++)
+		{
+			const Acqentry &entry = reading.entry(i);
+			cout << i << "\t" << fixed << setprecision(1) << entry.time_ms << "\t" << entry.x << "\t" << entry.y << "\t" << entry.z
+					<< "\t" << entry.channel << "\t" << entry.width << "x" << entry.height << "\t" << entry.stored;
+			cout.unsetf(ios::fixed);
+			cout << setprecision(6);
+			for (int m=0; m<entry.metric_count; m++)
+				cout << "\t" << entry.metrics[m];
+			cout << endl;
+		}
+		return 0;
+	}
+	
+	if (frame < 0 || frame >= reading.frames())
+	{
+		cout << "\nNo such frame" << endl;
+		return 1;
+	}
+	
+	const Acqentry &entry = reading.entry(frame);
+	cout << "\nFrame " << frame << ": z " << entry.z << ", x " << entry.x << ", y " << entry.y << ", channel " << entry.channel << endl;
+	
+	if (output.empty())
+		return 0;
+	
+	vector<unsigned char> luma;
+	if (!reading.read(frame, luma))
+	{
+		cout << "\nCould not decode frame " << frame << endl;
+		return 1;
+	}
+	
+	stringstream comment;
+	comment << "z " << entry.z << " x " << entry.x << " y " << entry.y;
+	if (!write_pgm(output, &luma[0], entry.width, entry.height, comment.str()))
+		return 1;
+	
+	cout << "Saved to " << output << endl;
+	
+	return 0;
+	
+}
@@ -0,0 +1,813 @@
+// Acquisition Container Classes
+
+/* This file contains the classes that write and read acquisition files: every frame of a run in one append-only file, with an index
+ * saying where, when and in which channel each was taken, and the focus values computed on it.
+ * Frames are stored as 8-bit luma planes, raw or compressed losslessly with zlib (after replacing each pixel by its difference from the
+ * one on its left, which makes microscope pictures compress two to three times better).
+ * The file is written in fixed-size chunks, so writes are few, large and sequential however small the frames, and nothing else
+ * (no directory of pictures, no text file of values) is created.
+ *
+ * Layout, all numbers in the byte order of the machine (little-endian on the Pi):
+ * 		header: "MSACQ001", chunk size (4 bytes), 4 bytes reserved
+ * 		frames: for each, "FRAM", its index entry (ACQ_ENTRY_SIZE bytes) and its stored bytes
+ * 		footer: the index entries of all frames, then "MSACQIDX", the number of frames and the offset of the index (8 bytes)
+ * The footer is written on close, and replaced when frames are appended later. A file that was never closed (power cut, crash)
+ * has no footer, but every frame carries its own entry, so the reader rebuilds the index by walking the frames.
+ *
+ * Acqwriter
+ * public:
+ * Acqwriter() -> Only class constructor. Opens nothing.
+ * ~Acqwriter() -> Class destructor, closing the file if open.
+ * open(string, int, int) -> Opens a file to append to (creating it if needed), with the zlib level to store frames at (0 to store them raw,
+ * 		default 1, the fastest) and the chunk size in bytes (default 1 MB, used for new files only). Returns false if it can't be opened.
+ * append(const unsigned char*, Acqentry) -> Adds a frame of the width and height given in the entry, which also gives its time, position,
+ * 		channel and focus values. The stored size, offset and compression of the entry are filled in here.
+ * close() -> Writes the last chunk and the footer. Returns false if anything could not be written.
+ * is_open(), frames() -> Whether a file is open, and how many frames it holds.
+ *
+ * Acqreader
+ * public:
+ * Acqreader() -> Only class constructor.
+ * ~Acqreader() -> Class destructor, unmapping and closing the file if open.
+ * open(string) -> Opens a file and maps its index into memory, or rebuilds the index if the file has no footer.
+ * frames(), entry(int) -> Number of frames, and the index entry of one.
+ * read(int, vector<unsigned char>&) -> Maps the stored bytes of a frame and decodes them into a luma plane.
+ * nearest_time(double) -> Frame taken closest to a time.
+ * nearest_position(int, int, int, int) -> Frame taken closest to a position (x, y, z), optionally only among those of a channel.
+ * data_end() -> Where the frames end, where appending continues.
+ * close() -> Closes the file.
+ */
+
+
+
+#ifndef ACQUISITION_CLASS_H
+#define ACQUISITION_CLASS_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdlib>
+#include <cmath>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <zlib.h>
+
+using namespace std;
+
+
+// Size of the entry of each frame in the index, and the most focus values one can carry
+#define ACQ_ENTRY_SIZE 72
+#define ACQ_METRICS 4
+#define ACQ_HEADER_SIZE 16
+
+// Chunk sizes a writer uses, and accepts from the header of an existing file
+#define ACQ_MIN_CHUNK 4096
+#define ACQ_MAX_CHUNK (1 << 28)
+#define ACQ_TRAILER_SIZE 20
+
+// How the bytes of a frame are stored
+#define ACQ_RAW 0
+#define ACQ_DEFLATE_DELTA 1
+
+
+
+// Index entry of a frame
+struct Acqentry
+{
+	double time_ms;
+	int x;
+	int y;
+	int z;
+	int channel;
+	int metric_count;
+	float metrics[ACQ_METRICS];
+	int width;
+	int height;
+
+	// Filled in when the frame is appended
+	int compression;
+	unsigned int stored;
+	off_t offset;
+};
+
+
+
+/* Entries to and from their bytes on disk */
+inline void acq_put(char * bytes, const void * value, size_t size, size_t &at)
+{
+	memcpy(bytes + at, value, size);
+	at += size;
+}
+
+inline void acq_get(const char * bytes, void * value, size_t size, size_t &at)
+{
+	memcpy(value, bytes + at, size);
+	at += size;
+}
+
+inline void acq_encode(const Acqentry &entry, char * bytes)
+{
+
+	// Offsets are split in two halves, so files over 4 GB work whatever the size of off_t
+	unsigned int offset_low = (unsigned int)(entry.offset & 0xFFFFFFFF);
+	unsigned int offset_high = (unsigned int)((entry.offset >> 16) >> 16);
+
+	memset(bytes, 0, ACQ_ENTRY_SIZE);
+	size_t at = 0;
+	acq_put(bytes, &offset_low, 4, at);
+	acq_put(bytes, &offset_high, 4, at);
+	acq_put(bytes, &entry.stored, 4, at);
+	acq_put(bytes, &entry.width, 4, at);
+	acq_put(bytes, &entry.height, 4, at);
+	acq_put(bytes, &entry.compression, 4, at);
+	acq_put(bytes, &entry.time_ms, 8, at);
+	acq_put(bytes, &entry.x, 4, at);
+	acq_put(bytes, &entry.y, 4, at);
+	acq_put(bytes, &entry.z, 4, at);
+	acq_put(bytes, &entry.channel, 4, at);
+	acq_put(bytes, &entry.metric_count, 4, at);
+	acq_put(bytes, entry.metrics, 4*ACQ_METRICS, at);
+
+	return;
+
+}
+
+inline void acq_decode(const char * bytes, Acqentry &entry)
+{
+
+	unsigned int offset_low, offset_high;
+
+	size_t at = 0;
+	acq_get(bytes, &offset_low, 4, at);
+	acq_get(bytes, &offset_high, 4, at);
+	acq_get(bytes, &entry.stored, 4, at);
+	acq_get(bytes, &entry.width, 4, at);
+	acq_get(bytes, &entry.height, 4, at);
+	acq_get(bytes, &entry.compression, 4, at);
+	acq_get(bytes, &entry.time_ms, 8, at);
+	acq_get(bytes, &entry.x, 4, at);
+	acq_get(bytes, &entry.y, 4, at);
+	acq_get(bytes, &entry.z, 4, at);
+	acq_get(bytes, &entry.channel, 4, at);
+	acq_get(bytes, &entry.metric_count, 4, at);
+	acq_get(bytes, entry.metrics, 4*ACQ_METRICS, at);
+
+	entry.offset = (off_t)offset_low;
+	if (sizeof(off_t) > 4)
+		entry.offset |= ((off_t)offset_high << 16) << 16;
+
+	return;
+
+}
+
+
+
+/* Read exactly size bytes at an offset of a file */
+inline bool acq_read_at(int file, char * data, size_t size, off_t offset)
+{
+
+	size_t done = 0;
+	while (done < size)
+	{
+		ssize_t got = pread(file, data + done, size - done, offset + done);
+		if (got <= 0)
+			return false;
+		done += got;
+	}
+
+	return true;
+
+}
+
+
+
+
+class Acqreader
+{
+
+private:
+
+	int m_file;
+	off_t m_size;
+	off_t m_data_end;
+	vector<Acqentry> m_entries;
+
+	// Index mapped from the footer
+	void * m_map;
+	size_t m_map_size;
+
+
+	bool load_footer();
+
+	bool rebuild();
+
+
+public:
+
+	Acqreader();
+
+	~Acqreader();
+
+	bool open(string location);
+
+	void close();
+
+	int frames()
+	{	return (int)m_entries.size();	}
+
+	const Acqentry & entry(int frame)
+	{	return m_entries[frame];	}
+
+	const vector<Acqentry> & entries()
+	{	return m_entries;	}
+
+	off_t data_end()
+	{	return m_data_end;	}
+
+	bool read(int frame, vector<unsigned char> &luma);
+
+	int nearest_time(double time_ms);
+
+	int nearest_position(int x, int y, int z, int channel = -1);
+
+
+};
+
+
+
+
+class Acqwriter
+{
+
+private:
+
+	int m_file;
+	int m_level;
+	int m_chunk_size;
+	vector<Acqentry> m_entries;
+
+	// Chunk being filled, and where it starts in the file
+	vector<char> m_chunk;
+	size_t m_fill;
+	off_t m_chunk_start;
+	bool m_failed;
+
+	// Buffers for encoding, kept from one frame to the next
+	vector<unsigned char> m_delta;
+	vector<unsigned char> m_deflated;
+
+
+	void put(const void * data, size_t size);
+
+	bool write_all(const char * data, size_t size, off_t offset);
+
+
+public:
+
+	Acqwriter();
+
+	~Acqwriter();
+
+	bool open(string location, int level = 1, int chunk_size = 1 << 20);
+
+	bool append(const unsigned char * luma, Acqentry entry);
+
+	bool close();
+
+	bool is_open()
+	{	return m_file >= 0;	}
+
+	int frames()
+	{	return (int)m_entries.size();	}
+
+
+};
+
+
+
+
+/* Acqreader class CONSTRUCTOR */
+Acqreader::Acqreader()
+{
+
+	m_file = -1;
+	m_size = 0;
+	m_data_end = ACQ_HEADER_SIZE;
+	m_map = NULL;
+	m_map_size = 0;
+
+}
+
+
+
+
+/* Acqreader class DESTRUCTOR */
+Acqreader::~Acqreader()
+{
+
+	close();
+
+}
+
+
+
+
+/* Open a file, from its footer if it has one, or by walking its frames if not */
+bool Acqreader::open(string location)
+{
+
+	close();
+
+	m_file = ::open(location.c_str(), O_RDONLY);
+	if (m_file < 0)
+	{
+		cout << "\nCould not open " << location << endl;
+		return false;
+	}
+
+	struct stat status;
+	char header[ACQ_HEADER_SIZE];
+	if (fstat(m_file, &status) != 0 || !acq_read_at(m_file, header, ACQ_HEADER_SIZE, 0) || memcmp(header, "MSACQ001", 8) != 0)
+	{
+		cout << "\n" << location << " is not an acquisition file" << endl;
+		close();
+		return false;
+	}
+	m_size = status.st_size;
+
+	if (!load_footer())
+	{
+		rebuild();
+		cout << "\n" << location << " was not closed, recovered " << m_entries.size() << " frames" << endl;
+	}
+
+	return true;
+
+}
+
+
+
+
+/* Unmap and close the file */
+void Acqreader::close()
+{
+
+	if (m_map != NULL)
+	{
+		munmap(m_map, m_map_size);
+		m_map = NULL;
+	}
+	if (m_file >= 0)
+	{
+		::close(m_file);
+		m_file = -1;
+	}
+	m_entries.clear();
+	m_data_end = ACQ_HEADER_SIZE;
+
+	return;
+
+}
+
+
+
+
+/* Index from the footer, mapped rather than read so opening a large file costs only the pages of the index */
+bool Acqreader::load_footer()
+{
+
+	if (m_size < ACQ_HEADER_SIZE + ACQ_TRAILER_SIZE)
+		return false;
+
+	char trailer[ACQ_TRAILER_SIZE];
+	if (!acq_read_at(m_file, trailer, ACQ_TRAILER_SIZE, m_size - ACQ_TRAILER_SIZE) || memcmp(trailer, "MSACQIDX", 8) != 0)
+		return false;
+
+	unsigned int count, offset_low, offset_high;
+	size_t at = 8;
+	acq_get(trailer, &count, 4, at);
+	acq_get(trailer, &offset_low, 4, at);
+	acq_get(trailer, &offset_high, 4, at);
+	off_t index = (off_t)offset_low;
+	if (sizeof(off_t) > 4)
+		index |= ((off_t)offset_high << 16) << 16;
+
+	if (index < ACQ_HEADER_SIZE || index + (off_t)count*ACQ_ENTRY_SIZE + ACQ_TRAILER_SIZE != m_size)
+		return false;
+
+	// Mappings start on a page
+	off_t page = sysconf(_SC_PAGESIZE);
+	off_t start = index/page*page;
+	m_map_size = (size_t)(m_size - start);
+	m_map = mmap(NULL, m_map_size, PROT_READ, MAP_SHARED, m_file, start);
+	if (m_map == MAP_FAILED)
+	{
+		m_map = NULL;
+		return false;
+	}
+
+	const char * entries = (const char *)m_map + (index - start);
+	m_entries.resize(count);
+	for (unsigned int i=0; i<count; i++)
+		acq_decode(entries + (size_t)i*ACQ_ENTRY_SIZE, m_entries[i]);
+	m_data_end = index;
+
+	return true;
+
+}
+
+
+
+
+/* Index from the entries carried by the frames themselves, up to the first frame that is incomplete */
+bool Acqreader::rebuild()
+{
+
+	m_entries.clear();
+
+	off_t at = ACQ_HEADER_SIZE;
+	char record[4 + ACQ_ENTRY_SIZE];
+	while (at + 4 + ACQ_ENTRY_SIZE <= m_size)
+	{
+		if (!acq_read_at(m_file, record, sizeof record, at) || memcmp(record, "FRAM", 4) != 0)
+			break;
+
+		Acqentry entry;
+		acq_decode(record + 4, entry);
+		if (entry.offset != at + 4 + ACQ_ENTRY_SIZE || entry.offset + (off_t)entry.stored > m_size)
+			break;
+
+		m_entries.push_back(entry);
+		at = entry.offset + entry.stored;
+	}
+	m_data_end = at;
+
+	return true;
+
+}
+
+
+
+
+/* Decode a frame
+ * Only the pages holding the frame are mapped, so files of any size can be read on the 32-bit Pi */
+bool Acqreader::read(int frame, vector<unsigned char> &luma)
+{
+
+	if (frame < 0 || frame >= (int)m_entries.size())
+		return false;
+
+	const Acqentry &entry = m_entries[frame];
+	size_t pixels = (size_t)entry.width*entry.height;
+	luma.resize(pixels);
+
+	off_t page = sysconf(_SC_PAGESIZE);
+	off_t start = entry.offset/page*page;
+	size_t length = (size_t)(entry.offset - start) + entry.stored;
+	void * mapped = mmap(NULL, length, PROT_READ, MAP_SHARED, m_file, start);
+	if (mapped == MAP_FAILED)
+		return false;
+	const unsigned char * stored = (const unsigned char *)mapped + (entry.offset - start);
+
+	bool done = false;
+	if (entry.compression == ACQ_RAW)
+	{
+		done = (entry.stored == pixels);
+		if (done)
+			memcpy(&luma[0], stored, pixels);
+	}
+	else if (entry.compression == ACQ_DEFLATE_DELTA)
+	{
+		uLongf size = pixels;
+		done = (uncompress(&luma[0], &size, stored, entry.stored) == Z_OK && size == pixels);
+
+		// Undo the differences along each row
+		for (int y=0; y<entry.height && done; y++)
+		{
+			unsigned char * row = &luma[(size_t)y*entry.width];
+			for (int x=1; x<entry.width; x++)
+				row[x] = (unsigned char)(row[x] + row[x-1]);
+		}
+	}
+
+	munmap(mapped, length);
+
+	return done;
+
+}
+
+
+
+
+/* Frame taken closest to a time
+ * Frames are appended as they are taken, so times only go up and a binary search finds it */
+int Acqreader::nearest_time(double time_ms)
+{
+
+	if (m_entries.empty())
+		return -1;
+
+	int low = 0;
+	int high = (int)m_entries.size() - 1;
+	while (low < high)
+	{
+		int middle = (low + high)/2;
+		if (m_entries[middle].time_ms < time_ms)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	if (low > 0 && time_ms - m_entries[low-1].time_ms < m_entries[low].time_ms - time_ms)
+		low--;
+
+	return low;
+
+}
+
+
+
+
+/* Frame taken closest to a position, in a channel if given, or -1 if there is none */
+int Acqreader::nearest_position(int x, int y, int z, int channel)
+{
+
+	int nearest = -1;
+	double best = 0;
+	for (size_t i=0; i<m_entries.size(); i++)
+	{
+		const Acqentry &entry = m_entries[i];
+		if (channel >= 0 && entry.channel != channel)
+			continue;
+		double distance = pow((double)entry.x - x, 2) + pow((double)entry.y - y, 2) + pow((double)entry.z - z, 2);
+		if (nearest < 0 || distance < best)
+		{
+			nearest = (int)i;
+			best = distance;
+		}
+	}
+
+	return nearest;
+
+}
+
+
+
+
+/* Acqwriter class CONSTRUCTOR */
+Acqwriter::Acqwriter()
+{
+
+	m_file = -1;
+	m_level = 1;
+	m_chunk_size = 1 << 20;
+	m_fill = 0;
+	m_chunk_start = 0;
+	m_failed = false;
+
+}
+
+
+
+
+/* Acqwriter class DESTRUCTOR */
+Acqwriter::~Acqwriter()
+{
+
+	close();
+
+}
+
+
+
+
+/* Open a file to append to
+ * An existing file is read for its index, cut back to the end of its frames, and its last partial chunk reloaded,
+ * so the chunks of the new frames carry on where the old ones stopped */
+bool Acqwriter::open(string location, int level, int chunk_size)
+{
+
+	close();
+
+	m_level = (level < 0) ? 0 : ((level > 9) ? 9 : level);
+	m_entries.clear();
+	m_failed = false;
+
+	off_t data_end = ACQ_HEADER_SIZE;
+	struct stat status;
+	if (stat(location.c_str(), &status) == 0 && status.st_size > 0)
+	{
+		Acqreader existing;
+		if (!existing.open(location))
+			return false;
+		m_entries = existing.entries();
+		data_end = existing.data_end();
+
+		char header[ACQ_HEADER_SIZE];
+		int file = ::open(location.c_str(), O_RDONLY);
+		bool read = (file >= 0 && acq_read_at(file, header, ACQ_HEADER_SIZE, 0));
+		if (file >= 0)
+			::close(file);
+		if (!read)
+			return false;
+		memcpy(&m_chunk_size, header + 8, 4);
+		if (m_chunk_size < ACQ_MIN_CHUNK || m_chunk_size > ACQ_MAX_CHUNK)
+		{
+			cout << "\nChunk size " << m_chunk_size << " in the header of " << location << " is not valid" << endl;
+			return false;
+		}
+	}
+	else
+		m_chunk_size = (chunk_size < ACQ_MIN_CHUNK) ? ACQ_MIN_CHUNK : ((chunk_size > ACQ_MAX_CHUNK) ? ACQ_MAX_CHUNK : chunk_size);
+
+	m_file = ::open(location.c_str(), O_RDWR | O_CREAT, 0644);
+	if (m_file < 0)
+	{
+		cout << "\nCould not open " << location << endl;
+		return false;
+	}
+
+	m_chunk.resize(m_chunk_size);
+
+	if (data_end == ACQ_HEADER_SIZE && m_entries.empty())
+	{
+		char header[ACQ_HEADER_SIZE];
+		memset(header, 0, sizeof header);
+		memcpy(header, "MSACQ001", 8);
+		memcpy(header + 8, &m_chunk_size, 4);
+		if (ftruncate(m_file, 0) != 0 || !write_all(header, ACQ_HEADER_SIZE, 0))
+		{
+			cout << "\nCould not write " << location << endl;
+			close();
+			return false;
+		}
+	}
+
+	// Chunks count from the end of the header
+	m_chunk_start = ACQ_HEADER_SIZE + (data_end - ACQ_HEADER_SIZE)/m_chunk_size*m_chunk_size;
+	m_fill = (size_t)(data_end - m_chunk_start);
+	if ((m_fill > 0 && !acq_read_at(m_file, &m_chunk[0], m_fill, m_chunk_start)) || ftruncate(m_file, data_end) != 0)
+	{
+		cout << "\nCould not read the end of " << location << endl;
+		close();
+		return false;
+	}
+
+	return true;
+
+}
+
+
+
+
+/* Append a frame: its record header and entry, then its bytes, through the chunk */
+bool Acqwriter::append(const unsigned char * luma, Acqentry entry)
+{
+
+	if (m_file < 0)
+		return false;
+
+	size_t pixels = (size_t)entry.width*entry.height;
+	const unsigned char * stored = luma;
+	entry.compression = ACQ_RAW;
+	entry.stored = pixels;
+
+	if (m_level > 0)
+	{
+		// Differences along each row, wrapping round, are small numbers clustered round 0 that deflate well
+		m_delta.resize(pixels);
+		for (int y=0; y<entry.height; y++)
+		{
+			const unsigned char * row = luma + (size_t)y*entry.width;
+			unsigned char * out = &m_delta[(size_t)y*entry.width];
+			out[0] = row[0];
+			for (int x=1; x<entry.width; x++)
+				out[x] = (unsigned char)(row[x] - row[x-1]);
+		}
+
+		uLongf size = compressBound(pixels);
+		m_deflated.resize(size);
+		if (compress2(&m_deflated[0], &size, &m_delta[0], pixels, m_level) == Z_OK && size < pixels)
+		{
+			stored = &m_deflated[0];
+			entry.compression = ACQ_DEFLATE_DELTA;
+			entry.stored = size;
+		}
+	}
+
+	entry.offset = m_chunk_start + (off_t)m_fill + 4 + ACQ_ENTRY_SIZE;
+	if (entry.metric_count > ACQ_METRICS)
+		entry.metric_count = ACQ_METRICS;
+
+	char record[4 + ACQ_ENTRY_SIZE];
+	memcpy(record, "FRAM", 4);
+	acq_encode(entry, record + 4);
+	put(record, sizeof record);
+	put(stored, entry.stored);
+
+	m_entries.push_back(entry);
+
+	return !m_failed;
+
+}
+
+
+
+
+/* Write the last chunk and the footer */
+bool Acqwriter::close()
+{
+
+	if (m_file < 0)
+		return true;
+
+	if (m_fill > 0 && !write_all(&m_chunk[0], m_fill, m_chunk_start))
+		m_failed = true;
+
+	off_t index = m_chunk_start + (off_t)m_fill;
+	vector<char> footer((size_t)m_entries.size()*ACQ_ENTRY_SIZE + ACQ_TRAILER_SIZE);
+	for (size_t i=0; i<m_entries.size(); i++)
+		acq_encode(m_entries[i], &footer[i*ACQ_ENTRY_SIZE]);
+
+	unsigned int count = (unsigned int)m_entries.size();
+	unsigned int offset_low = (unsigned int)(index & 0xFFFFFFFF);
+	unsigned int offset_high = (unsigned int)((index >> 16) >> 16);
+	size_t at = m_entries.size()*ACQ_ENTRY_SIZE;
+	acq_put(&footer[0], "MSACQIDX", 8, at);
+	acq_put(&footer[0], &count, 4, at);
+	acq_put(&footer[0], &offset_low, 4, at);
+	acq_put(&footer[0], &offset_high, 4, at);
+
+	if (!write_all(&footer[0], footer.size(), index) || ftruncate(m_file, index + (off_t)footer.size()) != 0)
+		m_failed = true;
+
+	if (::close(m_file) != 0)
+		m_failed = true;
+	m_file = -1;
+	m_fill = 0;
+
+	if (m_failed)
+		cout << "\nCould not write all frames of the acquisition file" << endl;
+
+	return !m_failed;
+
+}
+
+
+
+
+/* Copy bytes into the chunk, writing it out each time it fills */
+void Acqwriter::put(const void * data, size_t size)
+{
+
+	const char * bytes = (const char *)data;
+	while (size > 0)
+	{
+		size_t part = m_chunk_size - m_fill;
+		if (part > size)
+			part = size;
+		memcpy(&m_chunk[m_fill], bytes, part);
+		m_fill += part;
+		bytes += part;
+		size -= part;
+
+		if (m_fill == (size_t)m_chunk_size)
+		{
+			if (!write_all(&m_chunk[0], m_fill, m_chunk_start))
+				m_failed = true;
+			m_chunk_start += m_fill;
+			m_fill = 0;
+		}
+	}
+
+	return;
+
+}
+
+
+
+
+/* Write exactly size bytes at an offset, retrying short writes */
+bool Acqwriter::write_all(const char * data, size_t size, off_t offset)
+{
+
+	size_t done = 0;
+	while (done < size)
+	{
+		ssize_t wrote = pwrite(m_file, data + done, size - done, offset + done);
+		if (wrote <= 0)
+			return false;
+		done += wrote;
+	}
+
+	return true;
+
+}
+
+
+
+#endif
@@ -17,13 +17,32 @@
  * 		Takes the number of images to be taken as input.
  * stop_stage(string) -> Verifies if the stage has finished moving before continuing with other operations.
  * 		Takes the command previously sent to move the stage as input. 
+ * wait_for_stage(bool, bool, int) -> Polls the Arduino until z and, if asked, x and y have stopped, for at most the given number of milliseconds.
+ * 		Returns false if they were still moving then. Used by the classes that drive the stage through this one.
+ * set_container(string, int) -> Records every picture analysed from now on, with its position, time and focusing value, in an
+ * 		acquisition file (see acquisition_class.h) compressed at the given zlib level. The JPEGs are then deleted once analysed.
+ * 		x and y are recorded as moved by comm_move_x(...) and comm_move_y(...) since the class was made.
+ * set_channel(int) -> Channel recorded with the pictures in the acquisition file (0 unless set).
+ * set_camera(Camera*) -> Takes pictures from a streaming camera (see camera_class.h) instead of raspistill, so they never touch a file
+ * 		unless kept, in which case they are saved as PGM. NULL goes back to raspistill.
+ * set_writer(size_t, int, int) -> Bounds the memory of pictures waiting to be saved, chooses what happens when it is full
+ * 		(see framewriter_class.h; by default 64 MB, halving pictures that don't fit) and the gzip level of kept PGM pictures.
+ * set_flatfield(const Flatfield*) -> Corrects every RaspiStill picture for the lighting before it is analysed (see flatfield_class.h),
+ * 		if the maps are the size of the pictures. Pictures from a camera are corrected by the camera itself (Camera::set_correction()).
  * 
  * private:
  * algorithm() -> Computes the focusing value of the last image saved.
  * greyfy() -> Turns the last image saved into greyscale.
- * raspistill_save() -> Saves an image using RaspiStill from terminal.
+ * raspistill_save() -> Takes an image, with RaspiStill into a scratch file (in memory, under /dev/shm, where there is one)
+ * 		or from the camera if one was given.
+ * load_picture() -> Loads the image just taken for analysis, unless it came from the camera and is loaded already.
+ * finish_picture() -> Once an image is analysed, hands it to the writer thread if it is to be kept, or deletes it.
  * remove_picture() -> Deletes the latest image saved.
  * remove_folder() -> Deletes the output folder, with all its content.
+ * record(int, float) -> Appends the picture just analysed to the acquisition file, if one is open.
+ * keep_pictures() -> Whether the JPEGs are kept once analysed.
+ * wait_ready(int) -> Waits for the Arduino to answer a query, or to start up if opening the port reset it, for at most the given number of milliseconds.
+ * read_line(string&, ptime) -> Reads a line from the serial port, giving up at the deadline.
  * move_and_capture(int, int&) -> Moves the stage by a certain number of steps (first input) and takes a picture.
  * 		It then computes the focusing value using algorithm() and stores the position reached in the second input.
  * serial_command(...) -> Sends a command to the Arduino through the serial port, and handles the output resulting.
@@ -41,13 +60,31 @@
 #include <vector>
 #include <boost/asio.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/bind/bind.hpp>
+#include <boost/thread.hpp>
+
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <ftw.h>
+#include <cerrno>
 
 #include "CImg.h"
+#include "image_kernels.h"
+#include "acquisition_class.h"
+#include "camera_class.h"
+#include "framewriter_class.h"
 
 using namespace cimg_library;
 using namespace std;
 using namespace boost::asio;
 
+// The Arduino counts all positions in microsteps, with this many to a full step of the motors
+#define MICROSTEPS_PER_STEP 16
+
+// More than the play in the z lead screw, in microsteps: moving this far below a height and back up reaches it with the play taken up
+#define BACKLASH_MICROSTEPS (8*MICROSTEPS_PER_STEP)
+
 
 class Autofocus
 {
@@ -87,11 +124,29 @@ private:
 	string m_first_part_command;
 	string m_first_part_name;
 	string m_picture_input;
+	string m_picture_output;
+	string m_scratch;
 	string m_objective;
+	string m_step_mode;
 	
 	// Image object
 	CImg<float> m_picture;
 	
+	// Acquisition file every picture analysed goes to, if open, and where the pictures are taken
+	Acqwriter m_container;
+	vector<unsigned char> m_luma;
+	int m_x;
+	int m_y;
+	int m_channel;
+	
+	// Camera pictures come from instead of raspistill, if given, and the thread saving those kept
+	Camera * m_camera;
+	Framewriter m_writer;
+	bool m_pending;
+	
+	// Maps RaspiStill pictures are corrected for the lighting with, if given
+	const Flatfield * m_flatfield;
+	
 	// String commands...
 	// ...without arguments
 	string m_calibrate;
@@ -99,6 +154,12 @@ private:
 	string m_get_z_len;
 	string m_get_z_pos;
 	string m_get_z_distance;
+	string m_save_state;
+	string m_get_x_distance;
+	string m_get_y_distance;
+	string m_clear_channels;
+	string m_start_channels;
+	string m_sync;					//single byte marking a frame taken, sent with no reply expected
 	
 	// ...with arguments
 	string m_move_to;
@@ -106,6 +167,10 @@ private:
 	string m_set_ring_colour;				//takes a string as argument, not a number
 	string m_set_ring_bright;		//takes a number only between 0-255, 0 for off. Set to a default value otherwise
 	string m_set_stage_led_bright;	//takes a number only between 0-255, 0 for off. Set to a default value otherwise
+	string m_set_step_mode;			//takes "coarse" or "fine" as argument
+	string m_move_x;				//relative moves of the xy stage, which has no limit switches to calibrate absolute positions against
+	string m_move_y;
+	string m_add_channel;			//takes "colour,ring brightness,stage LED brightness,frames" as argument
 	
 	// Parts of commands accessible only from within the class...
 	string m_number_steps;	
@@ -122,10 +187,21 @@ private:
 	void greyfy();
 	
 	void raspistill_save();
+	void load_picture();
+	void finish_picture();
 	
 	void remove_picture();
 	void remove_folder();
 	
+	void record(int position, float value);
+	
+	// The JPEGs are only worth keeping if asked for, and not already recorded
+	bool keep_pictures()
+	{	return m_leave_output && !m_container.is_open();	}
+	
+	void wait_ready(int timeout_ms = 3000);
+	bool read_line(string &line, boost::posix_time::ptime deadline);
+	
 	float move_and_capture(int steps, int &f_pos);
 	
 	bool serial_command(string command, int &number, bool couting = false, string check = "OK\r");
@@ -175,9 +251,10 @@ public:
 	float get_tolerance()
 	{	return m_precision;	}
 	
-	// Opens a serial port, by default on ttyUSB0.	
+	// Opens a serial port, by default on ttyUSB0, and waits for the Arduino to be ready.
+	// The step mode it is in is whatever it was left in, so the next comm_set_step_mode(...) always sends.
 	void set_serial(string s_port = "/dev/ttyUSB0")
-	{	m_serial = s_port; m_sp.open(s_port); sleep(3); return;	}
+	{	m_serial = s_port; m_sp.open(s_port); wait_ready(); m_step_mode = ""; return;	}
 	string get_serial()
 	{	return m_serial;	}
 	
@@ -197,9 +274,9 @@ public:
 		m_path = path;
 		set_strings();
 		
-		// Create directory where to work
-		string making_directory = "mkdir " + path;
-		system(making_directory.c_str());
+		// Create directory where to work, unless it is there already
+		if (mkdir(path.c_str(), 0755) != 0 && errno != EEXIST)
+			cout << "\nCould not create " << path << endl;
 		return; 
 	}
 	string get_path()
@@ -218,7 +295,7 @@ public:
 	// Sets command strings for raspistill command to send to terminal and for saving images with correct path and name
 	void set_strings()
 	{
-		m_first_part_command = "raspistill -n -w " + m_width + " -h " + m_height + " -o " + m_path + m_name;
+		m_first_part_command = "raspistill -n -w " + m_width + " -h " + m_height + " -o " + (m_scratch.empty() ? m_path : m_scratch) + m_name;
 		m_first_part_name = m_path + m_name;
 		return;
 	}
@@ -239,37 +316,57 @@ public:
 	bool get_output()
 	{	return m_leave_output;	}
 	
+	// Opens an acquisition file that every picture analysed is appended to
+	bool set_container(string file, int level = 1)
+	{	return m_container.open(file, level);	}
+	// Channel the pictures are recorded under, for programs that switch the illumination
+	void set_channel(int channel = 0)
+	{	m_channel = channel; return;	}
+	
+	// Takes pictures from a streaming camera instead of raspistill (NULL for raspistill)
+	void set_camera(Camera * camera = NULL)
+	{	finish_picture(); m_camera = camera; return;	}
+	
+	// Bounds the pictures waiting to be saved, and chooses what happens to those that don't fit and how kept PGMs are compressed
+	void set_writer(size_t bytes = 64 << 20, int policy = FRAMEWRITER_DOWNSAMPLE, int compression = 0)
+	{	m_writer.set_limit(bytes, policy); m_writer.set_compression(compression); return;	}
+	
+	// Corrects RaspiStill pictures for the lighting (NULL to stop)
+	void set_flatfield(const Flatfield * flatfield = NULL)
+	{	m_flatfield = flatfield; return;	}
+	
 	// Sets minimum number of steps and initial number of steps depending on the objective chosen
 	void set_objective(string objective_type = "4x")
 	{
 		m_objective = objective_type;
 		// Set limiters for fine tuning
+		// All values are in microsteps; the high magnification objectives go below a full step
 		if (objective_type.compare("4x") == 0)
 		{
-			m_min_steps = 5;
-			m_steps = 560;
+			m_min_steps = 5*MICROSTEPS_PER_STEP;
+			m_steps = 560*MICROSTEPS_PER_STEP;
 		}
 		else if (objective_type.compare("10x") == 0)
 		{
-			m_min_steps = 2;
-			m_steps = 100;
+			m_min_steps = 2*MICROSTEPS_PER_STEP;
+			m_steps = 100*MICROSTEPS_PER_STEP;
 		}
 		else if (objective_type.compare("40x") == 0)
 		{
-			m_min_steps = 1;
-			m_steps = 20;
+			m_min_steps = MICROSTEPS_PER_STEP/4;
+			m_steps = 20*MICROSTEPS_PER_STEP;
 		}
 		else if (objective_type.compare("100x") == 0)
 		{
 			m_min_steps = 1;
-			m_steps = 5;
+			m_steps = 5*MICROSTEPS_PER_STEP;
 		}
 		else
 		{
 			// Use default values.
 			cout << "\nObjective not recognised, using default values." << endl;
-			m_min_steps = 10;
-			m_steps = 560;
+			m_min_steps = 10*MICROSTEPS_PER_STEP;
+			m_steps = 560*MICROSTEPS_PER_STEP;
 		}
 		return;
 	}
@@ -311,6 +408,30 @@ public:
 	{
 		return serial_command(m_get_z_distance, "000000", out);
 	}
+	// The xy position is counted here, as the Arduino can't give an absolute one
+	bool comm_move_x(int steps, bool out = false)
+	{
+		if (!serial_command(m_move_x, steps, out))
+			return false;
+		m_x += steps;
+		return true;
+	}
+	bool comm_move_y(int steps, bool out = false)
+	{
+		if (!serial_command(m_move_y, steps, out))
+			return false;
+		m_y += steps;
+		return true;
+	}
+	// True once both x and y have arrived
+	bool comm_get_xy_dist(bool out = false)
+	{
+		return serial_command(m_get_x_distance, "000000", out) && serial_command(m_get_y_distance, "000000", out);
+	}
+	bool comm_save_state(bool out = false)
+	{
+		return serial_command(m_save_state, "000000", out);
+	}
 	bool comm_set_ring_colour(string exa_value = "000000", bool out = false)
 	{
 		return serial_command(m_set_ring_colour, exa_value, out);
@@ -323,6 +444,37 @@ public:
 	{
 		return serial_command(m_set_stage_led_bright, value, out); 
 	}
+	// Multi-channel acquisition: the channels are loaded once, started, then moved on by a sync byte per frame
+	bool comm_clear_channels(bool out = false)
+	{
+		return serial_command(m_clear_channels, "000000", out);
+	}
+	bool comm_add_channel(string exa_value, int ring, int led, int frames = 1, bool out = false)
+	{
+		stringstream argument;
+		argument << exa_value << "," << ring << "," << led << "," << frames;
+		return serial_command(m_add_channel, argument.str(), out);
+	}
+	bool comm_start_channels(bool out = false)
+	{
+		return serial_command(m_start_channels, "000000", out);
+	}
+	// No reply comes, so this doesn't wait for the Arduino
+	bool comm_sync()
+	{
+		write(m_sp, buffer(m_sync));
+		return true;
+	}
+	// Only talks to the Arduino if the mode actually changes, and remembers the mode only once the Arduino has taken it
+	bool comm_set_step_mode(string mode = "coarse", bool out = false)
+	{
+		if (mode.compare(m_step_mode) == 0)
+			return true;
+		if (!serial_command(m_set_step_mode, mode, out))
+			return false;
+		m_step_mode = mode;
+		return true;
+	}
 
 	
 	// See function declarations for details
@@ -341,6 +493,8 @@ public:
 	
 	void stop_stage(string command = "not_calibrate\n", bool couting = false);
 	
+	bool wait_for_stage(bool z = true, bool xy = false, int timeout_ms = 30000);
+	
 };
 
 
@@ -367,6 +521,12 @@ void Autofocus::initialise()
 	m_get_z_len = "z_get_length\n";
 	m_get_z_pos = "z_get_position\n";
 	m_get_z_distance = "z_get_distance_to_go\n";
+	m_save_state = "save_state\n";
+	m_get_x_distance = "x_get_distance_to_go\n";
+	m_get_y_distance = "y_get_distance_to_go\n";
+	m_clear_channels = "channels_clear\n";
+	m_start_channels = "channels_start\n";
+	m_sync = "~";
 		
 	m_endpoint = "0\r";
 	m_OK = "OK\r";
@@ -376,6 +536,18 @@ void Autofocus::initialise()
 	m_set_ring_colour = "set_ring_colour";
 	m_set_ring_bright = "set_ring_brightness";
 	m_set_stage_led_bright = "set_stage_led_brightness";
+	m_set_step_mode = "z_set_step_mode";
+	m_move_x = "x_move";
+	m_move_y = "y_move";
+	m_add_channel = "channel_add";
+	
+	// The Arduino keeps its step mode across connections, so it is unknown until the first comm_set_step_mode(...)
+	m_step_mode = "";
+	
+	// x and y count from wherever the stage is now
+	m_x = 0;
+	m_y = 0;
+	m_channel = 0;
 	
 	// Initialise control variables
 	m_f_max = 0;
@@ -387,6 +559,17 @@ void Autofocus::initialise()
 	m_path = "./test/";
 	m_name = "test";
 	
+	// Pictures are taken into memory where there is a memory-backed filesystem, so those not kept never reach the card
+	struct stat shared_memory;
+	m_scratch = "";
+	if (stat("/dev/shm", &shared_memory) == 0 && S_ISDIR(shared_memory.st_mode))
+		m_scratch = "/dev/shm/microscope" + boost::lexical_cast<string>(getpid()) + "_";
+	m_camera = NULL;
+	m_flatfield = NULL;
+	m_pending = false;
+	set_writer();
+	m_writer.start();
+	
 	m_number_images_sweep = 10;
 	m_number_of_times = 2;
 	
@@ -453,10 +636,18 @@ Autofocus::Autofocus(string serial_device, string objective,
 }
 
 /* Autofocus class DESTRUCTOR
- * Deletes the output folder if so required at the last operation executed by the program */
+ * Saves the stage position on the Arduino, so the next session can start without calibrating,
+ * and deletes the output folder if so required at the last operation executed by the program */
 Autofocus::~Autofocus()
 {
+	if (m_sp.is_open())
+		comm_save_state();
+	
+	finish_picture();
+	m_writer.stop();
+	
 	m_values.close();
+	m_container.close();
 	
 	if (!m_leave_output)
 		remove_folder();
@@ -472,38 +663,12 @@ Autofocus::~Autofocus()
 float Autofocus::algorithm() 
 {
 	
-	float intensity = 0.0;
-	float mean_intensity = 0.0;
-	float intensity_squared_sum = 0.0;
-	float focusing = 0.0;
-	
 	greyfy();
-		
-	// Calculate intensity of a matrix of pixels
-	for (int x=0; x<m_picture.width(); x++) {
-		for (int y=0; y<m_picture.height(); y++) 
-		{			
-			intensity += (float)(m_picture(x,y,0,0));
-		}
-	}
-	
-	mean_intensity = intensity/(float)(m_picture.width()*m_picture.height());
-	
-	// Make sure that no value of mean_intensity is effectively 0.0
-	// to prevent division by 0, even though very unlikely
-	if (mean_intensity == 0.0) mean_intensity = 1E-10;
 	
 	// Apply focusing algorithm of choice, in this case a normalised deviation based
-	for (int i=0; i<m_picture.width(); i++) {
-		for (int j=0; j<m_picture.height(); j++) 
-		{	
-			intensity_squared_sum += ((float)m_picture(i,j,0,0) - mean_intensity)*((float)m_picture(i,j,0,0) - mean_intensity);
-		}
-	}
-	
-	focusing = intensity_squared_sum/((float)m_picture.width()*(float)m_picture.height()*mean_intensity);
-	
-	return focusing;
+	// The first channel of a CImg is a row-major plane of its own, holding the grey values after greyfy()
+	// The same measure, taken over the neighbourhood of each pixel, fuses z-stacks (see local_normalised_variance() in image_kernels.h)
+	return normalised_variance(m_picture.data(), (size_t)m_picture.width()*m_picture.height());
 	
 }
 
@@ -523,6 +688,9 @@ void Autofocus::sweep()
 	
 	cout << "\nExecuting sweep" << flush;
 	
+	// Long moves, so step the motors in full steps
+	comm_set_step_mode("coarse");
+	
 	while (sweep_done == false) 
 	{
 		
@@ -541,10 +709,11 @@ void Autofocus::sweep()
 		
 		// In the meantime, analyse picture saving focus value
 		// of maximum dynamically
-		m_picture.assign(m_picture_input.c_str());
+		load_picture();
 		
 		m_f_values.push_back( algorithm() );
 		m_values << m_ind << "\t" << m_f_values[m_ind] << endl;
+		record(pos, m_f_values[m_ind]);
 		if (m_f_values[m_ind] >= m_f_max)
 		{
 			//Save position and value of maximum
@@ -554,9 +723,8 @@ void Autofocus::sweep()
 		}
 		m_ind++;
 		
-		// Remove picture if necessary
-		if (!m_leave_output)
-			remove_picture();
+		// Save or remove picture as required
+		finish_picture();
 				
 		
 		// Wait for the stage to finish moving
@@ -607,6 +775,12 @@ bool Autofocus::fine_tune(float f_max, int f_max_pos,
 		m_steps = m_min_steps;
 	}
 	
+	// Once the moves get shorter than a full step, microstep all the way
+	if (m_steps < MICROSTEPS_PER_STEP)
+		comm_set_step_mode("fine");
+	else
+		comm_set_step_mode("coarse");
+	
 		
 	// Take picture at starting point
 	raspistill_save();
@@ -622,9 +796,8 @@ bool Autofocus::fine_tune(float f_max, int f_max_pos,
 	m_f_max = f_max;
 	m_f_max_pos = f_max_pos;
 	
-	// Remove picture if necessary
-	if (!m_leave_output)
-		remove_picture();
+	// Save or remove picture as required
+	finish_picture();
 	
 	
 	//cout << "\nStart call at\n" << f_max_pos << "\t" << f_max << endl;
@@ -641,9 +814,8 @@ bool Autofocus::fine_tune(float f_max, int f_max_pos,
 		//cout << f_above_pos << "\t" << f_above << endl;
 		cout << "." << flush;
 		
-		// Remove picture if necessary
-		if (!m_leave_output)
-			remove_picture();
+		// Save or remove picture as required
+		finish_picture();
 		
 		
 	
@@ -665,9 +837,8 @@ bool Autofocus::fine_tune(float f_max, int f_max_pos,
 			//cout << f_below_pos << "\t" << f_below << endl;
 			cout << "." << flush;
 			
-			// Remove picture if necessary
-			if (!m_leave_output)
-				remove_picture();
+			// Save or remove picture as required
+			finish_picture();
 		
 
 
@@ -722,9 +893,8 @@ bool Autofocus::fine_tune(float f_max, int f_max_pos,
 		//cout << f_below_pos << "\t" << f_below << endl;
 		cout << "." << flush;
 		
-		// Remove picture if necessary
-		if (!m_leave_output)
-			remove_picture();
+		// Save or remove picture as required
+		finish_picture();
 	
 	
 		if (f_below > ((2.0-m_precision)*f_max))
@@ -745,9 +915,8 @@ bool Autofocus::fine_tune(float f_max, int f_max_pos,
 			//cout << f_above_pos << "\t" << f_above << endl;
 			cout << "." << flush;
 		
-			// Remove picture if necessary
-			if (!m_leave_output)
-				remove_picture();
+			// Save or remove picture as required
+			finish_picture();
 
 
 			if (f_above > ((2.0-m_precision)*f_max))
@@ -807,7 +976,7 @@ void Autofocus::keep_in_focus()
 	{
 		sleep(120);
 		
-		m_steps = 40;
+		m_steps = 40*MICROSTEPS_PER_STEP;
 		
 		fine_tune();
 	}
@@ -844,9 +1013,13 @@ void Autofocus::test_run(int number_images)
 		raspistill_save();
 		//cout << m_picture_input << endl;
 		
+		// Position of the picture, before moving on
+		int pos = 0;
+		serial_command(m_get_z_pos, pos);
+		
 		
 		// Create picture to analise
-		m_picture.assign(m_picture_input.c_str());
+		load_picture();
 
 
 		// Move the stage to next picture position
@@ -856,12 +1029,12 @@ void Autofocus::test_run(int number_images)
 		// Calculate focusing value for the latest picture
 		m_f_values.push_back( algorithm() );
 		m_values << m_ind << "\t" << m_f_values[m_ind] << endl;
+		record(pos, m_f_values[m_ind]);
 		m_ind++;
 		
 		
-		// Remove picture if necessary
-		if (!m_leave_output)
-			remove_picture();
+		// Save or remove picture as required
+		finish_picture();
 		
 		
 		// Wait for stage to finish moving		
@@ -871,8 +1044,23 @@ void Autofocus::test_run(int number_images)
 		
 	}
 	
-	string save_the_data = "mv " + m_path + "focusingdata.txt ../";
-	system(save_the_data.c_str());
+	// Move the data up out of the working directory, copying it if that is on another filesystem
+	string data = m_path + "focusingdata.txt";
+	if (rename(data.c_str(), "../focusingdata.txt") != 0)
+	{
+		bool copied = false;
+		if (errno == EXDEV)
+		{
+			ifstream from(data.c_str(), ios::binary);
+			ofstream to("../focusingdata.txt", ios::binary);
+			to << from.rdbuf();
+			copied = from.good() && to.good();
+		}
+		if (copied)
+			unlink(data.c_str());
+		else
+			cout << "\nCould not move " << data << endl;
+	}
 	
 	cout << endl;
 	
@@ -906,24 +1094,121 @@ void Autofocus::greyfy()
 
 //###########################################
 /* Saves image using RaspiStill, and returns the name of the image (with the path) to be used with imaging library.
- * The picture will be saved in the folder chosen with the default name and a progressively increasing number. */
+ * The picture is taken into the scratch folder with the default name and a progressively increasing number,
+ * and moved to the folder chosen by finish_picture() if it is kept.
+ * With a camera, the next frame is taken straight into the image instead, and kept as a PGM picture. */
 void Autofocus::raspistill_save()
 {
 	
+	// A picture taken and never analysed is dealt with before the next
+	finish_picture();
+	
 	stringstream naming;
+	
+	if (m_camera != NULL)
+	{
+		int width = m_camera->width();
+		int height = m_camera->height();
+		m_luma.resize((size_t)width*height);
+		if (!m_camera->grab(&m_luma[0], m_camera->sequence()))
+			cout << "\nThe camera gave no frame" << endl;
+		
+		m_picture.assign(width, height, 1, 3);
+		for (int c=0; c<3; c++)
+		{
+			float * plane = m_picture.data(0, 0, 0, c);
+			for (size_t i=0; i<m_luma.size(); i++)
+				plane[i] = m_luma[i];
+		}
+		
+		naming << m_first_part_name << m_ind << ".pgm";
+		m_picture_input = naming.str();
+		m_picture_output = m_picture_input;
+		m_pending = true;
+		
+		return;
+	}
+	
 	stringstream commanding;
-	naming << m_first_part_name << m_ind << ".jpg";
+	naming << (m_scratch.empty() ? m_path : m_scratch) << m_name << m_ind << ".jpg";
 	commanding << m_first_part_command << m_ind << ".jpg -t 0";
 				
 	string extension = commanding.str();
 	const char * conversion = extension.c_str();
 	
 	m_picture_input = naming.str();
+	naming.str("");
+	naming << m_first_part_name << m_ind << ".jpg";
+	m_picture_output = naming.str();
 	
 	naming.str("");
 	commanding.str("");
 	
 	system(conversion);
+	m_pending = true;
+	
+	return;
+	
+}
+
+
+
+
+//#########################################
+/* Loads the picture just taken, unless it came from the camera straight into the image, and corrects it for the lighting.
+ * The maps are of the luma, so every colour channel is corrected with them. */
+void Autofocus::load_picture()
+{
+	
+	if (m_camera != NULL)
+		return;
+	
+	m_picture.assign(m_picture_input.c_str());
+	
+	if (m_flatfield != NULL && m_flatfield->width() == m_picture.width() && m_flatfield->height() == m_picture.height())
+	{
+		for (int c=0; c<m_picture.spectrum(); c++)
+			m_flatfield->correct(m_picture.data(0, 0, 0, c));
+	}
+	
+	return;
+	
+}
+
+
+
+
+//#########################################
+/* Keeps or deletes the picture just analysed.
+ * Kept pictures are handed to the writer thread, which moves or writes them to the output folder without holding up the focusing.
+ * Others are deleted from the scratch folder, or were never written at all if they came from the camera. */
+void Autofocus::finish_picture()
+{
+	
+	if (!m_pending)
+		return;
+	m_pending = false;
+	
+	if (keep_pictures())
+	{
+		Frame * frame = new Frame;
+		frame->file = m_picture_output;
+		if (m_camera != NULL)
+		{
+			frame->width = m_picture.width();
+			frame->height = m_picture.height();
+			frame->luma = m_luma;
+		}
+		else
+		{
+			frame->width = 0;
+			frame->height = 0;
+			frame->source = m_picture_input;
+		}
+		m_writer.write(frame);
+	}
+	else if (m_camera == NULL)
+		remove_picture();
 	
 	return;
 	
@@ -937,21 +1222,60 @@ void Autofocus::raspistill_save()
 void Autofocus::remove_picture()
 {
 	
-	string removing = "rm " + m_picture_input;
-	
-	system(removing.c_str());
+	unlink(m_picture_input.c_str());
 	
 	return;
 	
 }
 
-/* Removes folder used by program. */
+/* Removes one file or directory found by remove_folder(), whose contents nftw() has already visited */
+int remove_entry(const char * path, const struct stat *, int, struct FTW *)
+{
+	return remove(path);
+}
+
+/* Removes folder used by program.
+ * The folder is walked depth first without following links, so everything in it goes before it does. */
 void Autofocus::remove_folder()
 {
 	
-	string removing = "rm -r " + m_path;
+	if (nftw(m_path.c_str(), remove_entry, 16, FTW_DEPTH | FTW_PHYS) != 0)
+		cout << "\nCould not remove all of " << m_path << endl;
 	
-	system(removing.c_str());
+	return;
+	
+}
+
+/* Appends the last picture analysed to the acquisition file, if one is open.
+ * algorithm() has turned it to greyscale, so its first channel is the luma. */
+void Autofocus::record(int position, float value)
+{
+	
+	if (!m_container.is_open())
+		return;
+	
+	size_t pixels = (size_t)m_picture.width()*m_picture.height();
+	m_luma.resize(pixels);
+	const float * grey = m_picture.data();
+	for (size_t i=0; i<pixels; i++)
+		m_luma[i] = (unsigned char)(grey[i] < 0 ? 0 : (grey[i] > 255 ? 255 : grey[i] + 0.5f));
+	
+	timeval now;
+	gettimeofday(&now, NULL);
+	
+	Acqentry entry;
+	memset(&entry, 0, sizeof entry);
+	entry.time_ms = now.tv_sec*1000.0 + now.tv_usec/1000.0;
+	entry.x = m_x;
+	entry.y = m_y;
+	entry.z = position;
+	entry.channel = m_channel;
+	entry.metric_count = 1;
+	entry.metrics[0] = value;
+	entry.width = m_picture.width();
+	entry.height = m_picture.height();
+	
+	m_container.append(&m_luma[0], entry);
 	
 	return;
 	
@@ -960,6 +1284,86 @@ void Autofocus::remove_folder()
 
 
 
+//###################################################
+/* Completion handlers for read_line(), storing the result where the caller can see it. */
+void store_wait_result(boost::system::error_code *result, const boost::system::error_code &error)
+{
+	*result = error;
+}
+
+void store_read_result(boost::system::error_code *result, const boost::system::error_code &error, size_t)
+{
+	*result = error;
+}
+
+/* Asks the Arduino whether it is calibrated and waits for the answer, so a board that is already running is ready at once.
+ * Opening the port resets some boards, which lose the query while they boot and print READY once started instead.
+ * A query that arrived after the board opened its serial port is answered straight after the banner, so that answer
+ * is waited for briefly too, rather than left to be read as the reply to the next command. */
+void Autofocus::wait_ready(int timeout_ms)
+{
+	
+	boost::posix_time::ptime deadline = boost::posix_time::microsec_clock::universal_time() + boost::posix_time::milliseconds(timeout_ms);
+	string line;
+	
+	write(m_sp, buffer(m_is_cal));
+	
+	while (read_line(line, deadline))
+	{
+		if (line.compare("OK\r") == 0)
+			break;
+		if (line.compare("READY\r") == 0)
+			deadline = boost::posix_time::microsec_clock::universal_time() + boost::posix_time::milliseconds(100);
+	}
+	
+	// Throw away the answer and anything printed before it
+	m_buffering.consume(m_buffering.size());
+	
+	return;
+	
+}
+
+
+
+
+//###################################################
+/* Reads one line from the serial port into line, without the '\n'.
+ * Returns false if no whole line arrived before the deadline. */
+bool Autofocus::read_line(string &line, boost::posix_time::ptime deadline)
+{
+	
+	boost::system::error_code read_result = boost::asio::error::would_block;
+	boost::system::error_code timer_result = boost::asio::error::would_block;
+	
+	deadline_timer timer(m_io);
+	timer.expires_at(deadline);
+	timer.async_wait(boost::bind(&store_wait_result, &timer_result, boost::asio::placeholders::error));
+	boost::asio::async_read_until(m_sp, m_buffering, '\n',
+			boost::bind(&store_read_result, &read_result, boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred));
+	
+	// Whichever finishes first cancels the other
+	m_io.reset();
+	while (m_io.run_one())
+	{
+		if (read_result != boost::asio::error::would_block)
+			timer.cancel();
+		else if (timer_result != boost::asio::error::would_block)
+			m_sp.cancel();
+	}
+	
+	if (read_result)
+		return false;
+	
+	istream input(&m_buffering);
+	getline(input, line);
+	
+	return true;
+	
+}
+
+
+
+
 //###################################################
 /* Moves to position, records new reached position,
  * takes picture and analyses it, returning focusing value. */
@@ -978,8 +1382,9 @@ float Autofocus::move_and_capture(int position, int &f_pos)
 	raspistill_save();
 
 	// Compute ABOVE picture
-	m_picture.assign(m_picture_input.c_str());
+	load_picture();
 	float f_value = algorithm();
+	record(f_pos, f_value);
 		
 	return f_value;
 		
@@ -1025,6 +1430,26 @@ void Autofocus::stop_stage(string command, bool couting)
 
 
 
+//########################################################################################
+/* Polls the Arduino until the axes asked for have stopped, or the timeout has passed.
+ * Each poll is a round trip on the serial port, which takes a few milliseconds, so a short sleep is enough between them. */
+bool Autofocus::wait_for_stage(bool z, bool xy, int timeout_ms)
+{
+	
+	boost::posix_time::ptime deadline = boost::posix_time::microsec_clock::universal_time() + boost::posix_time::milliseconds(timeout_ms);
+	
+	while ((z && !comm_get_dist()) || (xy && !comm_get_xy_dist()))
+	{
+		if (boost::posix_time::microsec_clock::universal_time() > deadline)
+			return false;
+		boost::this_thread::sleep(boost::posix_time::milliseconds(2));
+	}
+	
+	return true;
+}
+
+
+
 //###################################################################
 /* Overloaded function that takes commands and sends them to the serial port */
 
@@ -1066,7 +1491,7 @@ bool Autofocus::serial_command(string command, string argument, bool couting, st
 				exiting = true;
 		}
 	}
-	else if (command.compare(m_get_z_distance) == 0)
+	else if (command.compare(m_get_z_distance) == 0 || command.compare(m_get_x_distance) == 0 || command.compare(m_get_y_distance) == 0)
 	{
 		ss << command;
 		write(m_sp, buffer(ss.str()));
@@ -1085,6 +1510,37 @@ bool Autofocus::serial_command(string command, string argument, bool couting, st
 			line.clear();
 		}
 	}
+	// Requires "coarse" or "fine" as argument, or a channel
+	else if (command.compare(m_set_step_mode) == 0 || command.compare(m_add_channel) == 0)
+	{
+		ss << command << " " << argument << "\n";
+		write(m_sp, buffer(ss.str()));
+		ss.str("");
+		
+		while (exiting == false)
+		{
+			boost::asio::read_until(m_sp, m_buffering, '\n');
+			getline(is, line);
+			if (couting)
+				cout << line << endl;
+			if (line.compare(check) == 0)
+			{
+				exiting = true;
+				control = true;
+			}
+			
+			if (line.compare("ERR: UNKNOWN COMMAND\r") == 0)
+			{
+				exiting = true;
+			}
+			if (line.compare("ERR: UNKNOWN STEP MODE\r") == 0 || line.compare("ERR: TOO MANY CHANNELS\r") == 0)
+			{
+				exiting = true;
+			}
+				
+			line.clear();
+		}
+	}
 	// Requires string as argument, since it must be exadecimal
 	else if (command.compare(m_set_ring_colour) == 0)
 	{
@@ -1136,6 +1592,10 @@ bool Autofocus::serial_command(string command, string argument, bool couting, st
 			{
 				exiting = true;
 			}
+			if (line.compare("ERR: NO CHANNELS\r") == 0)
+			{
+				exiting = true;
+			}
 				
 			line.clear();
 		}
@@ -1184,7 +1644,7 @@ bool Autofocus::serial_command(string command, int &number, bool couting, string
 			line.clear();
 		}
 	}
-	else if (command.compare(m_get_z_distance) == 0)
+	else if (command.compare(m_get_z_distance) == 0 || command.compare(m_get_x_distance) == 0 || command.compare(m_get_y_distance) == 0)
 	{
 		ss << command;
 		write(m_sp, buffer(ss.str()));
@@ -1241,7 +1701,7 @@ bool Autofocus::serial_command(string command, int &number, bool couting, string
 		}
 	}
 	// Requires signed integer as argument
-	else if (command.compare(m_move) == 0)
+	else if (command.compare(m_move) == 0 || command.compare(m_move_x) == 0 || command.compare(m_move_y) == 0)
 	{
 		string number_in_words = boost::lexical_cast<string>((int)(number));
 		ss << command << " " << number_in_words << "\n";
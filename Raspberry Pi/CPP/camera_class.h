@@ -0,0 +1,390 @@
+// Camera Class
+
+/* This file contains the class that keeps the Pi camera streaming, so pictures can be taken without starting the camera each time.
+ * raspistill, used by the Autofocus class, starts the camera, meters, saves a JPEG and stops for every picture, which takes seconds.
+ * Here raspividyuv runs for as long as the object is open, writing raw YUV420 frames to a pipe, and a reader thread keeps the latest
+ * luma plane in memory. Taking a picture is then a copy of the next frame to arrive, and nothing touches the disk.
+ * These are:
+ *
+ * public:
+ * Camera() -> Only class constructor. Starts nothing.
+ * ~Camera() -> Class destructor, closing the stream if open.
+ * open(int, int, int, string) -> Starts raspividyuv at the given width, height and frame rate, with any further raspividyuv options
+ * 		(exposure, white balance...) in the string. Returns false if it could not be started or gave no frame.
+ * close() -> Stops raspividyuv and the reader thread.
+ * is_open() -> Whether the stream is running.
+ * width(), height() -> Size of the luma planes given out.
+ * sequence() -> Number of frames read so far. A frame numbered after a given sequence() started exposing after that call,
+ * 		give or take the frames raspividyuv buffers, which is what grab(...) uses to avoid frames taken while the stage was moving.
+ * grab(unsigned char*, unsigned int, int, unsigned int*) -> Copies the luma plane of the first frame numbered after the given one into
+ * 		the buffer (width*height bytes, rows packed), waiting for it at most the given number of milliseconds.
+ * 		Returns false on timeout or if the stream has stopped. If given, the number of the frame copied is stored in the last argument.
+ * set_correction(const Flatfield*) -> Corrects every frame from now on for the lighting with the given maps (see flatfield_class.h),
+ * 		as its rows are copied out of the pipe, or stops correcting if NULL. Returns false if the maps are not the size of the frames.
+ * 		Only returns once no frame is being corrected with the maps given before, so those can then be destroyed.
+ *
+ * private:
+ * reader() -> Loop of the reader thread, reading whole frames from the pipe and publishing each luma plane in turn.
+ * read_all(char*, size_t) -> Reads exactly the given number of bytes from the pipe, unless it ends.
+ */
+
+
+
+#ifndef CAMERA_CLASS_H
+#define CAMERA_CLASS_H
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <boost/thread.hpp>
+#include <boost/bind/bind.hpp>
+
+#include "flatfield_class.h"
+
+using namespace std;
+
+
+
+class Camera
+{
+
+private:
+
+	// raspividyuv process and the read end of its pipe
+	pid_t m_pid;
+	int m_pipe;
+	boost::thread m_thread;
+
+	// Size of the frames, and the size raspividyuv pads them to (width to 32, height to 16)
+	int m_width;
+	int m_height;
+	int m_padded_width;
+	int m_padded_height;
+
+	// Latest luma plane and its number, handed over under the mutex
+	boost::mutex m_mutex;
+	boost::condition_variable m_arrived;
+	vector<unsigned char> m_latest;
+	unsigned int m_sequence;
+	bool m_running;
+	const Flatfield * m_correction;
+
+	// Maps the reader is correcting a frame with, outside the mutex, and the signal that it has finished that frame
+	const Flatfield * m_correcting;
+	boost::condition_variable m_corrected;
+
+
+	void reader();
+
+	bool read_all(char * data, size_t size);
+
+
+public:
+
+	Camera();
+
+	~Camera();
+
+	bool open(int width = 640, int height = 480, int fps = 30, string options = "");
+
+	void close();
+
+	bool is_open()
+	{	return m_pid > 0;	}
+
+	int width()
+	{	return m_width;	}
+
+	int height()
+	{	return m_height;	}
+
+	unsigned int sequence();
+
+	bool grab(unsigned char * luma, unsigned int after, int timeout_ms = 2000, unsigned int * number = NULL);
+
+	bool set_correction(const Flatfield * correction = NULL);
+
+
+};
+
+
+
+
+/* Camera class CONSTRUCTOR */
+Camera::Camera()
+{
+
+	m_pid = 0;
+	m_pipe = -1;
+	m_width = 0;
+	m_height = 0;
+	m_padded_width = 0;
+	m_padded_height = 0;
+	m_sequence = 0;
+	m_running = false;
+	m_correction = NULL;
+	m_correcting = NULL;
+
+}
+
+
+
+
+/* Camera class DESTRUCTOR */
+Camera::~Camera()
+{
+
+	close();
+
+}
+
+
+
+
+/* Start raspividyuv writing to a pipe, and the reader thread taking frames from it
+ * The shell is only used to split the options; it execs raspividyuv, so the process to stop later is raspividyuv itself */
+bool Camera::open(int width, int height, int fps, string options)
+{
+
+	close();
+
+	m_width = width;
+	m_height = height;
+	m_padded_width = (width + 31)/32*32;
+	m_padded_height = (height + 15)/16*16;
+
+	stringstream command;
+	command << "exec raspividyuv -n -t 0 -w " << width << " -h " << height << " -fps " << fps << " " << options << " -o -";
+
+	int ends[2];
+	if (pipe(ends) != 0)
+	{
+		cout << "\nCould not create a pipe for the camera" << endl;
+		return false;
+	}
+
+	m_pid = fork();
+	if (m_pid < 0)
+	{
+		cout << "\nCould not start the camera" << endl;
+		::close(ends[0]);
+		::close(ends[1]);
+		m_pid = 0;
+		return false;
+	}
+
+	if (m_pid == 0)
+	{
+		// Child: frames on stdout into the pipe, messages left on stderr
+		dup2(ends[1], STDOUT_FILENO);
+		::close(ends[0]);
+		::close(ends[1]);
+		execl("/bin/sh", "sh", "-c", command.str().c_str(), (char *)NULL);
+		_exit(127);
+	}
+
+	::close(ends[1]);
+	m_pipe = ends[0];
+
+	{
+		boost::mutex::scoped_lock lock(m_mutex);
+		m_latest.assign((size_t)m_width*m_height, 0);
+		m_sequence = 0;
+		m_running = true;
+	}
+	m_thread = boost::thread(boost::bind(&Camera::reader, this));
+
+	// The first frame comes once the camera has metered, well within a few seconds
+	vector<unsigned char> first((size_t)m_width*m_height);
+	if (!grab(&first[0], 0, 5000))
+	{
+		cout << "\nThe camera gave no frame" << endl;
+		close();
+		return false;
+	}
+
+	return true;
+
+}
+
+
+
+
+/* Stop raspividyuv, which ends the pipe and so the reader thread */
+void Camera::close()
+{
+
+	if (m_pid > 0)
+	{
+		kill(m_pid, SIGTERM);
+		waitpid(m_pid, NULL, 0);
+		m_pid = 0;
+	}
+
+	if (m_pipe >= 0)
+	{
+		m_thread.join();
+		::close(m_pipe);
+		m_pipe = -1;
+	}
+
+	boost::mutex::scoped_lock lock(m_mutex);
+	m_running = false;
+	m_arrived.notify_all();
+
+	return;
+
+}
+
+
+
+
+/* Number of frames read so far */
+unsigned int Camera::sequence()
+{
+
+	boost::mutex::scoped_lock lock(m_mutex);
+	return m_sequence;
+
+}
+
+
+
+
+/* Copy the luma plane of the first frame numbered after the given one
+ * If that frame has already been replaced by a later one, the later one is given, which started exposing later still */
+bool Camera::grab(unsigned char * luma, unsigned int after, int timeout_ms, unsigned int * number)
+{
+
+	boost::mutex::scoped_lock lock(m_mutex);
+
+	boost::system_time deadline = boost::get_system_time() + boost::posix_time::milliseconds(timeout_ms);
+	while (m_running && m_sequence <= after)
+	{
+		if (!m_arrived.timed_wait(lock, deadline))
+			break;
+	}
+
+	if (m_sequence <= after)
+		return false;
+
+	memcpy(luma, &m_latest[0], m_latest.size());
+	if (number != NULL)
+		*number = m_sequence;
+
+	return true;
+
+}
+
+
+
+
+/* Correct every frame for the lighting from now on, or stop if NULL
+ * The maps must stay alive and unchanged until the correction is stopped or the camera closed.
+ * The reader corrects a frame without holding the mutex, so this waits until it is done with the frame it may be correcting
+ * with the previous maps; after that it only ever uses the new ones. */
+bool Camera::set_correction(const Flatfield * correction)
+{
+
+	if (correction != NULL && (!correction->is_ready() || correction->width() != m_width || correction->height() != m_height))
+	{
+		cout << "\nThe flat field maps are not the size of the frames" << endl;
+		return false;
+	}
+
+	boost::mutex::scoped_lock lock(m_mutex);
+	m_correction = correction;
+	while (m_correcting != NULL && m_correcting != correction)
+		m_corrected.wait(lock);
+
+	return true;
+
+}
+
+
+
+
+/* Reader thread
+ * Frames are read as fast as they come, so the latest one is never more than a frame old. The luma rows of each are unpadded into
+ * the spare plane, which is then swapped with the latest one, and the chroma planes are dropped.
+ * If there are flat field maps, each row is corrected on its way into the spare plane rather than copied, so it costs no extra pass. */
+void Camera::reader()
+{
+
+	size_t luma_size = (size_t)m_padded_width*m_padded_height;
+	size_t frame_size = luma_size + 2*(size_t)(m_padded_width/2)*(m_padded_height/2);
+
+	vector<char> frame(frame_size);
+	vector<unsigned char> spare((size_t)m_width*m_height);
+
+	while (read_all(&frame[0], frame_size))
+	{
+
+		const Flatfield * correction;
+		{
+			boost::mutex::scoped_lock lock(m_mutex);
+			correction = m_correction;
+			m_correcting = correction;
+		}
+
+		for (int y=0; y<m_height; y++)
+		{
+			if (correction != NULL)
+				correction->correct((const unsigned char *)&frame[(size_t)y*m_padded_width], &spare[(size_t)y*m_width], (size_t)y*m_width, m_width);
+			else
+				memcpy(&spare[(size_t)y*m_width], &frame[(size_t)y*m_padded_width], m_width);
+		}
+
+		boost::mutex::scoped_lock lock(m_mutex);
+		m_latest.swap(spare);
+		m_sequence++;
+		m_arrived.notify_all();
+		if (m_correcting != NULL)
+		{
+			m_correcting = NULL;
+			m_corrected.notify_all();
+		}
+
+	}
+
+	boost::mutex::scoped_lock lock(m_mutex);
+	m_running = false;
+	m_arrived.notify_all();
+
+	return;
+
+}
+
+
+
+
+/* Read exactly size bytes from the pipe, retrying after signals and short reads
+ * Returns false once the pipe ends, so a partial frame at the end is dropped */
+bool Camera::read_all(char * data, size_t size)
+{
+
+	size_t done = 0;
+	while (done < size)
+	{
+		ssize_t got = read(m_pipe, data + done, size - done);
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got <= 0)
+			return false;
+		done += got;
+	}
+
+	return true;
+
+}
+
+
+
+#endif
@@ -0,0 +1,500 @@
+// Cell Count Class
+
+/* This file contains the class that counts cells on 8-bit pictures, following the workflow shown in Docs/Presentation Images:
+ * blur, threshold, erode twice, then find the blobs left. Every step costs the same per pixel whatever its size, so a whole picture
+ * is counted in a few passes over it, fast enough to count every tile of a scan as it is taken (see scan_class.h).
+ * - The blur is a box filter along the rows and then the columns, each output pixel from a running sum.
+ * - The threshold compares every pixel with the mean of a window around it, read from an integral image in four lookups
+ * 		(adaptive thresholding), so uneven lighting across the field doesn't matter.
+ * - Erosion and dilation by a square use the van Herk/Gil-Werman algorithm along the rows and then the columns:
+ * 		the line is cut in blocks of the window's length, running minima (or maxima) are taken forwards and backwards within each block,
+ * 		and the result for any window, which spans at most two blocks, is the smaller of one backward and one forward value.
+ * 		That is three comparisons per pixel whatever the size of the square.
+ * - Blobs are labelled in two passes with 8-connectivity: the first gives every foreground pixel the label of a neighbour already seen,
+ * 		or a new one, and joins the labels of neighbours that meet in a union-find forest; the second replaces every label by the root
+ * 		of its tree while adding the pixel to the area, centroid and bounding box of its blob.
+ * These are:
+ *
+ * public:
+ * Cellcount() -> Only class constructor. Sets the default parameters below.
+ * set_blur(int) -> Chooses the radius of the box blur (default 1, 0 for none).
+ * set_threshold(int, int, bool) -> Chooses the radius of the window the threshold is taken over (default 15), how many percent
+ * 		darker than the mean of the window a pixel has to be to belong to a cell (default 10), and whether cells are darker than the
+ * 		background (default, for brightfield) or brighter (for fluorescence).
+ * set_morphology(int, int, int) -> Chooses how many erosions and then dilations to apply to the thresholded picture (default 2 and 0),
+ * 		by a square of the given radius (default 1, a 3x3 square).
+ * set_area(int, int) -> Blobs smaller than the first number of pixels, or larger than the second (if not 0), are not counted
+ * 		(default 10 and 0).
+ * count(const unsigned char*, int, int) -> Counts the cells on a plane of the given width and height, and returns how many there are.
+ * blobs() -> The cells found by the last count, with their area, centroid and bounding box.
+ * mask() -> The thresholded picture of the last count after erosion and dilation, 255 on cells and 0 elsewhere.
+ * save_mask(string) -> Saves it as a PGM picture.
+ *
+ * private:
+ * blur(const unsigned char*) -> Box blur of the plane into m_blurred.
+ * threshold() -> Adaptive threshold of m_blurred into m_mask.
+ * morphology(bool) -> Erodes or dilates m_mask once by the square.
+ * extremum_line(unsigned char*, int, int, bool) -> Running minimum or maximum of one row or column, the van Herk/Gil-Werman way.
+ * label() -> Finds the blobs of m_mask.
+ * find_root(int) -> Root of a label in the union-find forest, halving the path on the way.
+ */
+
+
+
+#ifndef CELLCOUNT_CLASS_H
+#define CELLCOUNT_CLASS_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstdio>
+
+#include "pgm_io.h"
+
+using namespace std;
+
+
+
+// A cell: its area in pixels, centroid, and bounding box (inclusive)
+struct Cellblob
+{
+	int area;
+	float x;
+	float y;
+	int left;
+	int top;
+	int right;
+	int bottom;
+};
+
+
+
+class Cellcount
+{
+
+private:
+
+	int m_blur;
+	int m_window;
+	int m_offset;
+	bool m_dark;
+	int m_erosions;
+	int m_dilations;
+	int m_radius;
+	int m_min_area;
+	int m_max_area;
+
+	// Planes of the last count, kept between counts so they are only allocated once
+	int m_width;
+	int m_height;
+	vector<unsigned char> m_blurred;
+	vector<unsigned char> m_mask;
+	vector<unsigned int> m_sums;
+	vector<int> m_column_sums;
+	vector<int> m_labels;
+	vector<int> m_parent;
+	vector<unsigned char> m_forward;
+	vector<unsigned char> m_backward;
+	vector<Cellblob> m_blobs;
+
+
+	void blur(const unsigned char * plane);
+
+	void threshold();
+
+	void morphology(bool erode);
+
+	void extremum_line(unsigned char * line, int length, int stride, bool minimum);
+
+	void label();
+
+	int find_root(int label);
+
+
+public:
+
+	Cellcount();
+
+	void set_blur(int radius = 1)
+	{	m_blur = (radius < 0) ? 0 : radius; return;	}
+
+	void set_threshold(int window = 15, int offset = 10, bool dark = true)
+	{	m_window = (window < 1) ? 1 : window; m_offset = offset; m_dark = dark; return;	}
+
+	void set_morphology(int erosions = 2, int dilations = 0, int radius = 1)
+	{	m_erosions = (erosions < 0) ? 0 : erosions; m_dilations = (dilations < 0) ? 0 : dilations; m_radius = (radius < 1) ? 1 : radius; return;	}
+
+	void set_area(int min_area = 10, int max_area = 0)
+	{	m_min_area = min_area; m_max_area = max_area; return;	}
+
+	int count(const unsigned char * plane, int width, int height);
+
+	const vector<Cellblob> & blobs() const
+	{	return m_blobs;	}
+
+	const vector<unsigned char> & mask() const
+	{	return m_mask;	}
+
+	bool save_mask(string location);
+
+
+};
+
+
+
+
+/* Cellcount class CONSTRUCTOR */
+Cellcount::Cellcount()
+{
+
+	set_blur();
+	set_threshold();
+	set_morphology();
+	set_area();
+
+	m_width = 0;
+	m_height = 0;
+
+}
+
+
+
+
+/* Count the cells on a plane */
+int Cellcount::count(const unsigned char * plane, int width, int height)
+{
+
+	m_width = width;
+	m_height = height;
+	m_blobs.clear();
+	if (width < 1 || height < 1)
+		return 0;
+
+	blur(plane);
+	threshold();
+	for (int i=0; i<m_erosions; i++)
+		morphology(true);
+	for (int i=0; i<m_dilations; i++)
+		morphology(false);
+	label();
+
+	return (int)m_blobs.size();
+
+}
+
+
+
+
+/* Box blur along the rows into m_mask, used as scratch, and then along the columns into m_blurred
+ * Each pixel is the running sum of the window divided by its length, pixels beyond the border being copies of the edge ones. */
+void Cellcount::blur(const unsigned char * plane)
+{
+
+	size_t pixels = (size_t)m_width*m_height;
+	m_blurred.resize(pixels);
+	m_mask.resize(pixels);
+
+	if (m_blur == 0)
+	{
+		m_blurred.assign(plane, plane + pixels);
+		return;
+	}
+
+	int length = 2*m_blur + 1;
+	int half = length/2;
+
+	for (int y=0; y<m_height; y++)
+	{
+		const unsigned char * in = plane + (size_t)y*m_width;
+		unsigned char * out = &m_mask[(size_t)y*m_width];
+		int sum = 0;
+		for (int k=-m_blur; k<=m_blur; k++)
+			sum += in[(k < 0) ? 0 : ((k >= m_width) ? m_width - 1 : k)];
+		for (int x=0; x<m_width; x++)
+		{
+			out[x] = (unsigned char)((sum + half)/length);
+			int leaving = x - m_blur;
+			int entering = x + m_blur + 1;
+			sum += in[(entering >= m_width) ? m_width - 1 : entering] - in[(leaving < 0) ? 0 : leaving];
+		}
+	}
+
+	m_column_sums.assign(m_width, 0);
+	int * sums = &m_column_sums[0];
+	for (int k=-m_blur; k<=m_blur; k++)
+	{
+		const unsigned char * in = &m_mask[(size_t)((k < 0) ? 0 : ((k >= m_height) ? m_height - 1 : k))*m_width];
+		for (int x=0; x<m_width; x++)
+			sums[x] += in[x];
+	}
+	for (int y=0; y<m_height; y++)
+	{
+		unsigned char * out = &m_blurred[(size_t)y*m_width];
+		int leaving = y - m_blur;
+		int entering = y + m_blur + 1;
+		const unsigned char * old_row = &m_mask[(size_t)((leaving < 0) ? 0 : leaving)*m_width];
+		const unsigned char * new_row = &m_mask[(size_t)((entering >= m_height) ? m_height - 1 : entering)*m_width];
+		for (int x=0; x<m_width; x++)
+		{
+			out[x] = (unsigned char)((sums[x] + half)/length);
+			sums[x] += new_row[x] - old_row[x];
+		}
+	}
+
+	return;
+
+}
+
+
+
+
+/* Adaptive threshold
+ * The integral image holds at (x, y) the sum of all pixels above and to the left, so the sum over any window is four lookups.
+ * It is kept in unsigned ints, which wrap round on large pictures, but the sum over a window is still right as long as the window
+ * itself is below 2^32 / 255 pixels, since unsigned arithmetic is modulo 2^32.
+ * A pixel belongs to a cell if it is offset percent darker (or brighter) than the mean of the window, clipped at the borders. */
+void Cellcount::threshold()
+{
+
+	int stride = m_width + 1;
+	m_sums.assign((size_t)stride*(m_height + 1), 0);
+	for (int y=0; y<m_height; y++)
+	{
+		const unsigned char * in = &m_blurred[(size_t)y*m_width];
+		const unsigned int * above = &m_sums[(size_t)y*stride];
+		unsigned int * row = &m_sums[(size_t)(y + 1)*stride];
+		unsigned int running = 0;
+		for (int x=0; x<m_width; x++)
+		{
+			running += in[x];
+			row[x + 1] = above[x + 1] + running;
+		}
+	}
+
+	// Compared as pixel*area*100 against sum*(100 -+ offset), in integers
+	int scale = m_dark ? 100 - m_offset : 100 + m_offset;
+	for (int y=0; y<m_height; y++)
+	{
+		int top = (y - m_window < 0) ? 0 : y - m_window;
+		int bottom = (y + m_window + 1 > m_height) ? m_height : y + m_window + 1;
+		const unsigned int * top_row = &m_sums[(size_t)top*stride];
+		const unsigned int * bottom_row = &m_sums[(size_t)bottom*stride];
+		const unsigned char * in = &m_blurred[(size_t)y*m_width];
+		unsigned char * out = &m_mask[(size_t)y*m_width];
+		for (int x=0; x<m_width; x++)
+		{
+			int left = (x - m_window < 0) ? 0 : x - m_window;
+			int right = (x + m_window + 1 > m_width) ? m_width : x + m_window + 1;
+			unsigned int sum = bottom_row[right] - bottom_row[left] - top_row[right] + top_row[left];
+			double area = (double)(right - left)*(bottom - top);
+			double pixel = (double)in[x]*area*100;
+			double mean = (double)sum*scale;
+			out[x] = (m_dark ? pixel < mean : pixel > mean) ? 255 : 0;
+		}
+	}
+
+	return;
+
+}
+
+
+
+
+/* Erode or dilate the mask once by the square, along every row and then every column */
+void Cellcount::morphology(bool erode)
+{
+
+	for (int y=0; y<m_height; y++)
+		extremum_line(&m_mask[(size_t)y*m_width], m_width, 1, erode);
+	for (int x=0; x<m_width; x++)
+		extremum_line(&m_mask[x], m_height, m_width, erode);
+
+	return;
+
+}
+
+
+
+
+/* Minimum (or maximum) over a window of 2*radius+1 pixels centred on every pixel of a line, in place
+ * The line is padded by radius pixels at both ends with the value that doesn't change the result (255 for a minimum, 0 for a maximum),
+ * so cells touching the border aren't eroded from outside, and then to a whole number of blocks of the window's length.
+ * forward[i] is the extremum from the start of i's block up to i, and backward[i] from i to the end of its block;
+ * the window starting at i covers the end of one block and the start of the next, so its extremum is that of backward[i]
+ * and forward[i + length - 1]. */
+void Cellcount::extremum_line(unsigned char * line, int length, int stride, bool minimum)
+{
+
+	int window = 2*m_radius + 1;
+	int padded = ((length + 2*m_radius + window - 1)/window)*window;
+	unsigned char neutral = minimum ? 255 : 0;
+	m_forward.assign(padded, neutral);
+	m_backward.resize(padded);
+
+	for (int i=0; i<length; i++)
+		m_forward[m_radius + i] = line[(size_t)i*stride];
+
+	unsigned char * forward = &m_forward[0];
+	unsigned char * backward = &m_backward[0];
+	for (int start=0; start<padded; start+=window)
+	{
+		int end = start + window - 1;
+		backward[end] = forward[end];
+		for (int i=end-1; i>=start; i--)
+			backward[i] = minimum ? (forward[i] < backward[i + 1] ? forward[i] : backward[i + 1])
+					: (forward[i] > backward[i + 1] ? forward[i] : backward[i + 1]);
+		for (int i=start+1; i<=end; i++)
+			forward[i] = minimum ? (forward[i] < forward[i - 1] ? forward[i] : forward[i - 1])
+					: (forward[i] > forward[i - 1] ? forward[i] : forward[i - 1]);
+	}
+
+	for (int i=0; i<length; i++)
+	{
+		unsigned char a = backward[i];
+		unsigned char b = forward[i + window - 1];
+		line[(size_t)i*stride] = minimum ? (a < b ? a : b) : (a > b ? a : b);
+	}
+
+	return;
+
+}
+
+
+
+
+/* Two pass labelling of the blobs of the mask, with 8-connectivity
+ * Labels start at 1, 0 being the background. A label's parent is itself until it is joined to a smaller one,
+ * so every root is the smallest label of its blob. */
+void Cellcount::label()
+{
+
+	m_labels.assign((size_t)m_width*m_height, 0);
+	m_parent.assign(1, 0);
+
+	for (int y=0; y<m_height; y++)
+	{
+		const unsigned char * in = &m_mask[(size_t)y*m_width];
+		int * row = &m_labels[(size_t)y*m_width];
+		const int * above = (y > 0) ? row - m_width : NULL;
+		for (int x=0; x<m_width; x++)
+		{
+			if (in[x] == 0)
+				continue;
+
+			// Neighbours already seen: left, and the three above
+			int neighbours[4];
+			int found = 0;
+			if (x > 0 && row[x - 1] != 0)
+				neighbours[found++] = row[x - 1];
+			if (above != NULL)
+			{
+				if (x > 0 && above[x - 1] != 0)
+					neighbours[found++] = above[x - 1];
+				if (above[x] != 0)
+					neighbours[found++] = above[x];
+				if (x+1 < m_width && above[x + 1] != 0)
+					neighbours[found++] = above[x + 1];
+			}
+
+			if (found == 0)
+			{
+				row[x] = (int)m_parent.size();
+				m_parent.push_back(row[x]);
+				continue;
+			}
+
+			int smallest = find_root(neighbours[0]);
+			for (int k=1; k<found; k++)
+			{
+				int root = find_root(neighbours[k]);
+				if (root < smallest)
+				{
+					m_parent[smallest] = root;
+					smallest = root;
+				}
+				else if (root > smallest)
+					m_parent[root] = smallest;
+			}
+			row[x] = smallest;
+		}
+	}
+
+	// Blob of every root, then every pixel added to the blob of its root
+	vector<int> blob_of(m_parent.size(), -1);
+	vector<double> sum_x;
+	vector<double> sum_y;
+	vector<Cellblob> found;
+	for (int y=0; y<m_height; y++)
+	{
+		const int * row = &m_labels[(size_t)y*m_width];
+		for (int x=0; x<m_width; x++)
+		{
+			if (row[x] == 0)
+				continue;
+			int root = find_root(row[x]);
+			int b = blob_of[root];
+			if (b < 0)
+			{
+				b = blob_of[root] = (int)found.size();
+				Cellblob blob;
+				blob.area = 0;
+				blob.left = blob.right = x;
+				blob.top = blob.bottom = y;
+				found.push_back(blob);
+				sum_x.push_back(0);
+				sum_y.push_back(0);
+			}
+			Cellblob &blob = found[b];
+			blob.area++;
+			sum_x[b] += x;
+			sum_y[b] += y;
+			if (x < blob.left) blob.left = x;
+			if (x > blob.right) blob.right = x;
+			blob.bottom = y;
+		}
+	}
+
+	for (size_t b=0; b<found.size(); b++)
+	{
+		if (found[b].area < m_min_area || (m_max_area > 0 && found[b].area > m_max_area))
+			continue;
+		found[b].x = sum_x[b]/found[b].area;
+		found[b].y = sum_y[b]/found[b].area;
+		m_blobs.push_back(found[b]);
+	}
+
+	return;
+
+}
+
+
+
+
+/* Root of a label, pointing every other label on the way to its grandparent so later searches are shorter */
+int Cellcount::find_root(int label)
+{
+
+	while (m_parent[label] != label)
+	{
+		m_parent[label] = m_parent[m_parent[label]];
+		label = m_parent[label];
+	}
+
+	return label;
+
+}
+
+
+
+
+/* Save the mask of the last count as a binary PGM picture */
+bool Cellcount::save_mask(string location)
+{
+
+	return write_pgm(location, &m_mask[0], m_width, m_height);
+
+}
+
+
+
+#endif
@@ -0,0 +1,130 @@
+// Cell Count Program
+
+/* Counts the cells on pictures through the Cellcount class, and lists them with their area, centroid and bounding box.
+ * Usage:
+ * 		./count.x [options] <picture> [<picture> ...]
+ * Options:
+ * 		-b <radius>		radius of the blur (default 1)
+ * 		-w <radius>		radius of the window the threshold is taken over (default 15)
+ * 		-p <percent>	how much darker than the window a pixel has to be to belong to a cell (default 10)
+ * 		-l				cells are lighter than the background, as with fluorescence
+ * 		-e <erosions>	erosions of the thresholded picture (default 2)
+ * 		-d <dilations>	dilations after the erosions (default 0)
+ * 		-r <radius>		radius of the square eroded and dilated by (default 1)
+ * 		-a <area>		smallest area counted, in pixels (default 10)
+ * 		-q				only print the number of cells on each picture
+ * 		-m <file.pgm>	save the mask of the last picture
+ * Colour pictures are counted on the mean of their channels.
+ * For more information, see description of cellcount_class.h
+ */
+
+
+
+#include <cstdlib>
+#include <sys/time.h>
+#include "CImg.h"
+
+#include "cellcount_class.h"
+
+using namespace cimg_library;
+
+
+int main (int argc, char ** argv) {
+
+	Cellcount counting;
+	int blur = 1;
+	int window = 15;
+	int offset = 10;
+	bool dark = true;
+	int erosions = 2;
+	int dilations = 0;
+	int radius = 1;
+	int min_area = 10;
+	bool quiet = false;
+	string mask;
+	vector<string> files;
+
+	for (int i=1; i<argc; i++)
+	{
+		string option = argv[i];
+		bool has_value = (i+1 < argc);
+
+		if (option == "-b" && has_value)
+			blur = atoi(argv[++i]);
+		else if (option == "-w" && has_value)
+			window = atoi(argv[++i]);
+		else if (option == "-p" && has_value)
+			offset = atoi(argv[++i]);
+		else if (option == "-l")
+			dark = false;
+		else if (option == "-e" && has_value)
+			erosions = atoi(argv[++i]);
+		else if (option == "-d" && has_value)
+			dilations = atoi(argv[++i]);
+		else if (option == "-r" && has_value)
+			radius = atoi(argv[++i]);
+		else if (option == "-a" && has_value)
+			min_area = atoi(argv[++i]);
+		else if (option == "-q")
+			quiet = true;
+		else if (option == "-m" && has_value)
+			mask = argv[++i];
+		else if (option[0] == '-')
+		{
+			cout << "\nUnknown option " << option << endl;
+			return 1;
+		}
+		else
+			files.push_back(option);
+	}
+
+	if (files.empty())
+	{
+		cout << "\nUsage: " << argv[0] << " [-b blur] [-w window] [-p percent] [-l] [-e erosions] [-d dilations] [-r radius] [-a area] [-q] [-m mask.pgm] <picture> ..." << endl;
+		return 1;
+	}
+
+	counting.set_blur(blur);
+	counting.set_threshold(window, offset, dark);
+	counting.set_morphology(erosions, dilations, radius);
+	counting.set_area(min_area);
+
+	vector<unsigned char> luma;
+	for (size_t f=0; f<files.size(); f++)
+	{
+		CImg<unsigned char> picture(files[f].c_str());
+		int width = picture.width();
+		int height = picture.height();
+		int channels = picture.spectrum();
+
+		luma.resize((size_t)width*height);
+		for (size_t i=0; i<luma.size(); i++)
+		{
+			int sum = 0;
+			for (int c=0; c<channels; c++)
+				sum += picture.data()[i + c*luma.size()];
+			luma[i] = (unsigned char)(sum/channels);
+		}
+
+		struct timeval start, end;
+		gettimeofday(&start, NULL);
+		int cells = counting.count(&luma[0], width, height);
+		gettimeofday(&end, NULL);
+		double took = (end.tv_sec - start.tv_sec)*1000.0 + (end.tv_usec - start.tv_usec)/1000.0;
+
+		cout << files[f] << ": " << cells << " cells (" << took << " ms)" << endl;
+		if (quiet)
+			continue;
+
+		const vector<Cellblob> &blobs = counting.blobs();
+		for (size_t b=0; b<blobs.size(); b++)
+			cout << "\t" << blobs[b].x << " " << blobs[b].y << "\tarea " << blobs[b].area << "\tbox " << blobs[b].left << "," << blobs[b].top
+					<< " to " << blobs[b].right << "," << blobs[b].bottom << endl;
+	}
+
+	if (!mask.empty() && !counting.save_mask(mask))
+		return 1;
+
+	return 0;
+
+}
@@ -0,0 +1,1067 @@
+// Deconvolution Class
+
+/* This file contains the class that deconvolves z-stacks (see zstack_class.h) by the Richardson-Lucy algorithm.
+ * Every slice of a widefield stack holds the light of the slices around it, blurred by the point spread function (PSF) of the objective.
+ * Richardson-Lucy finds the stack which, blurred by the PSF, gives the one taken, by repeating
+ * 		estimate = estimate * PSF' (x) (data / (PSF (x) estimate))
+ * where (x) is a 3D convolution and PSF' the PSF mirrored. Each iteration sharpens the stack a little more, and amplifies the noise a little more,
+ * so the number of iterations trades time against quality; how long each took and how much it changed the stack are kept to choose it.
+ * The PSF is a theoretical widefield one, the intensity of the defocused pupil of the objective chosen (as in Autofocus::set_objective(string)),
+ * computed at the sampling of the stack: the pixel size at the sample (the camera pixel divided by the magnification) and the step between slices.
+ * The convolutions are products of 3D FFTs, on tiles of the stack taken one after the other, so memory is bounded by the size of a tile
+ * rather than of the stack. Each tile holds all the slices, and overlaps its neighbours by the radius of the PSF; only its centre is kept.
+ * The edges of the stack and of the tile are handled by masking the data outside them, so neither wraps round into the other.
+ * All the transforms of one length share a plan (see fft_plan(...) in image_kernels.h), and every step of an iteration runs on all threads.
+ * These are:
+ *
+ * public:
+ * Deconvolution() -> Only class constructor. Uses the 4x objective, a camera pixel of 5.67 micrometres (1.4 at full resolution, for 640
+ * 		pixel wide pictures) and a step of 1 micrometre, and one thread per core.
+ * ~Deconvolution() -> Class destructor.
+ * set_objective(string) -> Chooses the objective, "4x", "10x", "40x" or "100x", for its numerical aperture, immersion and magnification.
+ * set_sampling(float, float) -> Chooses the size of a camera pixel, and the step between slices at the sample, both in micrometres.
+ * set_wavelength(float) -> Chooses the wavelength of the light, in nanometres (default 550).
+ * set_extent(int, int) -> Chooses the radius of the PSF, in pixels across (default 12) and in slices (default 8, at most the depth of the stack).
+ * 		Light beyond it is ignored. It is also the overlap between tiles.
+ * set_tile(int) -> Chooses the side of the tiles (a power of two, default 128). Only the centre of the side less four radii is kept from each.
+ * set_threads(int) -> Chooses how many threads the iterations run on (by default one per core).
+ * clear() -> Forgets the stack.
+ * add_slice(const unsigned char*, int, int, int, double) -> Adds a slice (luma plane, width, height, position and time) to the stack.
+ * load(string) -> Reads a stack file written by ZStack::acquire(string). Returns false if it can't be read.
+ * run(int) -> Deconvolves the stack by the given number of iterations. Returns false if there is no stack or the tile is too small.
+ * save(string) -> Writes the deconvolved stack to a stack file, with the positions and times of the slices taken.
+ * save_psf(string) -> Writes the PSF as a stack file, one slice per depth, scaled so its brightest pixel is 255.
+ * slices(), width(), height() -> Size of the stack.
+ * slice(int) -> The deconvolved slice, as 8-bit luma. The stack is scaled down if needed so its brightest pixel is at most 255, see scale().
+ * scale() -> Factor the deconvolved stack was multiplied by to fit in 8 bits (1 unless it had brighter pixels).
+ * iteration_ms(int) -> Milliseconds taken by an iteration, over all tiles.
+ * iteration_change(int) -> Relative change an iteration made to the stack, the sum of the changes over the sum of the values.
+ * 		It falls as the iterations converge, so iterations past the point where it is small are not worth their time.
+ * total_ms() -> Milliseconds taken by the last run(int), including the PSF and setting up every tile.
+ *
+ * private:
+ * make_psf(int) -> Computes the PSF, to the given radius in slices, by the 2D FFT of the pupil defocused to each depth, at three or more points across each pixel and along each step.
+ * make_otf() -> Places the PSF centred on the origin of a tile and transforms it. The PSF is symmetric, so its transform is real.
+ * deconvolve_tile(int, int, int) -> Loads a tile, runs the given number of iterations on it and keeps its centre.
+ * transform(bool, bool) -> 3D FFT of the tile, forward or inverse, multiplied by the transform of the PSF if asked (a convolution).
+ * run_bands(...) -> Runs one step on every band of the tile at once, as Edgedetection::run_bands(...) does.
+ * band_*(int) -> Steps of an iteration, each on one band of lines or voxels of the tile.
+ */
+
+
+
+#ifndef DECONVOLUTION_CLASS_H
+#define DECONVOLUTION_CLASS_H
+
+#include <iostream>
+#include <cstdio>
+#include <cctype>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <boost/thread.hpp>
+#include <boost/bind/bind.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include "image_kernels.h"
+#include "threadpool_class.h"
+#include "pgm_io.h"
+
+using namespace std;
+
+// Points the PSF is computed at across each pixel and along each step, averaged into the pixel
+#define PSF_SAMPLES 3
+
+// Voxels seeing less than this fraction of the PSF over the data are left out of the estimate
+#define DECONVOLUTION_MIN_WEIGHT 1e-3f
+
+// Smallest blurred value divided by, so dark voxels don't divide by zero
+#define DECONVOLUTION_EPSILON 1e-6f
+
+
+
+class Deconvolution
+{
+
+private:
+
+	// Optics: numerical aperture, refractive index of the immersion and magnification, and the sampling
+	float m_aperture;
+	float m_immersion;
+	float m_magnification;
+	float m_camera_pixel_um;
+	float m_step_um;
+	float m_wavelength_nm;
+
+	int m_radius;
+	int m_radius_z;
+	int m_tile;
+
+	// Stack taken, and deconvolved
+	int m_width;
+	int m_height;
+	vector<unsigned char> m_stack;
+	vector<int> m_positions;
+	vector<double> m_times;
+	vector<float> m_result;
+	vector<unsigned char> m_output;
+	float m_scale;
+
+	// PSF, (2*radius + 1) across and (2*psf_radius_z + 1) deep, and its transform on a tile
+	// Its radius in slices is the one asked for, cut to the depth of the stack for a run
+	vector<float> m_psf;
+	int m_psf_radius_z;
+	int m_psf_depth;
+	vector<float> m_otf;
+
+	// Tile: side, depth (a power of two holding the slices and a PSF radius above and below), and where it starts in the stack
+	int m_depth;
+	int m_left;
+	int m_top;
+	vector<float> m_re;
+	vector<float> m_im;
+	vector<float> m_data;
+	vector<float> m_estimate;
+	vector<float> m_weight;
+	vector<unsigned char> m_inside_x;
+	vector<unsigned char> m_inside_y;
+	vector<unsigned char> m_inside_z;
+	Fft_plan m_plan_xy;
+	Fft_plan m_plan_z;
+	bool m_inverse;
+	bool m_filter;
+
+	// Bands for the parallel steps, with their lines being transformed and their sums
+	Threadpool * m_pool;
+	int m_bands;
+	vector< vector<float> > m_band_re;
+	vector< vector<float> > m_band_im;
+	vector<double> m_band_sums;
+	vector<double> m_band_changes;
+
+	// Timing and change of every iteration, summed over the tiles
+	vector<double> m_iteration_ms;
+	vector<double> m_iteration_changes;
+	vector<double> m_iteration_sums;
+	double m_total_ms;
+
+
+	void make_psf(int radius_z);
+
+	void make_otf();
+
+	void deconvolve_tile(int left, int top, int iterations);
+
+	void transform(bool inverse, bool filter);
+
+	void run_bands(void (Deconvolution::*step)(int));
+
+	void band_range(int band, size_t count, size_t &first, size_t &last);
+
+	void band_rows(int band);
+
+	void band_columns(int band);
+
+	void band_depth(int band);
+
+	void band_load(int band);
+
+	void band_weight(int band);
+
+	void band_start(int band);
+
+	void band_ratio(int band);
+
+	void band_update(int band);
+
+	bool write_stack(string file, const vector<unsigned char> &planes, int width, int height, int slices, bool taken);
+
+
+public:
+
+	Deconvolution();
+
+	~Deconvolution();
+
+	void set_objective(string objective_type = "4x");
+
+	void set_sampling(float camera_pixel_um = 5.67f, float step_um = 1.0f)
+	{	m_camera_pixel_um = camera_pixel_um; m_step_um = step_um; return;	}
+
+	void set_wavelength(float wavelength_nm = 550)
+	{	m_wavelength_nm = wavelength_nm; return;	}
+
+	void set_extent(int radius = 12, int radius_z = 8)
+	{	m_radius = (radius < 1) ? 1 : radius; m_radius_z = (radius_z < 0) ? 0 : radius_z; return;	}
+
+	void set_tile(int side = 128)
+	{	m_tile = power_of_two_below(side); return;	}
+
+	void set_threads(int threads);
+
+	void clear();
+
+	bool add_slice(const unsigned char * luma, int width, int height, int position = 0, double time_ms = 0);
+
+	bool load(string file);
+
+	bool run(int iterations);
+
+	bool save(string file)
+	{	return write_stack(file, m_output, m_width, m_height, slices(), true);	}
+
+	bool save_psf(string file);
+
+	int slices()
+	{	return (int)m_positions.size();	}
+
+	int width()
+	{	return m_width;	}
+
+	int height()
+	{	return m_height;	}
+
+	const unsigned char * slice(int index)
+	{	return &m_output[(size_t)index*m_width*m_height];	}
+
+	float scale()
+	{	return m_scale;	}
+
+	int iterations()
+	{	return (int)m_iteration_ms.size();	}
+
+	double iteration_ms(int iteration)
+	{	return m_iteration_ms[iteration];	}
+
+	double iteration_change(int iteration)
+	{	return (m_iteration_sums[iteration] > 0) ? m_iteration_changes[iteration]/m_iteration_sums[iteration] : 0;	}
+
+	double total_ms()
+	{	return m_total_ms;	}
+
+
+};
+
+
+
+
+/* Deconvolution class CONSTRUCTOR */
+Deconvolution::Deconvolution()
+{
+
+	m_pool = NULL;
+	set_objective();
+	set_sampling();
+	set_wavelength();
+	set_extent();
+	set_tile();
+	set_threads(boost::thread::hardware_concurrency());
+
+	m_width = 0;
+	m_height = 0;
+	m_scale = 1;
+	m_psf_radius_z = 0;
+	m_psf_depth = 0;
+	m_depth = 0;
+	m_left = 0;
+	m_top = 0;
+	m_inverse = false;
+	m_filter = false;
+	m_total_ms = 0;
+
+}
+
+
+
+
+/* Deconvolution class DESTRUCTOR
+ * Deleting the pool waits for its threads */
+Deconvolution::~Deconvolution()
+{
+
+	delete m_pool;
+
+}
+
+
+
+
+/* Choose the objective
+ * Apertures of usual achromats; the 100x is an oil objective, the others dry */
+void Deconvolution::set_objective(string objective_type)
+{
+
+	m_immersion = 1.0f;
+	if (objective_type.compare("4x") == 0)
+	{
+		m_aperture = 0.10f;
+		m_magnification = 4;
+	}
+	else if (objective_type.compare("10x") == 0)
+	{
+		m_aperture = 0.25f;
+		m_magnification = 10;
+	}
+	else if (objective_type.compare("40x") == 0)
+	{
+		m_aperture = 0.65f;
+		m_magnification = 40;
+	}
+	else if (objective_type.compare("100x") == 0)
+	{
+		m_aperture = 1.25f;
+		m_immersion = 1.515f;
+		m_magnification = 100;
+	}
+	else
+	{
+		cout << "\nObjective not recognised, using the 4x." << endl;
+		m_aperture = 0.10f;
+		m_magnification = 4;
+	}
+
+	return;
+
+}
+
+
+
+
+/* Choose how many threads the iterations run on
+ * One thread (or fewer) runs everything on the calling thread as a single band, without a pool */
+void Deconvolution::set_threads(int threads)
+{
+
+	delete m_pool;
+	m_pool = NULL;
+
+	if (threads > 1)
+		m_pool = new Threadpool(threads);
+
+	m_bands = (threads > 1) ? threads : 1;
+	m_band_re.resize(m_bands);
+	m_band_im.resize(m_bands);
+	m_band_sums.resize(m_bands);
+	m_band_changes.resize(m_bands);
+
+	return;
+
+}
+
+
+
+
+/* Forget the stack */
+void Deconvolution::clear()
+{
+
+	m_width = 0;
+	m_height = 0;
+	m_stack.clear();
+	m_positions.clear();
+	m_times.clear();
+	m_result.clear();
+	m_output.clear();
+
+	return;
+
+}
+
+
+
+
+/* Add a slice to the stack
+ * All slices must be the size of the first */
+bool Deconvolution::add_slice(const unsigned char * luma, int width, int height, int position, double time_ms)
+{
+
+	if (m_positions.empty())
+	{
+		m_width = width;
+		m_height = height;
+	}
+	else if (width != m_width || height != m_height)
+	{
+		cout << "\nSlice of " << width << "x" << height << " in a stack of " << m_width << "x" << m_height << endl;
+		return false;
+	}
+
+	m_stack.insert(m_stack.end(), luma, luma + (size_t)width*height);
+	m_positions.push_back(position);
+	m_times.push_back(time_ms);
+
+	return true;
+
+}
+
+
+
+
+/* Read a stack file: binary PGM pictures one after the other, each with a '# z <position> t <milliseconds>' comment */
+bool Deconvolution::load(string file)
+{
+
+	FILE * input = fopen(file.c_str(), "rb");
+	if (input == NULL)
+	{
+		cout << "\nCould not open stack " << file << endl;
+		return false;
+	}
+
+	clear();
+	vector<unsigned char> luma;
+	while (true)
+	{
+		// Pictures follow each other directly, but allow whitespace after the last one
+		int c = fgetc(input);
+		while (isspace(c))
+			c = fgetc(input);
+		if (c == EOF)
+			break;
+		ungetc(c, input);
+
+		int width, height;
+		string comment;
+		if (!read_pgm_header(input, width, height, &comment))
+		{
+			cout << "\nStack " << file << " holds something other than 8-bit binary PGM pictures" << endl;
+			fclose(input);
+			return false;
+		}
+
+		int position = slices();
+		double time_ms = 0;
+		sscanf(comment.c_str(), "z %d t %lf", &position, &time_ms);
+
+		luma.resize((size_t)width*height);
+		if (fread(&luma[0], 1, luma.size(), input) != luma.size() || !add_slice(&luma[0], width, height, position, time_ms))
+		{
+			cout << "\nStack " << file << " ends in the middle of slice " << slices() << endl;
+			fclose(input);
+			return false;
+		}
+	}
+
+	fclose(input);
+
+	if (m_positions.empty())
+	{
+		cout << "\nStack " << file << " is empty" << endl;
+		return false;
+	}
+
+	return true;
+
+}
+
+
+
+
+/* Write planes as a stack file, with the positions and times of the slices taken or, for the PSF, the index of the plane */
+bool Deconvolution::write_stack(string file, const vector<unsigned char> &planes, int width, int height, int slices, bool taken)
+{
+
+	if (planes.size() < (size_t)width*height*slices || slices < 1)
+	{
+		cout << "\nNothing to save to " << file << endl;
+		return false;
+	}
+
+	FILE * output = fopen(file.c_str(), "wb");
+	if (output == NULL)
+	{
+		cout << "\nCould not open " << file << " to write" << endl;
+		return false;
+	}
+
+	size_t pixels = (size_t)width*height;
+	bool written = true;
+	for (int s=0; s<slices && written; s++)
+	{
+		stringstream comment;
+		comment << "z " << (taken ? m_positions[s] : s) << " t " << fixed << setprecision(1) << (taken ? m_times[s] : 0.0);
+		written = write_pgm_header(output, width, height, comment.str()) && fwrite(&planes[s*pixels], 1, pixels, output) == pixels;
+	}
+
+	if (fclose(output) != 0 || !written)
+	{
+		cout << "\nCould not write " << file << endl;
+		return false;
+	}
+
+	return true;
+
+}
+
+
+
+
+/* Write the PSF, brightest pixel at 255 */
+bool Deconvolution::save_psf(string file)
+{
+
+	make_psf(m_radius_z);
+
+	float brightest = 0;
+	for (size_t i=0; i<m_psf.size(); i++)
+		if (m_psf[i] > brightest)
+			brightest = m_psf[i];
+
+	vector<unsigned char> planes(m_psf.size());
+	for (size_t i=0; i<m_psf.size(); i++)
+		planes[i] = (unsigned char)(255*m_psf[i]/brightest + 0.5f);
+
+	return write_stack(file, planes, 2*m_radius + 1, 2*m_radius + 1, m_psf_depth, false);
+
+}
+
+
+
+
+/* Deconvolve the stack
+ * Each tile keeps a side less four PSF radii: one radius each side is data shared with the neighbours, the next is empty space
+ * the estimate can spread into without wrapping round. The tiles are taken in rows, and their centres fill the deconvolved stack. */
+bool Deconvolution::run(int iterations)
+{
+
+	if (m_positions.empty())
+	{
+		cout << "\nNo stack to deconvolve" << endl;
+		return false;
+	}
+
+	int core = m_tile - 4*m_radius;
+	if (core < 8)
+	{
+		cout << "\nTiles of " << m_tile << " pixels are too small for a PSF radius of " << m_radius << endl;
+		return false;
+	}
+
+	boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+
+	// Cut for this stack only, so a deeper stack later gets the radius asked for
+	int radius_z = (m_radius_z > slices() - 1) ? slices() - 1 : m_radius_z;
+	m_depth = 1;
+	while (m_depth < slices() + 2*radius_z)
+		m_depth *= 2;
+
+	make_psf(radius_z);
+
+	size_t voxels = (size_t)m_tile*m_tile*m_depth;
+	m_re.resize(voxels);
+	m_im.resize(voxels);
+	m_data.resize(voxels);
+	m_estimate.resize(voxels);
+	m_weight.resize(voxels);
+	m_inside_x.resize(m_tile);
+	m_inside_y.resize(m_tile);
+	m_inside_z.resize(m_depth);
+	fft_plan(m_tile, m_plan_xy);
+	fft_plan(m_depth, m_plan_z);
+	int line = (m_tile > m_depth) ? m_tile : m_depth;
+	for (int b=0; b<m_bands; b++)
+	{
+		m_band_re[b].resize(line);
+		m_band_im[b].resize(line);
+	}
+
+	make_otf();
+
+	m_result.assign(m_stack.size(), 0);
+	m_iteration_ms.assign(iterations, 0);
+	m_iteration_changes.assign(iterations, 0);
+	m_iteration_sums.assign(iterations, 0);
+
+	int tiles = ((m_width + core - 1)/core)*((m_height + core - 1)/core);
+	cout << "\nDeconvolving " << tiles << " tiles of " << m_tile << "x" << m_tile << "x" << m_depth << " " << flush;
+	for (int top=0; top<m_height; top+=core)
+	{
+		for (int left=0; left<m_width; left+=core)
+		{
+			deconvolve_tile(left, top, iterations);
+			cout << "." << flush;
+		}
+	}
+	cout << endl;
+
+	// Back to 8 bits, scaled down only if something went over
+	float brightest = 0;
+	for (size_t i=0; i<m_result.size(); i++)
+		if (m_result[i] > brightest)
+			brightest = m_result[i];
+	m_scale = (brightest > 255) ? 255/brightest : 1;
+
+	m_output.resize(m_result.size());
+	for (size_t i=0; i<m_result.size(); i++)
+		m_output[i] = (unsigned char)(m_result[i]*m_scale + 0.5f);
+
+	m_total_ms = (boost::posix_time::microsec_clock::universal_time() - start).total_microseconds()/1000.0;
+
+	return true;
+
+}
+
+
+
+
+/* Compute the PSF
+ * The field at the focal plane is the Fourier transform of the pupil, a disc of radius NA/wavelength in spatial frequency;
+ * defocusing by z multiplies each frequency f by exp(2*pi*i*z*sqrt((n/wavelength)^2 - f^2)) (angular spectrum), which is exact
+ * for a scalar field at any aperture. The PSF is the intensity of the transformed field, averaged over PSF_SAMPLES points across each pixel
+ * and along each step, and normalised so it sums to 1.
+ * The points are spaced finely enough that the pupil stays below the Nyquist frequency, and the plane transformed is at least twice the PSF. */
+void Deconvolution::make_psf(int radius_z)
+{
+
+	int side = 2*m_radius + 1;
+	m_psf_radius_z = radius_z;
+	m_psf_depth = 2*radius_z + 1;
+	m_psf.assign((size_t)side*side*m_psf_depth, 0);
+
+	float wavelength_um = m_wavelength_nm/1000;
+	float pixel_um = m_camera_pixel_um/m_magnification;
+	float cutoff = m_aperture/wavelength_um;
+	float medium = m_immersion/wavelength_um;
+
+	int samples = PSF_SAMPLES;
+	while (2*cutoff*pixel_um/samples > 0.9f)
+		samples += 2;
+	float sample_um = pixel_um/samples;
+
+	int plane = 64;
+	while (plane < 2*side*samples)
+		plane *= 2;
+	float frequency = 1/(plane*sample_um);
+
+	vector<float> re((size_t)plane*plane);
+	vector<float> im((size_t)plane*plane);
+	for (int zs=0; zs<m_psf_depth; zs++)
+	{
+		for (int sz=0; sz<samples; sz++)
+		{
+			float z_um = (zs - m_psf_radius_z + (sz - (samples - 1)/2.0f)/samples)*m_step_um;
+
+			for (int v=0; v<plane; v++)
+			{
+				float fy = ((v < plane/2) ? v : v - plane)*frequency;
+				for (int u=0; u<plane; u++)
+				{
+					float fx = ((u < plane/2) ? u : u - plane)*frequency;
+					float f2 = fx*fx + fy*fy;
+					size_t i = (size_t)v*plane + u;
+					if (f2 > cutoff*cutoff)
+					{
+						re[i] = 0;
+						im[i] = 0;
+						continue;
+					}
+					double phase = 2*M_PI*z_um*sqrt(medium*medium - f2);
+					re[i] = (float)cos(phase);
+					im[i] = (float)sin(phase);
+				}
+			}
+
+			fft_2d(&re[0], &im[0], plane, plane, false);
+
+			// Intensity at the points of every pixel, the point at the centre of the PSF being the origin of the plane
+			for (int py=0; py<side; py++)
+			{
+				for (int sy=0; sy<samples; sy++)
+				{
+					int v = ((py - m_radius)*samples + sy - (samples - 1)/2 + plane) % plane;
+					for (int px=0; px<side; px++)
+					{
+						float sum = 0;
+						for (int sx=0; sx<samples; sx++)
+						{
+							int u = ((px - m_radius)*samples + sx - (samples - 1)/2 + plane) % plane;
+							size_t i = (size_t)v*plane + u;
+							sum += re[i]*re[i] + im[i]*im[i];
+						}
+						m_psf[((size_t)zs*side + py)*side + px] += sum;
+					}
+				}
+			}
+		}
+	}
+
+	double total = 0;
+	for (size_t i=0; i<m_psf.size(); i++)
+		total += m_psf[i];
+	for (size_t i=0; i<m_psf.size(); i++)
+		m_psf[i] = (float)(m_psf[i]/total);
+
+	return;
+
+}
+
+
+
+
+/* Transform of the PSF on a tile
+ * The PSF is placed with its centre at voxel (0, 0, 0), wrapping round to the far sides, so convolving by it doesn't shift the tile.
+ * It is symmetric about its centre, so its transform is real and convolving and correlating by it are the same product. */
+void Deconvolution::make_otf()
+{
+
+	int side = 2*m_radius + 1;
+	size_t plane = (size_t)m_tile*m_tile;
+	m_re.assign(m_re.size(), 0);
+	m_im.assign(m_im.size(), 0);
+	for (int z=0; z<m_psf_depth; z++)
+	{
+		int tz = (z - m_psf_radius_z + m_depth) % m_depth;
+		for (int y=0; y<side; y++)
+		{
+			int ty = (y - m_radius + m_tile) % m_tile;
+			for (int x=0; x<side; x++)
+			{
+				int tx = (x - m_radius + m_tile) % m_tile;
+				m_re[tz*plane + (size_t)ty*m_tile + tx] = m_psf[((size_t)z*side + y)*side + x];
+			}
+		}
+	}
+
+	transform(false, false);
+	m_otf = m_re;
+
+	return;
+
+}
+
+
+
+
+/* Deconvolve one tile, whose kept centre starts at (left, top) of the stack
+ * The estimate starts flat at the mean of the data. Voxels outside the stack or the tile are masked: the ratio there is 0,
+ * and each voxel of the estimate is divided by how much of its light falls on the data (the PSF correlated with the mask),
+ * so voxels near the edges are not darkened by the light they lose over them. */
+void Deconvolution::deconvolve_tile(int left, int top, int iterations)
+{
+
+	int margin = 2*m_radius;
+	m_left = left - margin;
+	m_top = top - margin;
+	for (int x=0; x<m_tile; x++)
+		m_inside_x[x] = (x >= m_radius && x < m_tile - m_radius && m_left + x >= 0 && m_left + x < m_width);
+	for (int y=0; y<m_tile; y++)
+		m_inside_y[y] = (y >= m_radius && y < m_tile - m_radius && m_top + y >= 0 && m_top + y < m_height);
+	for (int z=0; z<m_depth; z++)
+		m_inside_z[z] = (z >= m_psf_radius_z && z < m_psf_radius_z + slices());
+
+	// Data and mask, then the weights from the mask
+	run_bands(&Deconvolution::band_load);
+	transform(false, true);
+	transform(true, false);
+	run_bands(&Deconvolution::band_weight);
+
+	double sum = 0;
+	double count = 0;
+	for (int b=0; b<m_bands; b++)
+	{
+		sum += m_band_sums[b];
+		count += m_band_changes[b];
+	}
+	float mean = (count > 0) ? (float)(sum/count) : 0;
+	m_band_sums.assign(m_bands, mean);
+	run_bands(&Deconvolution::band_start);
+
+	for (int i=0; i<iterations; i++)
+	{
+		boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+
+		transform(false, true);
+		transform(true, false);
+		run_bands(&Deconvolution::band_ratio);
+		transform(false, true);
+		transform(true, false);
+		run_bands(&Deconvolution::band_update);
+
+		for (int b=0; b<m_bands; b++)
+		{
+			m_iteration_changes[i] += m_band_changes[b];
+			m_iteration_sums[i] += m_band_sums[b];
+		}
+		m_iteration_ms[i] += (boost::posix_time::microsec_clock::universal_time() - start).total_microseconds()/1000.0;
+	}
+
+	// Keep the centre
+	size_t plane = (size_t)m_tile*m_tile;
+	size_t pixels = (size_t)m_width*m_height;
+	for (int s=0; s<slices(); s++)
+	{
+		for (int y=margin; y<m_tile - margin && m_top + y < m_height; y++)
+		{
+			for (int x=margin; x<m_tile - margin && m_left + x < m_width; x++)
+				m_result[s*pixels + (size_t)(m_top + y)*m_width + m_left + x] = m_estimate[(s + m_psf_radius_z)*plane + (size_t)y*m_tile + x];
+		}
+	}
+
+	return;
+
+}
+
+
+
+
+/* 3D FFT of the tile in m_re and m_im, along rows, then columns, then depth
+ * With filter, the forward transform is multiplied by the transform of the PSF as its last pass writes it back; the inverse is scaled there. */
+void Deconvolution::transform(bool inverse, bool filter)
+{
+
+	m_inverse = inverse;
+	m_filter = filter;
+	run_bands(&Deconvolution::band_rows);
+	run_bands(&Deconvolution::band_columns);
+	run_bands(&Deconvolution::band_depth);
+
+	return;
+
+}
+
+
+
+
+/* Run one step on every band
+ * run_bands() only returns when all of them are done, so the next step can read across band boundaries */
+void Deconvolution::run_bands(void (Deconvolution::*step)(int))
+{
+
+	if (m_pool == NULL)
+	{
+		(this->*step)(0);
+		return;
+	}
+
+	m_pool->run(boost::bind(step, this, boost::placeholders::_1), m_bands);
+
+	return;
+
+}
+
+
+
+
+/* Share of a band of count lines or voxels, split as evenly as possible */
+void Deconvolution::band_range(int band, size_t count, size_t &first, size_t &last)
+{
+
+	first = count*band/m_bands;
+	last = count*(band + 1)/m_bands;
+
+	return;
+
+}
+
+
+
+
+/* Transform the rows of a band, each in place as they are contiguous */
+void Deconvolution::band_rows(int band)
+{
+
+	size_t first, last;
+	band_range(band, (size_t)m_tile*m_depth, first, last);
+	for (size_t l=first; l<last; l++)
+		fft_execute(m_plan_xy, &m_re[l*m_tile], &m_im[l*m_tile], m_inverse);
+
+	return;
+
+}
+
+
+
+
+/* Transform the columns of a band, each copied to a contiguous line and back so the butterflies work in cache */
+void Deconvolution::band_columns(int band)
+{
+
+	size_t first, last;
+	band_range(band, (size_t)m_tile*m_depth, first, last);
+	float * re = &m_band_re[band][0];
+	float * im = &m_band_im[band][0];
+	for (size_t l=first; l<last; l++)
+	{
+		size_t offset = (l/m_tile)*m_tile*m_tile + l%m_tile;
+		for (int k=0; k<m_tile; k++)
+		{
+			re[k] = m_re[offset + (size_t)k*m_tile];
+			im[k] = m_im[offset + (size_t)k*m_tile];
+		}
+		fft_execute(m_plan_xy, re, im, m_inverse);
+		for (int k=0; k<m_tile; k++)
+		{
+			m_re[offset + (size_t)k*m_tile] = re[k];
+			m_im[offset + (size_t)k*m_tile] = im[k];
+		}
+	}
+
+	return;
+
+}
+
+
+
+
+/* Transform along the depth of a band, in the same way as the columns, multiplying or scaling on the way back */
+void Deconvolution::band_depth(int band)
+{
+
+	size_t plane = (size_t)m_tile*m_tile;
+	size_t first, last;
+	band_range(band, plane, first, last);
+	float * re = &m_band_re[band][0];
+	float * im = &m_band_im[band][0];
+	float scale = m_inverse ? 1.0f/((float)plane*m_depth) : 1.0f;
+	for (size_t l=first; l<last; l++)
+	{
+		for (int k=0; k<m_depth; k++)
+		{
+			re[k] = m_re[l + k*plane];
+			im[k] = m_im[l + k*plane];
+		}
+		fft_execute(m_plan_z, re, im, m_inverse);
+		for (int k=0; k<m_depth; k++)
+		{
+			float factor = m_filter ? m_otf[l + k*plane] : scale;
+			m_re[l + k*plane] = re[k]*factor;
+			m_im[l + k*plane] = im[k]*factor;
+		}
+	}
+
+	return;
+
+}
+
+
+
+
+/* Load the data of a band of voxels, 0 outside the stack, and put the mask in the tile to be convolved
+ * The band sums hold the sum of the data and the band changes how many voxels it has, for its mean */
+void Deconvolution::band_load(int band)
+{
+
+	size_t plane = (size_t)m_tile*m_tile;
+	size_t pixels = (size_t)m_width*m_height;
+	size_t first, last;
+	band_range(band, plane*m_depth, first, last);
+	double sum = 0;
+	double count = 0;
+	for (size_t i=first; i<last; i++)
+	{
+		int z = (int)(i/plane);
+		int y = (int)((i%plane)/m_tile);
+		int x = (int)(i%m_tile);
+		float value = 0;
+		bool inside = m_inside_x[x] && m_inside_y[y] && m_inside_z[z];
+		if (inside)
+		{
+			value = m_stack[(z - m_psf_radius_z)*pixels + (size_t)(m_top + y)*m_width + m_left + x];
+			sum += value;
+			count++;
+		}
+		m_data[i] = value;
+		m_re[i] = inside ? 1.0f : 0.0f;
+		m_im[i] = 0;
+	}
+	m_band_sums[band] = sum;
+	m_band_changes[band] = count;
+
+	return;
+
+}
+
+
+
+
+/* Weights from the mask convolved by the PSF, 0 for voxels whose light hardly reaches the data */
+void Deconvolution::band_weight(int band)
+{
+
+	size_t first, last;
+	band_range(band, m_weight.size(), first, last);
+	for (size_t i=first; i<last; i++)
+		m_weight[i] = (m_re[i] > DECONVOLUTION_MIN_WEIGHT) ? 1/m_re[i] : 0;
+
+	return;
+
+}
+
+
+
+
+/* Flat first estimate at the mean held in every band sum, put in the tile to be convolved */
+void Deconvolution::band_start(int band)
+{
+
+	float mean = (float)m_band_sums[band];
+	size_t first, last;
+	band_range(band, m_estimate.size(), first, last);
+	for (size_t i=first; i<last; i++)
+	{
+		m_estimate[i] = (m_weight[i] > 0) ? mean : 0;
+		m_re[i] = m_estimate[i];
+		m_im[i] = 0;
+	}
+
+	return;
+
+}
+
+
+
+
+/* Ratio of the data to the blurred estimate, inside the mask */
+void Deconvolution::band_ratio(int band)
+{
+
+	size_t plane = (size_t)m_tile*m_tile;
+	size_t first, last;
+	band_range(band, plane*m_depth, first, last);
+	for (size_t i=first; i<last; i++)
+	{
+		int z = (int)(i/plane);
+		int y = (int)((i%plane)/m_tile);
+		int x = (int)(i%m_tile);
+		float blurred = (m_re[i] > DECONVOLUTION_EPSILON) ? m_re[i] : DECONVOLUTION_EPSILON;
+		m_re[i] = (m_inside_x[x] && m_inside_y[y] && m_inside_z[z]) ? m_data[i]/blurred : 0;
+		m_im[i] = 0;
+	}
+
+	return;
+
+}
+
+
+
+
+/* Multiply the estimate by the correlated ratio over the weight, and put it in the tile for the next iteration
+ * The band sums hold the sum of the estimate and of its change, over the whole tile */
+void Deconvolution::band_update(int band)
+{
+
+	size_t first, last;
+	band_range(band, m_estimate.size(), first, last);
+	double sum = 0;
+	double change = 0;
+	for (size_t i=first; i<last; i++)
+	{
+		float factor = (m_re[i] > 0) ? m_re[i]*m_weight[i] : 0;
+		float updated = m_estimate[i]*factor;
+		change += fabs(updated - m_estimate[i]);
+		sum += m_estimate[i];
+		m_estimate[i] = updated;
+		m_re[i] = updated;
+		m_im[i] = 0;
+	}
+	m_band_sums[band] = sum;
+	m_band_changes[band] = change;
+
+	return;
+
+}
+
+
+
+#endif
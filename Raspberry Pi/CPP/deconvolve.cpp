@@ -0,0 +1,113 @@
+// Deconvolution Program
+
+/* Deconvolves a stack file taken by the stack program through the Deconvolution class, and prints how long each iteration took
+ * and how much it changed the stack, so the number of iterations worth running can be chosen.
+ * Usage:
+ * 		./deconvolve.x [options] <stack> <output>
+ * Options:
+ * 		-o <objective>	objective the stack was taken with, 4x, 10x, 40x or 100x (default 4x)
+ * 		-z <step>		step between slices at the sample, in micrometres (default 1)
+ * 		-c <pixel>		size of a camera pixel, in micrometres (default 5.67, for 640 pixel wide pictures)
+ * 		-l <wavelength>	wavelength of the light, in nanometres (default 550)
+ * 		-i <iterations>	iterations of Richardson-Lucy (default 10)
+ * 		-r <radius>		radius of the PSF across, in pixels (default 12)
+ * 		-d <radius>		radius of the PSF in depth, in slices (default 8)
+ * 		-s <side>		side of the tiles, a power of two (default 128)
+ * 		-t <threads>	threads to run on (default one per core)
+ * 		-p <file>		save the PSF as a stack file too
+ * For more information, see description of deconvolution_class.h
+ */
+
+
+
+#include <cstdlib>
+
+#include "deconvolution_class.h"
+
+
+int main (int argc, char ** argv) {
+
+	Deconvolution deconvolving;
+	string objective = "4x";
+	float step_um = 1;
+	float pixel_um = 5.67f;
+	float wavelength_nm = 550;
+	int iterations = 10;
+	int radius = 12;
+	int radius_z = 8;
+	int side = 128;
+	int threads = 0;
+	string psf;
+	vector<string> files;
+
+	for (int i=1; i<argc; i++)
+	{
+		string option = argv[i];
+		bool has_value = (i+1 < argc);
+
+		if (option == "-o" && has_value)
+			objective = argv[++i];
+		else if (option == "-z" && has_value)
+			step_um = (float)atof(argv[++i]);
+		else if (option == "-c" && has_value)
+			pixel_um = (float)atof(argv[++i]);
+		else if (option == "-l" && has_value)
+			wavelength_nm = (float)atof(argv[++i]);
+		else if (option == "-i" && has_value)
+			iterations = atoi(argv[++i]);
+		else if (option == "-r" && has_value)
+			radius = atoi(argv[++i]);
+		else if (option == "-d" && has_value)
+			radius_z = atoi(argv[++i]);
+		else if (option == "-s" && has_value)
+			side = atoi(argv[++i]);
+		else if (option == "-t" && has_value)
+			threads = atoi(argv[++i]);
+		else if (option == "-p" && has_value)
+			psf = argv[++i];
+		else if (option[0] == '-')
+		{
+			cout << "\nUnknown option " << option << endl;
+			return 1;
+		}
+		else
+			files.push_back(option);
+	}
+
+	if (files.size() != 2)
+	{
+		cout << "\nUsage: " << argv[0] << " [-o objective] [-z step] [-c pixel] [-l wavelength] [-i iterations] [-r radius] [-d radius] [-s side]"
+				<< " [-t threads] [-p psf] <stack> <output>" << endl;
+		return 1;
+	}
+
+	deconvolving.set_objective(objective);
+	deconvolving.set_sampling(pixel_um, step_um);
+	deconvolving.set_wavelength(wavelength_nm);
+	deconvolving.set_extent(radius, radius_z);
+	deconvolving.set_tile(side);
+	if (threads > 0)
+		deconvolving.set_threads(threads);
+
+	if (!deconvolving.load(files[0]))
+		return 1;
+	cout << "\nStack of " << deconvolving.slices() << " slices of " << deconvolving.width() << "x" << deconvolving.height() << endl;
+
+	if (!deconvolving.run(iterations))
+		return 1;
+
+	cout << "\nIteration\tms\tchange" << endl;
+	for (int i=0; i<deconvolving.iterations(); i++)
+		cout << i + 1 << "\t\t" << deconvolving.iteration_ms(i) << "\t" << deconvolving.iteration_change(i) << endl;
+	cout << "Total " << deconvolving.total_ms() << " ms" << endl;
+	if (deconvolving.scale() < 1)
+		cout << "Scaled by " << deconvolving.scale() << " to fit in 8 bits" << endl;
+
+	if (!deconvolving.save(files[1]))
+		return 1;
+	if (!psf.empty() && !deconvolving.save_psf(psf))
+		return 1;
+
+	return 0;
+
+}
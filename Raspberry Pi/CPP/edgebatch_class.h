@@ -0,0 +1,430 @@
+// Edge Batch Class
+
+/* This file contains the class that runs edge detection unattended over many pictures, such as a whole directory of archived captures.
+ * Pictures are decoded ahead by a prefetch thread into a bounded queue, while a bounded pool of workers, each with its own headless
+ * Edgedetection object, takes them from the queue. Decoding the next pictures thus overlaps with detecting edges in the current ones,
+ * and memory is limited to the pictures in the queue plus the one each worker holds.
+ * These are:
+ *
+ * public:
+ * Edgebatch(const Edgeparameters&, int, int) -> Only class constructor.
+ * 		Takes the parameters for every picture, the number of workers (0 for one per core) and how many decoded pictures may wait in the queue.
+ * add(string) -> Adds pictures to the batch. The string may be a directory, in which case every picture in it is added in name order,
+ * 		a '.txt' file with one picture path per line, or a single picture.
+ * size() -> Number of pictures in the batch.
+ * run(string) -> Processes the whole batch, saving the edges of each picture as '<name>_edges.pgm' in the given directory, along with
+ * 		'timing.csv' giving the size, decode, detection and save times and the number of edge pixels of every picture.
+ * 		Returns the number of pictures that failed. If two pictures have the same name (from different directories), their results would
+ * 		overwrite each other, so nothing is processed and every picture counts as failed.
+ *
+ * private:
+ * prefetch() -> Loop of the prefetch thread, decoding pictures in order into the queue.
+ * worker() -> Loop of each worker thread, detecting and saving edges until the queue is empty and nothing is left to decode.
+ * is_picture(string) -> Whether a file name has a picture extension that CImg can load.
+ * output_name(string) -> Name of the result file for a picture.
+ */
+
+
+
+#ifndef EDGEBATCH_CLASS_H
+#define EDGEBATCH_CLASS_H
+
+#include <deque>
+#include <map>
+#include <cctype>
+#include <algorithm>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "edgedetection_class.h"
+
+
+
+// Settings applied to every picture of a batch
+// threshold_high and threshold_low mean what they do for the THRESHOLD_* mode chosen, see choose_thresholds() in image_kernels.h
+struct Edgeparameters
+{
+	int smoothing;
+	float smoothing_size;
+	int threshold_mode;
+	float threshold_high;
+	float threshold_low;
+	bool l1_magnitude;
+	int threads_per_picture;
+
+	Edgeparameters()
+	{	smoothing = SMOOTH_GAUSSIAN; smoothing_size = 1.4; threshold_mode = THRESHOLD_OTSU; threshold_high = 0; threshold_low = 0.5;
+		l1_magnitude = false; threads_per_picture = 1;	}
+};
+
+
+
+// What happened to each picture, written to 'timing.csv'
+struct Edgetiming
+{
+	bool done;
+	int width;
+	int height;
+	double decode_ms;
+	double detect_ms;
+	double save_ms;
+	int edges;
+
+	Edgetiming()
+	{	done = false; width = 0; height = 0; decode_ms = 0; detect_ms = 0; save_ms = 0; edges = 0;	}
+};
+
+
+
+// A decoded picture waiting for a worker
+struct Edgeframe
+{
+	int number;
+	bool decoded;
+	CImg<float> picture;
+};
+
+
+
+class Edgebatch
+{
+
+private:
+
+	Edgeparameters m_parameters;
+	int m_workers;
+	int m_prefetch;
+
+	vector<string> m_pictures;
+	vector<Edgetiming> m_timing;
+	string m_output;
+
+	// Queue between the prefetch thread and the workers
+	boost::mutex m_mutex;
+	boost::condition_variable m_not_full;
+	boost::condition_variable m_not_empty;
+	deque<Edgeframe *> m_queue;
+	bool m_decoding;
+
+	boost::mutex m_print;
+
+
+	void prefetch();
+
+	void worker();
+
+	bool is_picture(string);
+
+	string output_name(string);
+
+
+public:
+
+	Edgebatch(const Edgeparameters &parameters, int workers = 0, int prefetch = 4);
+
+	void add(string);
+
+	int size()
+	{	return (int)m_pictures.size();	}
+
+	int run(string output_directory);
+
+
+};
+
+
+
+
+/* Edgebatch class CONSTRUCTOR */
+Edgebatch::Edgebatch(const Edgeparameters &parameters, int workers, int prefetch)
+{
+
+	m_parameters = parameters;
+
+	if (workers < 1)
+		workers = boost::thread::hardware_concurrency();
+	m_workers = (workers < 1) ? 1 : workers;
+	m_prefetch = (prefetch < 1) ? 1 : prefetch;
+
+	m_decoding = false;
+
+}
+
+
+
+
+/* Add a directory, a list of pictures or a single picture to the batch */
+void Edgebatch::add(string location)
+{
+
+	struct stat info;
+	if (stat(location.c_str(), &info) != 0)
+	{
+		cout << "\nCould not find " << location << endl;
+		return;
+	}
+
+	if (S_ISDIR(info.st_mode))
+	{
+		DIR * directory = opendir(location.c_str());
+		if (directory == NULL)
+		{
+			cout << "\nCould not open directory " << location << endl;
+			return;
+		}
+
+		vector<string> found;
+		struct dirent * entry;
+		while ((entry = readdir(directory)) != NULL)
+		{
+			string name = entry->d_name;
+			if (name[0] != '.' && is_picture(name))
+				found.push_back(location + "/" + name);
+		}
+		closedir(directory);
+
+		sort(found.begin(), found.end());
+		m_pictures.insert(m_pictures.end(), found.begin(), found.end());
+	}
+	else if (location.size() > 4 && location.substr(location.size() - 4) == ".txt")
+	{
+		ifstream reading(location.c_str());
+		string line;
+		while (getline(reading, line))
+		{
+			if (!line.empty() && line[line.size() - 1] == '\r')
+				line.erase(line.size() - 1);
+			if (!line.empty())
+				m_pictures.push_back(line);
+		}
+	}
+	else
+		m_pictures.push_back(location);
+
+	return;
+
+}
+
+
+
+
+/* Process the whole batch
+ * The prefetch thread and the workers run until every picture has been through, then the timing of each is written out */
+int Edgebatch::run(string output_directory)
+{
+
+	m_output = output_directory;
+
+	// Results are named after the pictures without their directories, so two pictures of the same name would share one
+	map<string, string> named;
+	for (size_t i=0; i<m_pictures.size(); i++)
+	{
+		string name = output_name(m_pictures[i]);
+		if (named.count(name) > 0)
+		{
+			cout << "\n" << named[name] << " and " << m_pictures[i] << " would both be saved as " << name << ", nothing processed" << endl;
+			return (int)m_pictures.size();
+		}
+		named[name] = m_pictures[i];
+	}
+
+	mkdir(m_output.c_str(), 0755);
+
+	m_timing.assign(m_pictures.size(), Edgetiming());
+	m_queue.clear();
+	m_decoding = true;
+
+	boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+
+	boost::thread_group threads;
+	threads.create_thread(boost::bind(&Edgebatch::prefetch, this));
+	for (int i=0; i<m_workers; i++)
+		threads.create_thread(boost::bind(&Edgebatch::worker, this));
+	threads.join_all();
+
+	double total = (boost::posix_time::microsec_clock::universal_time() - start).total_microseconds()/1000.0;
+
+	// Timing of every picture, in the order they were added
+	int failed = 0;
+	ofstream timing((m_output + "/timing.csv").c_str());
+	timing << "picture,width,height,decode_ms,detect_ms,save_ms,edges" << endl;
+	for (size_t i=0; i<m_pictures.size(); i++)
+	{
+		Edgetiming &t = m_timing[i];
+		if (!t.done)
+			failed++;
+		timing << m_pictures[i] << "," << t.width << "," << t.height << "," << t.decode_ms << "," << t.detect_ms << "," << t.save_ms << ","
+			<< (t.done ? t.edges : -1) << endl;
+	}
+
+	cout << "\nProcessed " << m_pictures.size() - failed << " of " << m_pictures.size() << " pictures in " << total/1000.0 << " s";
+	cout << " with " << m_workers << " workers" << endl;
+
+	return failed;
+
+}
+
+
+
+
+/* Prefetch thread
+ * Decodes the pictures in order, waiting whenever the queue is full so that memory stays bounded
+ * A picture that can't be decoded is still queued, marked as such, so the worker taking it can report it */
+void Edgebatch::prefetch()
+{
+
+	for (size_t i=0; i<m_pictures.size(); i++)
+	{
+
+		Edgeframe * frame = new Edgeframe;
+		frame->number = (int)i;
+
+		boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+		try
+		{
+			frame->picture.assign(m_pictures[i].c_str());
+			frame->decoded = !frame->picture.is_empty();
+		}
+		catch (...)
+		{
+			frame->decoded = false;
+		}
+		m_timing[i].decode_ms = (boost::posix_time::microsec_clock::universal_time() - start).total_microseconds()/1000.0;
+
+		boost::mutex::scoped_lock lock(m_mutex);
+		while ((int)m_queue.size() >= m_prefetch)
+			m_not_full.wait(lock);
+		m_queue.push_back(frame);
+		m_not_empty.notify_one();
+
+	}
+
+	boost::mutex::scoped_lock lock(m_mutex);
+	m_decoding = false;
+	m_not_empty.notify_all();
+
+	return;
+
+}
+
+
+
+
+/* Worker thread
+ * Each worker keeps its own Edgedetection object, so its planes are reused from one picture to the next */
+void Edgebatch::worker()
+{
+
+	Edgedetection detecting;
+	detecting.set_smoothing(m_parameters.smoothing, m_parameters.smoothing_size);
+	if (m_parameters.threshold_mode == THRESHOLD_MEAN)
+		detecting.set_thresholds(m_parameters.threshold_high, m_parameters.threshold_low);
+	else if (m_parameters.threshold_mode == THRESHOLD_PERCENTILE)
+		detecting.set_percentile_thresholds(m_parameters.threshold_high, m_parameters.threshold_low);
+	else
+		detecting.set_otsu_thresholds(m_parameters.threshold_low);
+	detecting.set_magnitude(m_parameters.l1_magnitude);
+	detecting.set_threads(m_parameters.threads_per_picture);
+
+	while (true)
+	{
+
+		Edgeframe * frame;
+		{
+			boost::mutex::scoped_lock lock(m_mutex);
+			while (m_queue.empty() && m_decoding)
+				m_not_empty.wait(lock);
+			if (m_queue.empty())
+				return;
+			frame = m_queue.front();
+			m_queue.pop_front();
+			m_not_full.notify_one();
+		}
+
+		// Each picture has its own entry in m_timing, so no lock is needed to fill it
+		Edgetiming &timing = m_timing[frame->number];
+		string &name = m_pictures[frame->number];
+
+		if (!frame->decoded)
+		{
+			boost::mutex::scoped_lock lock(m_print);
+			cout << "\nCould not decode " << name << endl;
+			delete frame;
+			continue;
+		}
+
+		timing.width = frame->picture.width();
+		timing.height = frame->picture.height();
+
+		try
+		{
+			boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+			detecting.open(frame->picture);
+			timing.edges = detecting.detect();
+			boost::posix_time::ptime detected = boost::posix_time::microsec_clock::universal_time();
+			detecting.save_edges(output_name(name));
+			boost::posix_time::ptime saved = boost::posix_time::microsec_clock::universal_time();
+
+			timing.detect_ms = (detected - start).total_microseconds()/1000.0;
+			timing.save_ms = (saved - detected).total_microseconds()/1000.0;
+			timing.done = true;
+		}
+		catch (...)
+		{
+			boost::mutex::scoped_lock lock(m_print);
+			cout << "\nCould not process " << name << endl;
+		}
+
+		delete frame;
+
+		if (timing.done)
+		{
+			boost::mutex::scoped_lock lock(m_print);
+			cout << name << ": " << timing.edges << " edge pixels in " << timing.detect_ms << " ms" << endl;
+		}
+
+	}
+
+}
+
+
+
+
+/* Picture extensions CImg can load, natively or through ImageMagick */
+bool Edgebatch::is_picture(string name)
+{
+
+	size_t dot = name.rfind('.');
+	if (dot == string::npos)
+		return false;
+
+	string extension = name.substr(dot + 1);
+	for (size_t i=0; i<extension.size(); i++)
+		extension[i] = tolower(extension[i]);
+
+	return extension == "jpg" || extension == "jpeg" || extension == "png" || extension == "bmp" || extension == "pgm"
+		|| extension == "ppm" || extension == "pnm" || extension == "tif" || extension == "tiff";
+
+}
+
+
+
+
+/* Result file for a picture: its name without directory or extension, followed by '_edges.pgm'
+ * PGM is written by CImg itself, so saving needs no external converter and loses nothing */
+string Edgebatch::output_name(string picture)
+{
+
+	size_t slash = picture.rfind('/');
+	string name = (slash == string::npos) ? picture : picture.substr(slash + 1);
+	size_t dot = name.rfind('.');
+	if (dot != string::npos)
+		name = name.substr(0, dot);
+
+	return m_output + "/" + name + "_edges.pgm";
+
+}
+
+
+
+#endif
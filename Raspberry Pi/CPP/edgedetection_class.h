@@ -4,20 +4,53 @@
  * These are:
  * 
  * public:
- * Edgedetection(string) -> Only class constructor.
+ * Edgedetection(string) -> Interactive class constructor.
  * 		Uses string as location of the file to be opened.
  * 		Full path should be provided, and it's the main program's job to make sure that the full path is passed to the constructor.
+ * 		Asks through terminal whether to save the result and whether to input the threshold multipliers.
+ * Edgedetection() -> Headless class constructor.
+ * 		Asks nothing and opens no picture, so it can run unattended (see edgebatch_class.h). Pictures are given through open(...)
+ * 		and processed with detect(), which shows nothing and waits for nobody. It runs on a single thread unless set_threads(int) says otherwise.
  * ~Edgedetection() -> Class destructor.
- * 		Deallocates all memory allocated dinamically during the construction and execution of methods in the class.
+ * open(string) -> Loads another image to be processed by the same object.
+ * 		The working planes are only reallocated if the new image is larger than any seen before.
+ * open(const CImg<float>&) -> Same, from a picture already in memory.
+ * detect() -> Runs the whole algorithm without displaying or asking anything, and returns the number of edge pixels found.
+ * detect(const unsigned char*, int, int, int, unsigned char*, int) -> Same, on an 8-bit luma buffer already in memory (a camera frame,
+ * 		or the data() of a greyscale CImg<unsigned char>) with the given width, height and stride in bytes between rows.
+ * 		The edges are written into the caller's buffer, with its own stride, as 255 on edges and 0 elsewhere.
+ * 		The picture held by the object is neither used nor changed, and nothing touches the disk.
+ * detect(const unsigned char*, int, int, int, vector<Edgepoint>&) -> Same, but the edges are given as a list of points with their
+ * 		gradient magnitude, which is much smaller than a full buffer for sparse edges. The list is cleared first but keeps its memory.
+ * 		With both of these, the planes are only reallocated for a frame larger than any before, so the object can be reused frame after frame.
+ * save_edges(string) -> Saves the edges found as a black and white picture, 255 on edges and 0 elsewhere.
+ * set_otsu_thresholds(float) -> Chooses the high threshold of every picture by Otsu's method on its gradient magnitude histogram,
+ * 		with the low threshold the given fraction of it (default 0.5). This is the default, and needs no tuning between kinds of picture.
+ * set_percentile_thresholds(float, float) -> Chooses the high threshold so that the given fraction of pixels lie below it (default 0.95),
+ * 		with the low threshold the given fraction of it (default 0.4).
+ * set_thresholds(float, float) -> Chooses the high and low thresholds as multipliers of the mean gradient magnitude (3 and 1.2 if not given).
+ * 		These are also the multipliers the user is asked for if they chose to input their own.
  * canny_edge_detection() -> Executes the algorithm of edge detection on the image at the path used in the constructor.
  * 		It will display all changes made on the image by the subsequent methods.
+ * set_smoothing(int, float) -> Chooses the noise-damping filter: SMOOTH_GAUSSIAN with the given sigma (default, 1.4), SMOOTH_BOX with the given radius,
+ * 		or SMOOTH_MATRIX for the matrix in './matrix_size5.txt', or of the size chosen by set_matrix_size(int).
+ * set_matrix_size(int) -> Chooses the side of the SMOOTH_MATRIX matrix (odd, default 5), read from './matrix_size<side>.txt'.
+ * 		Sides of 3, 5 and 7 run through a convolution specialised at compile time (see convolve_matrix() in image_kernels.h).
+ * set_gradient_size(int) -> Chooses a 3x3 (default), 5x5 or 7x7 Sobel-like gradient. The larger ones see past more noise on fine grained
+ * 		pictures, at a little more cost, and give magnitudes on the same scale so thresholds need not change.
+ * set_magnitude(bool) -> Chooses the L1 norm |gx| + |gy| for the gradient magnitude instead of the default L2 norm.
+ * set_threads(int) -> Chooses how many threads the algorithm runs on (by default one per core).
+ * 		With more than one, the image is split into horizontal bands, one per thread, and each step runs on all bands at once (see run_bands()).
  * 
  * private:
- * greyfy() -> Turns an image into greyscale.
- * 		CAUTION! Because of the way this is implemented, this program will work only on images that are NOT previously in greyscale.
+ * greyfy() -> Turns an image into greyscale, in the single luma plane m_luma that all later steps work on.
  * load_matrix() -> Loads a noise-damping convolution matrix from file.
  * 		Read comments on methods to see all details on how this is done.
- * picture_convolution() -> Convolves the image with the previously loaded matrix to dampen the effect of artifacts on the end result.
+ * 		Only needed for SMOOTH_MATRIX; if the file can't be opened the gaussian is used instead.
+ * smooth() -> Dampens the effect of artifacts on the end result with the chosen filter.
+ * 		The gaussian and box filters are separable and run as vectorised row and column passes (see image_kernels.h).
+ * picture_convolution() -> Convolves the luma plane with the previously loaded matrix, band by band.
+ * show_plane(vector<float>&) -> Copies a plane into the picture and displays it.
  * simple_gradient() -> Computes the gradient associated with each pixel using a simple method.
  * 		The choice of this method or the next is totally arbitrary.
  * 		They are both provided just as different options.
@@ -25,12 +58,26 @@
  * 		This is a more complex method than the previous one, and it is supposed to be more precise.
  * 		Whether this is true or not can be tested by the user at his/her leisure.
  * 		By default, however, this is the gradient algorithm preferred.
- * edge_decision(float, float) -> This method takes a high and low threshold as a multiplier of the average modulus of the gradients of the picture.
+ * 		It runs vectorised through sobel_planes() in image_kernels.h, with the magnitude chosen by set_magnitude(),
+ * 		or for the larger sizes of set_gradient_size(int) as a row pass and a column pass through gradient_rows() and gradient_columns().
+ * edge_decision() -> This method sets a high and low threshold from the histogram of the modulus of the gradients of the picture, built while
+ * 		computing them, by the method chosen with the set_*thresholds(...) methods above, or from multipliers of their average given by the user.
  * 		It will then divide the pixels in three cathegories depending on the modulus of their gradient:
  * 		above high threshold -> true edge
  * 		between high and low threshold -> secondary edge
  * 		below low threshold -> not an edge
  * edge_selection() -> This method decides whether secondary edges are true edges or not depending on various criteria, mostly dependent on their proximity to a true edge.
+ * 		It links them with a worklist flood fill from the true edges, so it costs O(pixels) whatever the shape of the chains.
+ * run_bands(stage) -> Runs one step of the algorithm on every band, in parallel on the thread pool if there is one, and returns when all bands are done.
+ * 		Each step writes only the rows of its own band but may read the rows around it (the halo) from the previous step, which is complete by then.
+ * band_rows(int, int&, int&) -> First row and one past the last row of a band.
+ * band_*(int) -> The per-band parts of greyfy(), smooth(), sobel_gradient(), edge_decision() and edge_selection(),
+ * 		and band_load_luma(int), which copies an 8-bit luma buffer into m_luma.
+ * find_edges() -> The steps of the algorithm after greyscale, shared by all detect(...) methods. Returns the number of edge pixels.
+ * allocate_planes(int, int) -> Sizes the working planes for a picture of the given width and height.
+ * 		All per-pixel data lives in contiguous row-major planes (one value per pixel, index y*width + x):
+ * 		m_gx and m_gy for the gradient components, m_magnitude for its modulus, m_direction for its direction quantised to 0, 45, 90 or 135 degrees (DIR_* codes),
+ * 		and m_edge for the edge class of each pixel (EDGE_* codes).
  * crop_and_save() -> Removes the border of the image, necessarely turned black by the previous method (read descriptions) and saves the result image to file.
  */
 
@@ -50,14 +97,29 @@
 #include <boost/date_time/posix_time/posix_time.hpp>
 
 #include "CImg.h"
+#include "image_kernels.h"
+#include "threadpool_class.h"
 
 #define PI 3.14159265359
 
+// Noise damping filter using a loaded matrix, besides the separable ones in image_kernels.h
+#define SMOOTH_MATRIX 2
+
 using namespace cimg_library;
 using namespace std;
 using namespace boost::asio;
 
 
+
+// An edge pixel, as given by the edge list version of Edgedetection::detect(...)
+struct Edgepoint
+{
+	int x;
+	int y;
+	float magnitude;
+};
+
+
 class Edgedetection
 {
 	
@@ -66,16 +128,55 @@ private:
 	CImg<float> m_picture;
 	CImgDisplay m_show;
 	
-	float ** m_matrix;
-	float *** m_gradient;
-	int ** m_edge;
+	// Working planes, row-major and reused between images
+	int m_width;
+	int m_height;
+	vector<float> m_luma;
+	vector<float> m_temp;
+	vector<float> m_gx;
+	vector<float> m_gy;
+	vector<float> m_magnitude;
+	vector<unsigned char> m_direction;
+	vector<unsigned char> m_edge;
+	vector<int> m_worklist;
+	
+	vector<float> m_matrix;
 	int m_size_matrix;
 	
+	// Side of the gradient kernel, and the second plane its row pass writes (the first being m_temp)
+	int m_gradient_size;
+	vector<float> m_smoothed;
+	
+	int m_smoothing;
+	float m_smoothing_size;
+	vector<float> m_kernel;
+	
+	bool m_l1_magnitude;
+	
+	// Bands for the parallel steps, with the per-band working space
+	Threadpool * m_pool;
+	int m_bands;
+	vector< vector<int> > m_band_stacks;
+	vector< vector<unsigned int> > m_band_histograms;
+	vector<double> m_band_sums;
+	vector<unsigned int> m_histogram;
+	
+	// 8-bit luma buffer being loaded by band_load_luma()
+	const unsigned char * m_source;
+	int m_source_stride;
+	float m_high_thr;
+	float m_low_thr;
+	
+	// Way of choosing the thresholds (THRESHOLD_* code) and its two parameters, see choose_thresholds() in image_kernels.h
+	int m_threshold_mode;
+	float m_threshold_high;
+	float m_threshold_low;
+	
 	char m_input_multipliers;
 	char m_save;
 
 
-	void edge_decision(float high_thr_mult = 3, float low_thr_mult = 1.2);
+	void edge_decision();
 	
 	void edge_selection();
 	
@@ -83,23 +184,91 @@ private:
 	
 	void sobel_gradient();
 	
+	void smooth();
+	
 	void picture_convolution();
 	
-	float sum_matrix(float **, int, int);
+	void show_plane(const vector<float> &);
 	
 	void crop_and_save();
 	
 	void greyfy();
 	
-	void load_matrix();
+	bool load_matrix();
+	
+	void allocate_planes(int width, int height);
+	
+	int find_edges();
+	
+	void initialise();
+	
+	void run_bands(void (Edgedetection::*stage)(int));
+	
+	void band_rows(int band, int &first, int &last);
+	
+	void band_greyfy(int band);
+	
+	void band_load_luma(int band);
+	
+	void band_smooth_rows(int band);
+	
+	void band_smooth_columns(int band);
+	
+	void band_sobel(int band);
+	
+	void band_gradient_rows(int band);
+	
+	void band_gradient_columns(int band);
+	
+	void band_convolve(int band);
+	
+	void band_classify(int band);
+	
+	void band_link(int band);
+	
+	void band_clear(int band);
 	
 
 public:
 
 	Edgedetection(string);
 	
+	Edgedetection();
+	
 	~Edgedetection();
 	
+	void open(string);
+	
+	void open(const CImg<float> &);
+	
+	int detect();
+	
+	int detect(const unsigned char * luma, int width, int height, int stride, unsigned char * edges, int edges_stride);
+	
+	int detect(const unsigned char * luma, int width, int height, int stride, vector<Edgepoint> &points);
+	
+	void save_edges(string);
+	
+	void set_thresholds(float high_thr_mult = 3, float low_thr_mult = 1.2)
+	{	m_threshold_mode = THRESHOLD_MEAN; m_threshold_high = high_thr_mult; m_threshold_low = low_thr_mult; return;	}
+	
+	void set_percentile_thresholds(float high_fraction = 0.95, float low_ratio = 0.4)
+	{	m_threshold_mode = THRESHOLD_PERCENTILE; m_threshold_high = high_fraction; m_threshold_low = low_ratio; return;	}
+	
+	void set_otsu_thresholds(float low_ratio = 0.5)
+	{	m_threshold_mode = THRESHOLD_OTSU; m_threshold_high = 0; m_threshold_low = low_ratio; return;	}
+	
+	void set_smoothing(int type = SMOOTH_GAUSSIAN, float size = 1.4);
+	
+	void set_magnitude(bool l1 = false)
+	{	m_l1_magnitude = l1; return;	}
+	
+	void set_threads(int threads);
+	
+	void set_matrix_size(int size = 5);
+	
+	void set_gradient_size(int size = 3);
+	
 	CImg<float> canny_edge_detection();
 
 
@@ -110,15 +279,16 @@ public:
 
 /* Edgedetection class CONSTRUCTOR 
  * It contains all interface necessary for the correct execution of the algorithm
- * Note that the matrix size for noise damping is pre-established here, so the matrix loaded in canny_edge_detection() method must be of same size!
+ * Note that the matrix size for noise damping is pre-established here, so a matrix loaded for SMOOTH_MATRIX must be of same size!
  * We provide one such matrix in a file available in the 'Edge Detection' folder
- * Make sure the matrix is in the same folder as the executable file at runtime */
+ * It is only needed with SMOOTH_MATRIX, in which case make sure it is in the same folder as the executable file at runtime */
 Edgedetection::Edgedetection(string picture_location)
 {
 	
 	m_picture.assign(picture_location.c_str());
 	
-	m_size_matrix = 5;
+	initialise();
+	set_threads(boost::thread::hardware_concurrency());
 	
 	cout << "\nDo you wish to save the image after processing (y/n)? ";
 	cin >> m_save;
@@ -127,63 +297,352 @@ Edgedetection::Edgedetection(string picture_location)
 	cout << "\nNOTE: If 'n' is selected, default ones will be used... "; 
 	cin >> m_input_multipliers;
 	
-	// Create 3D matrix of gradient values
-	m_gradient = new float**[m_picture.width()];
-		for (int x=0; x<m_picture.width(); x++) 
-		{
-			m_gradient[x] = new float*[m_picture.height()];
-			for (int y=0; y<m_picture.height(); y++) 
-			{
-				m_gradient[x][y] = new float[4];
-			}
-		}
-	
-	// Create 2D matrix of edge values (for selection)	
-	m_edge = new int*[m_picture.width()];
-		for (int x=0; x<m_picture.width(); x++) 
-		{
-			m_edge[x] = new int[m_picture.height()];
-		}
-	
-	// Create 2D noise damping convolution matrix	
-	m_matrix = new float*[m_size_matrix];
-		for (int x=0; x<m_size_matrix; x++) 
-		{
-			m_matrix[x] = new float[m_size_matrix];
-		}
+	allocate_planes(m_picture.width(), m_picture.height());
 		
 }	
 
 
 
 
+/* Edgedetection class headless CONSTRUCTOR
+ * Nothing is asked and nothing is loaded; default multipliers are used and nothing is saved unless save_edges(...) is called
+ * Planes are sized by the first open(...) */
+Edgedetection::Edgedetection()
+{
+	
+	initialise();
+	set_threads(1);
+	
+	m_save = 'n';
+	m_input_multipliers = 'n';
+	
+}
+
+
+
+
+/* Settings shared by both constructors, and the 2D noise damping convolution matrix */
+void Edgedetection::initialise()
+{
+	
+	set_matrix_size();
+	set_gradient_size();
+	set_smoothing();
+	set_magnitude();
+	set_otsu_thresholds();
+	m_histogram.resize(MAGNITUDE_BINS);
+	m_pool = NULL;
+	m_source = NULL;
+	m_source_stride = 0;
+	
+	m_width = 0;
+	m_height = 0;
+	
+	return;
+	
+}
+
+
+
+
 
 /* Edgedetection class DESTRUCTOR 
- * Deallocates all matrices allocated dinamically */
+ * All planes are vectors, so they free themselves, and deleting the pool waits for its threads */
 Edgedetection::~Edgedetection()
 {
 	
-	for (unsigned int i=0; i<sizeof m_gradient; i++)
+	delete m_pool;
+	
+}
+
+
+
+
+/* Choose how many threads the algorithm runs on
+ * One thread (or fewer) runs everything on the calling thread as a single band, without a pool */
+void Edgedetection::set_threads(int threads)
+{
+	
+	delete m_pool;
+	m_pool = NULL;
+	
+	if (threads > 1)
+		m_pool = new Threadpool(threads);
+	
+	m_bands = (threads > 1) ? threads : 1;
+	m_band_stacks.resize(m_bands);
+	m_band_sums.resize(m_bands);
+	m_band_histograms.resize(m_bands, vector<unsigned int>(MAGNITUDE_BINS));
+	
+	return;
+	
+}
+
+
+
+
+/* Choose the side of the SMOOTH_MATRIX matrix
+ * It must be odd, so an even side is taken as the next odd one; the matrix is read again at the next smooth() */
+void Edgedetection::set_matrix_size(int size)
+{
+	
+	if (size < 1)
+		size = 1;
+	if (size % 2 == 0)
+		size++;
+	
+	m_size_matrix = size;
+	m_matrix.resize(m_size_matrix*m_size_matrix);
+	
+	return;
+	
+}
+
+
+
+
+/* Choose the side of the gradient kernel
+ * Only 3, 5 and 7 exist; anything else keeps the 3x3 Sobel */
+void Edgedetection::set_gradient_size(int size)
+{
+	
+	if (size != 5 && size != 7)
+	{
+		if (size != 3)
+			cout << "\nNo " << size << "x" << size << " gradient, using 3x3" << endl;
+		size = 3;
+	}
+	
+	m_gradient_size = size;
+	
+	return;
+	
+}
+
+
+
+
+/* Run one step of the algorithm on every band
+ * The bands are independent within a step, and run_bands() only returns when all of them are done,
+ * so the next step can read across band boundaries */
+void Edgedetection::run_bands(void (Edgedetection::*stage)(int))
+{
+	
+	if (m_pool == NULL)
+	{
+		(this->*stage)(0);
+		return;
+	}
+	
+	m_pool->run(boost::bind(stage, this, boost::placeholders::_1), m_bands);
+	
+	return;
+	
+}
+
+
+
+
+/* Rows of a band, split as evenly as possible over the height of the picture */
+void Edgedetection::band_rows(int band, int &first, int &last)
+{
+	
+	first = m_height*band/m_bands;
+	last = m_height*(band + 1)/m_bands;
+	
+	return;
+	
+}
+
+
+
+
+/* Load another picture, reusing the planes of the previous one */
+void Edgedetection::open(string picture_location)
+{
+	
+	m_picture.assign(picture_location.c_str());
+	allocate_planes(m_picture.width(), m_picture.height());
+	
+	return;
+	
+}
+
+
+
+
+/* Take another picture already in memory, reusing the planes of the previous one */
+void Edgedetection::open(const CImg<float> &picture)
+{
+	
+	m_picture.assign(picture);
+	allocate_planes(m_picture.width(), m_picture.height());
+	
+	return;
+	
+}
+
+
+
+
+/* Edge detection without display or questions
+ * Same steps as canny_edge_detection(), but the picture itself is left as it was given, apart from greyscale pictures being given three channels */
+int Edgedetection::detect()
+{
+	
+	greyfy();
+	
+	return find_edges();
+	
+}
+
+
+
+
+/* Edge detection on an 8-bit luma buffer, with the edges written into the caller's buffer
+ * Neither buffer needs to outlive the call */
+int Edgedetection::detect(const unsigned char * luma, int width, int height, int stride, unsigned char * edges, int edges_stride)
+{
+	
+	allocate_planes(width, height);
+	m_source = luma;
+	m_source_stride = stride;
+	run_bands(&Edgedetection::band_load_luma);
+	
+	int found = find_edges();
+	
+	for (int j=0; j<m_height; j++) 
 	{
-		for (unsigned int j=0; j<sizeof m_gradient[0]; j++)
+		const unsigned char * row = &m_edge[0] + (size_t)j*m_width;
+		unsigned char * result = edges + (size_t)j*edges_stride;
+		for (int i=0; i<m_width; i++) 
+			result[i] = (row[i] == EDGE_MAJOR) ? 255 : 0;
+	}
+	
+	return found;
+	
+}
+
+
+
+
+/* Edge detection on an 8-bit luma buffer, with the edges given as a list of points in raster order */
+int Edgedetection::detect(const unsigned char * luma, int width, int height, int stride, vector<Edgepoint> &points)
+{
+	
+	allocate_planes(width, height);
+	m_source = luma;
+	m_source_stride = stride;
+	run_bands(&Edgedetection::band_load_luma);
+	
+	find_edges();
+	
+	points.clear();
+	for (int j=0; j<m_height; j++) {
+		for (int i=0; i<m_width; i++) 
 		{
-			delete[] m_gradient[i][j];
+			int index = j*m_width + i;
+			if (m_edge[index] == EDGE_MAJOR)
+			{
+				Edgepoint point;
+				point.x = i;
+				point.y = j;
+				point.magnitude = m_magnitude[index];
+				points.push_back(point);
+			}
 		}
-		delete[] m_gradient[i];
 	}
-	delete[] m_gradient;
 	
-	for (unsigned int i=0; i<sizeof m_edge; i++)
+	return (int)points.size();
+	
+}
+
+
+
+
+/* Steps of the algorithm after greyscale, on whatever is in m_luma */
+int Edgedetection::find_edges()
+{
+	
+	smooth();
+	sobel_gradient();
+	edge_decision();
+	edge_selection();
+	
+	int edges = 0;
+	for (size_t index=0; index<(size_t)m_width*m_height; index++)
 	{
-		delete[] m_edge[i];
+		if (m_edge[index] == EDGE_MAJOR)
+			edges++;
 	}
-	delete[] m_edge;
 	
-	for (unsigned int i=0; i<sizeof m_matrix; i++)
-	{
-		delete[] m_matrix[i];
+	return edges;
+	
+}
+
+
+
+
+/* Save the edges as a single channel picture, in whatever format the extension of the file name says */
+void Edgedetection::save_edges(string location)
+{
+	
+	CImg<unsigned char> edges(m_width, m_height, 1, 1);
+	
+	for (int j=0; j<m_height; j++) {
+		for (int i=0; i<m_width; i++) 
+		{
+			edges(i,j,0,0) = (m_edge[j*m_width + i] == EDGE_MAJOR) ? 255 : 0;
+		}
 	}
-	delete[] m_matrix;
+	
+	edges.save(location.c_str());
+	
+	return;
+	
+}
+
+
+
+
+/* Size the planes for the current picture
+ * vectors never give back capacity on resize, so once the largest image has been seen no more allocation happens */
+void Edgedetection::allocate_planes(int width, int height)
+{
+	
+	m_width = width;
+	m_height = height;
+	size_t pixels = (size_t)m_width*(size_t)m_height;
+	
+	m_luma.resize(pixels);
+	m_temp.resize(pixels);
+	m_gx.resize(pixels);
+	m_gy.resize(pixels);
+	m_magnitude.resize(pixels);
+	m_direction.resize(pixels);
+	m_edge.resize(pixels);
+	
+	return;
+	
+}
+
+
+
+
+/* Choose the noise damping filter
+ * For SMOOTH_GAUSSIAN size is the sigma of the gaussian, for SMOOTH_BOX it is the radius of the box, and it is ignored for SMOOTH_MATRIX */
+void Edgedetection::set_smoothing(int type, float size)
+{
+	
+	m_smoothing = type;
+	m_smoothing_size = size;
+	
+	if (type == SMOOTH_BOX)
+		box_kernel((int)size, m_kernel);
+	else
+		gaussian_kernel(size, m_kernel);
+	
+	return;
 	
 }
 
@@ -198,32 +657,20 @@ CImg<float> Edgedetection::canny_edge_detection()
 	m_show.display(m_picture);
 	
 
-	// Load convolution matrix for noise damping
-	// This matrix will be convolved with the image to smooth away artifacts and 'ruined' pixels
-	load_matrix();
-	cout << "\nFinished loading convolution matrix for noise filtering" << endl;
-	
-	
-	
 	// Reduce image to greyscale (intensity scale)
 	// This is necessary for the following analysis, since we are interested in the intensity of the pixels and not their colour
-	//if ((m_picture(0,0,0,0) != m_picture(0,0,0,1)) || (m_picture(0,0,0,0) != m_picture(0,0,0,2))) 
-	//{
-		greyfy();
-		cout << "\nFinished turning image to greyscale" << endl;
-	//}
-	//else
-	//	cout << "\nImage is already in greyscale" << endl;
+	greyfy();
+	cout << "\nFinished turning image to greyscale" << endl;
 	
 	// Display the image after turning to grayscale
-	m_show.display(m_picture);
+	show_plane(m_luma);
 	
 	
 	
-	// Apply convolution with preset matrix
-	picture_convolution();
+	// Smooth away artifacts and 'ruined' pixels
+	smooth();
 	
-	m_show.display(m_picture);
+	show_plane(m_luma);
 		
 	cout << "\nFinished noise filtering" << endl;
 	
@@ -246,28 +693,19 @@ CImg<float> Edgedetection::canny_edge_detection()
 	edge_decision();
 	
 	// Assign different grey tonalities to major edges, minor edges and non-edges respectively
-	for (int i=0; i<m_picture.width(); i++) {
-		for (int j=0; j<m_picture.height(); j++) 
+	for (int j=0; j<m_height; j++) {
+		for (int i=0; i<m_width; i++) 
 		{
 			
-			if (m_edge[i][j] == 2) 
-			{
-				m_picture(i,j,0,0) = 255;
-				m_picture(i,j,0,1) = 255;
-				m_picture(i,j,0,2) = 255;
-			}
-			else if (m_edge[i][j] == 1) 
-			{
-				m_picture(i,j,0,0) = 130;
-				m_picture(i,j,0,1) = 130;
-				m_picture(i,j,0,2) = 130;
-			}	
-			else 
-			{
-				m_picture(i,j,0,0) = 0;
-				m_picture(i,j,0,1) = 0;
-				m_picture(i,j,0,2) = 0;
-			}
+			float tone = 0;
+			if (m_edge[j*m_width + i] == EDGE_MAJOR) 
+				tone = 255;
+			else if (m_edge[j*m_width + i] == EDGE_MINOR) 
+				tone = 130;
+			
+			m_picture(i,j,0,0) = tone;
+			m_picture(i,j,0,1) = tone;
+			m_picture(i,j,0,2) = tone;
 			
 		}
 	}
@@ -287,22 +725,14 @@ CImg<float> Edgedetection::canny_edge_detection()
 	edge_selection();
 	
 	// Assign 'white' to real edges, and black to non-edges
-	for (int i=0; i<m_picture.width(); i++) {
-		for (int j=0; j<m_picture.height(); j++) 
+	for (int j=0; j<m_height; j++) {
+		for (int i=0; i<m_width; i++) 
 		{
 			
-			if (m_edge[i][j] == 2) 
-			{
-				m_picture(i,j,0,0) = 255;
-				m_picture(i,j,0,1) = 255;
-				m_picture(i,j,0,2) = 255;
-			}
-			else 
-			{
-				m_picture(i,j,0,0) = 0;
-				m_picture(i,j,0,1) = 0;
-				m_picture(i,j,0,2) = 0;
-			}
+			float tone = (m_edge[j*m_width + i] == EDGE_MAJOR) ? 255 : 0;
+			m_picture(i,j,0,0) = tone;
+			m_picture(i,j,0,1) = tone;
+			m_picture(i,j,0,2) = tone;
 			
 		}
 	}
@@ -330,28 +760,36 @@ CImg<float> Edgedetection::canny_edge_detection()
 
 
 /* Decide whether each pixel is on an edge or not depending on gradient
- * Two thresholds are established either by the user or by default (see CONSTRUCTOR)
+ * Two thresholds are established either by the user, as multipliers of the average gradient, or from the gradient histogram (see set_*thresholds)
  * All pixels with gradient magnitude greater than the high threshold are selected as major edges
  * All pixels with gradient magnitude between the high and the low threshold are selected as minor edges
  * All other pixels are non-edges
  * Note that pixels around the borders of the picture need to be selected as non-edges because they don't have neighbours to calculate the gradient from
  * The gradient values are pre-established externally from this method, by the invocation of one of the *_gradient methods */
-void Edgedetection::edge_decision(float high_thr_mult, float low_thr_mult) 
+void Edgedetection::edge_decision() 
 {
 	
-	float intermediate = 0;
-	for (int i=3; i<m_picture.width()-3; i++) {
-		for (int j=3; j<m_picture.height()-3; j++) 
-		{
-			intermediate += m_gradient[i][j][2];
-		}
+	// Each band built its own histogram while computing the gradient, and they are added up here
+	double intermediate = 0;
+	for (int bin=0; bin<MAGNITUDE_BINS; bin++)
+		m_histogram[bin] = 0;
+	for (int band=0; band<m_bands; band++)
+	{
+		intermediate += m_band_sums[band];
+		for (int bin=0; bin<MAGNITUDE_BINS; bin++)
+			m_histogram[bin] += m_band_histograms[band][bin];
 	}
-	float average = (float)intermediate/(float)(m_picture.width()*m_picture.height());
-	//cout << intermediate << endl;
 	
-	// Establish thresholds of edge detection from average of gradients
+	// Pixels with a gradient, which leave a border that depends on the size of the gradient kernel
+	double counted = 0;
+	for (int bin=0; bin<MAGNITUDE_BINS; bin++)
+		counted += m_histogram[bin];
+	
+	// Establish thresholds of edge detection from the histogram, or from the average of gradients if the user wants to give multipliers
 	if (m_input_multipliers == 'y')
 	{
+		float high_thr_mult, low_thr_mult;
+		float average = (counted > 0) ? (float)(intermediate/counted) : 0;
 		m_show.close();
 		cout << "\n\tAverage of gradient: " << average;
 		cout << "\n\tThe following will be multiplied by the average of the gradient.";
@@ -360,60 +798,30 @@ void Edgedetection::edge_decision(float high_thr_mult, float low_thr_mult)
 		cout << "\tInsert low threshold multiplier : ";
 		cin >> low_thr_mult;
 		m_show.show();
+		choose_thresholds(&m_histogram[0], intermediate, THRESHOLD_MEAN, high_thr_mult, low_thr_mult, m_high_thr, m_low_thr);
 	}
-	float high_thr = average * high_thr_mult;
-	float low_thr = average * low_thr_mult;
+	else
+		choose_thresholds(&m_histogram[0], intermediate, m_threshold_mode, m_threshold_high, m_threshold_low, m_high_thr, m_low_thr);
 	
 	// Establish primary and secondary edges
-	for (int i=0; i<m_picture.width(); i++) {
-		for (int j=0; j<m_picture.height(); j++) 
-		{
-			
-			if (i==0 || i==1 || i==2 || i==m_picture.width()-2 || i==m_picture.width()-1 || i==m_picture.width())//|| i==3 || i==m_picture.width()-3 || i==m_picture.width()-2 || i==m_picture.width()-1 || i==m_picture.width()) 
-				m_edge[i][j] = 0;
-			else if (j==0 || j==1 || j==2 || j==m_picture.height()-2 || j==m_picture.height()-1 || j==m_picture.height())//|| j==3 || j==m_picture.height()-3 || j==m_picture.height()-2 || j==m_picture.height()-1 || j==m_picture.height()) 
-				m_edge[i][j] = 0;
-			else if (m_gradient[i][j][3] == 0 && m_gradient[i-1][j][2] < m_gradient[i][j][2] && m_gradient[i+1][j][2] < m_gradient[i][j][2]) 
-			{
-				if (m_gradient[i][j][2] > high_thr) 			
-					m_edge[i][j] = 2;
-				else if (m_gradient[i][j][2] > low_thr)
-					m_edge[i][j] = 1;
-				else
-					m_edge[i][j] = 0;
-			}
-			else if (m_gradient[i][j][3] == 45 && m_gradient[i+1][j+1][2] < m_gradient[i][j][2] && m_gradient[i-1][j-1][2] < m_gradient[i][j][2]) 
-			{
-				if (m_gradient[i][j][2] > high_thr) 			
-					m_edge[i][j] = 2;
-				else if (m_gradient[i][j][2] > low_thr)
-					m_edge[i][j] = 1;
-				else
-					m_edge[i][j] = 0;
-			}
-			else if (m_gradient[i][j][3] == 90 && m_gradient[i][j-1][2] < m_gradient[i][j][2] && m_gradient[i][j+1][2] < m_gradient[i][j][2]) 
-			{
-				if (m_gradient[i][j][2] > high_thr) 			
-					m_edge[i][j] = 2;
-				else if (m_gradient[i][j][2] > low_thr)
-					m_edge[i][j] = 1;
-				else
-					m_edge[i][j] = 0;
-			}
-			else if (m_gradient[i][j][3] == 135 && m_gradient[i-1][j+1][2] < m_gradient[i][j][2] && m_gradient[i+1][j-1][2] < m_gradient[i][j][2]) 
-			{
-				if (m_gradient[i][j][2] > high_thr) 			
-					m_edge[i][j] = 2;
-				else if (m_gradient[i][j][2] > low_thr)
-					m_edge[i][j] = 1;
-				else
-					m_edge[i][j] = 0;
-			}
-			else 
-				m_edge[i][j] = 0;			
-			
-		}
-	}
+	run_bands(&Edgedetection::band_classify);
+	
+	return;
+	
+}
+
+
+
+
+/* Non-maximum suppression and thresholding of the rows of one band (see suppress_edges() in image_kernels.h)
+ * Comparing with the neighbours along the gradient reads one row into each neighbouring band */
+void Edgedetection::band_classify(int band)
+{
+	
+	int first, last;
+	band_rows(band, first, last);
+	
+	suppress_edges(&m_magnitude[0], &m_direction[0], &m_edge[0], m_width, first, last, EDGE_BORDER, m_height-EDGE_BORDER+1, m_high_thr, m_low_thr);
 	
 	return;
 	
@@ -423,58 +831,66 @@ void Edgedetection::edge_decision(float high_thr_mult, float low_thr_mult)
 
 
 /* Establish whether minor edges should be part of major or not
- * The picture is swept first left to right to check whether minor edges are continuation or close neighbours of major edges
- * Then the picture is swept right to left to make sure that nothing is left unchecked (edges can go in both directions!)
- * This is necessary because if a minor edge connects to a major edge at its rightmost point, it will be ignored in the first sweep but not in the second */
+ * A minor edge becomes major if it lies within two pixels of a major edge, or of a minor edge that has itself become major
+ * This is done as a flood fill outwards from the major edges (see hysteresis() in image_kernels.h), so a chain of minor edges is followed
+ * however it winds, and each pixel is visited a bounded number of times
+ * Minor edges that are not reached are then cleared
+ * With several bands each one is filled on its own in parallel, and then chains crossing the seams are followed from either side */
 void Edgedetection::edge_selection() 
 {
 	
-	// Swipe through secondary edges first time to assign them to primary or not
-	for (int i=2; i<m_picture.width()-2; i++) {
-		for (int j=2; j<m_picture.height()-2; j++) 
-		{
-			
-			if (m_edge[i][j] == 1) 
-			{
-				for (int x=-2; x<3; x++) {
-					for (int y=-2; y<3; y++) 
-					{
-						if (m_edge[i-x][j-y] == 2) 
-							m_edge[i][j] = 2;
-					}
-				}
-			}
-			
-		}
+	// Link within each band first, without looking past its rows
+	run_bands(&Edgedetection::band_link);
+	
+	// Chains that cross a seam between bands have a major edge within LINK_RADIUS rows of the seam on one side
+	// Filling again from those, now over the whole picture, carries them into the next band and as far along it as they go
+	m_worklist.clear();
+	for (int band=1; band<m_bands; band++)
+	{
+		int first, last;
+		band_rows(band, first, last);
+		int above = (first - LINK_RADIUS < 0) ? 0 : first - LINK_RADIUS;
+		int below = (first + LINK_RADIUS > m_height) ? m_height : first + LINK_RADIUS;
+		seed_edges(&m_edge[0], m_width, above, below, m_worklist);
 	}
+	link_edges(&m_edge[0], m_width, 0, m_height, m_worklist);
+	
+	run_bands(&Edgedetection::band_clear);
+	
+	return;
+	
+}
 
-	// Swipe through secondary edges in reverse order to check for possible updates from previous swipe
-	for (int i=m_picture.width()-2; i>2; i--) {
-		for (int j=m_picture.height()-2; j>2; j--) 
-		{
-			
-			if (m_edge[i][j] == 1) 
-			{
-				for (int x=-2; x<3; x++) {
-					for (int y=-2; y<3; y++) 
-					{
-						if (m_edge[i-x][j-y] == 2) 
-							m_edge[i][j] = 2;
-					}
-				}
-			}
-			
-		}
-	}
+
+
+
+/* Flood fill from the major edges of one band, staying inside its rows */
+void Edgedetection::band_link(int band)
+{
 	
-	// Cleanup
-	for (int i=0; i<m_picture.width(); i++) {
-		for (int j=0; j<m_picture.height(); j++) 
-		{			
-			if (m_edge[i][j] == 1) 
-				m_edge[i][j] = 0;
-		}
-	}
+	int first, last;
+	band_rows(band, first, last);
+	
+	vector<int> &stack = m_band_stacks[band];
+	stack.clear();
+	seed_edges(&m_edge[0], m_width, first, last, stack);
+	link_edges(&m_edge[0], m_width, first, last, stack);
+	
+	return;
+	
+}
+
+
+
+
+/* Clear the minor edges of one band that were not reached */
+void Edgedetection::band_clear(int band)
+{
+	
+	int first, last;
+	band_rows(band, first, last);
+	
+	clear_minor_edges(&m_edge[0], m_width, first, last);
 	
 	return;
 	
@@ -489,40 +905,43 @@ void Edgedetection::edge_selection()
 void Edgedetection::simple_gradient() 
 {
 
-	float temporary;
+	// This runs as a single band, so all of the histogram goes to the first one
+	for (int band=0; band<m_bands; band++)
+	{
+		for (int bin=0; bin<MAGNITUDE_BINS; bin++)
+			m_band_histograms[band][bin] = 0;
+		m_band_sums[band] = 0;
+	}
 
-	for (int i=0; i<m_picture.width(); i++) {
-		for (int j=0; j<m_picture.height(); j++) 
+	for (int j=0; j<m_height; j++) {
+		for (int i=0; i<m_width; i++) 
 		{
 			
-			if (i==0 || i==(m_picture.width()-1)) 
-			{
-				m_gradient[i][j][0] = 0;
-				m_gradient[i][j][1] = 0;
-			}
-			else if (j==0 || j==(m_picture.height()-1)) 
+			int index = j*m_width + i;
+			
+			if (i==0 || i==(m_width-1) || j==0 || j==(m_height-1)) 
 			{
-				m_gradient[i][j][0] = 0;
-				m_gradient[i][j][1] = 0;
+				m_gx[index] = 0;
+				m_gy[index] = 0;
 			}
 			else { 	
-				m_gradient[i][j][0] = - 0.5*m_picture(i-1,j,0,0) + 0.5*m_picture(i+1,j,0,0);
-				m_gradient[i][j][1] = - 0.5*m_picture(i,j-1,0,0) + 0.5*m_picture(i,j+1,0,0);
-				m_gradient[i][j][2] = sqrt( pow(m_gradient[i][j][0],2) + pow(m_gradient[i][j][1],2) );
-				
-				temporary = abs(atan2(m_gradient[i][j][1],m_gradient[i][j][0]));
-				if (temporary < PI/8.0 || temporary >= 7.0*PI/8.0) 			m_gradient[i][j][3] = 0;
-				else if (PI/8.0 <= temporary && temporary < 3.0*PI/8.0) 		m_gradient[i][j][3] = 45;
-				else if (3.0*PI/8.0 <= temporary && temporary < 5.0*PI/8.0) 	m_gradient[i][j][3] = 90;
-				else if (5.0*PI/8.0 <= temporary && temporary < 7.0*PI/8.0) 	m_gradient[i][j][3] = 135;
-				else m_gradient[i][j][3] = 0;
+				m_gx[index] = - 0.5*m_luma[index-1] + 0.5*m_luma[index+1];
+				m_gy[index] = 0.5*m_luma[index-m_width] - 0.5*m_luma[index+m_width];
 			}
 			
-			//cout << m_gradient[i][j][0] << " " << m_gradient[i][j][1] << " " << m_gradient[i][j][2];
+			if (m_l1_magnitude)
+				m_magnitude[index] = fabs(m_gx[index]) + fabs(m_gy[index]);
+			else
+				m_magnitude[index] = sqrt( m_gx[index]*m_gx[index] + m_gy[index]*m_gy[index] );
+			m_direction[index] = quantise_direction(m_gx[index], m_gy[index]);
+			
+			if (i>0 && i<m_width-1 && j>0 && j<m_height-1)
+			{
+				histogram_add(&m_band_histograms[0][0], m_magnitude[index]);
+				m_band_sums[0] += m_magnitude[index];
+			}
 			
 		}
-		
-		//cout << endl;
 	}
 	
 	return;
@@ -537,41 +956,144 @@ void Edgedetection::simple_gradient()
  * Note that gradients also have a direction, which at the end of this method is simplified into four possible angles since pixels can only change horizontally, vertically or diagonally */
 void Edgedetection::sobel_gradient() 
 {
+	
+	if (m_gradient_size == 3)
+	{
+		run_bands(&Edgedetection::band_sobel);
+		return;
+	}
+	
+	// The larger kernels are separable: rows into m_temp and m_smoothed, then columns once every band has its rows done
+	if (m_smoothed.size() < m_temp.size())
+		m_smoothed.resize(m_temp.size());
+	
+	run_bands(&Edgedetection::band_gradient_rows);
+	run_bands(&Edgedetection::band_gradient_columns);
+	
+	return;
+	
+}
+
 
-	float temporary;
+
+
+/* Sobel gradient of the rows of one band, reading one row into each neighbouring band
+ * The magnitudes go into the histogram of the band on the same pass */
+void Edgedetection::band_sobel(int band)
+{
 	
-	for (int i=0; i<m_picture.width(); i++) {
-		for (int j=0; j<m_picture.height(); j++) 
-		{
-			if (i==0 || i==(m_picture.width()-1)) 
-			{
-				m_gradient[i][j][0] = 0;
-				m_gradient[i][j][1] = 0;
-			}
-			else if (j==0 || j==(m_picture.height()-1)) 
-			{
-				m_gradient[i][j][0] = 0;
-				m_gradient[i][j][1] = 0;
-			}
-			else 
-			{ 	
-				m_gradient[i][j][0] = -m_picture(i-1,j-1,0,0) -2*m_picture(i-1,j,0,0) -m_picture(i-1,j+1,0,0) +m_picture(i+1,j-1,0,0) +2*m_picture(i+1,j,0,0) +m_picture(i+1,j+1,0,0);
-				m_gradient[i][j][1] = +m_picture(i-1,j-1,0,0) +2*m_picture(i,j-1,0,0) +m_picture(i+1,j-1,0,0) -m_picture(i-1,j+1,0,0) -2*m_picture(i,j+1,0,0) -m_picture(i+1,j+1,0,0);
-				m_gradient[i][j][2] = sqrt( pow(m_gradient[i][j][0],2) + pow(m_gradient[i][j][1],2) );
-				//cout << m_gradient[i][j][0] << m_gradient[i][j][1] << m_gradient[i][j][2] << " ";
-			}
+	int first, last;
+	band_rows(band, first, last);
+	
+	vector<unsigned int> &histogram = m_band_histograms[band];
+	for (int bin=0; bin<MAGNITUDE_BINS; bin++)
+		histogram[bin] = 0;
+	m_band_sums[band] = 0;
+	
+	sobel_planes(&m_luma[0], &m_gx[0], &m_gy[0], &m_magnitude[0], &m_direction[0], m_width, m_height, m_l1_magnitude, first, last,
+			&histogram[0], &m_band_sums[band]);
+	
+	return;
+	
+}
+
+
+
+
+/* Row pass of the larger gradient kernels on one band, from m_luma into m_temp (derivative along x) and m_smoothed (smoothed along x) */
+void Edgedetection::band_gradient_rows(int band)
+{
+	
+	int first, last;
+	band_rows(band, first, last);
+	
+	gradient_rows(m_gradient_size, &m_luma[0], &m_temp[0], &m_smoothed[0], m_width, first, last);
+	
+	return;
+	
+}
+
+
+
+
+/* Column pass of the larger gradient kernels on one band, reading up to 3 rows into the neighbouring bands
+ * The magnitudes go into the histogram of the band as in band_sobel() */
+void Edgedetection::band_gradient_columns(int band)
+{
+	
+	int first, last;
+	band_rows(band, first, last);
+	
+	vector<unsigned int> &histogram = m_band_histograms[band];
+	for (int bin=0; bin<MAGNITUDE_BINS; bin++)
+		histogram[bin] = 0;
+	m_band_sums[band] = 0;
+	
+	gradient_columns(m_gradient_size, &m_temp[0], &m_smoothed[0], &m_gx[0], &m_gy[0], &m_magnitude[0], &m_direction[0],
+			m_width, m_height, m_l1_magnitude, first, last, &histogram[0], &m_band_sums[band]);
+	
+	return;
+	
+}
+
 
-			temporary = abs(atan2(m_gradient[i][j][1],m_gradient[i][j][0]));
-			if (temporary < PI/8.0 || temporary >= 7.0*PI/8.0) 			m_gradient[i][j][3] = 0;
-			else if (PI/8.0 <= temporary && temporary < 3.0*PI/8.0) 		m_gradient[i][j][3] = 45;
-			else if (3.0*PI/8.0 <= temporary && temporary < 5.0*PI/8.0) 	m_gradient[i][j][3] = 90;
-			else if (5.0*PI/8.0 <= temporary && temporary < 7.0*PI/8.0) 	m_gradient[i][j][3] = 135;
-			else m_gradient[i][j][3] = 0;
-					
+
+
+/* Dampen noise with the chosen filter
+ * The gaussian and box filters are separable, so they are done as a row pass and a column pass over the luma plane.
+ * The loaded matrix is only used when asked for, falling back to the gaussian if it can't be loaded. */
+void Edgedetection::smooth()
+{
+	
+	if (m_smoothing == SMOOTH_MATRIX)
+	{
+		if (load_matrix())
+		{
+			cout << "\nFinished loading convolution matrix for noise filtering" << endl;
+			picture_convolution();
+			return;
 		}
-		//cout << endl;
+		cout << "\nCould not load convolution matrix, using a gaussian instead" << endl;
+		set_smoothing(SMOOTH_GAUSSIAN);
 	}
 	
+	// Rows into m_temp, then columns back into m_luma once every band has its rows done
+	run_bands(&Edgedetection::band_smooth_rows);
+	run_bands(&Edgedetection::band_smooth_columns);
+	
+	return;
+	
+}
+
+
+
+
+/* Filter the rows of one band along x, from m_luma into m_temp */
+void Edgedetection::band_smooth_rows(int band)
+{
+	
+	int first, last;
+	band_rows(band, first, last);
+	
+	filter_rows(&m_luma[0] + (size_t)first*m_width, &m_temp[0] + (size_t)first*m_width, m_width, last - first, m_kernel);
+	
+	return;
+	
+}
+
+
+
+
+/* Filter the rows of one band along y, from m_temp back into m_luma
+ * This reads up to the kernel radius into the neighbouring bands */
+void Edgedetection::band_smooth_columns(int band)
+{
+	
+	int first, last;
+	band_rows(band, first, last);
+	
+	filter_columns(&m_temp[0], &m_luma[0], m_width, m_height, m_kernel, first, last);
+	
 	return;
 	
 }
@@ -579,46 +1101,17 @@ void Edgedetection::sobel_gradient()
 
 
 
-/* Convolves an image with the matrix given
+/* Convolves the luma plane with the matrix given
  * WARNING! It will assume that the size of the side of the matrix loaded is of ODD length
  * Otherwise, it goes boom 
+ * Pixels beyond the border are replaced by the nearest edge pixel
  * If you don't know what matrix convolution in terms of computational mathematics is, well, Google it */
 void Edgedetection::picture_convolution() 
 {
 	
-	CImg<float> convolution(m_picture.width(),m_picture.height(),1,3);
-	int limit = (m_size_matrix - 1)/2;
-	float ** temp = new float * [m_size_matrix];
-		for (int x=0; x<m_size_matrix; x++) 
-		{
-			temp[x] = new float[m_size_matrix];
-		}
-	
-	for (int i=limit; i<(m_picture.width()-limit); i++) {
-		for (int j=limit; j<(m_picture.height()-limit); j++) 
-		{
-			
-			for (int x=0; x<m_size_matrix; x++) {
-				for (int y=0; y<m_size_matrix; y++) 
-				{
-					temp[x][y] = m_matrix[x][y]*m_picture(i-limit+x,j-limit+y,0,0);
-				}
-			}
-				
-			convolution(i,j,0,0) = sum_matrix(temp, m_size_matrix, m_size_matrix);
-			convolution(i,j,0,1) = convolution(i,j,0,0);
-			convolution(i,j,0,2) = convolution(i,j,0,0);
-		
-		}
-	}
+	run_bands(&Edgedetection::band_convolve);
 
-	m_picture.assign(convolution);
-	
-	for (int i=0; i<m_size_matrix; i++)
-	{
-		delete[] temp[i];
-	}
-	delete[] temp;
+	m_luma.swap(m_temp);
 
 	return;
 	
@@ -627,21 +1120,39 @@ void Edgedetection::picture_convolution()
 
 
 
-/* Sum all values of a square matrix of prefixed size */
-float Edgedetection::sum_matrix(float ** matrix, int width, int height)
+/* Convolve the rows of one band, from m_luma into m_temp, reading up to half the matrix side into the neighbouring bands */
+void Edgedetection::band_convolve(int band)
 {
 	
-	float total = 0;
+	int first, last;
+	band_rows(band, first, last);
+	
+	convolve_matrix(&m_luma[0], &m_temp[0], m_width, m_height, &m_matrix[0], m_size_matrix, first, last);
+	
+	return;
+	
+}
 
-	for (int i=0; i<width; i++) {
-		for (int j=0; j<height; j++) 
-		{			
-			total += matrix[i][j];
-		}
-	}
 
-	return total;
 
+
+/* Copy a plane into all three channels of the picture and display it */
+void Edgedetection::show_plane(const vector<float> &plane)
+{
+	
+	for (int j=0; j<m_height; j++) {
+		for (int i=0; i<m_width; i++) 
+		{
+			m_picture(i,j,0,0) = plane[j*m_width + i];
+			m_picture(i,j,0,1) = plane[j*m_width + i];
+			m_picture(i,j,0,2) = plane[j*m_width + i];
+		}
+	}
+	
+	m_show.display(m_picture);
+	
+	return;
+	
 }
 
 
@@ -651,19 +1162,63 @@ float Edgedetection::sum_matrix(float ** matrix, int width, int height)
  * Check RGB to greyscale conversion on the internet
  * The prefactors for each RGB value come from the colour intensity form due to eye perception 
  * There are lots of papers on the subject, if you are interested 
- * Good luck finding them */
+ * Good luck finding them 
+ * Images that are already greyscale (a single channel) are copied as they are */
 void Edgedetection::greyfy() 
 {
 	
-	for (int x=0; x<m_picture.width(); x++) {
-		for (int y=0; y<m_picture.height(); y++) 
+	run_bands(&Edgedetection::band_greyfy);
+	
+	// Results are drawn in colour, so make sure the picture has three channels to draw in
+	if (m_picture.spectrum() < 3)
+		m_picture.assign(m_width, m_height, 1, 3);
+
+	return;
+	
+}
+
+
+
+
+/* Greyscale of the rows of one band */
+void Edgedetection::band_greyfy(int band)
+{
+	
+	int first, last;
+	band_rows(band, first, last);
+	
+	for (int y=first; y<last; y++) {
+		for (int x=0; x<m_width; x++) 
 		{
-			m_picture(x,y,0,0) = 0.299*m_picture(x,y,0,0) + 0.587*m_picture(x,y,0,1) + 0.114*m_picture(x,y,0,2);
-			m_picture(x,y,0,1) = 0.299*m_picture(x,y,0,0) + 0.587*m_picture(x,y,0,1) + 0.114*m_picture(x,y,0,2);
-			m_picture(x,y,0,2) = 0.299*m_picture(x,y,0,0) + 0.587*m_picture(x,y,0,1) + 0.114*m_picture(x,y,0,2);
+			if (m_picture.spectrum() < 3)
+				m_luma[y*m_width + x] = m_picture(x,y,0,0);
+			else
+				m_luma[y*m_width + x] = 0.299*m_picture(x,y,0,0) + 0.587*m_picture(x,y,0,1) + 0.114*m_picture(x,y,0,2);
 		}
 	}
+	
+	return;
+	
+}
+
 
+
+
+/* Copy the rows of one band of the 8-bit luma buffer into m_luma */
+void Edgedetection::band_load_luma(int band)
+{
+	
+	int first, last;
+	band_rows(band, first, last);
+	
+	for (int y=first; y<last; y++)
+	{
+		const unsigned char * row = m_source + (size_t)y*m_source_stride;
+		float * luma = &m_luma[0] + (size_t)y*m_width;
+		for (int x=0; x<m_width; x++)
+			luma[x] = row[x];
+	}
+	
 	return;
 	
 }
@@ -673,8 +1228,9 @@ void Edgedetection::greyfy()
 
 /* Load noise convolution matrix 
  * WARNING! The matrix is loaded from the same folder as the executalbe file, and it has a predefined name
- * Make sure that all of these parameters match! */
-void Edgedetection::load_matrix()
+ * Make sure that all of these parameters match! 
+ * Returns false if the file can't be opened */
+bool Edgedetection::load_matrix()
 {
 	
 	float factor = 0;
@@ -682,20 +1238,24 @@ void Edgedetection::load_matrix()
 	
 	ifstream reading;
 	
-	string location = "./matrix_size5.txt";
-	reading.open(location.c_str());
+	ostringstream location;
+	location << "./matrix_size" << m_size_matrix << ".txt";
+	reading.open(location.str().c_str());
+	if (!reading.is_open())
+		return false;
+	
 	reading >> factor;
 	for (int i=0; i<m_size_matrix; i++) {
 		for (int j=0; j<m_size_matrix; j++) 
 		{
 			reading >> element;
-			m_matrix[i][j] = factor * element;
+			m_matrix[i*m_size_matrix + j] = factor * element;
 		}
 	}
 	
 	reading.close();
 	
-	return;
+	return true;
 	
 }
 
@@ -0,0 +1,119 @@
+// Batch Edge Detection Program
+
+/* This program runs the edgedetection class unattended over whole directories or lists of pictures, through edgebatch_class.h.
+ * Nothing is asked through terminal, so it can be left running over thousands of captures.
+ * Usage:
+ * 		./edges_batch.x [options] <directory, list.txt or picture>...
+ * Options:
+ * 		-o <directory>	where the edges and timing.csv are written (default ./edges)
+ * 		-w <workers>	pictures processed at once (default one per core)
+ * 		-p <pictures>	decoded pictures allowed to wait for a worker (default 4)
+ * 		-s <sigma>		sigma of the gaussian smoothing (default 1.4)
+ * 		-b <radius>		use a box filter of the given radius instead of the gaussian
+ * 		-m <method>		how the thresholds are chosen from the gradient histogram: otsu (default), percentile or mean
+ * 		-h <value>		for percentile, the fraction of pixels below the high threshold (default 0.95);
+ * 						for mean, the multiplier of the mean gradient giving the high threshold (default 3)
+ * 		-l <value>		for otsu and percentile, the ratio of the low threshold to the high one (default 0.5 and 0.4);
+ * 						for mean, the multiplier of the mean gradient giving the low threshold (default 1.2)
+ * 		-t <threads>	threads for each picture (default 1)
+ * 		-1				use the L1 norm for the gradient magnitude
+ * For more information, see descriptions of edgebatch_class.h and edgedetection_class.h
+ */
+
+
+
+#include "edgebatch_class.h"
+
+
+int main (int argc, char ** argv) {
+	
+	Edgeparameters parameters;
+	string output = "./edges";
+	int workers = 0;
+	int prefetch = 4;
+	vector<string> inputs;
+	string method = "otsu";
+	float high = -1;
+	float low = -1;
+	
+	for (int i=1; i<argc; i++)
+	{
+		string option = argv[i];
+		bool has_value = (i+1 < argc);
+		
+		if (option == "-o" && has_value)
+			output = argv[++i];
+		else if (option == "-w" && has_value)
+			workers = atoi(argv[++i]);
+		else if (option == "-p" && has_value)
+			prefetch = atoi(argv[++i]);
+		else if (option == "-s" && has_value)
+		{
+			parameters.smoothing = SMOOTH_GAUSSIAN;
+			parameters.smoothing_size = atof(argv[++i]);
+		}
+		else if (option == "-b" && has_value)
+		{
+			parameters.smoothing = SMOOTH_BOX;
+			parameters.smoothing_size = atof(argv[++i]);
+		}
+		else if (option == "-m" && has_value)
+			method = argv[++i];
+		else if (option == "-h" && has_value)
+			high = atof(argv[++i]);
+		else if (option == "-l" && has_value)
+			low = atof(argv[++i]);
+		else if (option == "-t" && has_value)
+			parameters.threads_per_picture = atoi(argv[++i]);
+		else if (option == "-1")
+			parameters.l1_magnitude = true;
+		else if (option[0] == '-')
+		{
+			cout << "\nUnknown option " << option << endl;
+			return 1;
+		}
+		else
+			inputs.push_back(option);
+	}
+	
+	// Thresholds not given take the defaults of the method
+	if (method == "mean")
+	{
+		parameters.threshold_mode = THRESHOLD_MEAN;
+		parameters.threshold_high = (high < 0) ? 3 : high;
+		parameters.threshold_low = (low < 0) ? 1.2 : low;
+	}
+	else if (method == "percentile")
+	{
+		parameters.threshold_mode = THRESHOLD_PERCENTILE;
+		parameters.threshold_high = (high < 0) ? 0.95 : high;
+		parameters.threshold_low = (low < 0) ? 0.4 : low;
+	}
+	else if (method == "otsu")
+	{
+		parameters.threshold_mode = THRESHOLD_OTSU;
+		parameters.threshold_low = (low < 0) ? 0.5 : low;
+	}
+	else
+	{
+		cout << "\nUnknown threshold method " << method << endl;
+		return 1;
+	}
+	
+	if (inputs.empty())
+	{
+		cout << "\nUsage: " << argv[0] << " [-o dir] [-w workers] [-p prefetch] [-s sigma | -b radius] [-m method] [-h high] [-l low] [-t threads] [-1] <directory, list.txt or picture>..." << endl;
+		return 1;
+	}
+	
+	Edgebatch batch(parameters, workers, prefetch);
+	for (size_t i=0; i<inputs.size(); i++)
+		batch.add(inputs[i]);
+	
+	cout << "\nFound " << batch.size() << " pictures" << endl;
+	
+	int failed = batch.run(output);
+	
+	return (failed == 0) ? 0 : 2;
+
+}
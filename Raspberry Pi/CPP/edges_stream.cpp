@@ -0,0 +1,109 @@
+// Streaming Edge Detection Program
+
+/* This program runs the edgestream class on a picture too large to be loaded whole, such as a stitched mosaic.
+ * The picture must be an 8-bit binary PGM file, and the edges are written as another one.
+ * Usage:
+ * 		./edges_stream.x [options] <input.pgm> <output.pgm>
+ * Options:
+ * 		-r <rows>		rows in each strip (default 64); memory grows with rows times the width of the picture
+ * 		-s <sigma>		sigma of the gaussian smoothing (default 1.4)
+ * 		-b <radius>		use a box filter of the given radius instead of the gaussian
+ * 		-m <method>		how the thresholds are chosen from the gradient histogram: otsu (default), percentile or mean
+ * 		-h <value>		for percentile, the fraction of pixels below the high threshold (default 0.95);
+ * 						for mean, the multiplier of the mean gradient giving the high threshold (default 3)
+ * 		-l <value>		for otsu and percentile, the ratio of the low threshold to the high one (default 0.5 and 0.4);
+ * 						for mean, the multiplier of the mean gradient giving the low threshold (default 1.2)
+ * 		-1				use the L1 norm for the gradient magnitude
+ * For more information, see description of edgestream_class.h
+ */
+
+
+
+#include <cstdlib>
+#include <sys/time.h>
+
+#include "edgestream_class.h"
+
+
+int main (int argc, char ** argv) {
+	
+	int strip_rows = 64;
+	int smoothing = SMOOTH_GAUSSIAN;
+	float smoothing_size = 1.4;
+	string method = "otsu";
+	float high = -1;
+	float low = -1;
+	bool l1_magnitude = false;
+	vector<string> files;
+	
+	for (int i=1; i<argc; i++)
+	{
+		string option = argv[i];
+		bool has_value = (i+1 < argc);
+		
+		if (option == "-r" && has_value)
+			strip_rows = atoi(argv[++i]);
+		else if (option == "-s" && has_value)
+		{
+			smoothing = SMOOTH_GAUSSIAN;
+			smoothing_size = atof(argv[++i]);
+		}
+		else if (option == "-b" && has_value)
+		{
+			smoothing = SMOOTH_BOX;
+			smoothing_size = atof(argv[++i]);
+		}
+		else if (option == "-m" && has_value)
+			method = argv[++i];
+		else if (option == "-h" && has_value)
+			high = atof(argv[++i]);
+		else if (option == "-l" && has_value)
+			low = atof(argv[++i]);
+		else if (option == "-1")
+			l1_magnitude = true;
+		else if (option[0] == '-')
+		{
+			cout << "\nUnknown option " << option << endl;
+			return 1;
+		}
+		else
+			files.push_back(option);
+	}
+	
+	if (files.size() != 2)
+	{
+		cout << "\nUsage: " << argv[0] << " [-r rows] [-s sigma | -b radius] [-m method] [-h high] [-l low] [-1] <input.pgm> <output.pgm>" << endl;
+		return 1;
+	}
+	
+	Edgestream streaming(strip_rows);
+	streaming.set_smoothing(smoothing, smoothing_size);
+	
+	// Thresholds not given take the defaults of the method
+	if (method == "mean")
+		streaming.set_thresholds((high < 0) ? 3 : high, (low < 0) ? 1.2 : low);
+	else if (method == "percentile")
+		streaming.set_percentile_thresholds((high < 0) ? 0.95 : high, (low < 0) ? 0.4 : low);
+	else if (method == "otsu")
+		streaming.set_otsu_thresholds((low < 0) ? 0.5 : low);
+	else
+	{
+		cout << "\nUnknown threshold method " << method << endl;
+		return 1;
+	}
+	streaming.set_magnitude(l1_magnitude);
+	
+	timeval start, end;
+	gettimeofday(&start, NULL);
+	
+	if (!streaming.run(files[0], files[1]))
+		return 2;
+	
+	gettimeofday(&end, NULL);
+	double seconds = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec)/1000000.0;
+	
+	cout << "\nFound " << streaming.edges() << " edge pixels in " << seconds << " s" << endl;
+	
+	return 0;
+
+}
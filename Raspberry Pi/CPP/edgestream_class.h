@@ -0,0 +1,685 @@
+// Edge Stream Class
+
+/* This file contains the class that runs Canny edge detection on pictures too large to hold in memory, such as stitched slide mosaics.
+ * The picture is read from an 8-bit binary PGM file in horizontal strips, and the edges are written to another PGM file as each strip is done,
+ * so memory depends on the width of the picture and the height of a strip, but not on the height of the picture.
+ * Each strip is processed in a window holding the strip plus enough rows above and below it (the halo) for smoothing, gradient and
+ * non-maximum suppression to give exactly what they would on the whole picture. Input rows are kept in a rolling window, so every row
+ * is read from the file only once per pass.
+ * Hysteresis can't be finished inside a strip, since a chain of minor edges may carry on through any number of strips below.
+ * Chains that stay inside a strip are decided at once. Chains that reach the top or bottom of their strip get a label in a union-find,
+ * which is joined with the labels of the previous strip across the seam; their pixels are written out as non-edges for now and listed in
+ * a temporary file. Once the last strip is done, every listed pixel whose label joined a major edge is changed to an edge in the output file.
+ * The thresholds come from the gradient magnitude histogram of the whole picture, which takes a first pass through the file.
+ * These are:
+ *
+ * public:
+ * Edgestream(int) -> Only class constructor.
+ * 		Takes the number of rows in a strip. Memory is about 30 bytes per pixel of a strip, plus the halo.
+ * set_smoothing(int, float) -> Chooses SMOOTH_GAUSSIAN with the given sigma (default, 1.4) or SMOOTH_BOX with the given radius.
+ * set_otsu_thresholds(float), set_percentile_thresholds(float, float), set_thresholds(float, float) -> Choose how the thresholds
+ * 		are found from the gradient histogram, as for Edgedetection. Otsu's method is the default.
+ * set_magnitude(bool) -> Chooses the L1 norm |gx| + |gy| for the gradient magnitude instead of the default L2 norm.
+ * run(string, string) -> Detects the edges of the PGM picture at the first location and writes them, 255 on edges and 0 elsewhere,
+ * 		as a PGM picture at the second. Returns false, saying why, if either file can't be used.
+ * edges() -> Number of edge pixels found by the last run.
+ *
+ * private:
+ * open_input(string) -> Reads the PGM header and remembers where the pixels start, so that each pass can go back there.
+ * rewind_input() -> Goes back to the first row of pixels and empties the rolling window.
+ * load_window(int, int) -> Brings the rows needed for a strip into the window, reading only the rows not already there.
+ * gradient_window(int, int) -> Smooths the window and computes the gradient of the rows a strip needs.
+ * label_strip(int, int) -> Labels the chains of edges in a strip and decides the ones that don't reach its top or bottom.
+ * join_seam(int, int) -> Joins the labels of chains crossing the seam above a strip with those of the strip before.
+ * write_strip(int, int) -> Writes the rows of a strip to the output, and lists its undecided pixels in the temporary file.
+ * patch_output() -> Changes the listed pixels whose chain reached a major edge into edges in the output file.
+ * find(int) -> Root label of a union-find set.
+ */
+
+
+
+#ifndef EDGESTREAM_CLASS_H
+#define EDGESTREAM_CLASS_H
+
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+
+#include "image_kernels.h"
+#include "pgm_io.h"
+
+using namespace std;
+
+
+
+// A pixel whose chain was still undecided when its strip was written
+struct Edgepending
+{
+	int row;
+	int column;
+	int label;
+};
+
+
+
+class Edgestream
+{
+
+private:
+
+	int m_strip_rows;
+	int m_halo;
+	vector<float> m_kernel;
+	int m_threshold_mode;
+	float m_threshold_high;
+	float m_threshold_low;
+	bool m_l1_magnitude;
+
+	// Files and size of the picture
+	FILE * m_input;
+	FILE * m_output;
+	FILE * m_pending;
+	off_t m_input_data;
+	off_t m_output_data;
+	int m_width;
+	int m_height;
+
+	// Rolling window of input rows, starting at picture row m_window_first
+	vector<unsigned char> m_rows;
+	int m_window_first;
+	int m_window_rows;
+
+	// Working planes for the window
+	vector<float> m_luma;
+	vector<float> m_temp;
+	vector<float> m_gx;
+	vector<float> m_gy;
+	vector<float> m_magnitude;
+	vector<unsigned char> m_direction;
+	vector<unsigned char> m_edge;
+
+	// Labels of the strip, the chains they belong to, and the last rows of the previous strip for joining across the seam
+	vector<int> m_labels;
+	vector<int> m_stack;
+	vector<int> m_chain_label;
+	vector<unsigned char> m_chain_major;
+	vector<int> m_seam;
+	vector<unsigned char> m_out;
+
+	// Union-find over the chains that reach a seam
+	vector<int> m_parent;
+	vector<unsigned char> m_major;
+
+	vector<unsigned int> m_histogram;
+
+	float m_high_thr;
+	float m_low_thr;
+	long m_edges;
+
+
+	bool open_input(string);
+
+	void rewind_input();
+
+	void load_window(int first, int last);
+
+	void gradient_window(int first, int last);
+
+	void label_strip(int first, int last);
+
+	void join_seam(int first, int last);
+
+	void write_strip(int first, int last);
+
+	void patch_output();
+
+	int find(int);
+
+
+public:
+
+	Edgestream(int strip_rows = 64);
+
+	void set_smoothing(int type = SMOOTH_GAUSSIAN, float size = 1.4);
+
+	void set_thresholds(float high_thr_mult = 3, float low_thr_mult = 1.2)
+	{	m_threshold_mode = THRESHOLD_MEAN; m_threshold_high = high_thr_mult; m_threshold_low = low_thr_mult; return;	}
+
+	void set_percentile_thresholds(float high_fraction = 0.95, float low_ratio = 0.4)
+	{	m_threshold_mode = THRESHOLD_PERCENTILE; m_threshold_high = high_fraction; m_threshold_low = low_ratio; return;	}
+
+	void set_otsu_thresholds(float low_ratio = 0.5)
+	{	m_threshold_mode = THRESHOLD_OTSU; m_threshold_high = 0; m_threshold_low = low_ratio; return;	}
+
+	void set_magnitude(bool l1 = false)
+	{	m_l1_magnitude = l1; return;	}
+
+	bool run(string input_location, string output_location);
+
+	long edges()
+	{	return m_edges;	}
+
+
+};
+
+
+
+
+/* Edgestream class CONSTRUCTOR
+ * A strip is never shorter than the rows chains are linked across, so a seam only ever involves two strips */
+Edgestream::Edgestream(int strip_rows)
+{
+
+	m_strip_rows = (strip_rows < 2*LINK_RADIUS) ? 2*LINK_RADIUS : strip_rows;
+	set_smoothing();
+	set_otsu_thresholds();
+	set_magnitude();
+
+	m_input = NULL;
+	m_output = NULL;
+	m_pending = NULL;
+	m_width = 0;
+	m_height = 0;
+	m_edges = 0;
+
+}
+
+
+
+
+/* Choose the noise damping filter
+ * The halo is what the smoothing radius needs, plus a row for the gradient and one for non-maximum suppression */
+void Edgestream::set_smoothing(int type, float size)
+{
+
+	if (type == SMOOTH_BOX)
+		box_kernel((int)size, m_kernel);
+	else
+		gaussian_kernel(size, m_kernel);
+
+	m_halo = (int)m_kernel.size()/2 + 2;
+
+	return;
+
+}
+
+
+
+
+/* Edge detection of a whole PGM picture, strip by strip */
+bool Edgestream::run(string input_location, string output_location)
+{
+
+	m_edges = 0;
+
+	if (!open_input(input_location))
+		return false;
+
+	m_output = fopen(output_location.c_str(), "w+b");
+	if (m_output == NULL)
+	{
+		cout << "\nCould not create " << output_location << endl;
+		fclose(m_input);
+		return false;
+	}
+	if (!write_pgm_header(m_output, m_width, m_height))
+	{
+		cout << "\nCould not write " << output_location << endl;
+		fclose(m_input);
+		fclose(m_output);
+		return false;
+	}
+	m_output_data = ftello(m_output);
+
+	m_pending = tmpfile();
+	if (m_pending == NULL)
+	{
+		cout << "\nCould not create a temporary file" << endl;
+		fclose(m_input);
+		fclose(m_output);
+		return false;
+	}
+
+	size_t window = (size_t)(m_strip_rows + 2*m_halo)*m_width;
+	m_rows.resize(window);
+	m_luma.resize(window);
+	m_temp.resize(window);
+	m_gx.resize(window);
+	m_gy.resize(window);
+	m_magnitude.resize(window);
+	m_direction.resize(window);
+	m_edge.resize(window);
+	m_labels.resize((size_t)m_strip_rows*m_width);
+	m_out.resize((size_t)m_strip_rows*m_width);
+	m_seam.assign((size_t)LINK_RADIUS*m_width, -1);
+	m_parent.clear();
+	m_major.clear();
+
+	// First pass: gradient magnitude histogram, leaving out the border as Edgedetection does
+	double total = 0;
+	m_histogram.assign(MAGNITUDE_BINS, 0);
+	rewind_input();
+	for (int first=0; first<m_height; first+=m_strip_rows)
+	{
+		int last = (first + m_strip_rows > m_height) ? m_height : first + m_strip_rows;
+		load_window(first, last);
+		gradient_window(first, last);
+
+		for (int y=first; y<last; y++)
+		{
+			if (y < 1 || y >= m_height-1)
+				continue;
+			const float * row = &m_magnitude[0] + (size_t)(y - m_window_first)*m_width;
+			for (int x=1; x<m_width-1; x++)
+			{
+				histogram_add(&m_histogram[0], row[x]);
+				total += row[x];
+			}
+		}
+	}
+	choose_thresholds(&m_histogram[0], total, m_threshold_mode, m_threshold_high, m_threshold_low, m_high_thr, m_low_thr);
+
+	// Second pass: edges strip by strip
+	rewind_input();
+	for (int first=0; first<m_height; first+=m_strip_rows)
+	{
+		int last = (first + m_strip_rows > m_height) ? m_height : first + m_strip_rows;
+		load_window(first, last);
+		gradient_window(first, last);
+
+		int offset = first - m_window_first;
+		suppress_edges(&m_magnitude[0], &m_direction[0], &m_edge[0], m_width, offset, offset + last - first,
+				EDGE_BORDER - m_window_first, m_height - EDGE_BORDER + 1 - m_window_first, m_high_thr, m_low_thr);
+
+		label_strip(first, last);
+		join_seam(first, last);
+		write_strip(first, last);
+	}
+
+	// Chains crossing seams are known only now
+	patch_output();
+
+	fclose(m_input);
+	fclose(m_output);
+	fclose(m_pending);
+	m_input = m_output = m_pending = NULL;
+
+	return true;
+
+}
+
+
+
+
+/* Open the input and read its PGM header */
+bool Edgestream::open_input(string location)
+{
+
+	m_input = fopen(location.c_str(), "rb");
+	if (m_input == NULL)
+	{
+		cout << "\nCould not open " << location << endl;
+		return false;
+	}
+
+	if (!read_pgm_header(m_input, m_width, m_height))
+	{
+		cout << "\n" << location << " is not an 8-bit binary PGM picture" << endl;
+		fclose(m_input);
+		return false;
+	}
+
+	m_input_data = ftello(m_input);
+
+	return true;
+
+}
+
+
+
+
+/* Back to the first row of pixels, with nothing in the window */
+void Edgestream::rewind_input()
+{
+
+	fseeko(m_input, m_input_data, SEEK_SET);
+	m_window_first = 0;
+	m_window_rows = 0;
+
+	return;
+
+}
+
+
+
+
+/* Bring the rows a strip needs into the window
+ * Rows above the halo of the strip are dropped, and rows below the last one already held are read in
+ * A file that ends early is padded with black rows */
+void Edgestream::load_window(int first, int last)
+{
+
+	int need_first = (first - m_halo < 0) ? 0 : first - m_halo;
+	int need_last = (last + m_halo > m_height) ? m_height : last + m_halo;
+
+	int drop = need_first - m_window_first;
+	if (drop > 0)
+	{
+		int keep = (m_window_rows > drop) ? m_window_rows - drop : 0;
+		if (keep > 0)
+			memmove(&m_rows[0], &m_rows[0] + (size_t)drop*m_width, (size_t)keep*m_width);
+		m_window_first = need_first;
+		m_window_rows = keep;
+	}
+
+	int have_last = m_window_first + m_window_rows;
+	if (need_last > have_last)
+	{
+		unsigned char * start = &m_rows[0] + (size_t)m_window_rows*m_width;
+		size_t wanted = (size_t)(need_last - have_last)*m_width;
+		size_t got = fread(start, 1, wanted, m_input);
+		if (got < wanted)
+			memset(start + got, 0, wanted - got);
+		m_window_rows = need_last - m_window_first;
+	}
+
+	return;
+
+}
+
+
+
+
+/* Smooth the whole window, then take the gradient of the strip and one row either side of it
+ * The halo is deep enough that every row used has all the input rows it needs, so no result depends on where the window ends */
+void Edgestream::gradient_window(int first, int last)
+{
+
+	size_t pixels = (size_t)m_window_rows*m_width;
+	for (size_t i=0; i<pixels; i++)
+		m_luma[i] = m_rows[i];
+
+	separable_filter(&m_luma[0], &m_temp[0], m_width, m_window_rows, m_kernel);
+
+	int from = first - m_window_first - 1;
+	int to = last - m_window_first + 1;
+	sobel_planes(&m_luma[0], &m_gx[0], &m_gy[0], &m_magnitude[0], &m_direction[0], m_width, m_window_rows, m_l1_magnitude,
+			(from < 0) ? 0 : from, (to > m_window_rows) ? m_window_rows : to);
+
+	return;
+
+}
+
+
+
+
+/* Label the chains of the strip
+ * Minor and major edges within LINK_RADIUS of each other belong to the same chain, found by a flood fill from each unlabelled one.
+ * A chain reaching the first or last LINK_RADIUS rows of the strip may continue into the next one, so it gets a union-find label;
+ * any other chain is decided here, as an edge if it holds a major edge. */
+void Edgestream::label_strip(int first, int last)
+{
+
+	int rows = last - first;
+	const unsigned char * edge = &m_edge[0] + (size_t)(first - m_window_first)*m_width;
+	int * labels = &m_labels[0];
+
+	for (size_t i=0; i<(size_t)rows*m_width; i++)
+		labels[i] = -1;
+	m_chain_label.clear();
+	m_chain_major.clear();
+
+	for (int start=0; start<rows*m_width; start++)
+	{
+
+		if (edge[start] == EDGE_NONE || labels[start] >= 0)
+			continue;
+
+		int chain = (int)m_chain_label.size();
+		bool major = false;
+		bool seam = false;
+
+		m_stack.clear();
+		m_stack.push_back(start);
+		labels[start] = chain;
+
+		while (!m_stack.empty())
+		{
+
+			int index = m_stack.back();
+			m_stack.pop_back();
+
+			int x = index % m_width;
+			int y = index / m_width;
+			if (edge[index] == EDGE_MAJOR)
+				major = true;
+			if ((y < LINK_RADIUS && first > 0) || (y >= rows - LINK_RADIUS && last < m_height))
+				seam = true;
+
+			int x_first = (x < LINK_RADIUS) ? 0 : x - LINK_RADIUS;
+			int x_last = (x + LINK_RADIUS >= m_width) ? m_width - 1 : x + LINK_RADIUS;
+			int y_first = (y < LINK_RADIUS) ? 0 : y - LINK_RADIUS;
+			int y_last = (y + LINK_RADIUS >= rows) ? rows - 1 : y + LINK_RADIUS;
+
+			for (int j=y_first; j<=y_last; j++) {
+				for (int i=x_first; i<=x_last; i++)
+				{
+					int next = j*m_width + i;
+					if (edge[next] != EDGE_NONE && labels[next] < 0)
+					{
+						labels[next] = chain;
+						m_stack.push_back(next);
+					}
+				}
+			}
+
+		}
+
+		if (seam)
+		{
+			m_chain_label.push_back((int)m_parent.size());
+			m_parent.push_back((int)m_parent.size());
+			m_major.push_back(major ? 1 : 0);
+		}
+		else
+			m_chain_label.push_back(-1);
+		m_chain_major.push_back(major ? 1 : 0);
+
+	}
+
+	return;
+
+}
+
+
+
+
+/* Join chains across the seam above the strip
+ * A pixel in the first LINK_RADIUS rows of the strip links to any pixel of the last LINK_RADIUS rows of the previous strip
+ * within LINK_RADIUS of it; both are then labelled, since they reach the seam.
+ * The last strip may have fewer rows than that, and the rest of m_labels is left over from the strip before */
+void Edgestream::join_seam(int first, int last)
+{
+
+	int rows = (last - first < LINK_RADIUS) ? last - first : LINK_RADIUS;
+
+	if (first > 0)
+	{
+		for (int y=0; y<rows; y++) {
+			for (int x=0; x<m_width; x++)
+			{
+
+				int chain = m_labels[y*m_width + x];
+				if (chain < 0)
+					continue;
+				int label = m_chain_label[chain];
+
+				// Rows of the previous strip are rows -LINK_RADIUS to -1 here, stored as rows 0 to LINK_RADIUS-1 of m_seam
+				int x_first = (x < LINK_RADIUS) ? 0 : x - LINK_RADIUS;
+				int x_last = (x + LINK_RADIUS >= m_width) ? m_width - 1 : x + LINK_RADIUS;
+				for (int j=y; j<LINK_RADIUS; j++) {
+					for (int i=x_first; i<=x_last; i++)
+					{
+						int above = m_seam[j*m_width + i];
+						if (above < 0)
+							continue;
+						int a = find(label);
+						int b = find(above);
+						if (a != b)
+						{
+							m_parent[b] = a;
+							m_major[a] |= m_major[b];
+						}
+					}
+				}
+
+			}
+		}
+	}
+
+	return;
+
+}
+
+
+
+
+/* Write the rows of the strip
+ * Decided chains are written as they are. Pixels of undecided chains are written as non-edges and listed in the temporary file,
+ * and the labels of the last rows are kept for the seam below */
+void Edgestream::write_strip(int first, int last)
+{
+
+	int rows = last - first;
+
+	for (int y=0; y<rows; y++) {
+		for (int x=0; x<m_width; x++)
+		{
+
+			int index = y*m_width + x;
+			int chain = m_labels[index];
+			unsigned char tone = 0;
+
+			if (chain >= 0)
+			{
+				int label = m_chain_label[chain];
+				if (label < 0)
+				{
+					if (m_chain_major[chain])
+					{
+						tone = 255;
+						m_edges++;
+					}
+				}
+				else
+				{
+					Edgepending pending;
+					pending.row = first + y;
+					pending.column = x;
+					pending.label = label;
+					fwrite(&pending, sizeof(pending), 1, m_pending);
+				}
+			}
+
+			m_out[index] = tone;
+
+		}
+	}
+
+	fwrite(&m_out[0], 1, (size_t)rows*m_width, m_output);
+
+	for (int y=0; y<LINK_RADIUS; y++) {
+		for (int x=0; x<m_width; x++)
+		{
+			int row = rows - LINK_RADIUS + y;
+			int chain = (row >= 0) ? m_labels[row*m_width + x] : -1;
+			m_seam[y*m_width + x] = (chain >= 0) ? m_chain_label[chain] : -1;
+		}
+	}
+
+	return;
+
+}
+
+
+
+
+/* Turn the listed pixels whose chain reached a major edge into edges
+ * The list is in raster order, so the output is patched a strip at a time, and strips without listed edges are never read back */
+void Edgestream::patch_output()
+{
+
+	fflush(m_output);
+	rewind(m_pending);
+
+	int loaded = -1;
+	bool changed = false;
+	Edgepending pending;
+
+	while (fread(&pending, sizeof(pending), 1, m_pending) == 1)
+	{
+
+		if (!m_major[find(pending.label)])
+			continue;
+
+		int strip = pending.row/m_strip_rows;
+		int first = strip*m_strip_rows;
+		int rows = (first + m_strip_rows > m_height) ? m_height - first : m_strip_rows;
+
+		if (strip != loaded)
+		{
+			if (changed)
+			{
+				int loaded_first = loaded*m_strip_rows;
+				int loaded_rows = (loaded_first + m_strip_rows > m_height) ? m_height - loaded_first : m_strip_rows;
+				fseeko(m_output, m_output_data + (off_t)loaded_first*m_width, SEEK_SET);
+				fwrite(&m_out[0], 1, (size_t)loaded_rows*m_width, m_output);
+			}
+			fseeko(m_output, m_output_data + (off_t)first*m_width, SEEK_SET);
+			if (fread(&m_out[0], 1, (size_t)rows*m_width, m_output) != (size_t)rows*m_width)
+				break;
+			loaded = strip;
+			changed = false;
+		}
+
+		m_out[(pending.row - first)*m_width + pending.column] = 255;
+		changed = true;
+		m_edges++;
+
+	}
+
+	if (changed)
+	{
+		int loaded_first = loaded*m_strip_rows;
+		int loaded_rows = (loaded_first + m_strip_rows > m_height) ? m_height - loaded_first : m_strip_rows;
+		fseeko(m_output, m_output_data + (off_t)loaded_first*m_width, SEEK_SET);
+		fwrite(&m_out[0], 1, (size_t)loaded_rows*m_width, m_output);
+	}
+
+	return;
+
+}
+
+
+
+
+/* Root of a union-find set, halving the path on the way */
+int Edgestream::find(int label)
+{
+
+	while (m_parent[label] != label)
+	{
+		m_parent[label] = m_parent[m_parent[label]];
+		label = m_parent[label];
+	}
+
+	return label;
+
+}
+
+
+
+#endif
@@ -0,0 +1,132 @@
+// Flat Field Calibration Program
+
+/* Calibrates the flat field correction for one objective and lighting setting through the Flatfield class, and saves the maps
+ * where programs using that setting can load them.
+ * With the slide moved to an empty area, dark frames are averaged with the stage LED and the ring off, then flat frames with them
+ * set as chosen. The camera runs at a fixed exposure throughout, which the programs using the maps must open it with as well.
+ * How uneven the flat frame was, and is once corrected, is printed as the darkest and brightest parts of it relative to its mean.
+ * For more information, see description of flatfield_class.h
+ */
+
+
+
+#include "autofocus_class.h"
+#include "flatfield_class.h"
+#include "camera_class.h"
+
+
+// Darkest and brightest of the means of 16x16 blocks of a plane, relative to the mean of the whole plane
+void unevenness(const vector<unsigned char> &plane, int width, int height, float &darkest, float &brightest)
+{
+
+	double total = 0;
+	for (size_t i=0; i<plane.size(); i++)
+		total += plane[i];
+	double mean = total/plane.size();
+
+	darkest = 1e9;
+	brightest = 0;
+	for (int top=0; top+16<=height; top+=16)
+	{
+		for (int left=0; left+16<=width; left+=16)
+		{
+			double sum = 0;
+			for (int y=top; y<top+16; y++)
+				for (int x=left; x<left+16; x++)
+					sum += plane[(size_t)y*width + x];
+			float level = (float)(sum/256/mean);
+			if (level < darkest) darkest = level;
+			if (level > brightest) brightest = level;
+		}
+	}
+
+	return;
+
+}
+
+
+int main ()
+{
+
+	Autofocus autofocusing;
+
+	cout << "\nUsing default parameters..." << endl;
+	autofocusing.set_serial();
+	cout << "Serial port: " << autofocusing.get_serial() << endl;
+
+	string objective;
+	int led = 0;
+	string ring;
+	int shutter_us = 0;
+	int frames = 0;
+	string directory;
+	cout << "\n\tObjective (4x, 10x, 40x or 100x)? "; cin >> objective;
+	cout << "\n\tStage LED brightness (0 to 255)? "; cin >> led;
+	cout << "\n\tRing colour (hexadecimal RGB, 000000 for off)? "; cin >> ring;
+	cout << "\n\tShutter time, in microseconds? "; cin >> shutter_us;
+	cout << "\n\tFrames to average? "; cin >> frames;
+	cout << "\n\tDirectory for the calibration? "; cin >> directory;
+
+	autofocusing.set_objective(objective);
+
+	Flatfield flatfield;
+	Camera camera;
+	if (!camera.open(640, 480, 30, flatfield.camera_options(shutter_us)))
+		return 1;
+
+	string waiting;
+	cout << "\nMove the slide to an empty area, then type 'go': "; cin >> waiting;
+
+	vector<unsigned char> frame((size_t)camera.width()*camera.height());
+
+	// Dark frames, lights off; the first frames after a change are skipped as the frames already buffered were lit
+	autofocusing.comm_set_led_bright(0);
+	autofocusing.comm_set_ring_colour("000000");
+	unsigned int number = camera.sequence() + 3;
+	cout << "\nDark frames" << flush;
+	for (int f=0; f<frames; f++)
+	{
+		if (!camera.grab(&frame[0], number, 2000, &number) || !flatfield.add_dark(&frame[0], camera.width(), camera.height()))
+			return 1;
+		cout << "." << flush;
+	}
+
+	// Flat frames, lights as chosen
+	autofocusing.comm_set_led_bright(led);
+	autofocusing.comm_set_ring_colour(ring);
+	number = camera.sequence() + 3;
+	cout << "\nFlat frames" << flush;
+	for (int f=0; f<frames; f++)
+	{
+		if (!camera.grab(&frame[0], number, 2000, &number) || !flatfield.add_flat(&frame[0], camera.width(), camera.height()))
+			return 1;
+		cout << "." << flush;
+	}
+	cout << endl;
+
+	if (!flatfield.build(objective, led, ring) || !flatfield.save(directory))
+		return 1;
+
+	// Unevenness of one more flat frame, as it comes and corrected
+	float darkest = 0;
+	float brightest = 0;
+	camera.grab(&frame[0], camera.sequence());
+	unevenness(frame, camera.width(), camera.height(), darkest, brightest);
+	cout << "\nFlat frame from " << darkest << " to " << brightest << " of its mean" << endl;
+
+	if (camera.set_correction(&flatfield))
+	{
+		camera.grab(&frame[0], camera.sequence() + 2);
+		unevenness(frame, camera.width(), camera.height(), darkest, brightest);
+		cout << "Corrected, from " << darkest << " to " << brightest << " of its mean" << endl;
+		camera.set_correction();
+	}
+
+	camera.close();
+
+	cout << "\nCalibration saved to " << directory << "/" << flatfield.file_name(objective, led, ring) << endl;
+	cout << "Open the camera with the options '" << flatfield.camera_options(shutter_us) << "' to use it" << endl << endl;
+
+	return 0;
+
+}
@@ -0,0 +1,424 @@
+// Flat Field Class
+
+/* This file contains the class that corrects pictures for the uneven lighting of the stage LED and the LED ring, and for the dark
+ * level of the sensor. Without it the corners of every picture are darker than the middle, which adds to the variance that
+ * Autofocus::algorithm() measures and moves the thresholds of edge detection and cell counting across the field.
+ * Calibration averages frames twice: dark frames, with the lights off, and flat frames, of an empty part of the slide with the lights
+ * as they will be used (see flatfield.cpp). Averaging removes the noise of single frames, so the maps only hold the lighting.
+ * The camera must be opened with a fixed exposure and gains (see camera_options(int)), both to calibrate and to use the maps,
+ * otherwise it meters the dark frames up to the level of the flat ones and every picture to its own level.
+ * Every pixel is then corrected as (pixel - dark) * gain, where the gain brings (flat - dark) to its mean over the frame.
+ * The maps are stored compactly, the dark level as 8 bits and the gain in 8.8 fixed point (up to 16, for pixels lit 16 times less
+ * than the mean), so correcting a pixel is a saturating subtraction, one multiplication and a shift, done on 16 pixels at a time
+ * with NEON or SSE2, and can be fused with the copy that takes frames from the camera (see Camera::set_correction()).
+ * Maps depend on the objective and the lighting, so each is saved in its own file named after them, and the one matching the
+ * current setting is loaded. These are:
+ *
+ * public:
+ * Flatfield() -> Only class constructor. Holds no maps until calibrated or loaded.
+ * add_dark(const unsigned char*, int, int) -> Adds a frame of the given width and height to the average dark frame.
+ * 		The lights must be off. Returns false if it differs in size from the frames added before.
+ * add_flat(const unsigned char*, int, int) -> Adds a frame to the average flat frame. The lights must be on, over an empty part of the slide.
+ * build(string, int, string) -> Computes the maps from the two averages, for the given objective, stage LED brightness and ring colour,
+ * 		and starts new averages. Returns false if either has no frames, or the flat frame is no brighter than the dark one.
+ * save(string) -> Saves the maps into the given directory, in the file named by file_name(...).
+ * load(string, string, int, string) -> Loads the maps for an objective, stage LED brightness and ring colour from the given directory.
+ * file_name(string, int, string) -> Name of the file of the maps for a setting, 'flat_<objective>_<led>_<ring>.ffc'.
+ * camera_options(int) -> raspividyuv options fixing the exposure to the given shutter time in microseconds, with unit gains,
+ * 		for Camera::open(...).
+ * is_ready() -> Whether there are maps to correct with.
+ * width(), height() -> Size of the maps, which must be that of the pictures corrected.
+ * correct(const unsigned char*, unsigned char*, size_t, size_t) -> Corrects a run of pixels of an 8-bit plane, starting from the given
+ * 		pixel of the plane, into the output (which can be the input). A whole plane is one run from 0; a row is a run from its start.
+ * correct(float*) -> Corrects a whole plane of floats with the same maps, for pictures loaded as floats.
+ *
+ * private:
+ * add_frame(const unsigned char*, int, int, vector<unsigned int>&, int&) -> Adds a frame to the sums of one of the averages.
+ */
+
+
+
+#ifndef FLATFIELD_CLASS_H
+#define FLATFIELD_CLASS_H
+
+#include <iostream>
+#include <sstream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cstdio>
+
+#include "image_kernels.h"
+
+using namespace std;
+
+// Largest gain, in 8.8 fixed point: 16 times
+#define FLATFIELD_MAX_GAIN 4095
+
+
+
+class Flatfield
+{
+
+private:
+
+	int m_width;
+	int m_height;
+	string m_objective;
+	int m_led;
+	string m_ring;
+
+	// Sums of the frames of the calibration, and how many were added
+	vector<unsigned int> m_dark_sums;
+	vector<unsigned int> m_flat_sums;
+	int m_dark_frames;
+	int m_flat_frames;
+
+	// Maps: dark level of every pixel, and its gain in 8.8 fixed point
+	vector<unsigned char> m_offset;
+	vector<unsigned short> m_gain;
+
+
+	bool add_frame(const unsigned char * frame, int width, int height, vector<unsigned int> &sums, int &frames);
+
+
+public:
+
+	Flatfield();
+
+	bool add_dark(const unsigned char * frame, int width, int height)
+	{	return add_frame(frame, width, height, m_dark_sums, m_dark_frames);	}
+
+	bool add_flat(const unsigned char * frame, int width, int height)
+	{	return add_frame(frame, width, height, m_flat_sums, m_flat_frames);	}
+
+	bool build(string objective, int led, string ring = "000000");
+
+	bool save(string directory);
+
+	bool load(string directory, string objective, int led, string ring = "000000");
+
+	string file_name(string objective, int led, string ring = "000000");
+
+	string camera_options(int shutter_us);
+
+	bool is_ready() const
+	{	return !m_gain.empty();	}
+
+	int width() const
+	{	return m_width;	}
+
+	int height() const
+	{	return m_height;	}
+
+	void correct(const unsigned char * in, unsigned char * out, size_t first, size_t count) const;
+
+	void correct(float * plane) const;
+
+
+};
+
+
+
+
+/* Flatfield class CONSTRUCTOR */
+Flatfield::Flatfield()
+{
+
+	m_width = 0;
+	m_height = 0;
+	m_led = 0;
+	m_dark_frames = 0;
+	m_flat_frames = 0;
+
+}
+
+
+
+
+/* Add a frame to the sums of an average
+ * The first frame of either average sets the size of both, and of the maps they will give. */
+bool Flatfield::add_frame(const unsigned char * frame, int width, int height, vector<unsigned int> &sums, int &frames)
+{
+
+	if (m_dark_frames + m_flat_frames == 0)
+	{
+		m_width = width;
+		m_height = height;
+	}
+	if (width != m_width || height != m_height || width < 1 || height < 1)
+	{
+		cout << "\nThe frame is " << width << "x" << height << ", not " << m_width << "x" << m_height << " as the others" << endl;
+		return false;
+	}
+
+	size_t pixels = (size_t)width*height;
+	if (frames == 0)
+		sums.assign(pixels, 0);
+	for (size_t i=0; i<pixels; i++)
+		sums[i] += frame[i];
+	frames++;
+
+	return true;
+
+}
+
+
+
+
+/* Compute the maps from the averaged dark and flat frames
+ * The gain of a pixel is the mean lit level of the frame over its own, so the corrected flat frame is even at that mean level. */
+bool Flatfield::build(string objective, int led, string ring)
+{
+
+	if (m_dark_frames == 0 || m_flat_frames == 0)
+	{
+		cout << "\nBoth dark and flat frames are needed" << endl;
+		return false;
+	}
+
+	size_t pixels = (size_t)m_width*m_height;
+	vector<float> dark(pixels);
+	vector<float> flat(pixels);
+	double lit = 0;
+	for (size_t i=0; i<pixels; i++)
+	{
+		dark[i] = (float)m_dark_sums[i]/m_dark_frames;
+		flat[i] = (float)m_flat_sums[i]/m_flat_frames;
+		lit += flat[i] - dark[i];
+	}
+	lit /= pixels;
+	m_dark_frames = 0;
+	m_flat_frames = 0;
+	if (lit < 1)
+	{
+		cout << "\nThe flat frame is no brighter than the dark one" << endl;
+		return false;
+	}
+
+	m_offset.resize(pixels);
+	m_gain.resize(pixels);
+	for (size_t i=0; i<pixels; i++)
+	{
+		m_offset[i] = (unsigned char)(dark[i] + 0.5);
+		float level = flat[i] - m_offset[i];
+		float gain = (level < 1) ? FLATFIELD_MAX_GAIN : (float)(256*lit/level + 0.5);
+		m_gain[i] = (unsigned short)((gain > FLATFIELD_MAX_GAIN) ? FLATFIELD_MAX_GAIN : gain);
+	}
+
+	m_objective = objective;
+	m_led = led;
+	m_ring = ring;
+
+	return true;
+
+}
+
+
+
+
+/* Name of the file of the maps for a setting */
+string Flatfield::file_name(string objective, int led, string ring)
+{
+
+	stringstream naming;
+	naming << "flat_" << objective << "_" << led << "_" << ring << ".ffc";
+
+	return naming.str();
+
+}
+
+
+
+
+/* raspividyuv options for a fixed exposure */
+string Flatfield::camera_options(int shutter_us)
+{
+
+	stringstream options;
+	options << "-ex off -ag 1 -dg 1 -ss " << shutter_us;
+
+	return options.str();
+
+}
+
+
+
+
+/* Save the maps
+ * A text header line 'MSFLAT01 <width> <height> <objective> <led> <ring>', then the dark levels, then the gains as little-endian pairs of bytes. */
+bool Flatfield::save(string directory)
+{
+
+	if (!is_ready())
+	{
+		cout << "\nThere are no maps to save" << endl;
+		return false;
+	}
+
+	string location = directory + "/" + file_name(m_objective, m_led, m_ring);
+	FILE * file = fopen(location.c_str(), "wb");
+	if (file == NULL)
+	{
+		cout << "\nCould not open " << location << endl;
+		return false;
+	}
+
+	fprintf(file, "MSFLAT01 %d %d %s %d %s\n", m_width, m_height, m_objective.c_str(), m_led, m_ring.c_str());
+
+	vector<unsigned char> gains(2*m_gain.size());
+	for (size_t i=0; i<m_gain.size(); i++)
+	{
+		gains[2*i] = (unsigned char)(m_gain[i] & 0xff);
+		gains[2*i + 1] = (unsigned char)(m_gain[i] >> 8);
+	}
+	bool written = fwrite(&m_offset[0], 1, m_offset.size(), file) == m_offset.size()
+			&& fwrite(&gains[0], 1, gains.size(), file) == gains.size();
+
+	if (fclose(file) != 0 || !written)
+	{
+		cout << "\nCould not write " << location << endl;
+		return false;
+	}
+
+	return true;
+
+}
+
+
+
+
+/* Load the maps for a setting */
+bool Flatfield::load(string directory, string objective, int led, string ring)
+{
+
+	string location = directory + "/" + file_name(objective, led, ring);
+	ifstream file(location.c_str(), ios::binary);
+	if (!file.is_open())
+	{
+		cout << "\nNo flat field calibration in " << location << endl;
+		return false;
+	}
+
+	string header;
+	getline(file, header);
+	stringstream reading(header);
+	string magic;
+	int width = 0;
+	int height = 0;
+	reading >> magic >> width >> height;
+	if (magic != "MSFLAT01" || width < 1 || height < 1)
+	{
+		cout << "\n" << location << " is not a flat field calibration" << endl;
+		return false;
+	}
+
+	size_t pixels = (size_t)width*height;
+	vector<unsigned char> offset(pixels);
+	vector<unsigned char> gains(2*pixels);
+	file.read((char *)&offset[0], pixels);
+	file.read((char *)&gains[0], 2*pixels);
+	if (!file)
+	{
+		cout << "\n" << location << " is incomplete" << endl;
+		return false;
+	}
+
+	m_width = width;
+	m_height = height;
+	m_objective = objective;
+	m_led = led;
+	m_ring = ring;
+	m_offset.swap(offset);
+	m_gain.resize(pixels);
+	for (size_t i=0; i<pixels; i++)
+		m_gain[i] = (unsigned short)(gains[2*i] | (gains[2*i + 1] << 8));
+
+	return true;
+
+}
+
+
+
+
+/* Correct a run of pixels
+ * out = ((in - dark) * gain + 128) / 256, with the subtraction saturating at 0 and the result at 255.
+ * The product needs up to 20 bits, so the vector loops widen it to 32: NEON multiplies long and narrows with a rounding shift, SSE2
+ * puts the low and high halves of the 16 by 16 bit product back together. Gains are kept below 16, so the shifted result fits in 16
+ * bits before it is saturated to 8. The scalar loop computes the same for the last pixels, and all of them round to nearest, as
+ * correct(float*) would. */
+void Flatfield::correct(const unsigned char * in, unsigned char * out, size_t first, size_t count) const
+{
+
+	const unsigned char * offset = &m_offset[first];
+	const unsigned short * gain = &m_gain[first];
+	size_t i = 0;
+
+#if defined(KERNELS_NEON)
+	for (; i+16<=count; i+=16)
+	{
+		uint8x16_t level = vqsubq_u8(vld1q_u8(in + i), vld1q_u8(offset + i));
+		uint16x8_t low = vmovl_u8(vget_low_u8(level));
+		uint16x8_t high = vmovl_u8(vget_high_u8(level));
+		uint16x8_t gain_low = vld1q_u16(gain + i);
+		uint16x8_t gain_high = vld1q_u16(gain + i + 8);
+		uint16x8_t result_low = vcombine_u16(vrshrn_n_u32(vmull_u16(vget_low_u16(low), vget_low_u16(gain_low)), 8),
+				vrshrn_n_u32(vmull_u16(vget_high_u16(low), vget_high_u16(gain_low)), 8));
+		uint16x8_t result_high = vcombine_u16(vrshrn_n_u32(vmull_u16(vget_low_u16(high), vget_low_u16(gain_high)), 8),
+				vrshrn_n_u32(vmull_u16(vget_high_u16(high), vget_high_u16(gain_high)), 8));
+		vst1q_u8(out + i, vcombine_u8(vqmovn_u16(result_low), vqmovn_u16(result_high)));
+	}
+#elif defined(KERNELS_SSE)
+	__m128i zero = _mm_setzero_si128();
+	__m128i rounding = _mm_set1_epi32(128);
+	for (; i+16<=count; i+=16)
+	{
+		__m128i level = _mm_subs_epu8(_mm_loadu_si128((const __m128i *)(in + i)), _mm_loadu_si128((const __m128i *)(offset + i)));
+		__m128i halves[2];
+		for (int half=0; half<2; half++)
+		{
+			__m128i pixels = half ? _mm_unpackhi_epi8(level, zero) : _mm_unpacklo_epi8(level, zero);
+			__m128i gains = _mm_loadu_si128((const __m128i *)(gain + i + 8*half));
+			__m128i product_low = _mm_mullo_epi16(pixels, gains);
+			__m128i product_high = _mm_mulhi_epu16(pixels, gains);
+			__m128i first = _mm_srli_epi32(_mm_add_epi32(_mm_unpacklo_epi16(product_low, product_high), rounding), 8);
+			__m128i second = _mm_srli_epi32(_mm_add_epi32(_mm_unpackhi_epi16(product_low, product_high), rounding), 8);
+			// At most 4080, so the signed pack does not saturate
+			halves[half] = _mm_packs_epi32(first, second);
+		}
+		_mm_storeu_si128((__m128i *)(out + i), _mm_packus_epi16(halves[0], halves[1]));
+	}
+#endif
+
+	for (; i<count; i++)
+	{
+		unsigned int level = (in[i] > offset[i]) ? in[i] - offset[i] : 0;
+		unsigned int result = (level*gain[i] + 128) >> 8;
+		out[i] = (unsigned char)((result > 255) ? 255 : result);
+	}
+
+	return;
+
+}
+
+
+
+
+/* Correct a whole plane of floats, which are not rounded or saturated */
+void Flatfield::correct(float * plane) const
+{
+
+	size_t pixels = m_offset.size();
+	for (size_t i=0; i<pixels; i++)
+	{
+		float level = plane[i] - m_offset[i];
+		plane[i] = (level > 0) ? level*m_gain[i]*(1.0f/256) : 0;
+	}
+
+	return;
+
+}
+
+
+
+#endif
@@ -169,25 +169,25 @@ void focus_tune(Autofocus &autof)
 			
 			if (autof.get_objective().compare("4x") == 0)
 			{
-				autof.set_steps(200);
+				autof.set_steps(200*MICROSTEPS_PER_STEP);
 				cout << "\nRunning fine tuning" << flush;
 				autof.fine_tune();
 			}
 			else if (autof.get_objective().compare("10x") == 0)
 			{
-				autof.set_steps(40);
+				autof.set_steps(40*MICROSTEPS_PER_STEP);
 				cout << "\nRunning fine tuning" << flush;
 				autof.fine_tune();
 			}
 			else if (autof.get_objective().compare("40x") == 0)
 			{
-				autof.set_steps(10);
+				autof.set_steps(10*MICROSTEPS_PER_STEP);
 				cout << "\nRunning fine tuning" << flush;
 				autof.fine_tune();
 			}
 			else if (autof.get_objective().compare("100x") == 0)
 			{
-				autof.set_steps(3);
+				autof.set_steps(3*MICROSTEPS_PER_STEP);
 				cout << "\nRunning fine tuning" << flush;
 				autof.fine_tune();
 			}
@@ -213,7 +213,7 @@ void focus_tune(Autofocus &autof)
 						
 			
 			// Set initial number of steps
-			autof.set_steps(200);
+			autof.set_steps(200*MICROSTEPS_PER_STEP);
 			
 			
 			// Run fine tuning
@@ -245,7 +245,7 @@ void serial_send(Autofocus &autof)
 	while (serial_commanding)
 	{
 		
-		cout << "\n\tWhat Arduino command would you like to use?\n\t('z_get_length', 'z_get_position', 'z_move', 'z_move_to', 'set_ring_colour', 'set_ring_brightness', 'set_stage_led_brightness', 'exit')\n\n\t" << flush;
+		cout << "\n\tWhat Arduino command would you like to use?\n\t('z_get_length', 'z_get_position', 'z_move', 'z_move_to', 'z_set_step_mode', 'set_ring_colour', 'set_ring_brightness', 'set_stage_led_brightness', 'exit')\n\n\t" << flush;
 		cin >> command;
 		
 		if (command.compare("z_get_length") == 0)
@@ -272,6 +272,12 @@ void serial_send(Autofocus &autof)
 			cin >> argument_int; cout << endl;
 			autof.comm_move_to(argument_int, true);
 		}
+		else if (command.compare("z_set_step_mode") == 0)
+		{
+			cout << "\tArgument ('coarse' or 'fine'): " << flush;
+			cin >> argument_string; cout << endl;
+			autof.comm_set_step_mode(argument_string, true);
+		}
 		else if (command.compare("set_ring_colour") == 0)
 		{
 			cout << "\tArgument: " << flush;
@@ -0,0 +1,212 @@
+// Focus Stack Class
+
+/* This file contains the class that fuses a z-stack into a single picture in focus everywhere (extended depth of field).
+ * Every pixel of the fused picture is taken from the slice where its neighbourhood is sharpest, the sharpness being the
+ * normalised variance that Autofocus::algorithm() uses for whole pictures, taken over a small box around each pixel.
+ * Slices are fused one at a time as they arrive, keeping only the fused picture, the best sharpness so far and the slice it came from
+ * for every pixel, so memory doesn't grow with the depth of the stack and the result is ready as soon as the last slice is added.
+ * These are:
+ *
+ * public:
+ * Focusstack(int) -> Only class constructor. Takes the radius of the box the sharpness is measured over (default 4, a 9x9 box).
+ * 		Larger boxes give smoother depth maps but blur the boundaries between regions in focus at different heights.
+ * add(const unsigned char*, int, int, int) -> Fuses a slice, given as an 8-bit luma plane of the given width and height (rows packed)
+ * 		taken at the given stage position. The first slice after clear() sets the size; slices of another size are refused.
+ * 		It has the arguments of a ZStack listener, so a stack can be fused while it is being taken (see set_listener() in zstack_class.h).
+ * clear() -> Starts a new stack, keeping the memory of the planes.
+ * slices() -> Number of slices fused so far.
+ * width(), height() -> Size of the fused picture.
+ * fused() -> The fused picture, width()*height() bytes.
+ * depth() -> For every pixel, the number of the slice it was taken from (0 for the first slice added).
+ * position(int) -> Stage position of a slice, so depth() can be turned into heights.
+ * save(string, string) -> Saves the fused picture, and if a second name is given the depth map, as PGM pictures.
+ * 		The depth map is scaled so the first slice is black and the last one white.
+ */
+
+
+
+#ifndef FOCUSSTACK_CLASS_H
+#define FOCUSSTACK_CLASS_H
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <cstdio>
+
+#include "image_kernels.h"
+#include "pgm_io.h"
+
+
+
+class Focusstack
+{
+
+private:
+
+	int m_width;
+	int m_height;
+	vector<float> m_box;
+
+	// Result, kept from one slice to the next
+	vector<unsigned char> m_fused;
+	vector<float> m_best;
+	vector<unsigned short> m_depth;
+	vector<int> m_positions;
+
+	// Working planes for the sharpness of the current slice
+	vector<float> m_luma;
+	vector<float> m_sharpness;
+	vector<float> m_squares;
+	vector<float> m_temp;
+
+
+public:
+
+	Focusstack(int radius = 4);
+
+	bool add(const unsigned char * luma, int width, int height, int position);
+
+	void clear()
+	{	m_positions.clear(); return;	}
+
+	int slices()
+	{	return (int)m_positions.size();	}
+
+	int width()
+	{	return m_width;	}
+
+	int height()
+	{	return m_height;	}
+
+	const unsigned char * fused()
+	{	return &m_fused[0];	}
+
+	const unsigned short * depth()
+	{	return &m_depth[0];	}
+
+	int position(int slice)
+	{	return m_positions[slice];	}
+
+	bool save(string fused_file, string depth_file = "");
+
+
+};
+
+
+
+
+/* Focusstack class CONSTRUCTOR */
+Focusstack::Focusstack(int radius)
+{
+
+	box_kernel((radius < 1) ? 1 : radius, m_box);
+	m_width = 0;
+	m_height = 0;
+
+}
+
+
+
+
+/* Fuse one slice
+ * Where this slice is sharper than any before, its pixels replace the fused ones and its number goes into the depth map
+ * Ties keep the earlier slice, so a featureless area stays on the first slice rather than flickering between them */
+bool Focusstack::add(const unsigned char * luma, int width, int height, int position)
+{
+
+	size_t pixels = (size_t)width*height;
+
+	if (m_positions.empty())
+	{
+		m_width = width;
+		m_height = height;
+
+		// Vectors keep their memory when resized, so later stacks reuse the planes
+		m_fused.resize(pixels);
+		m_best.resize(pixels);
+		m_depth.resize(pixels);
+		m_luma.resize(pixels);
+		m_sharpness.resize(pixels);
+		m_squares.resize(pixels);
+		m_temp.resize(pixels);
+	}
+	else if (width != m_width || height != m_height)
+	{
+		cout << "\nSlice of " << width << "x" << height << " in a stack of " << m_width << "x" << m_height << ", not fused" << endl;
+		return false;
+	}
+
+	for (size_t i=0; i<pixels; i++)
+		m_luma[i] = luma[i];
+
+	local_normalised_variance(&m_luma[0], &m_sharpness[0], &m_squares[0], &m_temp[0], m_width, m_height, m_box);
+
+	unsigned short slice = (unsigned short)m_positions.size();
+	if (slice == 0)
+	{
+		for (size_t i=0; i<pixels; i++)
+		{
+			m_best[i] = m_sharpness[i];
+			m_fused[i] = luma[i];
+			m_depth[i] = 0;
+		}
+	}
+	else
+	{
+		for (size_t i=0; i<pixels; i++)
+		{
+			if (m_sharpness[i] > m_best[i])
+			{
+				m_best[i] = m_sharpness[i];
+				m_fused[i] = luma[i];
+				m_depth[i] = slice;
+			}
+		}
+	}
+
+	m_positions.push_back(position);
+
+	return true;
+
+}
+
+
+
+
+/* Save the fused picture, and the depth map if a name is given for it, as binary PGM pictures */
+bool Focusstack::save(string fused_file, string depth_file)
+{
+
+	if (m_positions.empty())
+	{
+		cout << "\nNothing fused to save" << endl;
+		return false;
+	}
+
+	size_t pixels = (size_t)m_width*m_height;
+
+	if (!write_pgm(fused_file, &m_fused[0], m_width, m_height))
+		return false;
+
+	if (depth_file.empty())
+		return true;
+
+	// Slice numbers spread over the grey levels
+	int last = (int)m_positions.size() - 1;
+	vector<unsigned char> scaled(pixels, 0);
+	if (last > 0)
+	{
+		for (size_t i=0; i<pixels; i++)
+			scaled[i] = (unsigned char)(m_depth[i]*255/last);
+	}
+
+	stringstream comment;
+	comment << "slices " << last + 1 << " from z " << m_positions[0] << " to " << m_positions[last];
+
+	return write_pgm(depth_file, &scaled[0], m_width, m_height, comment.str());
+
+}
+
+
+
+#endif
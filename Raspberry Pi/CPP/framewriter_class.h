@@ -0,0 +1,544 @@
+// Frame Writer Class
+
+/* This file contains the class that saves frames on a background thread, so encoding and writing them never holds up the next acquisition.
+ * Frames are handed over by pointer into a queue, which the writer thread empties in order. A frame is either a luma plane, saved as a
+ * binary PGM picture with a comment carrying whatever describes it (time, position, channel...), optionally gzip compressed,
+ * or a picture already encoded in a scratch file (such as a JPEG from raspistill in memory-backed /dev/shm), moved to its place.
+ * The queue can be bounded in bytes, with a policy for when the card falls behind and it fills: wait for room, drop the frame,
+ * or halve the frame in both directions so it takes a quarter of the room (dropping it if even that doesn't fit).
+ * Files are flushed to the card in batches, after so many frames or milliseconds, rather than one sync per frame.
+ * These are:
+ *
+ * public:
+ * Framewriter() -> Only class constructor. Starts nothing. The queue is unbounded until set_limit(...).
+ * ~Framewriter() -> Class destructor, writing what is left in the queue and stopping the thread if started.
+ * set_limit(size_t, int) -> Chooses the most bytes of frames that may wait in the queue (0 for no limit), and what write(...) does when
+ * 		a frame doesn't fit: FRAMEWRITER_BLOCK, FRAMEWRITER_DROP or FRAMEWRITER_DOWNSAMPLE.
+ * set_sync(int, int) -> Chooses to sync the files written to the card once this many are waiting, or once the oldest has waited this many
+ * 		milliseconds, whichever comes first (default 16 and 2000; 0 frames never syncs, leaving it to the system).
+ * set_compression(int) -> Saves luma planes gzip compressed at this level, as '<file>.gz' (default 0, not compressed).
+ * start() -> Starts the writer thread.
+ * write(Frame*) -> Queues a frame to be saved, taking ownership of it. Returns false if the frame was dropped.
+ * stop() -> Waits for the queue to be written and synced, then stops the thread. Returns false if any frame could not be saved.
+ * written(), failed(), dropped(), downsampled() -> Frames saved, frames that could not be saved, dropped, and halved, so far.
+ * peak_queue() -> Largest number of frames that were waiting at once.
+ *
+ * private:
+ * writer() -> Loop of the writer thread.
+ * save(const Frame&) -> Saves one frame, returning the descriptor to sync it through. A scratch file is gone once it has been saved,
+ * 		moved or copied and deleted, and is left where it was if it could not be.
+ * sync_all() -> Syncs and closes the files waiting to be synced.
+ * downsample(Frame*) -> Halves a luma plane in both directions.
+ * frame_bytes(const Frame*) -> Room a frame takes in the queue.
+ * discard(Frame*) -> Deletes a frame that is not saved, with its scratch file if it has one.
+ */
+
+
+
+#ifndef FRAMEWRITER_CLASS_H
+#define FRAMEWRITER_CLASS_H
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <boost/thread.hpp>
+#include <boost/bind/bind.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include "pgm_io.h"
+
+using namespace std;
+
+
+// What write(...) does with a frame that doesn't fit in the queue
+#define FRAMEWRITER_BLOCK 0
+#define FRAMEWRITER_DROP 1
+#define FRAMEWRITER_DOWNSAMPLE 2
+
+
+
+// A frame to be saved in the given file: a luma plane, with a comment for its header (without the '#', may be empty),
+// or, if source is given, an encoded file to move there instead
+struct Frame
+{
+	string file;
+	string comment;
+	int width;
+	int height;
+	vector<unsigned char> luma;
+	string source;
+};
+
+
+
+class Framewriter
+{
+
+private:
+
+	boost::thread m_thread;
+	boost::mutex m_mutex;
+	boost::condition_variable m_queued;
+	boost::condition_variable m_taken;
+	deque<Frame *> m_queue;
+	bool m_running;
+
+	// Bound of the queue and what to do when it is reached
+	size_t m_limit;
+	size_t m_queued_bytes;
+	int m_policy;
+
+	// Files written and not yet synced, and since when
+	int m_sync_frames;
+	int m_sync_ms;
+	vector<int> m_unsynced;
+	boost::posix_time::ptime m_oldest_unsynced;
+	int m_level;
+
+	int m_written;
+	int m_failed;
+	int m_dropped;
+	int m_downsampled;
+	int m_peak_queue;
+
+
+	void writer();
+
+	int save(const Frame &frame);
+
+	void sync_all();
+
+	void downsample(Frame * frame);
+
+	size_t frame_bytes(const Frame * frame);
+
+	void discard(Frame * frame);
+
+
+public:
+
+	Framewriter();
+
+	~Framewriter();
+
+	void set_limit(size_t bytes, int policy = FRAMEWRITER_BLOCK)
+	{	boost::mutex::scoped_lock lock(m_mutex); m_limit = bytes; m_policy = policy; m_taken.notify_all(); return;	}
+
+	void set_sync(int frames = 16, int ms = 2000)
+	{	m_sync_frames = (frames < 0) ? 0 : frames; m_sync_ms = ms; return;	}
+
+	void set_compression(int level = 0)
+	{	m_level = (level < 0) ? 0 : ((level > 9) ? 9 : level); return;	}
+
+	void start();
+
+	bool write(Frame * frame);
+
+	bool stop();
+
+	int written()
+	{	boost::mutex::scoped_lock lock(m_mutex); return m_written;	}
+
+	int failed()
+	{	boost::mutex::scoped_lock lock(m_mutex); return m_failed;	}
+
+	int dropped()
+	{	boost::mutex::scoped_lock lock(m_mutex); return m_dropped;	}
+
+	int downsampled()
+	{	boost::mutex::scoped_lock lock(m_mutex); return m_downsampled;	}
+
+	int peak_queue()
+	{	boost::mutex::scoped_lock lock(m_mutex); return m_peak_queue;	}
+
+
+};
+
+
+
+
+/* Framewriter class CONSTRUCTOR */
+Framewriter::Framewriter()
+{
+
+	m_running = false;
+	m_limit = 0;
+	m_queued_bytes = 0;
+	m_policy = FRAMEWRITER_BLOCK;
+	set_sync();
+	set_compression();
+
+	m_written = 0;
+	m_failed = 0;
+	m_dropped = 0;
+	m_downsampled = 0;
+	m_peak_queue = 0;
+
+}
+
+
+
+
+/* Framewriter class DESTRUCTOR */
+Framewriter::~Framewriter()
+{
+
+	stop();
+
+}
+
+
+
+
+/* Start the writer thread, clearing the counts of the last run */
+void Framewriter::start()
+{
+
+	stop();
+
+	m_written = 0;
+	m_failed = 0;
+	m_dropped = 0;
+	m_downsampled = 0;
+	m_peak_queue = 0;
+	m_running = true;
+	m_thread = boost::thread(boost::bind(&Framewriter::writer, this));
+
+	return;
+
+}
+
+
+
+
+/* Queue a frame for the writer thread, applying the policy if the queue is full
+ * A frame larger than the whole limit is let into an empty queue, so blocking can't wait forever */
+bool Framewriter::write(Frame * frame)
+{
+
+	boost::mutex::scoped_lock lock(m_mutex);
+
+	size_t bytes = frame_bytes(frame);
+	bool halved = false;
+	if (m_limit > 0 && m_queued_bytes > 0 && m_queued_bytes + bytes > m_limit)
+	{
+		if (m_policy == FRAMEWRITER_BLOCK)
+		{
+			while (m_running && m_queued_bytes > 0 && m_queued_bytes + bytes > m_limit)
+				m_taken.wait(lock);
+		}
+		else if (m_policy == FRAMEWRITER_DOWNSAMPLE && frame->source.empty() && frame->width > 1 && frame->height > 1)
+		{
+			downsample(frame);
+			halved = true;
+			bytes = frame_bytes(frame);
+		}
+	}
+
+	if (!m_running || (m_limit > 0 && m_queued_bytes > 0 && m_queued_bytes + bytes > m_limit))
+	{
+		m_dropped++;
+		lock.unlock();
+		discard(frame);
+		return false;
+	}
+
+	if (halved)
+		m_downsampled++;
+	m_queue.push_back(frame);
+	m_queued_bytes += bytes;
+	if ((int)m_queue.size() > m_peak_queue)
+		m_peak_queue = (int)m_queue.size();
+	m_queued.notify_one();
+
+	return true;
+
+}
+
+
+
+
+/* Let the writer thread empty the queue and sync, then stop it */
+bool Framewriter::stop()
+{
+
+	{
+		boost::mutex::scoped_lock lock(m_mutex);
+		if (!m_running)
+			return m_failed == 0;
+		m_running = false;
+		m_queued.notify_all();
+		m_taken.notify_all();
+	}
+	m_thread.join();
+
+	return m_failed == 0;
+
+}
+
+
+
+
+/* Writer thread
+ * Saves queued frames in order until stop() is called and the queue is empty. While waiting for frames it wakes up often enough
+ * to sync files that have waited too long, and the last ones are synced before it returns. */
+void Framewriter::writer()
+{
+
+	while (true)
+	{
+
+		Frame * frame = NULL;
+		{
+			boost::mutex::scoped_lock lock(m_mutex);
+			while (m_queue.empty() && m_running)
+			{
+				if (m_unsynced.empty())
+					m_queued.wait(lock);
+				else
+				{
+					boost::posix_time::ptime due = m_oldest_unsynced + boost::posix_time::milliseconds(m_sync_ms);
+					if (!m_queued.timed_wait(lock, due) && m_queue.empty())
+						break;
+				}
+			}
+			if (!m_queue.empty())
+			{
+				frame = m_queue.front();
+				m_queue.pop_front();
+				m_queued_bytes -= frame_bytes(frame);
+				m_taken.notify_all();
+			}
+			else if (!m_running)
+			{
+				lock.unlock();
+				sync_all();
+				return;
+			}
+		}
+
+		if (frame != NULL)
+		{
+			// save() has dealt with the scratch file, whose name may already belong to a newer picture
+			int descriptor = save(*frame);
+			delete frame;
+
+			boost::mutex::scoped_lock lock(m_mutex);
+			if (descriptor < -1)
+				m_failed++;
+			else
+				m_written++;
+			lock.unlock();
+
+			if (descriptor >= 0)
+			{
+				if (m_unsynced.empty())
+					m_oldest_unsynced = boost::posix_time::microsec_clock::universal_time();
+				m_unsynced.push_back(descriptor);
+			}
+		}
+
+		bool overdue = !m_unsynced.empty() &&
+				boost::posix_time::microsec_clock::universal_time() >= m_oldest_unsynced + boost::posix_time::milliseconds(m_sync_ms);
+		if ((m_sync_frames > 0 && (int)m_unsynced.size() >= m_sync_frames) || overdue)
+			sync_all();
+
+	}
+
+}
+
+
+
+
+/* Save one frame
+ * Returns a descriptor of the file saved, kept open for the batched sync, -1 if there is nothing to sync, or -2 if it failed */
+int Framewriter::save(const Frame &frame)
+{
+
+	string location = frame.file;
+	int descriptor = -1;
+
+	if (!frame.source.empty())
+	{
+		// Scratch files on another filesystem can't be renamed, so they are copied, and only deleted once the copy is complete
+		if (rename(frame.source.c_str(), location.c_str()) == 0)
+			descriptor = (m_sync_frames > 0) ? ::open(location.c_str(), O_RDONLY) : -1;
+		else
+		{
+			FILE * in = fopen(frame.source.c_str(), "rb");
+			FILE * out = fopen(location.c_str(), "wb");
+			bool copied = (in != NULL && out != NULL);
+			char buffer[65536];
+			size_t got;
+			while (copied && (got = fread(buffer, 1, sizeof buffer, in)) > 0)
+				copied = fwrite(buffer, 1, got, out) == got;
+			if (in != NULL)
+				fclose(in);
+			if (out != NULL)
+			{
+				fflush(out);
+				descriptor = (m_sync_frames > 0 && copied) ? dup(fileno(out)) : -1;
+				if (fclose(out) != 0)
+					copied = false;
+			}
+			if (!copied)
+			{
+				cout << "\nCould not move " << frame.source << " to " << location << ", left where it was" << endl;
+				return -2;
+			}
+			unlink(frame.source.c_str());
+		}
+		return descriptor;
+	}
+
+	string header = pgm_header(frame.width, frame.height, frame.comment);
+
+	bool written;
+	if (m_level > 0)
+	{
+		location += ".gz";
+		int file = ::open(location.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (file < 0)
+		{
+			cout << "\nCould not open " << location << endl;
+			return -2;
+		}
+		descriptor = (m_sync_frames > 0) ? dup(file) : -1;
+
+		stringstream mode;
+		mode << "wb" << m_level;
+		gzFile compressed = gzdopen(file, mode.str().c_str());
+		written = (compressed != NULL);
+		if (written)
+		{
+			written = gzwrite(compressed, header.c_str(), header.size()) == (int)header.size() &&
+					gzwrite(compressed, &frame.luma[0], frame.luma.size()) == (int)frame.luma.size();
+			written = (gzclose(compressed) == Z_OK) && written;
+		}
+		else
+			::close(file);
+	}
+	else
+	{
+		FILE * file = fopen(location.c_str(), "wb");
+		if (file == NULL)
+		{
+			cout << "\nCould not open " << location << endl;
+			return -2;
+		}
+		written = fwrite(header.c_str(), 1, header.size(), file) == header.size() &&
+				fwrite(&frame.luma[0], 1, frame.luma.size(), file) == frame.luma.size();
+		fflush(file);
+		descriptor = (m_sync_frames > 0) ? dup(fileno(file)) : -1;
+		if (fclose(file) != 0)
+			written = false;
+	}
+
+	if (!written)
+	{
+		cout << "\nCould not write " << location << endl;
+		if (descriptor >= 0)
+			::close(descriptor);
+		return -2;
+	}
+
+	return descriptor;
+
+}
+
+
+
+
+/* Sync the files waiting for it, one batch at a time */
+void Framewriter::sync_all()
+{
+
+	for (size_t i=0; i<m_unsynced.size(); i++)
+	{
+		fdatasync(m_unsynced[i]);
+		::close(m_unsynced[i]);
+	}
+	m_unsynced.clear();
+
+	return;
+
+}
+
+
+
+
+/* Halve a luma plane in both directions, each pixel the mean of the 2x2 it replaces */
+void Framewriter::downsample(Frame * frame)
+{
+
+	int width = frame->width/2;
+	int height = frame->height/2;
+	int stride = frame->width;
+	unsigned char * pixels = &frame->luma[0];
+
+	// In place: each output pixel only reads pixels at or after it
+	for (int y=0; y<height; y++)
+	{
+		for (int x=0; x<width; x++)
+		{
+			const unsigned char * in = pixels + (size_t)2*y*stride + 2*x;
+			pixels[(size_t)y*width + x] = (unsigned char)((in[0] + in[1] + in[stride] + in[stride + 1] + 2)/4);
+		}
+	}
+
+	frame->width = width;
+	frame->height = height;
+	frame->luma.resize((size_t)width*height);
+	vector<unsigned char>(frame->luma).swap(frame->luma);
+	frame->comment += (frame->comment.empty() ? "" : " ");
+	frame->comment += "downsampled 2";
+
+	return;
+
+}
+
+
+
+
+/* Room a frame takes in the queue: its pixels, or the size of its scratch file, which is in memory too if in /dev/shm */
+size_t Framewriter::frame_bytes(const Frame * frame)
+{
+
+	if (frame->source.empty())
+		return frame->luma.size();
+
+	struct stat status;
+	if (stat(frame->source.c_str(), &status) != 0)
+		return 0;
+
+	return (size_t)status.st_size;
+
+}
+
+
+
+
+/* Delete a frame that won't be saved, and its scratch file */
+void Framewriter::discard(Frame * frame)
+{
+
+	if (!frame->source.empty())
+		unlink(frame->source.c_str());
+	delete frame;
+
+	return;
+
+}
+
+
+
+#endif
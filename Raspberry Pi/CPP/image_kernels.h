@@ -0,0 +1,1653 @@
+// Image Kernels
+
+/* This file contains the low level filters shared by the image processing classes.
+ * They all work on single channel planes of floats stored row-major (index y*width + x), so they can be vectorised
+ * and used on any plane regardless of where it came from.
+ * Where the compiler targets NEON (Raspberry Pi 2 and later) or SSE2 the inner loops process four pixels at a time,
+ * otherwise they fall back to plain scalar code giving the same results.
+ *
+ * gaussian_kernel(float, vector<float>&) -> Fills a normalised 1D gaussian of the given sigma, with a radius of 3 sigma.
+ * box_kernel(int, vector<float>&) -> Fills a normalised 1D box (mean) filter of the given radius.
+ * filter_rows(...) -> Convolves every row of a plane with a 1D kernel, replicating the edge pixels beyond the border.
+ * filter_columns(...) -> Convolves every column of a plane with a 1D kernel, replicating the edge rows beyond the border.
+ * 		It can be limited to a range of output rows, so that horizontal bands of one plane can be filtered in parallel.
+ * separable_filter(...) -> Smooths a plane with a 1D kernel along rows and then columns.
+ * 		Gaussian and box filters are separable, so this gives the same result as the full 2D convolution
+ * 		for 2*size instead of size*size operations per pixel.
+ * 		filter_rows and filter_columns hand kernels of 3, 5, 7, 9 or 11 taps to filter_rows_fixed<SIZE> and filter_columns_fixed<SIZE>,
+ * 		whose tap loops have a length known at compile time, so the compiler unrolls them and keeps the taps in registers.
+ * 		Other lengths take the generic loops.
+ * normalised_variance(const float*, size_t) -> Focus value of a whole plane: the variance of its pixels divided by their mean.
+ * 		This is the measure Autofocus::algorithm() maximises.
+ * local_normalised_variance(...) -> The same measure for the neighbourhood of every pixel, from box filters of the plane and of its squares,
+ * 		so each pixel gets a sharpness on the same scale as the focus value of a picture. Used to fuse z-stacks (see focusstack_class.h).
+ * convolve_matrix(...) -> Convolves a plane with a square matrix of odd size, replicating the edge pixels beyond the border.
+ * 		Matrices of size 3, 5 and 7 are handed to convolve_fixed<SIZE> in the same way; other sizes take a generic loop.
+ * sobel_planes(...) -> Computes the Sobel gradient of a plane into separate gx, gy, magnitude and direction planes.
+ * 		The magnitude is either the usual L2 norm or, if asked for, the cheaper L1 norm |gx| + |gy|.
+ * 		Like filter_columns(...) it can be limited to a range of rows.
+ * 		If given a histogram it also adds the magnitude of every pixel with a gradient to it, and to the sum, on the same pass.
+ * gradient_rows(...) and gradient_columns(...) -> Larger 5x5 and 7x7 Sobel-like gradients, as a pass along the rows and then one along the columns.
+ * 		Their coefficients are compile-time constants of Gradient_kernel<SIZE>, scaled to give the same response to a step as the 3x3 one,
+ * 		so thresholds and the histogram range hold for every size. A size of 3 is handed to sobel_planes(...) by the caller.
+ * gradient_directions(...) -> Quantises the directions of a row of gradients and adds its magnitudes to the histogram, for both of the above.
+ * histogram_add(unsigned int*, float) -> Adds one gradient magnitude to a histogram of MAGNITUDE_BINS bins.
+ * histogram_percentile(const unsigned int*, float) -> Magnitude below which the given fraction of the histogram lies.
+ * histogram_otsu(const unsigned int*) -> Magnitude splitting the histogram in two classes of greatest variance between them (Otsu's method).
+ * choose_thresholds(...) -> High and low edge thresholds from a magnitude histogram and its sum, by one of the THRESHOLD_* methods:
+ * 		THRESHOLD_MEAN -> high and low are multipliers of the mean magnitude.
+ * 		THRESHOLD_PERCENTILE -> high is the fraction of pixels below the high threshold, and low the ratio of the low threshold to the high one.
+ * 		THRESHOLD_OTSU -> the high threshold is found by Otsu's method, and low is the ratio of the low threshold to it (high is not used).
+ * quantise_direction(float, float) -> Quantises the direction of a gradient into one of the four DIR_* codes.
+ * 		This compares the slope |gy|/|gx| with tan(22.5) and tan(67.5) rather than calling atan2.
+ * suppress_edges(...) -> Non-maximum suppression and double thresholding: pixels that are a maximum of the gradient magnitude along their direction
+ * 		become major edges above the high threshold and minor edges above the low one; all others, and any pixel outside the allowed rows
+ * 		or within the EDGE_BORDER columns, become non-edges.
+ * hysteresis(...) -> Promotes every minor edge connected to a major edge (through other minor edges within LINK_RADIUS pixels) to major,
+ * 		and clears the rest. It is a flood fill from the major edges using a stack of plane indices, so each pixel is pushed at most once
+ * 		and chains of any shape are followed to the end.
+ * 		It is built from three steps that can also be used on their own over a range of rows, to link horizontal bands in parallel:
+ * 		seed_edges(...) pushes the major edges, link_edges(...) runs the flood fill and clear_minor_edges(...) clears what is left.
+ * fft(...) -> In place radix-2 fast Fourier transform of n complex values (n a power of two) held as separate real and imaginary arrays,
+ * 		with a stride between values so the same code transforms rows and columns. The inverse is not scaled.
+ * fft_2d(...) -> 2D transform of a plane of complex values, rows and then columns. The inverse is scaled by 1/(width*height),
+ * 		so a forward and an inverse transform give back the plane.
+ * fft_plan(int, Fft_plan&) -> Prepares the transform of one length: the pairs of values swapped by the bit reversal and the table of twiddle factors,
+ * 		as FFTW prepares a plan, so transforms run again and again at that length (as by deconvolution_class.h) compute no index or sin/cos.
+ * fft_execute(const Fft_plan&, ...) -> The same transform as fft(...), from a plan. A plan is only read, so threads can share it.
+ * power_of_two_below(int) -> Largest power of two not above the given number, for choosing transform sizes.
+ * phase_correlate(...) -> Finds the shift between two equally sized windows (both sides powers of two) by phase correlation:
+ * 		the inverse transform of their normalised cross-power spectrum peaks at the shift, found to a fraction of a pixel.
+ * 		Returns the height of the peak, near 1 for windows that match and near 0 for unrelated ones, as a measure of confidence.
+ */
+
+#ifndef IMAGE_KERNELS_H
+#define IMAGE_KERNELS_H
+
+#include <cmath>
+#include <cstddef>
+#include <vector>
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define KERNELS_NEON
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define KERNELS_SSE
+#endif
+
+using namespace std;
+
+// Separable noise damping filters
+#define SMOOTH_GAUSSIAN 0
+#define SMOOTH_BOX 1
+
+// Quantised gradient directions, named after the direction of the line of pixels that non-maximum suppression compares against
+// DIR_0 -> (x-1,y) and (x+1,y), DIR_45 -> (x-1,y-1) and (x+1,y+1), DIR_90 -> (x,y-1) and (x,y+1), DIR_135 -> (x+1,y-1) and (x-1,y+1)
+#define DIR_0 0
+#define DIR_45 1
+#define DIR_90 2
+#define DIR_135 3
+
+#define TAN_22_5 0.41421356f
+
+// Edge classes of a pixel, as left by non-maximum suppression and hysteresis
+#define EDGE_NONE 0
+#define EDGE_MINOR 1
+#define EDGE_MAJOR 2
+
+// Gradient magnitude histogram, for choosing the thresholds
+// The magnitudes of 8-bit pictures stay below MAGNITUDE_RANGE: at most 4*255 for each Sobel component, so 2040 for the L1 norm
+#define MAGNITUDE_BINS 1024
+#define MAGNITUDE_RANGE 2048.0f
+
+// Ways of choosing the thresholds from the histogram
+#define THRESHOLD_MEAN 0
+#define THRESHOLD_PERCENTILE 1
+#define THRESHOLD_OTSU 2
+
+// Pixels this close to the left and top of the picture (one less on the right and bottom) are never edges
+#define EDGE_BORDER 3
+
+// Minor edges up to this many pixels away from a major edge, in x and y, are linked to it
+#define LINK_RADIUS 2
+
+
+// Thin wrappers over the vector instructions, so the kernels are written once for both instruction sets
+#if defined(KERNELS_NEON)
+
+#define KERNELS_SIMD
+typedef float32x4_t simd_float;
+
+inline simd_float simd_load(const float * p)				{ return vld1q_f32(p); }
+inline void simd_store(float * p, simd_float v)				{ vst1q_f32(p, v); }
+inline simd_float simd_set(float x)							{ return vdupq_n_f32(x); }
+inline simd_float simd_add(simd_float a, simd_float b)		{ return vaddq_f32(a, b); }
+inline simd_float simd_sub(simd_float a, simd_float b)		{ return vsubq_f32(a, b); }
+inline simd_float simd_mul(simd_float a, simd_float b)		{ return vmulq_f32(a, b); }
+inline simd_float simd_madd(simd_float acc, simd_float a, simd_float b)	{ return vmlaq_f32(acc, a, b); }
+inline simd_float simd_abs(simd_float a)					{ return vabsq_f32(a); }
+
+// ARMv7 NEON has no square root, so use the reciprocal estimate refined by two Newton steps
+// The small floor keeps 0 * (1/sqrt(0)) from giving NaN
+inline simd_float simd_sqrt(simd_float a)
+{
+	simd_float x = vmaxq_f32(a, vdupq_n_f32(1E-30f));
+	simd_float r = vrsqrteq_f32(x);
+	r = vmulq_f32(r, vrsqrtsq_f32(vmulq_f32(x, r), r));
+	r = vmulq_f32(r, vrsqrtsq_f32(vmulq_f32(x, r), r));
+	return vmulq_f32(a, r);
+}
+
+#elif defined(KERNELS_SSE)
+
+#define KERNELS_SIMD
+typedef __m128 simd_float;
+
+inline simd_float simd_load(const float * p)				{ return _mm_loadu_ps(p); }
+inline void simd_store(float * p, simd_float v)				{ _mm_storeu_ps(p, v); }
+inline simd_float simd_set(float x)							{ return _mm_set1_ps(x); }
+inline simd_float simd_add(simd_float a, simd_float b)		{ return _mm_add_ps(a, b); }
+inline simd_float simd_sub(simd_float a, simd_float b)		{ return _mm_sub_ps(a, b); }
+inline simd_float simd_mul(simd_float a, simd_float b)		{ return _mm_mul_ps(a, b); }
+inline simd_float simd_madd(simd_float acc, simd_float a, simd_float b)	{ return _mm_add_ps(acc, _mm_mul_ps(a, b)); }
+inline simd_float simd_abs(simd_float a)					{ return _mm_andnot_ps(_mm_set1_ps(-0.0f), a); }
+inline simd_float simd_sqrt(simd_float a)					{ return _mm_sqrt_ps(a); }
+
+#endif
+
+
+// Tables of a radix-2 transform of one length, made by fft_plan(...)
+struct Fft_plan
+{
+	int n;
+	vector<int> swaps;
+	vector<float> w_re;
+	vector<float> w_im;
+};
+
+
+inline void gaussian_kernel(float sigma, vector<float> &kernel);
+inline void box_kernel(int radius, vector<float> &kernel);
+inline void filter_rows(const float * in, float * out, int width, int height, const vector<float> &kernel);
+inline void filter_columns(const float * in, float * out, int width, int height, const vector<float> &kernel,
+		int first_row = 0, int last_row = -1);
+inline void separable_filter(float * plane, float * temp, int width, int height, const vector<float> &kernel);
+inline float normalised_variance(const float * plane, size_t pixels);
+inline void local_normalised_variance(const float * in, float * sharpness, float * squares, float * temp, int width, int height,
+		const vector<float> &box);
+template <int SIZE> inline void filter_rows_fixed(const float * in, float * out, int width, int height, const float * k);
+template <int SIZE> inline void filter_columns_fixed(const float * in, float * out, int width, int height, const float * k,
+		int first_row, int last_row);
+inline void filter_row_borders(const float * row, float * result, int width, int start, int end, const float * k, int size);
+inline void convolve_matrix(const float * in, float * out, int width, int height, const float * matrix, int size,
+		int first_row = 0, int last_row = -1);
+template <int SIZE> inline void convolve_fixed(const float * in, float * out, int width, int height, const float * matrix,
+		int first_row, int last_row);
+inline unsigned char quantise_direction(float gx, float gy);
+inline void sobel_planes(const float * in, float * gx, float * gy, float * magnitude, unsigned char * direction,
+		int width, int height, bool l1_magnitude = false, int first_row = 0, int last_row = -1,
+		unsigned int * histogram = NULL, double * sum = NULL);
+inline void gradient_directions(const float * gx, const float * gy, const float * magnitude, unsigned char * direction, int width, int border,
+		unsigned int * histogram, double * sum);
+inline void gradient_rows(int size, const float * in, float * derivative, float * smoothed, int width, int first_row, int last_row);
+inline void gradient_columns(int size, const float * derivative, const float * smoothed, float * gx, float * gy, float * magnitude,
+		unsigned char * direction, int width, int height, bool l1_magnitude, int first_row, int last_row,
+		unsigned int * histogram = NULL, double * sum = NULL);
+inline void histogram_add(unsigned int * histogram, float magnitude);
+inline float histogram_percentile(const unsigned int * histogram, float fraction);
+inline float histogram_otsu(const unsigned int * histogram);
+inline void choose_thresholds(const unsigned int * histogram, double sum, int mode, float high, float low, float &high_thr, float &low_thr);
+inline void suppress_edges(const float * magnitude, const unsigned char * direction, unsigned char * edge, int width,
+		int first_row, int last_row, int valid_first, int valid_last, float high_thr, float low_thr);
+inline void seed_edges(const unsigned char * edge, int width, int first_row, int last_row, vector<int> &stack);
+inline void link_edges(unsigned char * edge, int width, int first_row, int last_row, vector<int> &stack);
+inline void clear_minor_edges(unsigned char * edge, int width, int first_row, int last_row);
+inline void hysteresis(unsigned char * edge, int width, int height, vector<int> &stack);
+inline void fft(float * re, float * im, int n, bool inverse, int stride = 1);
+inline void fft_2d(float * re, float * im, int width, int height, bool inverse);
+inline void fft_plan(int n, Fft_plan &plan);
+inline void fft_execute(const Fft_plan &plan, float * re, float * im, bool inverse, int stride = 1);
+inline int power_of_two_below(int number);
+inline float phase_correlate(const float * a, const float * b, int width, int height, vector<float> &work, float &dx, float &dy);
+
+
+
+
+/* Normalised gaussian, sampled out to 3 sigma on each side */
+inline void gaussian_kernel(float sigma, vector<float> &kernel)
+{
+
+	if (sigma <= 0)
+	{
+		kernel.assign(1, 1.0f);
+		return;
+	}
+
+	int radius = (int)ceil(3.0*sigma);
+	kernel.resize(2*radius + 1);
+
+	float total = 0;
+	for (int i=-radius; i<=radius; i++)
+	{
+		kernel[i+radius] = exp(-(float)(i*i)/(2.0f*sigma*sigma));
+		total += kernel[i+radius];
+	}
+	for (size_t i=0; i<kernel.size(); i++)
+		kernel[i] /= total;
+
+	return;
+
+}
+
+
+
+
+/* Normalised box filter, i.e. the mean over 2*radius + 1 pixels */
+inline void box_kernel(int radius, vector<float> &kernel)
+{
+
+	if (radius < 0)
+		radius = 0;
+	kernel.assign(2*radius + 1, 1.0f/(float)(2*radius + 1));
+
+	return;
+
+}
+
+
+
+
+/* Convolve each row with a 1D kernel of odd length
+ * Pixels closer than the radius to the left and right borders read the edge pixel in place of the ones outside the image,
+ * all others take the vectorised path, which reads the taps straight from the row */
+inline void filter_rows(const float * in, float * out, int width, int height, const vector<float> &kernel)
+{
+
+	int radius = (int)kernel.size()/2;
+	int size = (int)kernel.size();
+	const float * k = &kernel[0];
+
+	switch (size)
+	{
+		case 3: filter_rows_fixed<3>(in, out, width, height, k); return;
+		case 5: filter_rows_fixed<5>(in, out, width, height, k); return;
+		case 7: filter_rows_fixed<7>(in, out, width, height, k); return;
+		case 9: filter_rows_fixed<9>(in, out, width, height, k); return;
+		case 11: filter_rows_fixed<11>(in, out, width, height, k); return;
+	}
+
+	for (int y=0; y<height; y++)
+	{
+
+		const float * row = in + (size_t)y*width;
+		float * result = out + (size_t)y*width;
+
+		// First and last pixel that have all taps inside the row
+		int start = radius;
+		int end = width - radius;
+		if (end <= start)
+			end = start = width;
+
+		int x = start;
+#if defined(KERNELS_SIMD)
+		for (; x+4<=end; x+=4)
+		{
+			simd_float acc = simd_set(0);
+			const float * taps = row + x - radius;
+			for (int i=0; i<size; i++)
+				acc = simd_madd(acc, simd_load(taps + i), simd_set(k[i]));
+			simd_store(result + x, acc);
+		}
+#endif
+		for (; x<end; x++)
+		{
+			float acc = 0;
+			const float * taps = row + x - radius;
+			for (int i=0; i<size; i++)
+				acc += taps[i]*k[i];
+			result[x] = acc;
+		}
+
+		filter_row_borders(row, result, width, start, end, k, size);
+
+	}
+
+	return;
+
+}
+
+
+
+
+/* Pixels of a row outside start to end-1, replicating the edge pixels in place of the ones outside the image */
+inline void filter_row_borders(const float * row, float * result, int width, int start, int end, const float * k, int size)
+{
+
+	int radius = size/2;
+
+	for (int b=0; b<width; b++)
+	{
+		if (b == start)
+		{
+			b = end - 1;
+			continue;
+		}
+		float acc = 0;
+		for (int i=0; i<size; i++)
+		{
+			int xi = b + i - radius;
+			if (xi < 0) xi = 0;
+			if (xi >= width) xi = width - 1;
+			acc += row[xi]*k[i];
+		}
+		result[b] = acc;
+	}
+
+	return;
+
+}
+
+
+
+
+/* filter_rows(...) for a kernel of SIZE taps
+ * With the length known the tap loops unroll, and the vectorised path keeps every tap in its own register */
+template <int SIZE>
+inline void filter_rows_fixed(const float * in, float * out, int width, int height, const float * k)
+{
+
+	const int radius = SIZE/2;
+
+#if defined(KERNELS_SIMD)
+	simd_float taps[SIZE];
+	for (int i=0; i<SIZE; i++)
+		taps[i] = simd_set(k[i]);
+#endif
+
+	for (int y=0; y<height; y++)
+	{
+
+		const float * row = in + (size_t)y*width;
+		float * result = out + (size_t)y*width;
+
+		int start = radius;
+		int end = width - radius;
+		if (end <= start)
+			end = start = width;
+
+		int x = start;
+#if defined(KERNELS_SIMD)
+		for (; x+4<=end; x+=4)
+		{
+			const float * p = row + x - radius;
+			simd_float acc = simd_mul(simd_load(p), taps[0]);
+			for (int i=1; i<SIZE; i++)
+				acc = simd_madd(acc, simd_load(p + i), taps[i]);
+			simd_store(result + x, acc);
+		}
+#endif
+		for (; x<end; x++)
+		{
+			const float * p = row + x - radius;
+			float acc = p[0]*k[0];
+			for (int i=1; i<SIZE; i++)
+				acc += p[i]*k[i];
+			result[x] = acc;
+		}
+
+		filter_row_borders(row, result, width, start, end, k, SIZE);
+
+	}
+
+	return;
+
+}
+
+
+
+
+/* Convolve each column with a 1D kernel of odd length
+ * Rows are contiguous, so every output row is a weighted sum of whole input rows and vectorises without any gathering.
+ * Rows beyond the top and bottom borders are replaced by the edge rows.
+ * Only output rows first_row to last_row-1 are written (all of them if last_row is negative), but input rows are read across the whole plane. */
+inline void filter_columns(const float * in, float * out, int width, int height, const vector<float> &kernel,
+		int first_row, int last_row)
+{
+
+	int radius = (int)kernel.size()/2;
+	int size = (int)kernel.size();
+	const float * k = &kernel[0];
+	vector<const float *> rows(size);
+
+	if (last_row < 0 || last_row > height)
+		last_row = height;
+
+	switch (size)
+	{
+		case 3: filter_columns_fixed<3>(in, out, width, height, k, first_row, last_row); return;
+		case 5: filter_columns_fixed<5>(in, out, width, height, k, first_row, last_row); return;
+		case 7: filter_columns_fixed<7>(in, out, width, height, k, first_row, last_row); return;
+		case 9: filter_columns_fixed<9>(in, out, width, height, k, first_row, last_row); return;
+		case 11: filter_columns_fixed<11>(in, out, width, height, k, first_row, last_row); return;
+	}
+
+	for (int y=first_row; y<last_row; y++)
+	{
+
+		for (int i=0; i<size; i++)
+		{
+			int yi = y + i - radius;
+			if (yi < 0) yi = 0;
+			if (yi >= height) yi = height - 1;
+			rows[i] = in + (size_t)yi*width;
+		}
+
+		float * result = out + (size_t)y*width;
+
+		int x = 0;
+#if defined(KERNELS_SIMD)
+		for (; x+4<=width; x+=4)
+		{
+			simd_float acc = simd_set(0);
+			for (int i=0; i<size; i++)
+				acc = simd_madd(acc, simd_load(rows[i] + x), simd_set(k[i]));
+			simd_store(result + x, acc);
+		}
+#endif
+		for (; x<width; x++)
+		{
+			float acc = 0;
+			for (int i=0; i<size; i++)
+				acc += rows[i][x]*k[i];
+			result[x] = acc;
+		}
+
+	}
+
+	return;
+
+}
+
+
+
+
+/* filter_columns(...) for a kernel of SIZE taps, over output rows first_row to last_row-1 */
+template <int SIZE>
+inline void filter_columns_fixed(const float * in, float * out, int width, int height, const float * k,
+		int first_row, int last_row)
+{
+
+	const int radius = SIZE/2;
+	const float * rows[SIZE];
+
+#if defined(KERNELS_SIMD)
+	simd_float taps[SIZE];
+	for (int i=0; i<SIZE; i++)
+		taps[i] = simd_set(k[i]);
+#endif
+
+	for (int y=first_row; y<last_row; y++)
+	{
+
+		for (int i=0; i<SIZE; i++)
+		{
+			int yi = y + i - radius;
+			if (yi < 0) yi = 0;
+			if (yi >= height) yi = height - 1;
+			rows[i] = in + (size_t)yi*width;
+		}
+
+		float * result = out + (size_t)y*width;
+
+		int x = 0;
+#if defined(KERNELS_SIMD)
+		for (; x+4<=width; x+=4)
+		{
+			simd_float acc = simd_mul(simd_load(rows[0] + x), taps[0]);
+			for (int i=1; i<SIZE; i++)
+				acc = simd_madd(acc, simd_load(rows[i] + x), taps[i]);
+			simd_store(result + x, acc);
+		}
+#endif
+		for (; x<width; x++)
+		{
+			float acc = rows[0][x]*k[0];
+			for (int i=1; i<SIZE; i++)
+				acc += rows[i][x]*k[i];
+			result[x] = acc;
+		}
+
+	}
+
+	return;
+
+}
+
+
+
+
+/* Convolve a plane with a square matrix of odd size, over output rows first_row to last_row-1 (all of them if last_row is negative)
+ * The matrix is stored column by column, element (x,y) at x*size + y, as it is read from file
+ * Pixels beyond the border are replaced by the nearest edge pixel */
+inline void convolve_matrix(const float * in, float * out, int width, int height, const float * matrix, int size,
+		int first_row, int last_row)
+{
+
+	if (last_row < 0 || last_row > height)
+		last_row = height;
+
+	switch (size)
+	{
+		case 3: convolve_fixed<3>(in, out, width, height, matrix, first_row, last_row); return;
+		case 5: convolve_fixed<5>(in, out, width, height, matrix, first_row, last_row); return;
+		case 7: convolve_fixed<7>(in, out, width, height, matrix, first_row, last_row); return;
+	}
+
+	int limit = (size - 1)/2;
+
+	for (int j=first_row; j<last_row; j++) {
+		for (int i=0; i<width; i++)
+		{
+
+			float total = 0;
+			for (int y=0; y<size; y++) {
+
+				int row = j - limit + y;
+				if (row < 0) row = 0;
+				if (row >= height) row = height - 1;
+
+				for (int x=0; x<size; x++)
+				{
+					int column = i - limit + x;
+					if (column < 0) column = 0;
+					if (column >= width) column = width - 1;
+
+					total += matrix[x*size + y]*in[(size_t)row*width + column];
+				}
+			}
+
+			out[(size_t)j*width + i] = total;
+
+		}
+	}
+
+	return;
+
+}
+
+
+
+
+/* convolve_matrix(...) for a SIZE x SIZE matrix
+ * Columns at least SIZE/2 from the borders read straight from the rows, four at a time where possible, with all SIZE*SIZE taps unrolled */
+template <int SIZE>
+inline void convolve_fixed(const float * in, float * out, int width, int height, const float * matrix,
+		int first_row, int last_row)
+{
+
+	const int radius = SIZE/2;
+	const float * rows[SIZE];
+
+#if defined(KERNELS_SIMD)
+	simd_float taps[SIZE*SIZE];
+	for (int i=0; i<SIZE*SIZE; i++)
+		taps[i] = simd_set(matrix[i]);
+#endif
+
+	for (int y=first_row; y<last_row; y++)
+	{
+
+		for (int j=0; j<SIZE; j++)
+		{
+			int yj = y + j - radius;
+			if (yj < 0) yj = 0;
+			if (yj >= height) yj = height - 1;
+			rows[j] = in + (size_t)yj*width;
+		}
+
+		float * result = out + (size_t)y*width;
+
+		int start = radius;
+		int end = width - radius;
+		if (end <= start)
+			end = start = width;
+
+		int x = start;
+#if defined(KERNELS_SIMD)
+		for (; x+4<=end; x+=4)
+		{
+			simd_float acc = simd_set(0);
+			for (int j=0; j<SIZE; j++)
+			{
+				const float * p = rows[j] + x - radius;
+				for (int i=0; i<SIZE; i++)
+					acc = simd_madd(acc, simd_load(p + i), taps[i*SIZE + j]);
+			}
+			simd_store(result + x, acc);
+		}
+#endif
+		for (; x<end; x++)
+		{
+			float acc = 0;
+			for (int j=0; j<SIZE; j++)
+			{
+				const float * p = rows[j] + x - radius;
+				for (int i=0; i<SIZE; i++)
+					acc += p[i]*matrix[i*SIZE + j];
+			}
+			result[x] = acc;
+		}
+
+		// Borders, replicating the edge columns
+		for (int b=0; b<width; b++)
+		{
+			if (b == start)
+			{
+				b = end - 1;
+				continue;
+			}
+			float acc = 0;
+			for (int j=0; j<SIZE; j++) {
+				for (int i=0; i<SIZE; i++)
+				{
+					int xi = b + i - radius;
+					if (xi < 0) xi = 0;
+					if (xi >= width) xi = width - 1;
+					acc += rows[j][xi]*matrix[i*SIZE + j];
+				}
+			}
+			result[b] = acc;
+		}
+
+	}
+
+	return;
+
+}
+
+
+
+
+/* Smooth a plane in place with a separable kernel
+ * temp must hold as many pixels as the plane */
+inline void separable_filter(float * plane, float * temp, int width, int height, const vector<float> &kernel)
+{
+
+	filter_rows(plane, temp, width, height, kernel);
+	filter_columns(temp, plane, width, height, kernel);
+
+	return;
+
+}
+
+
+
+
+/* Variance of the pixels of a plane divided by their mean, which is largest for the sharpest picture of a field
+ * Dividing by the mean keeps it from simply favouring brighter pictures. The sums are kept in double, as a picture has millions of pixels. */
+inline float normalised_variance(const float * plane, size_t pixels)
+{
+
+	if (pixels == 0)
+		return 0;
+
+	double sum = 0;
+	for (size_t i=0; i<pixels; i++)
+		sum += plane[i];
+
+	double mean = sum/pixels;
+
+	// Make sure that no value of mean is effectively 0.0, to prevent division by 0, even though very unlikely
+	if (mean == 0.0) mean = 1E-10;
+
+	double squares = 0;
+	for (size_t i=0; i<pixels; i++)
+		squares += (plane[i] - mean)*(plane[i] - mean);
+
+	return (float)(squares/(pixels*mean));
+
+}
+
+
+
+
+/* Normalised variance of the neighbourhood of every pixel, the neighbourhood being the given box kernel along x and y
+ * The box filters give the local mean of the pixels and of their squares, and variance = mean of squares - square of mean
+ * squares and temp are working planes of the same size; in may be the same plane as neither */
+inline void local_normalised_variance(const float * in, float * sharpness, float * squares, float * temp, int width, int height,
+		const vector<float> &box)
+{
+
+	size_t pixels = (size_t)width*height;
+
+	for (size_t i=0; i<pixels; i++)
+	{
+		sharpness[i] = in[i];
+		squares[i] = in[i]*in[i];
+	}
+
+	separable_filter(sharpness, temp, width, height, box);
+	separable_filter(squares, temp, width, height, box);
+
+	// Means below 1 grey level are taken as 1, so dark noise isn't blown up into sharpness
+	for (size_t i=0; i<pixels; i++)
+	{
+		float mean = sharpness[i];
+		float variance = squares[i] - mean*mean;
+		if (variance < 0) variance = 0;
+		sharpness[i] = variance/((mean < 1) ? 1 : mean);
+	}
+
+	return;
+
+}
+
+
+/* Quantise the direction of a gradient without atan2
+ * gy is taken as (row above - row below), as in the Sobel kernel below, so a gradient with gx and gy of the same sign
+ * points up-right or down-left in the image and is compared along the DIR_135 diagonal */
+inline unsigned char quantise_direction(float gx, float gy)
+{
+
+	float ax = fabs(gx);
+	float ay = fabs(gy);
+
+	if (ay < TAN_22_5*ax)
+		return DIR_0;
+	if (ax <= TAN_22_5*ay)
+		return DIR_90;
+	return ((gx > 0) == (gy > 0)) ? DIR_135 : DIR_45;
+
+}
+
+
+
+
+/* Sobel gradient of a plane
+ * gx = (right column - left column) and gy = (row above - row below), each weighted 1 2 1 across
+ * The one pixel border has no neighbours to compute a gradient from, so it is set to 0.
+ * All output planes must hold width*height values, of which only rows first_row to last_row-1 are written (all of them if last_row is negative).
+ * If histogram is not NULL, the magnitudes of those rows, leaving out the border, are added to it and to sum. */
+inline void sobel_planes(const float * in, float * gx, float * gy, float * magnitude, unsigned char * direction,
+		int width, int height, bool l1_magnitude, int first_row, int last_row,
+		unsigned int * histogram, double * sum)
+{
+
+	if (last_row < 0 || last_row > height)
+		last_row = height;
+
+	for (int y=first_row; y<last_row; y++)
+	{
+
+		size_t first = (size_t)y*width;
+
+		if (y == 0 || y == height-1 || width < 3)
+		{
+			for (int x=0; x<width; x++)
+			{
+				gx[first + x] = gy[first + x] = magnitude[first + x] = 0;
+				direction[first + x] = DIR_0;
+			}
+			continue;
+		}
+
+		const float * above = in + first - width;
+		const float * here = in + first;
+		const float * below = in + first + width;
+		float * row_gx = gx + first;
+		float * row_gy = gy + first;
+		float * row_mag = magnitude + first;
+
+		row_gx[0] = row_gy[0] = row_mag[0] = 0;
+		row_gx[width-1] = row_gy[width-1] = row_mag[width-1] = 0;
+
+		int x = 1;
+#if defined(KERNELS_SIMD)
+		simd_float two = simd_set(2.0f);
+		for (; x+4<=width-1; x+=4)
+		{
+			simd_float a_left = simd_load(above + x - 1);
+			simd_float a_right = simd_load(above + x + 1);
+			simd_float b_left = simd_load(below + x - 1);
+			simd_float b_right = simd_load(below + x + 1);
+
+			simd_float sx = simd_sub(simd_add(a_right, b_right), simd_add(a_left, b_left));
+			sx = simd_madd(sx, simd_sub(simd_load(here + x + 1), simd_load(here + x - 1)), two);
+
+			simd_float sy = simd_sub(simd_add(a_left, a_right), simd_add(b_left, b_right));
+			sy = simd_madd(sy, simd_sub(simd_load(above + x), simd_load(below + x)), two);
+
+			simd_float m;
+			if (l1_magnitude)
+				m = simd_add(simd_abs(sx), simd_abs(sy));
+			else
+				m = simd_sqrt(simd_madd(simd_mul(sx, sx), sy, sy));
+
+			simd_store(row_gx + x, sx);
+			simd_store(row_gy + x, sy);
+			simd_store(row_mag + x, m);
+		}
+#endif
+		for (; x<width-1; x++)
+		{
+			float sx = -above[x-1] -2*here[x-1] -below[x-1] +above[x+1] +2*here[x+1] +below[x+1];
+			float sy = +above[x-1] +2*above[x] +above[x+1] -below[x-1] -2*below[x] -below[x+1];
+			row_gx[x] = sx;
+			row_gy[x] = sy;
+			if (l1_magnitude)
+				row_mag[x] = fabs(sx) + fabs(sy);
+			else
+				row_mag[x] = sqrt(sx*sx + sy*sy);
+		}
+
+		// Directions, and the histogram, in a second sweep over the row while it is still in cache
+		gradient_directions(row_gx, row_gy, row_mag, direction + first, width, 1, histogram, sum);
+
+	}
+
+	return;
+
+}
+
+
+
+
+/* Directions of a row of gradients, and its magnitudes added to the histogram leaving out border pixels at each end */
+inline void gradient_directions(const float * gx, const float * gy, const float * magnitude, unsigned char * direction, int width, int border,
+		unsigned int * histogram, double * sum)
+{
+
+	for (int x=0; x<width; x++)
+		direction[x] = quantise_direction(gx[x], gy[x]);
+
+	if (histogram != NULL)
+	{
+		double row_sum = 0;
+		for (int x=border; x<width-border; x++)
+		{
+			histogram_add(histogram, magnitude[x]);
+			row_sum += magnitude[x];
+		}
+		*sum += row_sum;
+	}
+
+	return;
+
+}
+
+
+
+
+/* Coefficients of the larger gradient kernels
+ * smooth() is the binomial across the gradient and derive() the difference along it, both scaled so a step of height h
+ * gives a gradient of 4h, as the 3x3 Sobel does. Every call is with a constant index once the loops are unrolled, so they fold away. */
+template <int SIZE> struct Gradient_kernel;
+
+template <> struct Gradient_kernel<5>
+{
+	static float smooth(int i)	{ static const float k[5] = { 0.25f, 1.0f, 1.5f, 1.0f, 0.25f }; return k[i]; }
+	static float derive(int i)	{ static const float k[5] = { -1.0f/3, -2.0f/3, 0.0f, 2.0f/3, 1.0f/3 }; return k[i]; }
+};
+
+template <> struct Gradient_kernel<7>
+{
+	static float smooth(int i)	{ static const float k[7] = { 0.0625f, 0.375f, 0.9375f, 1.25f, 0.9375f, 0.375f, 0.0625f }; return k[i]; }
+	static float derive(int i)	{ static const float k[7] = { -0.1f, -0.4f, -0.5f, 0.0f, 0.5f, 0.4f, 0.1f }; return k[i]; }
+};
+
+
+
+
+/* Row pass of a SIZE x SIZE gradient: each row differentiated along x into derivative, and smoothed along x into smoothed
+ * The SIZE/2 pixels at each end are set to 0, since the gradient there is cleared anyway */
+template <int SIZE>
+inline void gradient_rows_fixed(const float * in, float * derivative, float * smoothed, int width, int first_row, int last_row)
+{
+
+	const int radius = SIZE/2;
+
+	for (int y=first_row; y<last_row; y++)
+	{
+
+		const float * row = in + (size_t)y*width;
+		float * d = derivative + (size_t)y*width;
+		float * s = smoothed + (size_t)y*width;
+
+		int end = width - radius;
+		for (int x=0; x<width; x++)
+		{
+			if (x < radius || x >= end)
+				d[x] = s[x] = 0;
+		}
+
+		int x = radius;
+#if defined(KERNELS_SIMD)
+		for (; x+4<=end; x+=4)
+		{
+			const float * p = row + x - radius;
+			simd_float acc_d = simd_set(0);
+			simd_float acc_s = simd_set(0);
+			for (int i=0; i<SIZE; i++)
+			{
+				simd_float v = simd_load(p + i);
+				if (i != radius)
+					acc_d = simd_madd(acc_d, v, simd_set(Gradient_kernel<SIZE>::derive(i)));
+				acc_s = simd_madd(acc_s, v, simd_set(Gradient_kernel<SIZE>::smooth(i)));
+			}
+			simd_store(d + x, acc_d);
+			simd_store(s + x, acc_s);
+		}
+#endif
+		for (; x<end; x++)
+		{
+			const float * p = row + x - radius;
+			float acc_d = 0;
+			float acc_s = 0;
+			for (int i=0; i<SIZE; i++)
+			{
+				acc_d += p[i]*Gradient_kernel<SIZE>::derive(i);
+				acc_s += p[i]*Gradient_kernel<SIZE>::smooth(i);
+			}
+			d[x] = acc_d;
+			s[x] = acc_s;
+		}
+
+	}
+
+	return;
+
+}
+
+
+
+
+/* Column pass of a SIZE x SIZE gradient
+ * gx is the x derivative smoothed along y, and gy the x-smoothed rows differentiated along y with the row above counting positive, as in Sobel
+ * Rows within SIZE/2 of the top and bottom have no gradient, nor have the columns the row pass cleared, since both its planes are 0 there */
+template <int SIZE>
+inline void gradient_columns_fixed(const float * derivative, const float * smoothed, float * gx, float * gy, float * magnitude,
+		unsigned char * direction, int width, int height, bool l1_magnitude, int first_row, int last_row,
+		unsigned int * histogram, double * sum)
+{
+
+	const int radius = SIZE/2;
+
+	for (int y=first_row; y<last_row; y++)
+	{
+
+		size_t first = (size_t)y*width;
+		float * row_gx = gx + first;
+		float * row_gy = gy + first;
+		float * row_mag = magnitude + first;
+
+		if (y < radius || y >= height - radius)
+		{
+			for (int x=0; x<width; x++)
+			{
+				row_gx[x] = row_gy[x] = row_mag[x] = 0;
+				direction[first + x] = DIR_0;
+			}
+			continue;
+		}
+
+		const float * d = derivative + first - (size_t)radius*width;
+		const float * s = smoothed + first - (size_t)radius*width;
+
+		int x = 0;
+#if defined(KERNELS_SIMD)
+		for (; x+4<=width; x+=4)
+		{
+			simd_float sx = simd_set(0);
+			simd_float sy = simd_set(0);
+			for (int j=0; j<SIZE; j++)
+			{
+				sx = simd_madd(sx, simd_load(d + (size_t)j*width + x), simd_set(Gradient_kernel<SIZE>::smooth(j)));
+				if (j != radius)
+					sy = simd_madd(sy, simd_load(s + (size_t)j*width + x), simd_set(-Gradient_kernel<SIZE>::derive(j)));
+			}
+
+			simd_float m;
+			if (l1_magnitude)
+				m = simd_add(simd_abs(sx), simd_abs(sy));
+			else
+				m = simd_sqrt(simd_madd(simd_mul(sx, sx), sy, sy));
+
+			simd_store(row_gx + x, sx);
+			simd_store(row_gy + x, sy);
+			simd_store(row_mag + x, m);
+		}
+#endif
+		for (; x<width; x++)
+		{
+			float sx = 0;
+			float sy = 0;
+			for (int j=0; j<SIZE; j++)
+			{
+				sx += d[(size_t)j*width + x]*Gradient_kernel<SIZE>::smooth(j);
+				sy -= s[(size_t)j*width + x]*Gradient_kernel<SIZE>::derive(j);
+			}
+			row_gx[x] = sx;
+			row_gy[x] = sy;
+			if (l1_magnitude)
+				row_mag[x] = fabs(sx) + fabs(sy);
+			else
+				row_mag[x] = sqrt(sx*sx + sy*sy);
+		}
+
+		gradient_directions(row_gx, row_gy, row_mag, direction + first, width, radius, histogram, sum);
+
+	}
+
+	return;
+
+}
+
+
+
+
+/* Row pass of a gradient of the given size (5 or 7), over rows first_row to last_row-1 */
+inline void gradient_rows(int size, const float * in, float * derivative, float * smoothed, int width, int first_row, int last_row)
+{
+
+	if (size == 7)
+		gradient_rows_fixed<7>(in, derivative, smoothed, width, first_row, last_row);
+	else
+		gradient_rows_fixed<5>(in, derivative, smoothed, width, first_row, last_row);
+
+	return;
+
+}
+
+
+
+
+/* Column pass of a gradient of the given size (5 or 7), over rows first_row to last_row-1
+ * It reads size/2 rows of the row pass above and below the range, which must be done by then */
+inline void gradient_columns(int size, const float * derivative, const float * smoothed, float * gx, float * gy, float * magnitude,
+		unsigned char * direction, int width, int height, bool l1_magnitude, int first_row, int last_row,
+		unsigned int * histogram, double * sum)
+{
+
+	if (last_row < 0 || last_row > height)
+		last_row = height;
+
+	if (size == 7)
+		gradient_columns_fixed<7>(derivative, smoothed, gx, gy, magnitude, direction, width, height, l1_magnitude, first_row, last_row, histogram, sum);
+	else
+		gradient_columns_fixed<5>(derivative, smoothed, gx, gy, magnitude, direction, width, height, l1_magnitude, first_row, last_row, histogram, sum);
+
+	return;
+
+}
+
+
+/* Add a magnitude to its bin, the last bin taking anything beyond the range */
+inline void histogram_add(unsigned int * histogram, float magnitude)
+{
+
+	int bin = (int)(magnitude*(MAGNITUDE_BINS/MAGNITUDE_RANGE));
+	if (bin >= MAGNITUDE_BINS)
+		bin = MAGNITUDE_BINS - 1;
+	histogram[bin]++;
+
+	return;
+
+}
+
+
+
+
+/* Magnitude below which the given fraction of the counts lie, interpolating within the bin it falls in */
+inline float histogram_percentile(const unsigned int * histogram, float fraction)
+{
+
+	double total = 0;
+	for (int bin=0; bin<MAGNITUDE_BINS; bin++)
+		total += histogram[bin];
+
+	double target = fraction*total;
+	double below = 0;
+	for (int bin=0; bin<MAGNITUDE_BINS; bin++)
+	{
+		if (histogram[bin] > 0 && below + histogram[bin] >= target)
+			return (bin + (float)((target - below)/histogram[bin]))*(MAGNITUDE_RANGE/MAGNITUDE_BINS);
+		below += histogram[bin];
+	}
+
+	return MAGNITUDE_RANGE;
+
+}
+
+
+
+
+/* Otsu's method: the split maximising weight_below*weight_above*(mean_below - mean_above)^2
+ * The threshold returned is the top of the last bin below the split */
+inline float histogram_otsu(const unsigned int * histogram)
+{
+
+	double total = 0;
+	double moment = 0;
+	for (int bin=0; bin<MAGNITUDE_BINS; bin++)
+	{
+		total += histogram[bin];
+		moment += (double)bin*histogram[bin];
+	}
+	if (total == 0)
+		return MAGNITUDE_RANGE;
+
+	double weight_below = 0;
+	double moment_below = 0;
+	double best = -1;
+	int split = 0;
+
+	for (int bin=0; bin<MAGNITUDE_BINS-1; bin++)
+	{
+		weight_below += histogram[bin];
+		moment_below += (double)bin*histogram[bin];
+		double weight_above = total - weight_below;
+		if (weight_below == 0 || weight_above == 0)
+			continue;
+
+		double difference = moment_below/weight_below - (moment - moment_below)/weight_above;
+		double between = weight_below*weight_above*difference*difference;
+		if (between > best)
+		{
+			best = between;
+			split = bin;
+		}
+	}
+
+	return (split + 1)*(MAGNITUDE_RANGE/MAGNITUDE_BINS);
+
+}
+
+
+
+
+/* High and low thresholds by the chosen method
+ * An empty histogram (a picture too small to have gradients) gives thresholds nothing can reach */
+inline void choose_thresholds(const unsigned int * histogram, double sum, int mode, float high, float low, float &high_thr, float &low_thr)
+{
+
+	double count = 0;
+	for (int bin=0; bin<MAGNITUDE_BINS; bin++)
+		count += histogram[bin];
+
+	if (count == 0)
+	{
+		high_thr = low_thr = MAGNITUDE_RANGE;
+		return;
+	}
+
+	if (mode == THRESHOLD_PERCENTILE)
+	{
+		high_thr = histogram_percentile(histogram, high);
+		low_thr = high_thr*low;
+	}
+	else if (mode == THRESHOLD_OTSU)
+	{
+		high_thr = histogram_otsu(histogram);
+		low_thr = high_thr*low;
+	}
+	else
+	{
+		float mean = (float)(sum/count);
+		high_thr = mean*high;
+		low_thr = mean*low;
+	}
+
+	return;
+
+}
+
+
+
+
+/* Non-maximum suppression and thresholding of rows first_row to last_row-1
+ * Only rows valid_first to valid_last-1 may hold edges; for a whole picture these are EDGE_BORDER to height-EDGE_BORDER+1.
+ * Comparing with the neighbours along the gradient reads the magnitude one row above and below the range */
+inline void suppress_edges(const float * magnitude, const unsigned char * direction, unsigned char * edge, int width,
+		int first_row, int last_row, int valid_first, int valid_last, float high_thr, float low_thr)
+{
+
+	// Distance in the plane to the neighbours along the gradient, for each quantised direction
+	const int along[4] = { 1, width + 1, width, width - 1 };
+
+	for (int j=first_row; j<last_row; j++)
+	{
+
+		unsigned char * row = edge + (size_t)j*width;
+
+		if (j < valid_first || j >= valid_last)
+		{
+			for (int i=0; i<width; i++)
+				row[i] = EDGE_NONE;
+			continue;
+		}
+
+		for (int i=0; i<width; i++)
+		{
+
+			if (i < EDGE_BORDER || i >= width-EDGE_BORDER+1)
+			{
+				row[i] = EDGE_NONE;
+				continue;
+			}
+
+			// Only pixels that are a maximum along their gradient can be edges
+			size_t index = (size_t)j*width + i;
+			float value = magnitude[index];
+			int step = along[direction[index]];
+			if (magnitude[index-step] < value && magnitude[index+step] < value)
+			{
+				if (value > high_thr)
+					row[i] = EDGE_MAJOR;
+				else if (value > low_thr)
+					row[i] = EDGE_MINOR;
+				else
+					row[i] = EDGE_NONE;
+			}
+			else
+				row[i] = EDGE_NONE;
+
+		}
+
+	}
+
+	return;
+
+}
+
+
+
+
+/* Push every major edge in rows first_row to last_row-1 onto the stack */
+inline void seed_edges(const unsigned char * edge, int width, int first_row, int last_row, vector<int> &stack)
+{
+
+	int end = last_row*width;
+	for (int index=first_row*width; index<end; index++)
+	{
+		if (edge[index] == EDGE_MAJOR)
+			stack.push_back(index);
+	}
+
+	return;
+
+}
+
+
+
+
+/* Flood fill from the edges on the stack
+ * Popping a pixel promotes the minor edges in its (2*LINK_RADIUS+1)^2 neighbourhood, which are then pushed in turn,
+ * so a minor edge is reached however far along a chain it lies. Only rows first_row to last_row-1 are looked at or changed.
+ * The stack is empty on return. */
+inline void link_edges(unsigned char * edge, int width, int first_row, int last_row, vector<int> &stack)
+{
+
+	while (!stack.empty())
+	{
+
+		int index = stack.back();
+		stack.pop_back();
+
+		int x = index % width;
+		int y = index / width;
+		int x_first = (x < LINK_RADIUS) ? 0 : x - LINK_RADIUS;
+		int x_last = (x + LINK_RADIUS >= width) ? width - 1 : x + LINK_RADIUS;
+		int y_first = (y - LINK_RADIUS < first_row) ? first_row : y - LINK_RADIUS;
+		int y_last = (y + LINK_RADIUS >= last_row) ? last_row - 1 : y + LINK_RADIUS;
+
+		for (int j=y_first; j<=y_last; j++)
+		{
+			unsigned char * row = edge + (size_t)j*width;
+			for (int i=x_first; i<=x_last; i++)
+			{
+				if (row[i] == EDGE_MINOR)
+				{
+					row[i] = EDGE_MAJOR;
+					stack.push_back(j*width + i);
+				}
+			}
+		}
+
+	}
+
+	return;
+
+}
+
+
+
+
+/* Whatever is still minor in rows first_row to last_row-1 is not connected to any major edge */
+inline void clear_minor_edges(unsigned char * edge, int width, int first_row, int last_row)
+{
+
+	int end = last_row*width;
+	for (int index=first_row*width; index<end; index++)
+	{
+		if (edge[index] == EDGE_MINOR)
+			edge[index] = EDGE_NONE;
+	}
+
+	return;
+
+}
+
+
+
+
+/* Hysteresis edge linking over the whole plane
+ * Every major edge seeds the stack, the flood fill promotes all minor edges connected to them and the rest are cleared.
+ * stack is only working space; it is passed in so its memory can be reused from one image to the next. */
+inline void hysteresis(unsigned char * edge, int width, int height, vector<int> &stack)
+{
+
+	stack.clear();
+	seed_edges(edge, width, 0, height, stack);
+	link_edges(edge, width, 0, height, stack);
+	clear_minor_edges(edge, width, 0, height);
+
+	return;
+
+}
+
+
+
+
+
+/* In place radix-2 FFT of n complex values, n a power of two, the k-th value at re[k*stride] and im[k*stride]
+ * Iterative Cooley-Tukey: the values are put in bit-reversed order, then combined in butterflies of doubling length
+ * The twiddle factors of each length come from a recurrence in double, so there is one sin/cos per length rather than per butterfly */
+inline void fft(float * re, float * im, int n, bool inverse, int stride)
+{
+
+	// Bit reversal permutation
+	for (int i=1, j=0; i<n; i++)
+	{
+		int bit = n >> 1;
+		for (; j & bit; bit >>= 1)
+			j ^= bit;
+		j ^= bit;
+
+		if (i < j)
+		{
+			float t = re[i*stride]; re[i*stride] = re[j*stride]; re[j*stride] = t;
+			t = im[i*stride]; im[i*stride] = im[j*stride]; im[j*stride] = t;
+		}
+	}
+
+	for (int length=2; length<=n; length<<=1)
+	{
+
+		double angle = (inverse ? 2 : -2)*M_PI/length;
+		double step_re = cos(angle);
+		double step_im = sin(angle);
+		int half = length/2;
+
+		double w_re = 1;
+		double w_im = 0;
+		for (int k=0; k<half; k++)
+		{
+			for (int start=0; start<n; start+=length)
+			{
+				int top = (start + k)*stride;
+				int bottom = (start + k + half)*stride;
+
+				float t_re = (float)(w_re*re[bottom] - w_im*im[bottom]);
+				float t_im = (float)(w_re*im[bottom] + w_im*re[bottom]);
+
+				re[bottom] = re[top] - t_re;
+				im[bottom] = im[top] - t_im;
+				re[top] += t_re;
+				im[top] += t_im;
+			}
+
+			double next = w_re*step_re - w_im*step_im;
+			w_im = w_re*step_im + w_im*step_re;
+			w_re = next;
+		}
+
+	}
+
+	return;
+
+}
+
+
+
+
+/* 2D FFT of a row-major plane of complex values, both sides powers of two
+ * The inverse is scaled here, so that forward then inverse is the identity */
+inline void fft_2d(float * re, float * im, int width, int height, bool inverse)
+{
+
+	for (int y=0; y<height; y++)
+		fft(re + (size_t)y*width, im + (size_t)y*width, width, inverse);
+
+	for (int x=0; x<width; x++)
+		fft(re + x, im + x, height, inverse, width);
+
+	if (inverse)
+	{
+		float scale = 1.0f/((float)width*height);
+		size_t pixels = (size_t)width*height;
+		for (size_t i=0; i<pixels; i++)
+		{
+			re[i] *= scale;
+			im[i] *= scale;
+		}
+	}
+
+	return;
+
+}
+
+
+
+
+/* Plan of a radix-2 FFT of n values, n a power of two
+ * swaps holds the pairs (i, j), i < j, exchanged by the bit reversal, and w_re/w_im the n/2 forward twiddle factors exp(-2*pi*i*k/n),
+ * each computed directly in double, so they are more accurate than the recurrence of fft(...) as well as computed only once.
+ * The butterflies of length L use every (n/L)-th factor. */
+inline void fft_plan(int n, Fft_plan &plan)
+{
+
+	plan.n = n;
+	plan.swaps.clear();
+	for (int i=1, j=0; i<n; i++)
+	{
+		int bit = n >> 1;
+		for (; j & bit; bit >>= 1)
+			j ^= bit;
+		j ^= bit;
+
+		if (i < j)
+		{
+			plan.swaps.push_back(i);
+			plan.swaps.push_back(j);
+		}
+	}
+
+	plan.w_re.resize(n/2);
+	plan.w_im.resize(n/2);
+	for (int k=0; k<n/2; k++)
+	{
+		plan.w_re[k] = (float)cos(2*M_PI*k/n);
+		plan.w_im[k] = (float)-sin(2*M_PI*k/n);
+	}
+
+	return;
+
+}
+
+
+
+
+/* In place radix-2 FFT from a plan, the k-th value at re[k*stride] and im[k*stride]
+ * The same butterflies as fft(...), a stage at a time across the whole array, with the pairs to swap and the twiddle factors read
+ * from the plan rather than found by the bit reversal loop and the recurrence.
+ * The inverse uses the conjugate factors and is not scaled. */
+inline void fft_execute(const Fft_plan &plan, float * re, float * im, bool inverse, int stride)
+{
+
+	int n = plan.n;
+	const int * swaps = plan.swaps.empty() ? NULL : &plan.swaps[0];
+	for (size_t p=0; p<plan.swaps.size(); p+=2)
+	{
+		int i = swaps[p]*stride;
+		int j = swaps[p + 1]*stride;
+		float t = re[i]; re[i] = re[j]; re[j] = t;
+		t = im[i]; im[i] = im[j]; im[j] = t;
+	}
+
+	float sign = inverse ? -1.0f : 1.0f;
+	for (int length=2; length<=n; length<<=1)
+	{
+		int half = length/2;
+		int step = n/length;
+
+		for (int start=0; start<n; start+=length)
+		{
+			for (int k=0; k<half; k++)
+			{
+				float w_re = plan.w_re[k*step];
+				float w_im = sign*plan.w_im[k*step];
+				int top = (start + k)*stride;
+				int bottom = (start + k + half)*stride;
+
+				float t_re = w_re*re[bottom] - w_im*im[bottom];
+				float t_im = w_re*im[bottom] + w_im*re[bottom];
+
+				re[bottom] = re[top] - t_re;
+				im[bottom] = im[top] - t_im;
+				re[top] += t_re;
+				im[top] += t_im;
+			}
+		}
+	}
+
+	return;
+
+}
+
+
+
+
+/* Largest power of two not above the number, or 0 for numbers below 1 */
+inline int power_of_two_below(int number)
+{
+
+	if (number < 1)
+		return 0;
+
+	int power = 1;
+	while (power <= number/2)
+		power *= 2;
+
+	return power;
+
+}
+
+
+
+
+/* Shift of window b relative to window a by phase correlation, so that b(x,y) is about a(x - dx, y - dy)
+ * Both windows are tapered by a Hann window first, so their borders don't correlate as a strong false edge.
+ * The cross-power spectrum conj(A)*B is normalised to unit magnitude, keeping only the phase, whose inverse transform is a single peak at the shift.
+ * Shifts over half the window wrap round to negative ones. The peak is refined to a fraction of a pixel by a parabola through it and its neighbours.
+ * work is resized to four planes of the window size and can be reused from one call to the next. */
+inline float phase_correlate(const float * a, const float * b, int width, int height, vector<float> &work, float &dx, float &dy)
+{
+
+	size_t pixels = (size_t)width*height;
+	work.resize(4*pixels);
+	float * a_re = &work[0];
+	float * a_im = a_re + pixels;
+	float * b_re = a_im + pixels;
+	float * b_im = b_re + pixels;
+
+	// Remove the means, so the brightness of the windows doesn't become a peak at no shift, then taper
+	double a_sum = 0;
+	double b_sum = 0;
+	for (size_t i=0; i<pixels; i++)
+	{
+		a_sum += a[i];
+		b_sum += b[i];
+	}
+	float a_mean = (float)(a_sum/pixels);
+	float b_mean = (float)(b_sum/pixels);
+
+	for (int y=0; y<height; y++)
+	{
+		float wy = 0.5f - 0.5f*(float)cos(2*M_PI*y/height);
+		for (int x=0; x<width; x++)
+		{
+			float taper = wy*(0.5f - 0.5f*(float)cos(2*M_PI*x/width));
+			size_t i = (size_t)y*width + x;
+			a_re[i] = (a[i] - a_mean)*taper;
+			b_re[i] = (b[i] - b_mean)*taper;
+			a_im[i] = 0;
+			b_im[i] = 0;
+		}
+	}
+
+	fft_2d(a_re, a_im, width, height, false);
+	fft_2d(b_re, b_im, width, height, false);
+
+	// Normalised cross-power spectrum, into the planes of a
+	for (size_t i=0; i<pixels; i++)
+	{
+		float re = a_re[i]*b_re[i] + a_im[i]*b_im[i];
+		float im = a_re[i]*b_im[i] - a_im[i]*b_re[i];
+		float magnitude = sqrt(re*re + im*im);
+		if (magnitude > 1E-20f)
+		{
+			a_re[i] = re/magnitude;
+			a_im[i] = im/magnitude;
+		}
+		else
+			a_re[i] = a_im[i] = 0;
+	}
+
+	fft_2d(a_re, a_im, width, height, true);
+
+	size_t best = 0;
+	for (size_t i=1; i<pixels; i++)
+	{
+		if (a_re[i] > a_re[best])
+			best = i;
+	}
+
+	int px = (int)(best % width);
+	int py = (int)(best / width);
+	float peak = a_re[best];
+
+	// Parabola through the peak and its neighbours, which wrap round like the shifts
+	float left = a_re[(size_t)py*width + (px + width - 1) % width];
+	float right = a_re[(size_t)py*width + (px + 1) % width];
+	float up = a_re[(size_t)((py + height - 1) % height)*width + px];
+	float down = a_re[(size_t)((py + 1) % height)*width + px];
+
+	float fx = 0;
+	float fy = 0;
+	float curve = left - 2*peak + right;
+	if (curve < 0)
+		fx = 0.5f*(left - right)/curve;
+	curve = up - 2*peak + down;
+	if (curve < 0)
+		fy = 0.5f*(up - down)/curve;
+
+	dx = ((px > width/2) ? px - width : px) + fx;
+	dy = ((py > height/2) ? py - height : py) + fy;
+
+	return peak;
+
+}
+
+
+#endif
@@ -0,0 +1,528 @@
+// Mosaic Class
+
+/* This file contains the class that holds stitched mosaics as multi-resolution pyramids on disk, so mosaics of any size can be built,
+ * viewed and processed without ever being held in memory whole.
+ * Level 0 is the mosaic at full resolution, and each further level halves it, until the whole mosaic fits in a single tile.
+ * Every level is cut into square tiles saved as PGM pictures, '<directory>/<level>/<column>_<row>.pgm', described by '<directory>/pyramid.txt'.
+ * Reading a region only loads the tiles it covers, through a cache of recently used tiles, so panning over a level or reading it
+ * in strips reads each tile from disk about once.
+ * These are:
+ *
+ * public:
+ * Mosaic(int) -> Only class constructor. Takes how many tiles the cache may hold (default 64, 4 MB of 256x256 tiles).
+ * build(string, const vector<Mosaictile>&, int) -> Builds the pyramid of the given pictures (PGM files, all the same size) placed at their
+ * 		positions in the mosaic, into the given directory, with tiles of the given side (default 256). Where pictures overlap, each pixel
+ * 		is taken from the picture whose centre is nearest, so the seams run halfway across the overlaps.
+ * 		Only the pictures crossing one row of tiles are loaded at a time. Returns false, saying why, if a file can't be read or written.
+ * open(string) -> Opens a pyramid built before. Returns false if the directory has none.
+ * levels() -> Number of levels.
+ * width(int), height(int) -> Size of a level.
+ * tile_size() -> Side of the tiles.
+ * read(int, int, int, int, int, unsigned char*) -> Copies a region of a level (left, top, width, height) into a buffer, rows packed.
+ * 		Parts of the region outside the level, or not covered by any picture, are black.
+ * export_level(string, int) -> Writes a whole level as a single PGM picture, one row of tiles at a time,
+ * 		for example to run edges_stream on a mosaic too large for memory.
+ *
+ * private:
+ * build_base(const vector<Mosaictile>&, int, int) -> Builds level 0 from the pictures.
+ * build_level(int) -> Builds a level by halving the one below it.
+ * tile(int, int, int) -> A tile of a level, from the cache or from disk.
+ * tile_name(int, int, int) -> File of a tile.
+ */
+
+
+
+#ifndef MOSAIC_CLASS_H
+#define MOSAIC_CLASS_H
+
+#include <iostream>
+#include <sstream>
+#include <fstream>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <map>
+#include <list>
+#include <sys/stat.h>
+
+#include "pgm_io.h"
+
+using namespace std;
+
+
+
+// A picture of the mosaic, at its position in pixels from the top left corner of level 0
+struct Mosaictile
+{
+	string file;
+	int x;
+	int y;
+};
+
+
+
+// A tile held in the cache, with its place in the order of use
+struct Mosaiccached
+{
+	vector<unsigned char> pixels;
+	int width;
+	int height;
+	list< pair<int, pair<int, int> > >::iterator used;
+};
+
+
+
+class Mosaic
+{
+
+private:
+
+	string m_directory;
+	int m_width;
+	int m_height;
+	int m_tile;
+	int m_levels;
+
+	// Cache of tiles by (level, (column, row)), the most recently used at the front of m_order
+	typedef pair<int, pair<int, int> > Tilekey;
+	map<Tilekey, Mosaiccached> m_cache;
+	list<Tilekey> m_order;
+	int m_cache_limit;
+
+
+	bool build_base(const vector<Mosaictile> &pictures, int picture_width, int picture_height);
+
+	bool build_level(int level);
+
+	const Mosaiccached * tile(int level, int column, int row);
+
+	string tile_name(int level, int column, int row);
+
+
+public:
+
+	Mosaic(int cache_tiles = 64);
+
+	bool build(string directory, const vector<Mosaictile> &pictures, int tile_size = 256);
+
+	bool open(string directory);
+
+	int levels()
+	{	return m_levels;	}
+
+	int width(int level = 0)
+	{	return (m_width + (1 << level) - 1) >> level;	}
+
+	int height(int level = 0)
+	{	return (m_height + (1 << level) - 1) >> level;	}
+
+	int tile_size()
+	{	return m_tile;	}
+
+	bool read(int level, int left, int top, int region_width, int region_height, unsigned char * out);
+
+	bool export_level(string location, int level = 0);
+
+
+};
+
+
+
+
+/* Mosaic class CONSTRUCTOR */
+Mosaic::Mosaic(int cache_tiles)
+{
+
+	m_width = 0;
+	m_height = 0;
+	m_tile = 256;
+	m_levels = 0;
+	m_cache_limit = (cache_tiles < 4) ? 4 : cache_tiles;
+
+}
+
+
+
+
+/* Build the whole pyramid: level 0 from the pictures, then each level from the one below, and finally the description */
+bool Mosaic::build(string directory, const vector<Mosaictile> &pictures, int tile_size)
+{
+
+	if (pictures.empty())
+	{
+		cout << "\nNo pictures to build a mosaic from" << endl;
+		return false;
+	}
+
+	// Every picture has the size of the first
+	vector<unsigned char> first;
+	int picture_width, picture_height;
+	if (!read_pgm(pictures[0].file, first, picture_width, picture_height))
+		return false;
+
+	m_directory = directory;
+	m_tile = (tile_size < 16) ? 16 : tile_size;
+	m_width = 0;
+	m_height = 0;
+	for (size_t i=0; i<pictures.size(); i++)
+	{
+		if (pictures[i].x + picture_width > m_width)
+			m_width = pictures[i].x + picture_width;
+		if (pictures[i].y + picture_height > m_height)
+			m_height = pictures[i].y + picture_height;
+	}
+
+	m_cache.clear();
+	m_order.clear();
+	mkdir(m_directory.c_str(), 0755);
+
+	m_levels = 1;
+	if (!build_base(pictures, picture_width, picture_height))
+		return false;
+
+	while (width(m_levels - 1) > m_tile || height(m_levels - 1) > m_tile)
+	{
+		if (!build_level(m_levels))
+			return false;
+		m_levels++;
+	}
+
+	ofstream description((m_directory + "/pyramid.txt").c_str());
+	description << m_width << " " << m_height << " " << m_tile << " " << m_levels << endl;
+	if (!description.good())
+	{
+		cout << "\nCould not write " << m_directory << "/pyramid.txt" << endl;
+		return false;
+	}
+
+	cout << "\nBuilt a mosaic of " << m_width << "x" << m_height << " in " << m_levels << " levels" << endl;
+
+	return true;
+
+}
+
+
+
+
+/* Open a pyramid built before, from its description */
+bool Mosaic::open(string directory)
+{
+
+	ifstream description((directory + "/pyramid.txt").c_str());
+	int width, height, tile, levels;
+	if (!(description >> width >> height >> tile >> levels) || levels < 1 || tile < 1)
+	{
+		cout << "\nNo mosaic in " << directory << endl;
+		return false;
+	}
+
+	m_directory = directory;
+	m_width = width;
+	m_height = height;
+	m_tile = tile;
+	m_levels = levels;
+	m_cache.clear();
+	m_order.clear();
+
+	return true;
+
+}
+
+
+
+
+/* Level 0, a row of tiles at a time
+ * The pictures crossing the row are loaded once for the whole row and dropped once the rows of tiles have passed them.
+ * Each tile keeps, for every pixel, how far it is from the centre of the picture it came from (in fractions of the picture,
+ * the larger of x and y), and a picture only writes the pixels it is nearer the centre of. */
+bool Mosaic::build_base(const vector<Mosaictile> &pictures, int picture_width, int picture_height)
+{
+
+	mkdir((m_directory + "/0").c_str(), 0755);
+
+	map<int, vector<unsigned char> > loaded;
+	vector<unsigned char> pixels((size_t)m_tile*m_tile);
+	vector<float> nearest((size_t)m_tile*m_tile);
+
+	int rows = (m_height + m_tile - 1)/m_tile;
+	int columns = (m_width + m_tile - 1)/m_tile;
+
+	for (int row=0; row<rows; row++)
+	{
+
+		int top = row*m_tile;
+		int bottom = (top + m_tile < m_height) ? top + m_tile : m_height;
+
+		// Drop the pictures above this row, and load the ones reaching into it
+		for (map<int, vector<unsigned char> >::iterator it=loaded.begin(); it!=loaded.end(); )
+		{
+			if (pictures[it->first].y + picture_height <= top)
+				loaded.erase(it++);
+			else
+				++it;
+		}
+		for (size_t i=0; i<pictures.size(); i++)
+		{
+			if (pictures[i].y < bottom && pictures[i].y + picture_height > top && loaded.find((int)i) == loaded.end())
+			{
+				int w, h;
+				if (!read_pgm(pictures[i].file, loaded[(int)i], w, h))
+					return false;
+				if (w != picture_width || h != picture_height)
+				{
+					cout << "\n" << pictures[i].file << " is not the size of the other pictures" << endl;
+					return false;
+				}
+			}
+		}
+
+		for (int column=0; column<columns; column++)
+		{
+
+			int left = column*m_tile;
+			int right = (left + m_tile < m_width) ? left + m_tile : m_width;
+			int tile_width = right - left;
+			int tile_height = bottom - top;
+
+			for (int i=0; i<tile_width*tile_height; i++)
+			{
+				pixels[i] = 0;
+				nearest[i] = 2;
+			}
+
+			for (map<int, vector<unsigned char> >::iterator it=loaded.begin(); it!=loaded.end(); ++it)
+			{
+				const Mosaictile &picture = pictures[it->first];
+				int x0 = (picture.x > left) ? picture.x : left;
+				int x1 = (picture.x + picture_width < right) ? picture.x + picture_width : right;
+				int y0 = (picture.y > top) ? picture.y : top;
+				int y1 = (picture.y + picture_height < bottom) ? picture.y + picture_height : bottom;
+
+				for (int y=y0; y<y1; y++)
+				{
+					float fy = fabs((y - picture.y + 0.5f)/picture_height - 0.5f);
+					const unsigned char * source = &it->second[(size_t)(y - picture.y)*picture_width];
+					for (int x=x0; x<x1; x++)
+					{
+						float fx = fabs((x - picture.x + 0.5f)/picture_width - 0.5f);
+						float distance = (fx > fy) ? fx : fy;
+						int i = (y - top)*tile_width + (x - left);
+						if (distance < nearest[i])
+						{
+							nearest[i] = distance;
+							pixels[i] = source[x - picture.x];
+						}
+					}
+				}
+			}
+
+			if (!write_pgm(tile_name(0, column, row), &pixels[0], tile_width, tile_height))
+				return false;
+
+		}
+
+	}
+
+	return true;
+
+}
+
+
+
+
+/* A level from the one below, each pixel the mean of the 2x2 pixels under it (or of those there are, on odd edges) */
+bool Mosaic::build_level(int level)
+{
+
+	stringstream naming;
+	naming << m_directory << "/" << level;
+	mkdir(naming.str().c_str(), 0755);
+
+	int level_width = width(level);
+	int level_height = height(level);
+	int below_width = width(level - 1);
+	int below_height = height(level - 1);
+
+	vector<unsigned char> below((size_t)4*m_tile*m_tile);
+	vector<unsigned char> pixels((size_t)m_tile*m_tile);
+
+	for (int top=0, row=0; top<level_height; top+=m_tile, row++)
+	{
+		for (int left=0, column=0; left<level_width; left+=m_tile, column++)
+		{
+
+			int tile_width = (left + m_tile < level_width) ? m_tile : level_width - left;
+			int tile_height = (top + m_tile < level_height) ? m_tile : level_height - top;
+			int read_width = 2*tile_width;
+			int read_height = 2*tile_height;
+
+			if (!read(level - 1, 2*left, 2*top, read_width, read_height, &below[0]))
+				return false;
+
+			for (int y=0; y<tile_height; y++)
+			{
+				int y0 = 2*y;
+				int y1 = (2*(top + y) + 1 < below_height) ? y0 + 1 : y0;
+				for (int x=0; x<tile_width; x++)
+				{
+					int x0 = 2*x;
+					int x1 = (2*(left + x) + 1 < below_width) ? x0 + 1 : x0;
+					int sum = below[y0*read_width + x0] + below[y0*read_width + x1] + below[y1*read_width + x0] + below[y1*read_width + x1];
+					pixels[y*tile_width + x] = (unsigned char)((sum + 2)/4);
+				}
+			}
+
+			if (!write_pgm(tile_name(level, column, row), &pixels[0], tile_width, tile_height))
+				return false;
+
+		}
+	}
+
+	return true;
+
+}
+
+
+
+
+/* Copy a region of a level, tile by tile */
+bool Mosaic::read(int level, int left, int top, int region_width, int region_height, unsigned char * out)
+{
+
+	for (int i=0; i<region_width*region_height; i++)
+		out[i] = 0;
+
+	if (level < 0 || level >= m_levels)
+		return false;
+
+	int level_width = width(level);
+	int level_height = height(level);
+
+	int x0 = (left > 0) ? left : 0;
+	int y0 = (top > 0) ? top : 0;
+	int x1 = (left + region_width < level_width) ? left + region_width : level_width;
+	int y1 = (top + region_height < level_height) ? top + region_height : level_height;
+
+	for (int row=y0/m_tile; row*m_tile<y1; row++)
+	{
+		for (int column=x0/m_tile; column*m_tile<x1; column++)
+		{
+
+			const Mosaiccached * cached = tile(level, column, row);
+			if (cached == NULL)
+				return false;
+
+			int tile_left = column*m_tile;
+			int tile_top = row*m_tile;
+			int from_x = (x0 > tile_left) ? x0 : tile_left;
+			int to_x = (x1 < tile_left + cached->width) ? x1 : tile_left + cached->width;
+			int from_y = (y0 > tile_top) ? y0 : tile_top;
+			int to_y = (y1 < tile_top + cached->height) ? y1 : tile_top + cached->height;
+
+			for (int y=from_y; y<to_y; y++)
+				memcpy(out + (size_t)(y - top)*region_width + (from_x - left),
+						&cached->pixels[(size_t)(y - tile_top)*cached->width + (from_x - tile_left)], to_x - from_x);
+
+		}
+	}
+
+	return true;
+
+}
+
+
+
+
+/* Write a whole level as one PGM picture, reading it a row of tiles at a time */
+bool Mosaic::export_level(string location, int level)
+{
+
+	if (level < 0 || level >= m_levels)
+	{
+		cout << "\nNo level " << level << " in the mosaic" << endl;
+		return false;
+	}
+
+	FILE * file = fopen(location.c_str(), "wb");
+	if (file == NULL)
+	{
+		cout << "\nCould not open " << location << endl;
+		return false;
+	}
+
+	int level_width = width(level);
+	int level_height = height(level);
+	vector<unsigned char> band((size_t)level_width*m_tile);
+	bool done = write_pgm_header(file, level_width, level_height);
+	for (int top=0; top<level_height && done; top+=m_tile)
+	{
+		int rows = (top + m_tile < level_height) ? m_tile : level_height - top;
+		done = read(level, 0, top, level_width, rows, &band[0]);
+		if (done)
+			done = fwrite(&band[0], 1, (size_t)level_width*rows, file) == (size_t)level_width*rows;
+	}
+
+	if (fclose(file) != 0 || !done)
+	{
+		cout << "\nCould not write " << location << endl;
+		return false;
+	}
+
+	return true;
+
+}
+
+
+
+
+/* A tile from the cache, or loaded into it, dropping the least recently used tile once the cache is full */
+const Mosaiccached * Mosaic::tile(int level, int column, int row)
+{
+
+	Tilekey key(level, pair<int, int>(column, row));
+
+	map<Tilekey, Mosaiccached>::iterator found = m_cache.find(key);
+	if (found != m_cache.end())
+	{
+		m_order.splice(m_order.begin(), m_order, found->second.used);
+		return &found->second;
+	}
+
+	if ((int)m_cache.size() >= m_cache_limit)
+	{
+		m_cache.erase(m_order.back());
+		m_order.pop_back();
+	}
+
+	Mosaiccached &cached = m_cache[key];
+	if (!read_pgm(tile_name(level, column, row), cached.pixels, cached.width, cached.height))
+	{
+		m_cache.erase(key);
+		return NULL;
+	}
+	m_order.push_front(key);
+	cached.used = m_order.begin();
+
+	return &cached;
+
+}
+
+
+
+
+/* File of a tile */
+string Mosaic::tile_name(int level, int column, int row)
+{
+
+	stringstream naming;
+	naming << m_directory << "/" << level << "/" << column << "_" << row << ".pgm";
+
+	return naming.str();
+
+}
+
+
+
+#endif
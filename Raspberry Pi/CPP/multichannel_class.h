@@ -0,0 +1,263 @@
+// Multi-channel Class
+
+/* This file contains the class that takes a picture in each of a sequence of illuminations (channels) with the camera streaming.
+ * Switching the lights by command costs a serial round trip for each change, and each picture then waits for the camera.
+ * Here the sequence is loaded on the Arduino once (see the multi-channel commands in Arduino/README.md). The camera keeps streaming, and
+ * each time a frame of the current channel has arrived a single sync byte is sent without waiting for any reply: the Arduino switches
+ * to the next channel as soon as it reads the byte that ends a channel, while the host is already waiting for the next frame.
+ * The frame being exposed while the lights change is mixed, so the settle frames after every switch are skipped. A channel then costs
+ * its frames plus the settle frames, all at the frame rate, and a whole pass costs one round trip, to start the sequence.
+ * The camera should run at a fixed exposure (see Flatfield::camera_options(int)), otherwise it meters every channel differently,
+ * so a channel is made brighter by more frames rather than a longer exposure: its frames are averaged into its picture,
+ * which also lowers the noise.
+ * After the last channel the Arduino goes back to the first, so the lights are left as the first channel.
+ * These are:
+ *
+ * public:
+ * Multichannel(Autofocus&, Camera&) -> Only class constructor. Takes an Autofocus object with its serial port open, and an open camera.
+ * add_channel(string, string, int, int, int) -> Adds a channel: its name, the ring colour (hexadecimal RGB), the brightness (0-255) of
+ * 		the ring and of the stage LED, and how many frames to average (default 1). Up to MULTICHANNEL_MAX channels.
+ * clear_channels() -> Forgets the channels.
+ * set_settle(int) -> Chooses how many frames to skip after every switch (default 1).
+ * load() -> Loads the channels on the Arduino. Done by acquire(...) if the channels changed since.
+ * acquire(vector< vector<unsigned char> >&) -> Takes a pass of all channels, one luma plane for each, in order.
+ * 		Returns false if the Arduino or the camera failed.
+ * channels() -> Number of channels.
+ * name(int) -> Name of a channel.
+ * last_ms() -> How long the last pass took, in milliseconds.
+ *
+ * private:
+ * take(int, unsigned int&, vector<unsigned char>&) -> Averages the frames of a channel, sending a sync byte after each.
+ */
+
+
+
+#ifndef MULTICHANNEL_CLASS_H
+#define MULTICHANNEL_CLASS_H
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include "autofocus_class.h"
+#include "camera_class.h"
+
+// Channels the Arduino holds (MAX_CHANNELS in Lighting.h)
+#define MULTICHANNEL_MAX 8
+
+
+
+// An illumination: ring colour and brightness, stage LED brightness, and frames averaged under it
+struct Lightchannel
+{
+	string name;
+	string colour;
+	int ring;
+	int led;
+	int frames;
+};
+
+
+
+class Multichannel
+{
+
+private:
+
+	Autofocus &m_stage;
+	Camera &m_camera;
+
+	vector<Lightchannel> m_channels;
+	int m_settle_frames;
+	bool m_loaded;
+	double m_last_ms;
+
+	// Sums of the frames of a channel, and the frame being added
+	vector<unsigned short> m_sums;
+	vector<unsigned char> m_frame;
+
+
+	bool take(int channel, unsigned int &number, vector<unsigned char> &plane);
+
+
+public:
+
+	Multichannel(Autofocus &stage, Camera &camera);
+
+	bool add_channel(string name, string colour, int ring, int led, int frames = 1);
+
+	void clear_channels()
+	{	m_channels.clear(); m_loaded = false; return;	}
+
+	void set_settle(int settle_frames = 1)
+	{	m_settle_frames = (settle_frames < 0) ? 0 : settle_frames; return;	}
+
+	bool load();
+
+	bool acquire(vector< vector<unsigned char> > &planes);
+
+	int channels()
+	{	return (int)m_channels.size();	}
+
+	string name(int channel)
+	{	return m_channels[channel].name;	}
+
+	double last_ms()
+	{	return m_last_ms;	}
+
+
+};
+
+
+
+
+/* Multichannel class CONSTRUCTOR */
+Multichannel::Multichannel(Autofocus &stage, Camera &camera)
+		:m_stage(stage), m_camera(camera)
+{
+
+	set_settle();
+	m_loaded = false;
+	m_last_ms = 0;
+
+}
+
+
+
+
+/* Add a channel
+ * Frames are summed in 16 bits, which holds 257 frames of 255, so a channel averages at most 255 (as the Arduino counts them in a byte) */
+bool Multichannel::add_channel(string name, string colour, int ring, int led, int frames)
+{
+
+	if ((int)m_channels.size() >= MULTICHANNEL_MAX)
+	{
+		cout << "\nThe Arduino holds at most " << MULTICHANNEL_MAX << " channels" << endl;
+		return false;
+	}
+
+	Lightchannel channel;
+	channel.name = name;
+	channel.colour = colour;
+	channel.ring = ring;
+	channel.led = led;
+	channel.frames = (frames < 1) ? 1 : ((frames > 255) ? 255 : frames);
+	m_channels.push_back(channel);
+	m_loaded = false;
+
+	return true;
+
+}
+
+
+
+
+/* Load the channels on the Arduino, one command each */
+bool Multichannel::load()
+{
+
+	if (m_channels.empty())
+	{
+		cout << "\nNo channels to load" << endl;
+		return false;
+	}
+
+	if (!m_stage.comm_clear_channels())
+		return false;
+	for (size_t c=0; c<m_channels.size(); c++)
+	{
+		if (!m_stage.comm_add_channel(m_channels[c].colour, m_channels[c].ring, m_channels[c].led, m_channels[c].frames))
+		{
+			cout << "\nThe Arduino did not take channel " << m_channels[c].name << endl;
+			return false;
+		}
+	}
+	m_loaded = true;
+
+	return true;
+
+}
+
+
+
+
+/* Take a pass of all channels
+ * Once the first channel is on, frames are taken by number: the first one started after the settle frames, then every one after it.
+ * The sync byte that ends a channel is sent as soon as its last frame has arrived, so the switch happens while the frames being
+ * skipped are exposed, and the frame numbers to wait for are known without asking the Arduino anything. */
+bool Multichannel::acquire(vector< vector<unsigned char> > &planes)
+{
+
+	if (!m_camera.is_open())
+	{
+		cout << "\nThe camera is not open" << endl;
+		return false;
+	}
+	if (!m_loaded && !load())
+		return false;
+
+	boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+
+	if (!m_stage.comm_start_channels())
+	{
+		cout << "\nThe Arduino did not start the channels" << endl;
+		return false;
+	}
+
+	planes.resize(m_channels.size());
+	unsigned int number = m_camera.sequence() + m_settle_frames;
+	for (size_t c=0; c<m_channels.size(); c++)
+	{
+		if (!take((int)c, number, planes[c]))
+		{
+			cout << "\nThe camera gave no frame in channel " << m_channels[c].name << endl;
+			return false;
+		}
+		number += m_settle_frames;
+	}
+
+	m_last_ms = (boost::posix_time::microsec_clock::universal_time() - start).total_microseconds()/1000.0;
+
+	return true;
+
+}
+
+
+
+
+/* Average the frames of a channel, each the first numbered after the one before, sending a sync byte once each has arrived */
+bool Multichannel::take(int channel, unsigned int &number, vector<unsigned char> &plane)
+{
+
+	size_t pixels = (size_t)m_camera.width()*m_camera.height();
+	int frames = m_channels[channel].frames;
+	plane.resize(pixels);
+
+	if (frames == 1)
+	{
+		if (!m_camera.grab(&plane[0], number, 2000, &number))
+			return false;
+		m_stage.comm_sync();
+		return true;
+	}
+
+	m_sums.assign(pixels, 0);
+	m_frame.resize(pixels);
+	for (int f=0; f<frames; f++)
+	{
+		if (!m_camera.grab(&m_frame[0], number, 2000, &number))
+			return false;
+		m_stage.comm_sync();
+		for (size_t i=0; i<pixels; i++)
+			m_sums[i] += m_frame[i];
+	}
+
+	int half = frames/2;
+	for (size_t i=0; i<pixels; i++)
+		plane[i] = (unsigned char)((m_sums[i] + half)/frames);
+
+	return true;
+
+}
+
+
+
+#endif
@@ -0,0 +1,188 @@
+// PGM Input and Output
+
+/* This file contains the reading and writing of 8-bit binary PGM pictures shared by the classes that save or load them,
+ * so every picture the programs write has the same header and every one they read is parsed the same way.
+ * A header is 'P5', an optional comment line, the width and height, and 255, each followed by one whitespace character.
+ *
+ * pgm_header(int, int, string) -> Text of the header of a picture of the given size, with the comment if one is given (without its '#').
+ * 		For writers that do not go through a FILE, such as the compressed frames of framewriter_class.h.
+ * write_pgm_header(FILE*, int, int, string) -> Writes that header to an open file, before the pixels. Returns false if it could not.
+ * write_pgm(string, const unsigned char*, int, int, string) -> Writes a whole picture to a file.
+ * 		Returns false, after saying why, if it could not be opened or written.
+ * read_pgm_header(FILE*, int&, int&, string*) -> Reads a header from an open file, leaving it at the first pixel.
+ * 		Comments are allowed anywhere in the header, as in the format; the first one is given back if asked for.
+ * 		Returns false if it is not the header of an 8-bit binary PGM picture.
+ * read_pgm(string, vector<unsigned char>&, int&, int&) -> Reads a whole picture from a file.
+ * 		Returns false, after saying why, if it could not be opened or is not an 8-bit binary PGM picture.
+ */
+
+#ifndef PGM_IO_H
+#define PGM_IO_H
+
+#include <cstdio>
+#include <cctype>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+
+
+inline string pgm_header(int width, int height, const string &comment = "");
+inline bool write_pgm_header(FILE * file, int width, int height, const string &comment = "");
+inline bool write_pgm(string location, const unsigned char * pixels, int width, int height, const string &comment = "");
+inline bool read_pgm_header(FILE * file, int &width, int &height, string * comment = NULL);
+inline bool read_pgm(string location, vector<unsigned char> &pixels, int &width, int &height);
+
+
+
+
+/* Header text of a picture */
+inline string pgm_header(int width, int height, const string &comment)
+{
+
+	stringstream header;
+	header << "P5\n";
+	if (!comment.empty())
+		header << "# " << comment << "\n";
+	header << width << " " << height << "\n255\n";
+
+	return header.str();
+
+}
+
+
+
+
+/* Write the header of a picture to an open file */
+inline bool write_pgm_header(FILE * file, int width, int height, const string &comment)
+{
+
+	string header = pgm_header(width, height, comment);
+
+	return fwrite(header.c_str(), 1, header.size(), file) == header.size();
+
+}
+
+
+
+
+/* Write a whole picture */
+inline bool write_pgm(string location, const unsigned char * pixels, int width, int height, const string &comment)
+{
+
+	FILE * file = fopen(location.c_str(), "wb");
+	if (file == NULL)
+	{
+		cout << "\nCould not open " << location << endl;
+		return false;
+	}
+
+	size_t size = (size_t)width*height;
+	bool written = write_pgm_header(file, width, height, comment) && fwrite(pixels, 1, size, file) == size;
+
+	if (fclose(file) != 0 || !written)
+	{
+		cout << "\nCould not write " << location << endl;
+		return false;
+	}
+
+	return true;
+
+}
+
+
+
+
+/* Read the header of a picture, leaving the file at its first pixel */
+inline bool read_pgm_header(FILE * file, int &width, int &height, string * comment)
+{
+
+	if (comment != NULL)
+		comment->clear();
+
+	int values[3] = { 0, 0, 0 };
+	bool found_comment = false;
+	bool ok = (fgetc(file) == 'P' && fgetc(file) == '5');
+	for (int i=0; i<3 && ok; i++)
+	{
+		int c = fgetc(file);
+		while (isspace(c) || c == '#')
+		{
+			if (c == '#')
+			{
+				// Past the '#' and the space after it, up to the end of the line
+				string text;
+				c = fgetc(file);
+				if (c == ' ')
+					c = fgetc(file);
+				while (c != '\n' && c != EOF)
+				{
+					text += (char)c;
+					c = fgetc(file);
+				}
+				if (comment != NULL && !found_comment)
+					*comment = text;
+				found_comment = true;
+			}
+			c = fgetc(file);
+		}
+		ungetc(c, file);
+		ok = (fscanf(file, "%d", &values[i]) == 1);
+	}
+	// Exactly one whitespace character separates the header from the pixels
+	if (ok)
+		fgetc(file);
+
+	if (!ok || values[0] < 1 || values[1] < 1 || values[2] < 1 || values[2] > 255)
+		return false;
+
+	width = values[0];
+	height = values[1];
+
+	return true;
+
+}
+
+
+
+
+/* Read a whole picture */
+inline bool read_pgm(string location, vector<unsigned char> &pixels, int &width, int &height)
+{
+
+	FILE * file = fopen(location.c_str(), "rb");
+	if (file == NULL)
+	{
+		cout << "\nCould not open " << location << endl;
+		return false;
+	}
+
+	int w, h;
+	bool ok = read_pgm_header(file, w, h);
+	if (ok)
+	{
+		pixels.resize((size_t)w*h);
+		ok = fread(&pixels[0], 1, pixels.size(), file) == pixels.size();
+	}
+
+	fclose(file);
+
+	if (!ok)
+	{
+		cout << "\n" << location << " is not an 8-bit binary PGM picture" << endl;
+		return false;
+	}
+
+	width = w;
+	height = h;
+
+	return true;
+
+}
+
+
+
+#endif
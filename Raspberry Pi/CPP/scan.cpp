@@ -0,0 +1,117 @@
+// Scan Main Program
+
+/* Scans a region of the slide in overlapping tiles through the Scan class, stitches them by phase correlation,
+ * and builds the mosaic into a pyramid of tiles at every resolution through the Mosaic class.
+ * The region starts at the top left corner where the stage is now, and the stage is brought back there at the end.
+ * The whole mosaic can also be exported as a single picture, a row of tiles at a time, for example for edges_stream.
+ * Cells can be counted on every tile as it is taken, with the default parameters of the Cellcount class.
+ * If the lighting was calibrated with flatfield, the tiles are corrected for it as they are taken.
+ * For more information, see descriptions of scan_class.h, mosaic_class.h, cellcount_class.h and camera_class.h
+ */
+
+
+
+#include "autofocus_class.h"
+#include "scan_class.h"
+#include "mosaic_class.h"
+#include "flatfield_class.h"
+
+
+int main ()
+{
+
+	Autofocus autofocusing;
+
+	cout << "\nUsing default parameters..." << endl;
+	autofocusing.set_serial();
+	cout << "Serial port: " << autofocusing.get_serial() << endl;
+	autofocusing.set_path();
+	autofocusing.set_name();
+	autofocusing.set_output(true);
+	autofocusing.set_file();
+	autofocusing.comm_set_led_bright(70);
+
+
+	// Scale of the stage on the pictures, region and overlap
+	float scale_x = 0;
+	float scale_y = 0;
+	int region_x = 0;
+	int region_y = 0;
+	float overlap = 0;
+	string directory;
+	cout << "\n\tPixels the picture moves per microstep in x? "; cin >> scale_x;
+	cout << "\n\tPixels the picture moves per microstep in y? "; cin >> scale_y;
+	cout << "\n\tWidth of the region, in microsteps? "; cin >> region_x;
+	cout << "\n\tHeight of the region, in microsteps? "; cin >> region_y;
+	cout << "\n\tOverlap between tiles (0.05 to 0.5)? "; cin >> overlap;
+	cout << "\n\tDirectory for the scan? "; cin >> directory;
+
+	char exporting;
+	cout << "\n\tExport the whole mosaic as one picture (y/n)? "; cin >> exporting;
+
+	char counting;
+	cout << "\n\tCount the cells (y/n)? "; cin >> counting;
+
+	string calibrations;
+	int shutter_us = 0;
+	cout << "\n\tDirectory of flat field calibrations (none to skip)? "; cin >> calibrations;
+	if (calibrations != "none")
+	{
+		cout << "\n\tShutter time it was calibrated with, in microseconds? "; cin >> shutter_us;
+	}
+
+	if (scale_x == 0 || scale_y == 0)
+	{
+		cout << "\nThe scale can't be 0" << endl;
+		return 1;
+	}
+
+
+	// Stream from the camera for the whole scan, corrected for the lighting if calibrated at this setting
+	Flatfield flatfield;
+	Camera camera;
+	if (calibrations != "none")
+	{
+		if (!flatfield.load(calibrations, autofocusing.get_objective(), 70))
+			return 1;
+		if (!camera.open(640, 480, 30, flatfield.camera_options(shutter_us)) || !camera.set_correction(&flatfield))
+			return 1;
+	}
+	else if (!camera.open(640, 480, 30))
+		return 1;
+
+	Scan scanning(autofocusing, camera);
+	scanning.set_scale(scale_x, scale_y);
+	scanning.set_region(region_x, region_y, overlap);
+	if (counting == 'y')
+		scanning.set_counting(Cellcount());
+
+	bool done = scanning.run(directory);
+
+	camera.close();
+
+	if (!done)
+	{
+		cout << "\nThe scan was not completed" << endl;
+		return 1;
+	}
+
+
+	// Pyramid of the stitched mosaic
+	Mosaic mosaic;
+	if (!mosaic.build(directory + "/pyramid", scanning.tiles()))
+		return 1;
+
+	cout << "\nMosaic pyramid saved to " << directory << "/pyramid" << endl;
+
+	if (exporting == 'y')
+	{
+		if (!mosaic.export_level(directory + "/mosaic.pgm"))
+			return 1;
+		cout << "\nWhole mosaic saved to " << directory << "/mosaic.pgm" << endl;
+	}
+
+	cout << endl;
+	return 0;
+
+}
@@ -0,0 +1,764 @@
+// Scan Class
+
+/* This file contains the class that scans a region of the slide in tiles with the XY stage and stitches them into one mosaic.
+ * The stage goes over the region along a serpentine path (left to right on one row, right to left on the next), so it never travels
+ * back empty, and a picture is taken from a streaming Camera at every tile, with neighbouring tiles overlapping.
+ * The stage cannot place tiles exactly, so the offset between every pair of neighbours is measured by phase correlation of their overlap
+ * (see phase_correlate() in image_kernels.h). This is done by worker threads as the tiles arrive, while the stage moves on, so only the
+ * tiles of the current and previous rows are held in memory and the offsets are all known when the last tile is taken.
+ * The measured offsets disagree slightly round every loop of tiles, so the positions of all tiles are then found together by least squares,
+ * each offset weighted by how confident the correlation was, and written out for the Mosaic class to build the mosaic pyramid from.
+ * Cells can also be counted on every tile by the workers (see cellcount_class.h). A cell in the overlap of two tiles is found on both,
+ * so once the tiles are placed each is only kept from the tile whose centre it is nearest.
+ * These are:
+ *
+ * public:
+ * Scan(Autofocus&, Camera&) -> Only class constructor. Takes an Autofocus object with its serial port open, and an open camera.
+ * set_scale(float, float) -> Chooses how many pixels the picture moves for each microstep of the stage in x and in y.
+ * 		Either can be negative, if the picture moves against the stage on that axis.
+ * set_region(int, int, float) -> Chooses the size of the region to scan in microsteps, starting from where the stage is now at the
+ * 		top left corner, and the fraction of each picture that overlaps its neighbours (default 0.2).
+ * 		The number of tiles and the step between them follow from the size of the pictures and set_scale(...).
+ * set_settle(int, int) -> Chooses how many milliseconds to wait once the stage reports it has stopped, and how many frames to skip after
+ * 		that (as for ZStack).
+ * set_workers(int) -> Number of threads measuring offsets and saving tiles (default 0, one per core).
+ * set_min_peak(float) -> Correlation peaks below this are taken as failed matches, over blank areas of the slide, and their offsets
+ * 		left out of the positions (default 0.1).
+ * set_counting(const Cellcount&) -> Counts the cells on every tile with the parameters of the given Cellcount object.
+ * run(string) -> Scans the region into the given directory: the tiles as 'tile_<column>_<row>.pgm' and their positions in scan.txt,
+ * 		one line '<file> <x> <y>' per tile, in pixels from the top left corner of the mosaic. The stage is brought back to the start.
+ * 		Returns false if the stage, the camera or a file failed on the way.
+ * 		If counting cells, they are written to cells.txt, one line '<x> <y> <area> <tile>' per cell, x and y in pixels of the mosaic.
+ * tiles() -> The tiles with their positions, as the Mosaic class takes them (see mosaic_class.h).
+ * cells() -> Number of cells counted over the whole region by the last scan.
+ * columns(), rows() -> Size of the grid of the last scan.
+ *
+ * private:
+ * queue(Scanjob) -> Hands a job to the workers, waiting while too many are queued.
+ * worker() -> Loop of each worker thread, saving tiles and measuring offsets until the scan is over and the queue is empty.
+ * measure(const Scanjob&, vector<float>&) -> Measures the offset between two neighbouring tiles.
+ * solve() -> Finds the positions of all tiles from the measured offsets.
+ * write_cells() -> Places the cells found on every tile in the mosaic, leaving out those found again on a neighbour, and saves them.
+ * tile_name(int) -> File of a tile, within the scan directory.
+ */
+
+
+
+#ifndef SCAN_CLASS_H
+#define SCAN_CLASS_H
+
+#include <deque>
+#include <cstdio>
+#include <cmath>
+#include <boost/shared_ptr.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include "autofocus_class.h"
+#include "camera_class.h"
+#include "mosaic_class.h"
+#include "cellcount_class.h"
+#include "image_kernels.h"
+#include "pgm_io.h"
+
+
+
+// Offset of tile b from tile a measured on their overlap, in pixels, with the height of the correlation peak
+struct Scanpair
+{
+	int a;
+	int b;
+	float dx;
+	float dy;
+	float peak;
+};
+
+
+
+// Work for the threads: a tile to save (b below 0), or a pair of neighbours to measure
+struct Scanjob
+{
+	int a;
+	int b;
+	boost::shared_ptr< vector<unsigned char> > first;
+	boost::shared_ptr< vector<unsigned char> > second;
+};
+
+
+
+class Scan
+{
+
+private:
+
+	Autofocus &m_stage;
+	Camera &m_camera;
+
+	float m_scale_x;
+	float m_scale_y;
+	int m_region_x;
+	int m_region_y;
+	float m_overlap;
+	int m_settle_ms;
+	int m_skip_frames;
+	int m_workers;
+	float m_min_peak;
+
+	// Grid of the last scan, tiles numbered row by row from the top left
+	int m_columns;
+	int m_rows;
+	int m_step_x;
+	int m_step_y;
+	int m_width;
+	int m_height;
+	string m_directory;
+	vector<float> m_x;
+	vector<float> m_y;
+
+	// Queue between the stage loop and the workers, and the offsets they measured
+	boost::mutex m_mutex;
+	boost::condition_variable m_queued;
+	boost::condition_variable m_taken;
+	deque<Scanjob> m_jobs;
+	int m_queue_limit;
+	bool m_scanning;
+	bool m_failed;
+	vector<Scanpair> m_pairs;
+
+	// Parameters each worker counts cells with, if counting, and the cells of every tile
+	bool m_counting;
+	Cellcount m_cellcount;
+	vector< vector<Cellblob> > m_cells;
+	int m_cell_total;
+
+
+	void queue(const Scanjob &job);
+
+	void worker();
+
+	bool measure(const Scanjob &job, vector<float> &work);
+
+	void solve();
+
+	bool write_cells();
+
+	string tile_name(int tile);
+
+
+public:
+
+	Scan(Autofocus &stage, Camera &camera);
+
+	void set_scale(float pixels_per_microstep_x, float pixels_per_microstep_y)
+	{	m_scale_x = pixels_per_microstep_x; m_scale_y = pixels_per_microstep_y; return;	}
+
+	void set_region(int region_x, int region_y, float overlap = 0.2);
+
+	void set_settle(int settle_ms = 0, int skip_frames = 1)
+	{	m_settle_ms = settle_ms; m_skip_frames = (skip_frames < 0) ? 0 : skip_frames; return;	}
+
+	void set_workers(int workers = 0);
+
+	void set_min_peak(float min_peak = 0.1)
+	{	m_min_peak = min_peak; return;	}
+
+	void set_counting(const Cellcount &counting)
+	{	m_cellcount = counting; m_counting = true; return;	}
+
+	bool run(string directory);
+
+	vector<Mosaictile> tiles();
+
+	int columns()
+	{	return m_columns;	}
+
+	int rows()
+	{	return m_rows;	}
+
+	int cells()
+	{	return m_cell_total;	}
+
+
+};
+
+
+
+
+/* Scan class CONSTRUCTOR */
+Scan::Scan(Autofocus &stage, Camera &camera)
+		:m_stage(stage), m_camera(camera)
+{
+
+	m_scale_x = 1;
+	m_scale_y = 1;
+	set_region(0, 0);
+	set_settle();
+	set_workers();
+	set_min_peak();
+
+	m_columns = 0;
+	m_rows = 0;
+	m_step_x = 0;
+	m_step_y = 0;
+	m_width = 0;
+	m_height = 0;
+
+	m_queue_limit = 16;
+	m_scanning = false;
+	m_failed = false;
+	m_counting = false;
+	m_cell_total = 0;
+
+}
+
+
+
+
+/* Choose the region to scan in microsteps, and how much neighbouring tiles overlap */
+void Scan::set_region(int region_x, int region_y, float overlap)
+{
+
+	m_region_x = (region_x < 0) ? -region_x : region_x;
+	m_region_y = (region_y < 0) ? -region_y : region_y;
+	m_overlap = (overlap < 0.05) ? 0.05 : ((overlap > 0.5) ? 0.5 : overlap);
+
+	return;
+
+}
+
+
+
+
+/* Choose the number of worker threads, one per core by default */
+void Scan::set_workers(int workers)
+{
+
+	if (workers < 1)
+		workers = boost::thread::hardware_concurrency();
+	m_workers = (workers < 1) ? 1 : workers;
+
+	return;
+
+}
+
+
+
+
+/* Scan the region
+ * Each tile is taken once the stage has stopped, then the move to the next one is sent before the tile is handed to the workers:
+ * one job to save it, and one for each neighbour already taken (the one before it on its row, and the one above it).
+ * Tiles are held by shared pointers, so a tile is freed as soon as the scan has passed its row and the jobs using it are done. */
+bool Scan::run(string directory)
+{
+
+	if (!m_camera.is_open())
+	{
+		cout << "\nThe camera is not open" << endl;
+		return false;
+	}
+
+	m_width = m_camera.width();
+	m_height = m_camera.height();
+
+	// Step between tiles, so that they overlap by the chosen fraction of a picture
+	float field_x = m_width/fabs(m_scale_x);
+	float field_y = m_height/fabs(m_scale_y);
+	m_step_x = (int)(field_x*(1 - m_overlap));
+	m_step_y = (int)(field_y*(1 - m_overlap));
+	if (m_step_x < 1 || m_step_y < 1)
+	{
+		cout << "\nThe field of view is too small for the scale given" << endl;
+		return false;
+	}
+	m_columns = (m_region_x > field_x) ? (int)ceil((m_region_x - field_x)/m_step_x) + 1 : 1;
+	m_rows = (m_region_y > field_y) ? (int)ceil((m_region_y - field_y)/m_step_y) + 1 : 1;
+
+	m_directory = directory;
+	mkdir(m_directory.c_str(), 0755);
+
+	int count = m_columns*m_rows;
+	m_x.assign(count, 0);
+	m_y.assign(count, 0);
+	m_pairs.clear();
+	m_jobs.clear();
+	m_cells.assign(m_counting ? count : 0, vector<Cellblob>());
+	m_cell_total = 0;
+	m_scanning = true;
+	m_failed = false;
+
+	boost::thread_group threads;
+	for (int i=0; i<m_workers; i++)
+		threads.create_thread(boost::bind(&Scan::worker, this));
+
+	cout << "\nScanning " << m_columns << "x" << m_rows << " tiles, " << m_step_x << " by " << m_step_y << " microsteps apart" << flush;
+
+	boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+	vector< boost::shared_ptr< vector<unsigned char> > > previous_row(m_columns);
+	vector< boost::shared_ptr< vector<unsigned char> > > this_row(m_columns);
+	int column = 0;
+	int taken = 0;
+	bool done = true;
+
+	// Tile the stage was last sent to, which is one further than the last taken once the next move has gone
+	int sent_column = 0;
+	int sent_row = 0;
+
+	for (int row=0; row<m_rows && done; row++)
+	{
+
+		bool forwards = (row % 2 == 0);
+
+		for (int i=0; i<m_columns; i++)
+		{
+
+			column = forwards ? i : m_columns - 1 - i;
+			int tile = row*m_columns + column;
+
+			if (!m_stage.wait_for_stage(false, true))
+			{
+				cout << "\nThe stage did not stop at tile " << column << ", " << row << endl;
+				done = false;
+				break;
+			}
+			if (m_settle_ms > 0)
+				boost::this_thread::sleep(boost::posix_time::milliseconds(m_settle_ms));
+
+			boost::shared_ptr< vector<unsigned char> > picture(new vector<unsigned char>((size_t)m_width*m_height));
+			if (!m_camera.grab(&(*picture)[0], m_camera.sequence() + m_skip_frames))
+			{
+				cout << "\nThe camera gave no frame at tile " << column << ", " << row << endl;
+				done = false;
+				break;
+			}
+
+			// The stage moves on while the tile is handed over: along the row, or down to the next one at its end
+			if (i+1 < m_columns)
+			{
+				m_stage.comm_move_x(forwards ? m_step_x : -m_step_x);
+				sent_column += forwards ? 1 : -1;
+			}
+			else if (row+1 < m_rows)
+			{
+				m_stage.comm_move_y(m_step_y);
+				sent_row++;
+			}
+
+			m_x[tile] = column*m_step_x*m_scale_x;
+			m_y[tile] = row*m_step_y*m_scale_y;
+			this_row[column] = picture;
+
+			Scanjob job;
+			job.a = tile;
+			job.b = -1;
+			job.first = picture;
+			queue(job);
+
+			// Pairs are always measured with a on the left or above
+			if (i > 0)
+			{
+				int before = forwards ? column - 1 : column + 1;
+				job.a = forwards ? tile - 1 : tile;
+				job.b = forwards ? tile : tile + 1;
+				job.first = forwards ? this_row[before] : picture;
+				job.second = forwards ? picture : this_row[before];
+				queue(job);
+			}
+			if (row > 0)
+			{
+				job.a = tile - m_columns;
+				job.b = tile;
+				job.first = previous_row[column];
+				job.second = picture;
+				queue(job);
+			}
+
+			taken++;
+			cout << "." << flush;
+
+			if (m_failed)
+			{
+				done = false;
+				break;
+			}
+
+		}
+
+		previous_row.swap(this_row);
+		for (int i=0; i<m_columns; i++)
+			this_row[i].reset();
+
+	}
+	previous_row.clear();
+
+	{
+		boost::mutex::scoped_lock lock(m_mutex);
+		m_scanning = false;
+		m_queued.notify_all();
+	}
+	threads.join_all();
+
+	double total = (boost::posix_time::microsec_clock::universal_time() - start).total_microseconds()/1000000.0;
+	cout << endl << "Took " << taken << " tiles in " << total << " s" << endl;
+
+	// Back to the start, from wherever the stage was last sent, even if the scan stopped short
+	m_stage.wait_for_stage(false, true);
+	m_stage.comm_move_x(-sent_column*m_step_x);
+	m_stage.wait_for_stage(false, true);
+	m_stage.comm_move_y(-sent_row*m_step_y);
+	m_stage.wait_for_stage(false, true);
+
+	if (m_failed)
+	{
+		cout << "\nCould not save all tiles to " << m_directory << endl;
+		done = false;
+	}
+	if (!done)
+		return false;
+
+	solve();
+
+	// Positions from the top left corner of the mosaic
+	float left = m_x[0];
+	float top = m_y[0];
+	for (int i=1; i<count; i++)
+	{
+		if (m_x[i] < left) left = m_x[i];
+		if (m_y[i] < top) top = m_y[i];
+	}
+	for (int i=0; i<count; i++)
+	{
+		m_x[i] -= left;
+		m_y[i] -= top;
+	}
+
+	ofstream positions((m_directory + "/scan.txt").c_str());
+	for (int i=0; i<count; i++)
+		positions << tile_name(i) << " " << m_x[i] << " " << m_y[i] << endl;
+	if (!positions.good())
+	{
+		cout << "\nCould not write " << m_directory << "/scan.txt" << endl;
+		return false;
+	}
+
+	if (m_counting)
+		return write_cells();
+
+	return true;
+
+}
+
+
+
+
+/* The tiles of the last scan with their positions, rounded to whole pixels */
+vector<Mosaictile> Scan::tiles()
+{
+
+	vector<Mosaictile> placed(m_x.size());
+	for (size_t i=0; i<m_x.size(); i++)
+	{
+		placed[i].file = m_directory + "/" + tile_name((int)i);
+		placed[i].x = (int)floor(m_x[i] + 0.5);
+		placed[i].y = (int)floor(m_y[i] + 0.5);
+	}
+
+	return placed;
+
+}
+
+
+
+
+/* Hand a job to the workers, waiting while the queue is full so slow workers hold back the stage rather than filling memory */
+void Scan::queue(const Scanjob &job)
+{
+
+	boost::mutex::scoped_lock lock(m_mutex);
+	while ((int)m_jobs.size() >= m_queue_limit && !m_failed)
+		m_taken.wait(lock);
+	m_jobs.push_back(job);
+	m_queued.notify_one();
+
+	return;
+
+}
+
+
+
+
+/* Worker thread
+ * Takes jobs until run(...) says there will be no more and the queue is empty.
+ * Each worker keeps its own planes for the correlation, and its own copy of the Cellcount object for its planes.
+ * Every tile is saved by one job only, so its cells are stored without locking. */
+void Scan::worker()
+{
+
+	vector<float> work;
+	Cellcount counting(m_cellcount);
+
+	while (true)
+	{
+
+		Scanjob job;
+		{
+			boost::mutex::scoped_lock lock(m_mutex);
+			while (m_jobs.empty() && m_scanning)
+				m_queued.wait(lock);
+			if (m_jobs.empty())
+				return;
+			job = m_jobs.front();
+			m_jobs.pop_front();
+			m_taken.notify_one();
+		}
+
+		if (job.b < 0)
+		{
+			if (!write_pgm(m_directory + "/" + tile_name(job.a), &(*job.first)[0], m_width, m_height))
+			{
+				boost::mutex::scoped_lock lock(m_mutex);
+				m_failed = true;
+				m_taken.notify_all();
+			}
+			if (m_counting)
+			{
+				counting.count(&(*job.first)[0], m_width, m_height);
+				m_cells[job.a] = counting.blobs();
+			}
+		}
+		else
+			measure(job, work);
+
+	}
+
+}
+
+
+
+
+/* Offset between two neighbouring tiles
+ * The windows are the largest powers of two (up to 256) fitting in the overlap the stage should have given, centred on it,
+ * one from each tile at the same place of the mosaic. Phase correlation gives what is left of the offset after the nominal one. */
+bool Scan::measure(const Scanjob &job, vector<float> &work)
+{
+
+	int nominal_x = (int)floor(m_x[job.b] - m_x[job.a] + 0.5);
+	int nominal_y = (int)floor(m_y[job.b] - m_y[job.a] + 0.5);
+
+	int overlap_width = m_width - abs(nominal_x);
+	int overlap_height = m_height - abs(nominal_y);
+	if (overlap_width < 16 || overlap_height < 16)
+		return false;
+
+	int window_width = power_of_two_below((overlap_width < 256) ? overlap_width : 256);
+	int window_height = power_of_two_below((overlap_height < 256) ? overlap_height : 256);
+
+	// Top left corner of the windows in tile a, and in tile b
+	int left = ((nominal_x > 0) ? nominal_x : 0) + (overlap_width - window_width)/2;
+	int top = ((nominal_y > 0) ? nominal_y : 0) + (overlap_height - window_height)/2;
+
+	size_t pixels = (size_t)window_width*window_height;
+	vector<float> first(pixels);
+	vector<float> second(pixels);
+	for (int y=0; y<window_height; y++)
+	{
+		const unsigned char * in_a = &(*job.first)[(size_t)(top + y)*m_width + left];
+		const unsigned char * in_b = &(*job.second)[(size_t)(top - nominal_y + y)*m_width + (left - nominal_x)];
+		for (int x=0; x<window_width; x++)
+		{
+			first[y*window_width + x] = in_a[x];
+			second[y*window_width + x] = in_b[x];
+		}
+	}
+
+	Scanpair pair;
+	pair.a = job.a;
+	pair.b = job.b;
+	pair.peak = phase_correlate(&first[0], &second[0], window_width, window_height, work, pair.dx, pair.dy);
+
+	// The windows were taken at the nominal offset, so what moved between them is how far the offset is from it
+	pair.dx = nominal_x - pair.dx;
+	pair.dy = nominal_y - pair.dy;
+
+	boost::mutex::scoped_lock lock(m_mutex);
+	m_pairs.push_back(pair);
+
+	return true;
+
+}
+
+
+
+
+/* Positions of all tiles from the offsets
+ * Minimises the sum over pairs of peak*(position b - position a - offset)^2, plus a weak pull of every tile towards where the stage
+ * should have put it, which holds tiles with no confident neighbour in place and fixes the mosaic as a whole.
+ * Solved by Gauss-Seidel iterations from the nominal positions, each tile in turn moved to the weighted mean of where its pairs put it. */
+void Scan::solve()
+{
+
+	const float prior = 0.01;
+	int count = (int)m_x.size();
+	vector<float> nominal_x(m_x);
+	vector<float> nominal_y(m_y);
+
+	// Pairs of each tile, dropping failed matches
+	vector< vector<int> > pairs_of(count);
+	int used = 0;
+	for (size_t p=0; p<m_pairs.size(); p++)
+	{
+		if (m_pairs[p].peak < m_min_peak)
+			continue;
+		pairs_of[m_pairs[p].a].push_back((int)p);
+		pairs_of[m_pairs[p].b].push_back((int)p);
+		used++;
+	}
+
+	int iteration = 0;
+	float change = 1;
+	for (; iteration<10000 && change > 0.001; iteration++)
+	{
+		change = 0;
+		for (int i=0; i<count; i++)
+		{
+			float weight = prior;
+			float sum_x = prior*nominal_x[i];
+			float sum_y = prior*nominal_y[i];
+			for (size_t k=0; k<pairs_of[i].size(); k++)
+			{
+				const Scanpair &pair = m_pairs[pairs_of[i][k]];
+				if (pair.a == i)
+				{
+					sum_x += pair.peak*(m_x[pair.b] - pair.dx);
+					sum_y += pair.peak*(m_y[pair.b] - pair.dy);
+				}
+				else
+				{
+					sum_x += pair.peak*(m_x[pair.a] + pair.dx);
+					sum_y += pair.peak*(m_y[pair.a] + pair.dy);
+				}
+				weight += pair.peak;
+			}
+			float x = sum_x/weight;
+			float y = sum_y/weight;
+			float moved = fabs(x - m_x[i]) + fabs(y - m_y[i]);
+			if (moved > change)
+				change = moved;
+			m_x[i] = x;
+			m_y[i] = y;
+		}
+	}
+
+	// How far the measured offsets still are from the solved positions
+	float worst = 0;
+	float mean = 0;
+	for (int i=0; i<count; i++)
+	{
+		for (size_t k=0; k<pairs_of[i].size(); k++)
+		{
+			const Scanpair &pair = m_pairs[pairs_of[i][k]];
+			if (pair.a != i)
+				continue;
+			float residual = sqrt(pow(m_x[pair.b] - m_x[pair.a] - pair.dx, 2) + pow(m_y[pair.b] - m_y[pair.a] - pair.dy, 2));
+			mean += residual;
+			if (residual > worst)
+				worst = residual;
+		}
+	}
+
+	cout << "\nPlaced " << count << " tiles from " << used << " of " << m_pairs.size() << " offsets in " << iteration << " iterations" << endl;
+	if (used > 0)
+		cout << "Offsets disagree with the positions by " << mean/used << " pixels on average, " << worst << " at most" << endl;
+
+	return;
+
+}
+
+
+
+
+/* Place the cells of every tile in the mosaic and save them
+ * Overlapping tiles find the same cells, so a cell is left out if it also lies on a neighbouring tile whose centre is nearer to it
+ * (or as near, with a lower number), which gives every point of the mosaic to exactly one tile.
+ * A cell near the line halfway between two tiles could be placed on either side of it by each, from the small errors left in the
+ * positions, so where the neighbour found the same cell (within 3 pixels) the two are compared as each tile placed its own. */
+bool Scan::write_cells()
+{
+
+	ofstream saving((m_directory + "/cells.txt").c_str());
+	m_cell_total = 0;
+
+	for (int tile=0; tile<(int)m_cells.size(); tile++)
+	{
+		int column = tile % m_columns;
+		int row = tile / m_columns;
+		float centre_x = m_x[tile] + m_width/2.0;
+		float centre_y = m_y[tile] + m_height/2.0;
+
+		for (size_t c=0; c<m_cells[tile].size(); c++)
+		{
+			const Cellblob &cell = m_cells[tile][c];
+			float x = m_x[tile] + cell.x;
+			float y = m_y[tile] + cell.y;
+			float distance = pow(x - centre_x, 2) + pow(y - centre_y, 2);
+
+			bool owned = true;
+			for (int j=row-1; j<=row+1 && owned; j++)
+			{
+				for (int i=column-1; i<=column+1 && owned; i++)
+				{
+					if (i < 0 || j < 0 || i >= m_columns || j >= m_rows || (i == column && j == row))
+						continue;
+					int other = j*m_columns + i;
+					if (x < m_x[other] || y < m_y[other] || x >= m_x[other] + m_width || y >= m_y[other] + m_height)
+						continue;
+					float other_distance = pow(x - m_x[other] - m_width/2.0, 2) + pow(y - m_y[other] - m_height/2.0, 2);
+					for (size_t k=0; k<m_cells[other].size(); k++)
+					{
+						float other_x = m_x[other] + m_cells[other][k].x;
+						float other_y = m_y[other] + m_cells[other][k].y;
+						if (fabs(other_x - x) < 3 && fabs(other_y - y) < 3)
+						{
+							other_distance = pow(m_cells[other][k].x - m_width/2.0, 2) + pow(m_cells[other][k].y - m_height/2.0, 2);
+							break;
+						}
+					}
+					if (other_distance < distance || (other_distance == distance && other < tile))
+						owned = false;
+				}
+			}
+			if (!owned)
+				continue;
+
+			saving << x << " " << y << " " << cell.area << " " << tile_name(tile) << endl;
+			m_cell_total++;
+		}
+	}
+
+	if (!saving.good())
+	{
+		cout << "\nCould not write " << m_directory << "/cells.txt" << endl;
+		return false;
+	}
+
+	cout << "\nCounted " << m_cell_total << " cells" << endl;
+
+	return true;
+
+}
+
+
+
+
+/* File of a tile, within the scan directory */
+string Scan::tile_name(int tile)
+{
+
+	stringstream naming;
+	naming << "tile_" << tile % m_columns << "_" << tile / m_columns << ".pgm";
+
+	return naming.str();
+
+}
+
+
+
+#endif
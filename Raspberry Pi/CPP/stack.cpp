@@ -0,0 +1,123 @@
+// Z-Stack Main Program
+
+/* Takes a z-stack around the focus point through the ZStack class, and reports how many slices per second it managed.
+ * The centre is either found first with the sweep and fine_tune methods of the Autofocus class, as in focus_full(), or taken
+ * as wherever the stage is now. The slices are streamed to a stack file, or only kept in memory to measure the throughput.
+ * They can also be fused as they come into a single picture in focus everywhere, saved with its depth map.
+ * For more information, see descriptions of zstack_class.h, camera_class.h and focusstack_class.h
+ */
+
+
+
+#include "autofocus_class.h"
+#include "zstack_class.h"
+#include "focusstack_class.h"
+
+
+int main ()
+{
+
+	Autofocus autofocusing;
+
+	cout << "\nUsing default parameters..." << endl;
+	autofocusing.set_serial();
+	cout << "Serial port: " << autofocusing.get_serial() << endl;
+	autofocusing.set_path();
+	autofocusing.set_name();
+	autofocusing.set_output(true);
+	autofocusing.set_file();
+	autofocusing.comm_set_led_bright(70);
+
+	if (!autofocusing.comm_is_calibrated())
+	{
+		cout << "\nCalibrating..." << endl;
+		autofocusing.comm_calibrate();
+		autofocusing.stop_stage(autofocusing.get_calibrate());
+	}
+
+
+	// Centre of the stack
+	int centre = 0;
+	char choice;
+	cout << "\n\tFind the focus point first (y/n)? "; cin >> choice;
+	if (choice == 'y')
+	{
+		int whole_distance;
+		autofocusing.comm_get_z_len(whole_distance);
+		autofocusing.comm_move_to(whole_distance);
+		autofocusing.stop_stage();
+
+		autofocusing.sweep();
+		autofocusing.comm_move_to(autofocusing.get_max_pos());
+		autofocusing.stop_stage();
+		autofocusing.set_steps(0.5*autofocusing.get_steps());
+
+		cout << "\nRunning fine tuning" << flush;
+		autofocusing.fine_tune();
+		cout << endl;
+
+		centre = autofocusing.get_max_pos();
+	}
+	else
+		autofocusing.comm_get_z_pos(centre);
+
+	cout << "\nCentre of the stack: " << centre << endl;
+
+
+	// Range, step and output
+	int range = 0;
+	int step = 0;
+	string output;
+	cout << "\n\tRange of the stack, in microsteps? "; cin >> range;
+	cout << "\n\tStep between slices, in microsteps? "; cin >> step;
+	cout << "\n\tStack file ('none' to keep the slices in memory only)? "; cin >> output;
+	if (output.compare("none") == 0)
+		output = "";
+
+	char fusing;
+	cout << "\n\tFuse the slices into one picture in focus everywhere (y/n)? "; cin >> fusing;
+
+
+	// Stream from the camera for the whole stack
+	Camera camera;
+	if (!camera.open(640, 480, 30))
+		return 1;
+
+	ZStack stack(autofocusing, camera);
+	stack.set_range(centre, range, step);
+
+	// Fused while the stage moves, so no slice needs keeping for it
+	Focusstack fused;
+	if (fusing == 'y')
+	{
+		stack.set_listener(boost::bind(&Focusstack::add, &fused,
+				boost::placeholders::_1, boost::placeholders::_2, boost::placeholders::_3, boost::placeholders::_4));
+		stack.set_keep(false);
+	}
+
+	bool done = stack.acquire(output);
+
+	camera.close();
+
+	// Back to the centre, so the field is left in focus
+	autofocusing.comm_move_to(centre);
+	autofocusing.stop_stage();
+
+	if (!done)
+	{
+		cout << "\nThe stack was not completed" << endl;
+		return 1;
+	}
+
+	if (fusing == 'y' && fused.save(autofocusing.get_path() + "fused.pgm", autofocusing.get_path() + "depth.pgm"))
+		cout << "\nFused " << fused.slices() << " slices into " << autofocusing.get_path() << "fused.pgm, with the depth map in depth.pgm" << endl;
+
+	if (output.empty() && fusing != 'y')
+		cout << "\nKept " << stack.size() << " slices of " << stack.width() << "x" << stack.height() << " in memory" << endl;
+	else if (!output.empty())
+		cout << "\nStack saved to " << output << endl;
+
+	cout << endl;
+	return 0;
+
+}
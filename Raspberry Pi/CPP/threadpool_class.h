@@ -0,0 +1,167 @@
+// Thread Pool Class
+
+/* This file contains a small pool of worker threads used to split image processing work between the cores of the Pi.
+ * The threads are started once and then sleep until given work, so handing out a job costs a wake-up rather than a thread creation.
+ * These are:
+ *
+ * public:
+ * Threadpool(int) -> Only class constructor.
+ * 		Starts the given number of worker threads.
+ * ~Threadpool() -> Class destructor.
+ * 		Wakes the workers up, tells them to finish and waits for them.
+ * size() -> Number of worker threads.
+ * run(boost::function<void (int)>, int) -> Calls the function once for every number from 0 to jobs-1, spread over the workers,
+ * 		and only returns when all calls have finished. It is meant to be called from one thread at a time.
+ *
+ * private:
+ * worker() -> Loop run by each worker thread, taking job numbers until none are left and then sleeping until the next run().
+ */
+
+
+
+#ifndef THREADPOOL_CLASS_H
+#define THREADPOOL_CLASS_H
+
+#include <boost/thread.hpp>
+#include <boost/function.hpp>
+#include <boost/bind/bind.hpp>
+
+
+
+class Threadpool
+{
+
+private:
+
+	boost::thread_group m_threads;
+	int m_size;
+
+	boost::mutex m_mutex;
+	boost::condition_variable m_wake;
+	boost::condition_variable m_done;
+
+	// Current job, the next number to hand out, and how many calls have finished
+	boost::function<void (int)> m_job;
+	int m_jobs;
+	int m_next;
+	int m_finished;
+	bool m_stop;
+
+
+	void worker();
+
+
+public:
+
+	Threadpool(int threads);
+
+	~Threadpool();
+
+	int size()
+	{	return m_size;	}
+
+	void run(boost::function<void (int)> job, int jobs);
+
+
+};
+
+
+
+
+/* Threadpool class CONSTRUCTOR
+ * At least one worker is always started */
+Threadpool::Threadpool(int threads)
+{
+
+	m_size = (threads < 1) ? 1 : threads;
+	m_jobs = 0;
+	m_next = 0;
+	m_finished = 0;
+	m_stop = false;
+
+	for (int i=0; i<m_size; i++)
+		m_threads.create_thread(boost::bind(&Threadpool::worker, this));
+
+}
+
+
+
+
+/* Threadpool class DESTRUCTOR */
+Threadpool::~Threadpool()
+{
+
+	{
+		boost::mutex::scoped_lock lock(m_mutex);
+		m_stop = true;
+	}
+	m_wake.notify_all();
+	m_threads.join_all();
+
+}
+
+
+
+
+/* Hand out the job numbers and wait for all of them to finish */
+void Threadpool::run(boost::function<void (int)> job, int jobs)
+{
+
+	if (jobs <= 0)
+		return;
+
+	boost::mutex::scoped_lock lock(m_mutex);
+
+	m_job = job;
+	m_next = 0;
+	m_finished = 0;
+	m_jobs = jobs;
+	m_wake.notify_all();
+
+	while (m_finished < m_jobs)
+		m_done.wait(lock);
+
+	// Nothing is left to take until the next run
+	m_jobs = 0;
+	m_next = 0;
+
+	return;
+
+}
+
+
+
+
+/* Worker loop
+ * The job itself runs with the mutex released, so the workers only meet to take a number and to report back */
+void Threadpool::worker()
+{
+
+	boost::mutex::scoped_lock lock(m_mutex);
+
+	while (true)
+	{
+
+		while (!m_stop && m_next >= m_jobs)
+			m_wake.wait(lock);
+
+		if (m_stop)
+			return;
+
+		int number = m_next++;
+		boost::function<void (int)> job = m_job;
+
+		lock.unlock();
+		job(number);
+		lock.lock();
+
+		if (++m_finished == m_jobs)
+			m_done.notify_one();
+
+	}
+
+}
+
+
+
+#endif
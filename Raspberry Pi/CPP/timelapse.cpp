@@ -0,0 +1,123 @@
+// Time-lapse Main Program
+
+/* Runs a time-lapse through the Timelapse class: a set of positions, each focused once at the start with fine_tune(),
+ * then pictured in one or more illumination channels at regular intervals, refocused quickly at every timepoint.
+ * Several channels are switched by the Arduino as the frames arrive, rather than by a command each.
+ * For more information, see descriptions of timelapse_class.h, multichannel_class.h, framewriter_class.h and camera_class.h
+ */
+
+
+
+#include "autofocus_class.h"
+#include "timelapse_class.h"
+
+
+int main ()
+{
+
+	Autofocus autofocusing;
+
+	cout << "\nUsing default parameters..." << endl;
+	autofocusing.set_serial();
+	cout << "Serial port: " << autofocusing.get_serial() << endl;
+	autofocusing.set_path();
+	autofocusing.set_name();
+	autofocusing.set_output(true);
+	autofocusing.set_file();
+	autofocusing.comm_set_led_bright(70);
+
+	if (!autofocusing.comm_is_calibrated())
+	{
+		cout << "\nCalibrating..." << endl;
+		autofocusing.comm_calibrate();
+		autofocusing.stop_stage(autofocusing.get_calibrate());
+	}
+
+
+	// Schedule
+	double interval = 0;
+	int timepoints = 0;
+	string directory;
+	cout << "\n\tInterval between timepoints, in seconds? "; cin >> interval;
+	cout << "\n\tNumber of timepoints? "; cin >> timepoints;
+	cout << "\n\tDirectory for the time-lapse? "; cin >> directory;
+
+
+	// Positions, focused once here and only refocused around that height afterwards
+	int number_positions = 1;
+	cout << "\n\tNumber of positions? "; cin >> number_positions;
+
+	vector<int> xs;
+	vector<int> ys;
+	vector<int> zs;
+	int x = 0;
+	int y = 0;
+	for (int p=0; p<number_positions; p++)
+	{
+		int next_x = 0;
+		int next_y = 0;
+		if (p > 0)
+		{
+			cout << "\n\tPosition " << p << " in x and y from the first, in microsteps? "; cin >> next_x >> next_y;
+			autofocusing.comm_move_x(next_x - x);
+			autofocusing.comm_move_y(next_y - y);
+			while (!autofocusing.comm_get_xy_dist())
+				usleep(10000);
+			x = next_x;
+			y = next_y;
+		}
+
+		cout << "\nFocusing position " << p << flush;
+		autofocusing.set_objective(autofocusing.get_objective());
+		autofocusing.fine_tune();
+		cout << endl;
+
+		xs.push_back(x);
+		ys.push_back(y);
+		zs.push_back(autofocusing.get_max_pos());
+	}
+
+	// The time-lapse starts from the first position
+	autofocusing.comm_move_x(-x);
+	autofocusing.comm_move_y(-y);
+
+
+	// Channels
+	int number_channels = 1;
+	cout << "\n\tNumber of channels? "; cin >> number_channels;
+
+	Camera camera;
+	if (!camera.open(640, 480, 30))
+		return 1;
+
+	Timelapse timelapse(autofocusing, camera);
+	timelapse.set_schedule(interval, timepoints);
+	for (int p=0; p<number_positions; p++)
+		timelapse.add_position(xs[p], ys[p], zs[p]);
+
+	for (int c=0; c<number_channels; c++)
+	{
+		string name;
+		int led = 0;
+		int ring = 0;
+		string colour;
+		cout << "\n\tName of channel " << c << ", stage LED and ring brightness (0->255), ring colour (RRGGBB)? "; cin >> name >> led >> ring >> colour;
+		timelapse.add_channel(name, led, ring, colour);
+	}
+
+	bool done = timelapse.run(directory);
+
+	camera.close();
+
+	if (!done)
+	{
+		cout << "\nThe time-lapse was not completed" << endl;
+		return 1;
+	}
+
+	cout << "\nTime-lapse saved to " << directory << endl;
+
+	cout << endl;
+	return 0;
+
+}
@@ -0,0 +1,587 @@
+// Time-lapse Class
+
+/* This file contains the class that runs time-lapses: pictures of a set of stage positions, in a set of illumination channels,
+ * taken at regular intervals.
+ * Timepoints are scheduled on the monotonic clock, each at start + n*interval rather than a fixed sleep after the last one,
+ * so the time taken by each timepoint doesn't add up into drift, and changes to the system clock don't move them.
+ * A timepoint that can't start before the next one is due is missed rather than run late, and counted.
+ * Focus drifts slowly between timepoints, so each position keeps the height it was last in focus at, and is refocused by a few frames
+ * around it (with the focus measure of Autofocus::algorithm()) instead of a full sweep and fine_tune().
+ * Frames come from a streaming Camera and are saved by a Framewriter thread, so the disk never holds up the next acquisition.
+ * With more than one channel, the channels are loaded on the Arduino and switched by sync bytes as the frames arrive (see multichannel_class.h),
+ * so a position costs a frame period or two per channel rather than a round trip and a wait for the camera for each.
+ * These are:
+ *
+ * public:
+ * Timelapse(Autofocus&, Camera&) -> Only class constructor. Takes an Autofocus object with its serial port open and the stage calibrated,
+ * 		and an open camera.
+ * set_schedule(double, int) -> Chooses the interval between timepoints in seconds and how many timepoints to take.
+ * add_position(int, int, int) -> Adds a position to visit at every timepoint: x and y in microsteps from where the XY stage is at the start
+ * 		of run(...), and the z position it is in focus at, for example from fine_tune().
+ * add_channel(string, int, int, string) -> Adds an illumination channel: its name, the brightness (0-255) of the stage LED and of the LED ring,
+ * 		and the colour of the ring (hexadecimal RGB, default white). Without any, a single channel with the stage LED at 70 is used.
+ * 		The first channel is the one positions are refocused under.
+ * set_refocus(int, int) -> Chooses the step between the frames of the refocus, in microsteps (0 to never refocus), and how many further
+ * 		steps it may follow the focus if it moved more than a step since the last timepoint (default 2 full steps, and 3).
+ * set_settle(int, int) -> Chooses how many milliseconds to wait once the stage has stopped, and how many frames to skip after that
+ * 		or after changing the illumination (as for ZStack).
+ * run(string) -> Runs the time-lapse, saving every frame in the given directory as 't<timepoint>_p<position>_<channel>.pgm',
+ * 		with its time and position in a comment, and the timing of every timepoint in timelapse.txt.
+ * 		Returns false if the stage, the camera or the files failed.
+ * missed() -> Timepoints missed in the last run(...).
+ * position(int) -> Focus height of a position, as last refocused.
+ *
+ * private:
+ * refocus(Timelapseposition&) -> Brings a position back into focus from its cached height.
+ * focus_value(int, float&, bool) -> Moves to a height, coming up to it from below unless already there, and measures the focus of the next frame.
+ * grab(unsigned char*) -> Takes the next frame started once the stage and the illumination have settled.
+ * set_channel(int) -> Switches the illumination to a channel.
+ *
+ * monotonic_ms() and sleep_until_ms(double) -> Time on the monotonic clock, and sleeping until a time on it.
+ */
+
+
+
+#ifndef TIMELAPSE_CLASS_H
+#define TIMELAPSE_CLASS_H
+
+#include <iomanip>
+#include <ctime>
+#include <cerrno>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include "autofocus_class.h"
+#include "camera_class.h"
+#include "framewriter_class.h"
+#include "multichannel_class.h"
+#include "image_kernels.h"
+
+
+
+// A place visited at every timepoint, and the height it was last in focus at
+struct Timelapseposition
+{
+	int x;
+	int y;
+	int z;
+};
+
+
+
+// An illumination, by the brightness of the stage LED and the LED ring, and the colour of the ring
+struct Timelapsechannel
+{
+	string name;
+	int led;
+	int ring;
+	string colour;
+};
+
+
+
+/* Milliseconds on the monotonic clock, which only ever goes forwards at a steady rate */
+inline double monotonic_ms()
+{
+
+	timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec*1000.0 + now.tv_nsec/1000000.0;
+
+}
+
+
+
+/* Sleep until a time on the monotonic clock
+ * The time is absolute, so waking late from one sleep doesn't push back the next */
+inline void sleep_until_ms(double time_ms)
+{
+
+	timespec until;
+	until.tv_sec = (time_t)(time_ms/1000);
+	until.tv_nsec = (long)((time_ms - until.tv_sec*1000.0)*1000000);
+	if (until.tv_nsec >= 1000000000)
+	{
+		until.tv_sec++;
+		until.tv_nsec -= 1000000000;
+	}
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR)
+	{
+	}
+
+	return;
+
+}
+
+
+
+class Timelapse
+{
+
+private:
+
+	Autofocus &m_stage;
+	Camera &m_camera;
+	Framewriter m_writer;
+	Multichannel m_multichannel;
+
+	vector<Timelapseposition> m_positions;
+	vector<Timelapsechannel> m_channels;
+	double m_interval_ms;
+	int m_timepoints;
+	int m_refocus_step;
+	int m_refocus_reach;
+	int m_settle_ms;
+	int m_skip_frames;
+
+	// Where the XY stage is from the start, the illumination on, and the travel of z
+	int m_x;
+	int m_y;
+	int m_channel;
+	int m_length;
+	bool m_uses_xy;
+	int m_missed;
+
+	// Frame being measured for focus
+	vector<unsigned char> m_luma;
+	vector<float> m_values;
+
+
+	bool refocus(Timelapseposition &position);
+
+	bool focus_value(int z, float &value, bool from_below = false);
+
+	bool grab(unsigned char * luma);
+
+	void set_channel(int channel);
+
+
+public:
+
+	Timelapse(Autofocus &stage, Camera &camera);
+
+	void set_schedule(double interval_s, int timepoints)
+	{	m_interval_ms = 1000*interval_s; m_timepoints = timepoints; return;	}
+
+	void add_position(int x, int y, int z);
+
+	void add_channel(string name, int led, int ring = 0, string colour = "FFFFFF");
+
+	void set_refocus(int step = 2*MICROSTEPS_PER_STEP, int reach = 3)
+	{	m_refocus_step = (step < 0) ? 0 : step; m_refocus_reach = (reach < 0) ? 0 : reach; return;	}
+
+	void set_settle(int settle_ms = 0, int skip_frames = 1)
+	{	m_settle_ms = settle_ms; m_skip_frames = (skip_frames < 0) ? 0 : skip_frames; return;	}
+
+	bool run(string directory);
+
+	int missed()
+	{	return m_missed;	}
+
+	int position(int index)
+	{	return m_positions[index].z;	}
+
+
+};
+
+
+
+
+/* Timelapse class CONSTRUCTOR */
+Timelapse::Timelapse(Autofocus &stage, Camera &camera)
+		:m_stage(stage), m_camera(camera), m_multichannel(stage, camera)
+{
+
+	set_schedule(60, 10);
+	set_refocus();
+	set_settle();
+
+	m_x = 0;
+	m_y = 0;
+	m_channel = -1;
+	m_length = 0;
+	m_uses_xy = false;
+	m_missed = 0;
+
+}
+
+
+
+
+/* Add a position, relative in x and y to where the XY stage starts */
+void Timelapse::add_position(int x, int y, int z)
+{
+
+	Timelapseposition position;
+	position.x = x;
+	position.y = y;
+	position.z = z;
+	m_positions.push_back(position);
+
+	if (x != 0 || y != 0)
+		m_uses_xy = true;
+
+	return;
+
+}
+
+
+
+
+/* Add an illumination channel */
+void Timelapse::add_channel(string name, int led, int ring, string colour)
+{
+
+	Timelapsechannel channel;
+	channel.name = name;
+	channel.led = led;
+	channel.ring = ring;
+	channel.colour = colour;
+	m_channels.push_back(channel);
+
+	return;
+
+}
+
+
+
+
+/* Run the time-lapse
+ * Timepoint n is due at start + n*interval. After each one, if the next is already overdue by a whole interval it is missed, and the
+ * latest one due starts straight away; otherwise the loop sleeps until the next is due.
+ * How late each timepoint started, and how long it took, are written to timelapse.txt as they happen. */
+bool Timelapse::run(string directory)
+{
+
+	if (!m_camera.is_open())
+	{
+		cout << "\nThe camera is not open" << endl;
+		return false;
+	}
+	if (m_positions.empty())
+	{
+		cout << "\nNo positions to take" << endl;
+		return false;
+	}
+	if (!m_stage.comm_get_z_len(m_length))
+	{
+		cout << "\nCould not get the length of travel, is the stage calibrated?" << endl;
+		return false;
+	}
+	if (m_channels.empty())
+		add_channel("led", 70);
+
+	mkdir(directory.c_str(), 0755);
+	ofstream timing((directory + "/timelapse.txt").c_str());
+	timing << "timepoint\tdue_s\tlate_ms\ttaken_ms";
+	for (size_t p=0; p<m_positions.size(); p++)
+		timing << "\tz" << p;
+	timing << endl;
+
+	m_luma.resize((size_t)m_camera.width()*m_camera.height());
+	m_values.resize(m_luma.size());
+	m_x = 0;
+	m_y = 0;
+	m_channel = -1;
+	m_missed = 0;
+
+	// Several channels are switched by the Arduino, starting with the lights on the first, as each pass of them leaves them
+	bool pipelined = (m_channels.size() > 1);
+	vector< vector<unsigned char> > planes;
+	if (pipelined)
+	{
+		m_multichannel.clear_channels();
+		m_multichannel.set_settle(m_skip_frames);
+		for (size_t c=0; c<m_channels.size(); c++)
+		{
+			if (!m_multichannel.add_channel(m_channels[c].name, m_channels[c].colour, m_channels[c].ring, m_channels[c].led))
+				return false;
+		}
+		if (!m_multichannel.load() || !m_stage.comm_start_channels())
+		{
+			cout << "\nCould not load the channels on the Arduino" << endl;
+			return false;
+		}
+		m_channel = 0;
+	}
+
+	m_writer.start();
+
+	cout << "\nTaking " << m_timepoints << " timepoints, " << m_interval_ms/1000 << " s apart, of " << m_positions.size()
+			<< " positions in " << m_channels.size() << " channels" << endl;
+
+	double start = monotonic_ms();
+	double late_total = 0;
+	double late_max = 0;
+	double longest = 0;
+	int taken = 0;
+	bool done = true;
+
+	for (int timepoint=0; timepoint<m_timepoints && done; )
+	{
+
+		double due = start + timepoint*m_interval_ms;
+		sleep_until_ms(due);
+		double began = monotonic_ms();
+
+		for (size_t p=0; p<m_positions.size() && done; p++)
+		{
+
+			Timelapseposition &position = m_positions[p];
+
+			// XY and z move together to the cached position
+			if (position.x != m_x)
+				m_stage.comm_move_x(position.x - m_x);
+			if (position.y != m_y)
+				m_stage.comm_move_y(position.y - m_y);
+			m_x = position.x;
+			m_y = position.y;
+
+			set_channel(0);
+			if (m_refocus_step > 0)
+				done = refocus(position);
+			else
+			{
+				m_stage.comm_move_to(position.z);
+				done = m_stage.wait_for_stage(true, m_uses_xy);
+			}
+
+			if (pipelined && done)
+				done = m_multichannel.acquire(planes);
+
+			for (size_t c=0; c<m_channels.size() && done; c++)
+			{
+				Frame * frame = new Frame;
+				frame->width = m_camera.width();
+				frame->height = m_camera.height();
+				if (pipelined)
+					frame->luma.swap(planes[c]);
+				else
+				{
+					set_channel((int)c);
+					frame->luma.resize(m_luma.size());
+					if (!grab(&frame->luma[0]))
+					{
+						delete frame;
+						done = false;
+						break;
+					}
+				}
+
+				stringstream naming;
+				naming << directory << "/t" << setfill('0') << setw(5) << timepoint << "_p" << setw(2) << p << "_" << m_channels[c].name << ".pgm";
+				frame->file = naming.str();
+				stringstream describing;
+				describing << "t " << (monotonic_ms() - start)/1000 << " x " << position.x << " y " << position.y << " z " << position.z
+						<< " channel " << m_channels[c].name;
+				frame->comment = describing.str();
+
+				m_writer.write(frame);
+			}
+
+		}
+
+		if (!done)
+		{
+			cout << "\nThe stage or the camera failed at timepoint " << timepoint << endl;
+			break;
+		}
+
+		double late = began - due;
+		double took = monotonic_ms() - began;
+		late_total += late;
+		if (late > late_max)
+			late_max = late;
+		if (took > longest)
+			longest = took;
+		taken++;
+
+		timing << timepoint << "\t" << (due - start)/1000 << "\t" << late << "\t" << took;
+		for (size_t p=0; p<m_positions.size(); p++)
+			timing << "\t" << m_positions[p].z;
+		timing << endl;
+		cout << "." << flush;
+
+		// Skip to the latest timepoint due if the next one has been overtaken
+		int next = timepoint + 1;
+		int overdue = (m_interval_ms > 0) ? (int)((monotonic_ms() - start)/m_interval_ms) : next;
+		if (overdue > next)
+		{
+			if (overdue > m_timepoints)
+				overdue = m_timepoints;
+			m_missed += overdue - next;
+			next = overdue;
+		}
+		timepoint = next;
+
+	}
+
+	// Back to where the XY stage started
+	if (m_x != 0)
+		m_stage.comm_move_x(-m_x);
+	if (m_y != 0)
+		m_stage.comm_move_y(-m_y);
+	m_x = 0;
+	m_y = 0;
+	m_stage.wait_for_stage(true, m_uses_xy);
+
+	bool saved = m_writer.stop();
+
+	cout << endl << "Took " << taken << " of " << m_timepoints << " timepoints, missed " << m_missed << endl;
+	if (taken > 0)
+		cout << "Started late by " << late_total/taken << " ms on average, " << late_max << " ms at most; the longest took " << longest << " ms" << endl;
+	cout << "Saved " << m_writer.written() << " frames, with at most " << m_writer.peak_queue() << " waiting to be written" << endl;
+	if (!saved)
+	{
+		cout << "\nCould not save " << m_writer.failed() << " frames" << endl;
+		done = false;
+	}
+
+	return done;
+
+}
+
+
+
+
+/* Bring a position back into focus
+ * Frames are taken one step below, at and above the cached height. While the best of them is at an end, the three frames move a step
+ * that way, up to the reach allowed; then a parabola through them gives the peak to a fraction of a step, which becomes the new height. */
+bool Timelapse::refocus(Timelapseposition &position)
+{
+
+	int step = m_refocus_step;
+	int centre = position.z;
+	float below, middle, above;
+
+	if (!focus_value(centre - step, below) || !focus_value(centre, middle, true) || !focus_value(centre + step, above, true))
+		return false;
+
+	for (int moved=0; moved<m_refocus_reach; moved++)
+	{
+		if (below > middle && below >= above && centre - 2*step >= 0)
+		{
+			centre -= step;
+			above = middle;
+			middle = below;
+			if (!focus_value(centre - step, below))
+				return false;
+		}
+		else if (above > middle && centre + 2*step <= m_length)
+		{
+			centre += step;
+			below = middle;
+			middle = above;
+			if (!focus_value(centre + step, above, true))
+				return false;
+		}
+		else
+			break;
+	}
+
+	float offset = 0;
+	float curvature = below - 2*middle + above;
+	if (curvature < 0)
+		offset = 0.5*(below - above)/curvature*step;
+	if (offset > step)
+		offset = step;
+	if (offset < -step)
+		offset = -step;
+
+	position.z = centre + (int)floor(offset + 0.5);
+	if (position.z < 0)
+		position.z = 0;
+	if (position.z > m_length)
+		position.z = m_length;
+
+	// The frames were all taken going up, so the new height is reached going up as well, from below by more than the backlash;
+	// coming down to it would leave the stage short of it by the play in the lead screw
+	int below_z = position.z - BACKLASH_MICROSTEPS;
+	m_stage.comm_move_to((below_z < 0) ? 0 : below_z);
+	if (!m_stage.wait_for_stage(true, m_uses_xy))
+		return false;
+	m_stage.comm_move_to(position.z);
+
+	return m_stage.wait_for_stage(true, m_uses_xy);
+
+}
+
+
+
+
+/* Focus of the next frame at a height, kept within the travel of the stage */
+bool Timelapse::focus_value(int z, float &value, bool from_below)
+{
+
+	if (z < 0)
+		z = 0;
+	if (z > m_length)
+		z = m_length;
+
+	// Frames compared with each other must all be reached going up, or the play in the lead screw shifts some of them.
+	// A frame above the last one is on the way; any other is approached from below by more than the backlash
+	if (!from_below)
+	{
+		int below_z = z - BACKLASH_MICROSTEPS;
+		m_stage.comm_move_to((below_z < 0) ? 0 : below_z);
+		if (!m_stage.wait_for_stage(true, m_uses_xy))
+			return false;
+	}
+	m_stage.comm_move_to(z);
+	if (!m_stage.wait_for_stage(true, m_uses_xy) || !grab(&m_luma[0]))
+		return false;
+
+	for (size_t i=0; i<m_luma.size(); i++)
+		m_values[i] = m_luma[i];
+	value = normalised_variance(&m_values[0], m_values.size());
+
+	return true;
+
+}
+
+
+
+
+/* Take the next frame started after the settling time and the frames to skip */
+bool Timelapse::grab(unsigned char * luma)
+{
+
+	if (m_settle_ms > 0)
+		boost::this_thread::sleep(boost::posix_time::milliseconds(m_settle_ms));
+
+	if (!m_camera.grab(luma, m_camera.sequence() + m_skip_frames))
+	{
+		cout << "\nThe camera gave no frame" << endl;
+		return false;
+	}
+
+	return true;
+
+}
+
+
+
+
+/* Switch the illumination to a channel, unless it is on already */
+void Timelapse::set_channel(int channel)
+{
+
+	if (channel == m_channel)
+		return;
+
+	if (m_channel < 0 || m_channels[channel].colour != m_channels[m_channel].colour)
+		m_stage.comm_set_ring_colour(m_channels[channel].colour);
+	if (m_channel < 0 || m_channels[channel].led != m_channels[m_channel].led)
+		m_stage.comm_set_led_bright(m_channels[channel].led);
+	if (m_channel < 0 || m_channels[channel].ring != m_channels[m_channel].ring)
+		m_stage.comm_set_ring_bright(m_channels[channel].ring);
+	m_channel = channel;
+
+	return;
+
+}
+
+
+
+#endif
@@ -0,0 +1,437 @@
+// Z-Stack Class
+
+/* This file contains the class that takes z-stacks: pictures of the same field at evenly spaced heights of the stage.
+ * It drives the stage through the serial commands of the Autofocus class and takes pictures from a streaming Camera, so no picture is
+ * saved as JPEG and read back, and the stage is polled every few milliseconds instead of every second.
+ * Each slice is taken as soon as the stage has stopped, and the move to the next height is sent before the slice is stored,
+ * so storing it (in memory, or by a writer thread to a stack file) overlaps with the stage moving.
+ * These are:
+ *
+ * public:
+ * ZStack(Autofocus&, Camera&) -> Only class constructor. Takes an Autofocus object with its serial port open, and an open camera.
+ * set_range(int, int, int) -> Chooses the centre of the stack (for example the position found by fine_tune()), the range it covers
+ * 		and the step between slices, all in microsteps. The slices go from centre - range/2 to centre + range/2, kept within the travel.
+ * set_settle(int, int) -> Chooses how many milliseconds to wait once the stage reports it has stopped (default 0, raise it if the
+ * 		stage keeps vibrating), and how many frames to skip after that (default 1, the frame that was exposing as the stage stopped).
+ * set_listener(function) -> Gives a function to call with every slice as it is taken: its luma plane, width, height and position.
+ * 		It is called while the stage moves to the next slice, so work done on each slice (such as fusing it, see focusstack_class.h)
+ * 		overlaps with the moves. Only one listener is kept; an empty function removes it.
+ * set_keep(bool) -> Chooses whether slices are kept in memory when no stack file is given (default yes). Turn it off when the listener
+ * 		is all that needs the slices, so memory doesn't grow with the depth of the stack.
+ * acquire(string) -> Takes the stack. With a file name, the slices are streamed to that file as they come and not kept;
+ * 		without one, they are kept in memory (unless set_keep(false)). Returns false if the stage, the camera or the file failed on the way.
+ * 		The stack file is a sequence of binary PGM pictures, one per slice, each with a '# z <position> t <milliseconds>' comment,
+ * 		so it can be split by any PGM reader and every slice knows where and when it was taken.
+ * size(), slice(int), position(int) -> Number of slices kept in memory, the luma plane of one (width()*height() bytes) and its position.
+ * width(), height() -> Size of the slices.
+ * get_rate() -> Slices per second over the last acquire(...), from the first move to the last slice stored.
+ * clear() -> Frees the slices kept in memory.
+ *
+ * private:
+ * store(Zslice*) -> Keeps a slice in memory, or queues it for the writer thread, or drops it if neither is wanted.
+ * writer() -> Loop of the writer thread, writing queued slices to the stack file in order.
+ * write_slice(const Zslice&) -> Writes one slice as a PGM picture.
+ */
+
+
+
+#ifndef ZSTACK_CLASS_H
+#define ZSTACK_CLASS_H
+
+#include <deque>
+#include <cstdio>
+#include <sstream>
+#include <iomanip>
+#include <boost/function.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include "autofocus_class.h"
+#include "camera_class.h"
+#include "pgm_io.h"
+
+
+
+// One picture of the stack, with the position it was taken at and the milliseconds since the start of the stack
+struct Zslice
+{
+	int position;
+	double time_ms;
+	vector<unsigned char> luma;
+};
+
+
+
+class ZStack
+{
+
+private:
+
+	Autofocus &m_stage;
+	Camera &m_camera;
+
+	int m_centre;
+	int m_range;
+	int m_step;
+	int m_settle_ms;
+	int m_skip_frames;
+
+	// Slices kept in memory, and the function each one is given to
+	vector<Zslice> m_slices;
+	bool m_keep;
+	boost::function<void (const unsigned char *, int, int, int)> m_listener;
+	int m_width;
+	int m_height;
+	float m_rate;
+
+	// Writer thread and its queue, bounded so that a slow card holds back the stage rather than filling memory
+	FILE * m_file;
+	boost::mutex m_mutex;
+	boost::condition_variable m_queued;
+	boost::condition_variable m_written;
+	deque<Zslice *> m_queue;
+	int m_queue_limit;
+	bool m_writing;
+	bool m_write_failed;
+
+
+	void store(Zslice * slice);
+
+	void writer();
+
+	bool write_slice(const Zslice &slice);
+
+
+public:
+
+	ZStack(Autofocus &stage, Camera &camera);
+
+	void set_range(int centre, int range, int step);
+
+	void set_settle(int settle_ms = 0, int skip_frames = 1)
+	{	m_settle_ms = settle_ms; m_skip_frames = (skip_frames < 0) ? 0 : skip_frames; return;	}
+
+	void set_listener(boost::function<void (const unsigned char *, int, int, int)> listener)
+	{	m_listener = listener; return;	}
+
+	void set_keep(bool keep = true)
+	{	m_keep = keep; return;	}
+
+	bool acquire(string stack_file = "");
+
+	int size()
+	{	return (int)m_slices.size();	}
+
+	const unsigned char * slice(int index)
+	{	return &m_slices[index].luma[0];	}
+
+	int position(int index)
+	{	return m_slices[index].position;	}
+
+	int width()
+	{	return m_width;	}
+
+	int height()
+	{	return m_height;	}
+
+	float get_rate()
+	{	return m_rate;	}
+
+	void clear()
+	{	vector<Zslice>().swap(m_slices); return;	}
+
+
+};
+
+
+
+
+/* ZStack class CONSTRUCTOR */
+ZStack::ZStack(Autofocus &stage, Camera &camera)
+		:m_stage(stage), m_camera(camera)
+{
+
+	m_centre = 0;
+	m_range = 0;
+	m_step = MICROSTEPS_PER_STEP;
+	set_settle();
+
+	m_width = 0;
+	m_height = 0;
+	m_rate = 0;
+	set_keep();
+
+	m_file = NULL;
+	m_queue_limit = 8;
+	m_writing = false;
+	m_write_failed = false;
+
+}
+
+
+
+
+/* Choose the centre, range and step of the stack, in microsteps */
+void ZStack::set_range(int centre, int range, int step)
+{
+
+	m_centre = centre;
+	m_range = (range < 0) ? -range : range;
+	m_step = (step < 1) ? 1 : step;
+
+	return;
+
+}
+
+
+
+
+/* Take the stack
+ * Slices are taken from the bottom up, so the lead screw always turns the same way between them. The stage first goes below the first slice
+ * (by BACKLASH_MICROSTEPS, as far as the travel allows) and comes up to it, so the backlash is taken up before the first slice as well,
+ * wherever the stage started. */
+bool ZStack::acquire(string stack_file)
+{
+
+	if (!m_camera.is_open())
+	{
+		cout << "\nThe camera is not open" << endl;
+		return false;
+	}
+
+	// Positions of the slices, within the travel of the stage
+	int length = 0;
+	if (!m_stage.comm_get_z_len(length))
+	{
+		cout << "\nCould not get the length of travel, is the stage calibrated?" << endl;
+		return false;
+	}
+
+	vector<int> positions;
+	int first = m_centre - m_range/2;
+	int last = m_centre + m_range/2;
+	if (first < 0) first = 0;
+	if (last > length) last = length;
+	for (int p=first; p<=last; p+=m_step)
+		positions.push_back(p);
+
+	if (positions.empty())
+	{
+		cout << "\nNo slices within the travel of the stage" << endl;
+		return false;
+	}
+
+	m_width = m_camera.width();
+	m_height = m_camera.height();
+	clear();
+
+	// Steps shorter than a full step need microstepping all the way
+	m_stage.comm_set_step_mode((m_step < MICROSTEPS_PER_STEP) ? "fine" : "coarse");
+
+	boost::thread writing;
+	if (!stack_file.empty())
+	{
+		m_file = fopen(stack_file.c_str(), "wb");
+		if (m_file == NULL)
+		{
+			cout << "\nCould not open " << stack_file << endl;
+			return false;
+		}
+		m_writing = true;
+		m_write_failed = false;
+		writing = boost::thread(boost::bind(&ZStack::writer, this));
+	}
+
+	cout << "\nTaking " << positions.size() << " slices from " << first << " to " << positions.back() << flush;
+
+	boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+	double settling = 0;
+	double grabbing = 0;
+	int taken = 0;
+	bool done = true;
+
+	int below = positions[0] - BACKLASH_MICROSTEPS;
+	m_stage.comm_move_to((below < 0) ? 0 : below);
+	if (!m_stage.wait_for_stage())
+		cout << "\nThe stage did not stop below the first slice" << endl;
+	m_stage.comm_move_to(positions[0]);
+
+	for (size_t i=0; i<positions.size(); i++)
+	{
+
+		boost::posix_time::ptime moved = boost::posix_time::microsec_clock::universal_time();
+		if (!m_stage.wait_for_stage())
+		{
+			cout << "\nThe stage did not stop at " << positions[i] << endl;
+			done = false;
+			break;
+		}
+		if (m_settle_ms > 0)
+			boost::this_thread::sleep(boost::posix_time::milliseconds(m_settle_ms));
+
+		// Only frames started after this point are taken
+		unsigned int after = m_camera.sequence() + m_skip_frames;
+		boost::posix_time::ptime settled = boost::posix_time::microsec_clock::universal_time();
+
+		Zslice * slice = new Zslice;
+		slice->luma.resize((size_t)m_width*m_height);
+		slice->position = positions[i];
+		m_stage.comm_get_z_pos(slice->position);
+
+		if (!m_camera.grab(&slice->luma[0], after))
+		{
+			cout << "\nThe camera gave no frame at " << positions[i] << endl;
+			delete slice;
+			done = false;
+			break;
+		}
+
+		boost::posix_time::ptime grabbed = boost::posix_time::microsec_clock::universal_time();
+		slice->time_ms = (grabbed - start).total_microseconds()/1000.0;
+		settling += (settled - moved).total_microseconds()/1000.0;
+		grabbing += (grabbed - settled).total_microseconds()/1000.0;
+
+		// The stage moves on while this slice is stored
+		if (i+1 < positions.size())
+			m_stage.comm_move_to(positions[i+1]);
+
+		if (m_listener)
+			m_listener(&slice->luma[0], m_width, m_height, slice->position);
+
+		store(slice);
+		taken++;
+		cout << "." << flush;
+
+		bool failed;
+		{
+			boost::mutex::scoped_lock lock(m_mutex);
+			failed = m_write_failed;
+		}
+		if (failed)
+		{
+			done = false;
+			break;
+		}
+
+	}
+
+	if (m_file != NULL)
+	{
+		{
+			boost::mutex::scoped_lock lock(m_mutex);
+			m_writing = false;
+			m_queued.notify_all();
+		}
+		writing.join();
+		if (fclose(m_file) != 0)
+			m_write_failed = true;
+		m_file = NULL;
+		if (m_write_failed)
+		{
+			cout << "\nCould not write all slices to " << stack_file << endl;
+			done = false;
+		}
+	}
+
+	double total = (boost::posix_time::microsec_clock::universal_time() - start).total_microseconds()/1000000.0;
+	m_rate = (total > 0) ? taken/total : 0;
+
+	cout << endl;
+	if (taken > 0)
+	{
+		cout << "Took " << taken << " slices in " << total << " s (" << m_rate << " slices/s)" << endl;
+		cout << "Average wait for the stage " << settling/taken << " ms, for a frame " << grabbing/taken << " ms" << endl;
+	}
+
+	return done;
+
+}
+
+
+
+
+/* Keep a slice in memory, or hand it to the writer, waiting while the queue is full */
+void ZStack::store(Zslice * slice)
+{
+
+	if (m_file == NULL && !m_keep)
+	{
+		delete slice;
+		return;
+	}
+
+	if (m_file == NULL)
+	{
+		m_slices.push_back(Zslice());
+		m_slices.back().position = slice->position;
+		m_slices.back().time_ms = slice->time_ms;
+		m_slices.back().luma.swap(slice->luma);
+		delete slice;
+		return;
+	}
+
+	boost::mutex::scoped_lock lock(m_mutex);
+	while ((int)m_queue.size() >= m_queue_limit && !m_write_failed)
+		m_written.wait(lock);
+	m_queue.push_back(slice);
+	m_queued.notify_one();
+
+	return;
+
+}
+
+
+
+
+/* Writer thread
+ * Writes the queued slices in order until acquire(...) says there will be no more and the queue is empty
+ * After a failed write the rest are dropped, and acquire(...) stops at the next slice */
+void ZStack::writer()
+{
+
+	while (true)
+	{
+
+		Zslice * slice;
+		{
+			boost::mutex::scoped_lock lock(m_mutex);
+			while (m_queue.empty() && m_writing)
+				m_queued.wait(lock);
+			if (m_queue.empty())
+				return;
+			slice = m_queue.front();
+			m_queue.pop_front();
+			m_written.notify_one();
+		}
+
+		if (!m_write_failed && !write_slice(*slice))
+		{
+			boost::mutex::scoped_lock lock(m_mutex);
+			m_write_failed = true;
+			m_written.notify_all();
+		}
+
+		delete slice;
+
+	}
+
+}
+
+
+
+
+/* Write one slice as a binary PGM picture, its position and time in a comment */
+bool ZStack::write_slice(const Zslice &slice)
+{
+
+	stringstream comment;
+	comment << "z " << slice.position << " t " << fixed << setprecision(1) << slice.time_ms;
+	if (!write_pgm_header(m_file, m_width, m_height, comment.str()))
+		return false;
+
+	return fwrite(&slice.luma[0], 1, slice.luma.size(), m_file) == slice.luma.size();
+
+}
+
+
+
+#endif
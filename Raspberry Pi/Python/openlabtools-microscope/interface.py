@@ -1,7 +1,7 @@
 __author__ = 'james'
 
 import serial
-from time import sleep
+from time import time
 
 
 class Microscope:
@@ -11,20 +11,50 @@ class Microscope:
         """Opens the serial connection given a port name"""
 
         #Open connection
-        self.ser = serial.Serial(port, 9600)
+        self.ser = serial.Serial(port, 9600, timeout=1)
 
-        #Flash the DTR pin to reset the Arduino (Needed so the Arduino is in a known state)
-        self.ser.setDTR(False)
-        sleep(0.22)
-        self.ser.setDTR(True)
-
-        #Read the first four lines from the Stepper shield initialization
-        for x in range(4):
-            self.ser.readline()
+        #Wait for the Arduino to answer rather than a fixed time. Opening the
+        #port resets some boards; the firmware restores its saved position, so
+        #a reset leaves it in a known state.
+        self.wait_ready()
 
     def __del__(self):
-        """Closes the serial connection on object deletion"""
-        self.ser.close()
+        """Saves the stage position and closes the serial connection on object deletion"""
+        try:
+            self.save_state()
+        finally:
+            self.ser.close()
+
+    def wait_ready(self, timeout=3):
+        """Waits up to timeout seconds for the Arduino to answer a query.
+
+        A board that reset as the port opened loses the query while it boots and
+        prints READY once started instead. A query it did receive is answered
+        straight after the banner, so that answer is waited for briefly too.
+
+        """
+        self.ser.write('is_calibrated\n')
+        end = time() + timeout
+        old_timeout = self.ser.timeout
+        self.ser.timeout = 0.1
+        line = ''
+        reset = False
+        try:
+            while time() < end:
+                #A line can be split across reads that time out
+                line += self.ser.readline()
+                if not line.endswith('\n'):
+                    continue
+                if line == 'OK\r\n':
+                    return True
+                if line == 'READY\r\n':
+                    reset = True
+                    end = time() + 0.1
+                line = ''
+            return reset
+        finally:
+            self.ser.timeout = old_timeout
+            self.ser.flushInput()
 
     def run_command(self, command):
         """Writes command to the interface and returns any response.
@@ -63,6 +93,11 @@ class Microscope:
         self.run_command(command)
         self.ser.timeout = 1
 
+    def save_state(self):
+        """Saves the stage position so the next session starts calibrated"""
+        command = 'save_state\n'
+        self.run_command(command)
+
     def is_calibrated(self):
         """Check if the microscope is calibrated"""
         command = 'is_calibrated\n'
@@ -104,6 +139,14 @@ class Microscope:
         command = axis + '_move_to' + str(position) + '\n'
         self.run_command(command)
 
+    def set_step_mode(self, axis, mode):
+        """Set the step mode ('coarse' or 'fine') used for moves of the specified axis"""
+        self.check_axis(axis)
+        if mode not in ['coarse', 'fine']:
+            raise Exception('Not a valid step mode!')
+        command = axis + '_set_step_mode ' + mode + '\n'
+        self.run_command(command)
+
     def set_ring_colour(self, colour):
         """Set the colour of the ring LED"""
         command = 'set_ring_colour ' + colour + '\n'